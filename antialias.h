@@ -0,0 +1,49 @@
+#pragma once
+
+#include "color.h"
+#include "defs.h"
+
+#include <math.h>
+
+// Controls the adaptive supersampling of Scene::adaptiveAA.
+// Every pixel starts with minSamples samples from Scene::sampler. Pixels whose luminance is still uncertain,
+// or that differ a lot from one of their neighbours, receive minSamples more in every round until
+// they are converged or have maxSamples. Flat areas stay at minSamples, edges go up to maxSamples.
+struct AntialiasSettings {
+	AntialiasSettings(): minSamples(4), maxSamples(16), threshold(0.02f), contrast(0.1f) {}
+	int minSamples; //< Samples of the first round and added by every further round, best a power of two
+	int maxSamples; //< Upper limit per pixel
+	float threshold; //< Standard error of the pixel luminance below which a pixel is converged
+	float contrast; //< Luminance difference to a neighbour that sends a pixel to refinement even if its samples agree
+};
+
+// Running mean and variance of the samples of one pixel
+struct PixelEstimator {
+	PixelEstimator(): sum(0.f, 0.f, 0.f), lumSum(0.f), lumSumSq(0.f), count(0) {}
+
+	// 'lum' is the luminance the convergence is measured on, usually clamped to the displayable range
+	void add(const Color& sample, float lum) {
+		sum += sample;
+		lumSum += lum;
+		lumSumSq += lum * lum;
+		count++;
+	}
+
+	Color getMean() const { return sum / float(count); }
+	float getMeanLuminance() const { return lumSum / float(count); }
+
+	// Standard error of the mean luminance, infinite until there are two samples
+	float getError() const {
+		if (count < 2) {
+			return INFINITY;
+		}
+		const float n = float(count);
+		const float variance = Max(0.f, (lumSumSq - lumSum * lumSum / n) / (n - 1.f));
+		return sqrtf(variance / n);
+	}
+
+	Color sum;
+	float lumSum;
+	float lumSumSq;
+	int count;
+};
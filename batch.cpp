@@ -0,0 +1,566 @@
+// Headless entry point. Renders a fixed number of frames without opening a window
+// and optionally writes every frame to disk. Used on render nodes without a display
+// and to measure raw render throughput.
+#include <stdio.h>
+#include <string.h>
+
+#include "render.h"
+#include "image.h"
+#include "meshloader.h"
+#include "framepipeline.h"
+#include "cluster.h"
+#include "scenefile.h"
+#include "tiledimage.h"
+#include "timer.h"
+
+#include <string>
+#include <thread>
+
+enum OutputFormat {
+	FORMAT_NONE,
+	FORMAT_PPM,
+	FORMAT_PFM,
+};
+
+// Side of the buckets, and of the tiles of tiled output
+const int BUCKET_SIZE = 32;
+
+// What moves between the frames
+enum Animation {
+	ANIMATE_LIGHT,
+	ANIMATE_SPHERE,
+	ANIMATE_NONE,
+};
+
+static void printUsage(const char* exe) {
+	printf("Usage: %s [width height] [options]\n", exe);
+	printf("  -frames N      number of frames to render (default 1)\n");
+	printf("  -threads N     number of render threads (default: all cores)\n");
+	printf("  -format F      output format: ppm, pfm or none (default ppm)\n");
+	printf("  -out PREFIX    output file prefix (default \"frame\")\n");
+	printf("  -packets       trace primary rays in SIMD packets\n");
+	printf("  -aa            adaptive supersampling, more samples where the pixel colors vary\n");
+	printf("  -aa-min N      samples every pixel starts with and added per refinement round (default 4)\n");
+	printf("  -aa-max N      maximum samples per pixel (default 16)\n");
+	printf("  -aa-threshold F  standard error of the pixel luminance that counts as converged (default 0.02)\n");
+	printf("  -progressive   accumulate one jittered sample per pixel and frame, the light does not move\n");
+	printf("  -deferred      keep the camera ray hits of the first frame and only shade them in the frames after it\n");
+	printf("  -incremental   only re-render the buckets that see what moved since the previous frame\n");
+	printf("  -animate A     what moves between frames: light, sphere (the last one) or none (default light)\n");
+	printf("  -exposure F    scale the colors by F before tonemapping the ppm output (default 1)\n");
+	printf("  -tonemap C     tonemap curve for the ppm output: clamp, reinhard or aces (default clamp)\n");
+	printf("  -srgb          apply the sRGB transfer function to the ppm output\n");
+	printf("  -lights N      replace the point light by N random sphere lights of the same total intensity\n");
+	printf("  -light-samples N  shadow rays per shading point (default 1)\n");
+	printf("  -pathtrace     render with the wavefront path tracer, prints the time of every stage\n");
+	printf("  -depth N       diffuse bounces of the path tracer (default 4)\n");
+	printf("  -spp N         paths per pixel and frame of the path tracer (default 1)\n");
+	printf("  -nosort        do not sort the path tracer rays by direction between bounces\n");
+	printf("  -sampler S     random numbers of the pixel samples: random, sobol or bluenoise (default sobol)\n");
+	printf("  -trace PREFIX  record bucket timings, write PREFIX.json (Chrome trace) and PREFIX_heatmap.ppm\n");
+	printf("  -metrics FILE  keep FILE updated with render statistics in Prometheus text format\n");
+	printf("  -tiled         write the buckets to PREFIX_NNNN.cgtile as they finish, the frame is never held in memory\n");
+	printf("  -pipeline      render the next frame while the previous one is written out\n");
+	printf("  -adaptive      split and balance buckets by their cost in the previous frame, prints load balance stats\n");
+	printf("  -scene FILE    load the camera, lights, materials and objects from a scene file, compiled to FILE.cgscene on first use\n");
+	printf("  -mesh FILE     load a triangle mesh from an .obj or binary .ply file, may be repeated\n");
+	printf("  -spheres N     add N random spheres behind the default one (default 0)\n");
+	printf("  -texture FILE  texture of the default material, a binary .ppm or .pfm, converted to FILE.cgtex on first use\n");
+	printf("  -texture-cache MB  memory for decoded texture tiles (default 64)\n");
+	printf("  -material M    material of the spheres: diffuse, phong, blinn, mirror, glass or mixed (default phong)\n");
+	printf("  -listen ADDR   hand the buckets out to worker processes connecting at ADDR, host:port or unix:/path\n");
+	printf("  -workers N     wait for N workers before the first frame (default 1)\n");
+	printf("  -local-workers N  start N workers on this machine, sharing its threads, a stand-in for a cluster\n");
+	printf("  -worker-timeout S  drop a worker that does not answer for S seconds (default 60)\n");
+	printf("  -connect ADDR  run as a worker of the coordinator at ADDR, give it the same scene options\n");
+}
+
+// Options that only concern the process that writes the frames. All others define the scene and
+// are passed on to the local workers.
+static bool isCoordinatorOption(const char* arg) {
+	const char* names[] = { "-frames", "-threads", "-format", "-out", "-trace", "-metrics", "-pipeline", "-tiled", "-adaptive",
+		"-animate", "-listen", "-workers", "-local-workers", "-worker-timeout", "-connect" };
+	for (int i = 0; i < int(sizeof(names) / sizeof(names[0])); i++) {
+		if (!strcmp(arg, names[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Renders the frames of the batch one after the other, animating the light or a sphere in between
+// With a cluster the buckets are rendered by its workers instead of the local threads.
+// renderTiledFrame renders the next frame into a tiled file instead of a canvas.
+struct BatchFrameSource : FrameSource {
+	BatchFrameSource(int numFrames, Animation animation, MetricsWriter* metrics, ClusterCoordinator* cluster)
+		: numFrames(numFrames), animation(animation), frame(0), totalMs(0.0), totalRays(0), metrics(metrics), cluster(cluster) {}
+	virtual bool renderFrame(Canvas& c) override {
+		if (frame == numFrames) {
+			return false;
+		}
+		scene.c = &c;
+		a7az0th::Timer t;
+		if (cluster) {
+			cluster->render(scene);
+		} else {
+			raytrace(scene);
+		}
+		t.stop();
+		endFrame(t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0);
+		return true;
+	}
+	bool renderTiledFrame(const std::string& fileName, TiledPixelFormat format) {
+		a7az0th::Timer t;
+		TiledImageWriter out;
+		if (!out.open(fileName, scene.cam.getWidth(), scene.cam.getHeight(), BUCKET_SIZE, format)) {
+			return false;
+		}
+		raytraceTiled(scene, out);
+		// The frame is done once the last tile is on disk
+		const bool ok = out.close();
+		t.stop();
+		endFrame(t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0);
+		const TiledWriterStats& stats = out.getStats();
+		printf("  %d tiles written in %.3f milliseconds of I/O, %.1f MB file, %d tile buffers, at most %d tiles queued\n",
+			stats.tilesWritten, stats.writeMs, stats.bytes / (1024.0 * 1024.0), stats.tilesAllocated, stats.maxQueued);
+		return ok;
+	}
+	void endFrame(double ms) {
+		totalMs += ms;
+		printf("Frame %d rendered in %.3f milliseconds\n", frame, ms);
+		if (scene.progressive) {
+			printf("  %d spp, error %.5f\n", scene.accum.getSamplesPerPixel(), scene.accum.getError());
+		}
+		if (scene.adaptiveBuckets) {
+			const SchedulerStats& stats = scene.scheduler.getStats();
+			printf("  %d buckets, %d stolen, busy max %.3f avg %.3f milliseconds, imbalance %.1f%%\n",
+				stats.numBuckets, stats.numSteals, stats.maxBusyMs, stats.avgBusyMs, stats.imbalance * 100.0);
+		}
+		if (cluster) {
+			const ClusterStats& stats = cluster->getStats();
+			printf("  %d worker(s), %d buckets, %d reissued, %d worker(s) lost, %d rendered locally\n",
+				stats.numWorkers, stats.numBuckets, stats.numReissued, stats.numLost, stats.numLocal);
+		}
+		if (scene.pathTracing) {
+			const WavefrontStats& stats = scene.integrator.getStats();
+			printf("  %llu path segments, %d bounces, generate %.3f extend %.3f shade %.3f shadow %.3f sort %.3f accumulate %.3f milliseconds\n",
+				(unsigned long long)stats.segments, stats.maxBounce, stats.stageMs[STAGE_GENERATE], stats.stageMs[STAGE_EXTEND],
+				stats.stageMs[STAGE_SHADE], stats.stageMs[STAGE_SHADOW], stats.stageMs[STAGE_SORT], stats.stageMs[STAGE_ACCUMULATE]);
+		}
+		if (scene.incremental) {
+			printf("  %d of %d buckets rendered\n", scene.stats.numBuckets, int(scene.buckets.size()));
+		}
+		if (scene.deferredShading && !scene.progressive && !scene.adaptiveAA && !scene.pathTracing) {
+			printf("  %s the G-buffer, %.1f MB\n", scene.gbuffer.wasShadeOnly() ? "shaded from" : "traced into",
+				scene.gbuffer.getMemoryUsage() / (1024.0 * 1024.0));
+		}
+		const StatCounters& counters = scene.stats.counters;
+		totalRays += counters[STAT_RAYS];
+		if (scene.adaptiveAA) {
+			printf("  %.2f rays per pixel\n", double(counters[STAT_RAYS]) / (double(scene.cam.getWidth()) * scene.cam.getHeight()));
+		}
+		// Frames shaded from the G-buffer trace shadow rays only
+		if (counters[STAT_RAYS] + counters[STAT_SHADOW_RAYS] > 0) {
+			const double allRays = double(counters[STAT_RAYS] + counters[STAT_SHADOW_RAYS]);
+			printf("  %llu rays, %llu shadow rays, %.1f nodes and %.1f intersection tests per ray, %llu hits, %llu shading calls\n",
+				(unsigned long long)counters[STAT_RAYS], (unsigned long long)counters[STAT_SHADOW_RAYS],
+				double(counters[STAT_NODE_VISITS]) / allRays, double(counters[STAT_PRIM_TESTS]) / allRays,
+				(unsigned long long)counters[STAT_HITS], (unsigned long long)counters[STAT_SHADING_CALLS]);
+		}
+		if (metrics && !metrics->update(scene.stats)) {
+			printf("Failed to write the metrics file\n");
+		}
+
+		if (!scene.progressive) {
+			if (animation == ANIMATE_LIGHT) {
+				animateLight();
+			} else if (animation == ANIMATE_SPHERE) {
+				animateSphere();
+			}
+		}
+		frame++;
+	}
+	int numFrames;
+	Animation animation;
+	int frame;
+	double totalMs;
+	uint64 totalRays; //< Rays traced in all frames, camera rays and secondary rays but not shadow rays
+	MetricsWriter* metrics;
+	ClusterCoordinator* cluster;
+};
+
+static bool saveFrame(const Canvas& c, OutputFormat format, const std::string& prefix, int frame) {
+	if (format == FORMAT_NONE) {
+		return true;
+	}
+	char fileName[1024];
+	const char* ext = (format == FORMAT_PPM) ? "ppm" : "pfm";
+	snprintf(fileName, sizeof(fileName), "%s_%04d.%s", prefix.c_str(), frame, ext);
+	const bool ok = (format == FORMAT_PPM) ? savePPM(c, fileName) : savePFM(c, fileName);
+	if (!ok) {
+		printf("Failed to write %s\n", fileName);
+	}
+	return ok;
+}
+
+int main(int argc, char ** argv) {
+
+	const int div = 4;
+	int width = 640 / div;
+	int height = 480 / div;
+	int numFrames = 1;
+	Animation animation = ANIMATE_LIGHT;
+	OutputFormat format = FORMAT_PPM;
+	std::string prefix = "frame";
+	int numSpheres = 0;
+	bool mixedMaterials = false;
+	int numLights = 0;
+	bool pipelined = false;
+	bool tiled = false;
+	std::string tracePrefix;
+	std::string metricsFile;
+	std::vector<std::string> meshFiles;
+	std::string sceneFile;
+	bool builtinSceneOptions = false; //< Options that change the built-in scene, they do not mix with -scene
+	std::string listenAddress;
+	std::string connectAddress;
+	int numWorkers = 1;
+	int numLocalWorkers = 0;
+	double workerTimeout = 60.0;
+	// The options that define the scene, passed on to the local workers
+	std::vector<std::string> sceneArgs;
+
+	int argIdx = 1;
+	if (argc >= 3 && argv[1][0] != '-') {
+		width  = std::stoi(argv[1]);
+		height = std::stoi(argv[2]);
+		argIdx = 3;
+	}
+	for (; argIdx < argc; argIdx++) {
+		const char* arg = argv[argIdx];
+		const bool hasValue = argIdx + 1 < argc;
+		const int firstArg = argIdx;
+		if (!strcmp(arg, "-frames") && hasValue) {
+			numFrames = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-threads") && hasValue) {
+			scene.numThreads = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-listen") && hasValue) {
+			listenAddress = argv[++argIdx];
+		} else if (!strcmp(arg, "-workers") && hasValue) {
+			numWorkers = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-local-workers") && hasValue) {
+			numLocalWorkers = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-worker-timeout") && hasValue) {
+			workerTimeout = std::stof(argv[++argIdx]);
+		} else if (!strcmp(arg, "-connect") && hasValue) {
+			connectAddress = argv[++argIdx];
+		} else if (!strcmp(arg, "-packets")) {
+			scene.usePackets = true;
+		} else if (!strcmp(arg, "-aa")) {
+			scene.adaptiveAA = true;
+		} else if (!strcmp(arg, "-aa-min") && hasValue) {
+			scene.antialias.minSamples = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-aa-max") && hasValue) {
+			scene.antialias.maxSamples = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-aa-threshold") && hasValue) {
+			scene.antialias.threshold = std::stof(argv[++argIdx]);
+		} else if (!strcmp(arg, "-progressive")) {
+			scene.progressive = true;
+		} else if (!strcmp(arg, "-deferred")) {
+			scene.deferredShading = true;
+		} else if (!strcmp(arg, "-incremental")) {
+			scene.incremental = true;
+		} else if (!strcmp(arg, "-animate") && hasValue) {
+			const char* what = argv[++argIdx];
+			if      (!strcmp(what, "light"))  animation = ANIMATE_LIGHT;
+			else if (!strcmp(what, "sphere")) animation = ANIMATE_SPHERE;
+			else if (!strcmp(what, "none"))   animation = ANIMATE_NONE;
+			else {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "-exposure") && hasValue) {
+			scene.tonemap.exposure = std::stof(argv[++argIdx]);
+		} else if (!strcmp(arg, "-tonemap") && hasValue) {
+			const char* curve = argv[++argIdx];
+			if      (!strcmp(curve, "clamp"))    scene.tonemap.curve = TONEMAP_CLAMP;
+			else if (!strcmp(curve, "reinhard")) scene.tonemap.curve = TONEMAP_REINHARD;
+			else if (!strcmp(curve, "aces"))     scene.tonemap.curve = TONEMAP_ACES;
+			else {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "-srgb")) {
+			scene.tonemap.srgb = true;
+		} else if (!strcmp(arg, "-lights") && hasValue) {
+			numLights = std::stoi(argv[++argIdx]);
+			builtinSceneOptions = true;
+		} else if (!strcmp(arg, "-light-samples") && hasValue) {
+			scene.lightSamples = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-pathtrace")) {
+			scene.pathTracing = true;
+		} else if (!strcmp(arg, "-depth") && hasValue) {
+			scene.wavefront.maxDepth = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-spp") && hasValue) {
+			scene.wavefront.samplesPerPixel = std::stoi(argv[++argIdx]);
+		} else if (!strcmp(arg, "-nosort")) {
+			scene.wavefront.sortRays = false;
+		} else if (!strcmp(arg, "-sampler") && hasValue) {
+			if (!parseSamplerType(argv[++argIdx], scene.sampler)) {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "-trace") && hasValue) {
+			tracePrefix = argv[++argIdx];
+		} else if (!strcmp(arg, "-metrics") && hasValue) {
+			metricsFile = argv[++argIdx];
+		} else if (!strcmp(arg, "-tiled")) {
+			tiled = true;
+		} else if (!strcmp(arg, "-pipeline")) {
+			pipelined = true;
+		} else if (!strcmp(arg, "-adaptive")) {
+			scene.adaptiveBuckets = true;
+		} else if (!strcmp(arg, "-scene") && hasValue) {
+			sceneFile = argv[++argIdx];
+		} else if (!strcmp(arg, "-mesh") && hasValue) {
+			meshFiles.push_back(argv[++argIdx]);
+			builtinSceneOptions = true;
+		} else if (!strcmp(arg, "-spheres") && hasValue) {
+			numSpheres = std::stoi(argv[++argIdx]);
+			builtinSceneOptions = true;
+		} else if (!strcmp(arg, "-texture") && hasValue) {
+			scene.materials[0].texture = scene.textures.add(argv[++argIdx]);
+			builtinSceneOptions = true;
+		} else if (!strcmp(arg, "-texture-cache") && hasValue) {
+			scene.textures.setCapacity(size_t(std::stoi(argv[++argIdx])) << 20);
+		} else if (!strcmp(arg, "-material") && hasValue) {
+			const char* name = argv[++argIdx];
+			mixedMaterials = !strcmp(name, "mixed");
+			builtinSceneOptions = true;
+			if (!mixedMaterials && !parseMaterialType(name, scene.materials[0].type)) {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "-out") && hasValue) {
+			prefix = argv[++argIdx];
+		} else if (!strcmp(arg, "-format") && hasValue) {
+			const char* f = argv[++argIdx];
+			if      (!strcmp(f, "ppm"))  format = FORMAT_PPM;
+			else if (!strcmp(f, "pfm"))  format = FORMAT_PFM;
+			else if (!strcmp(f, "none")) format = FORMAT_NONE;
+			else {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+		if (!isCoordinatorOption(arg)) {
+			sceneArgs.insert(sceneArgs.end(), argv + firstArg, argv + argIdx + 1);
+		}
+	}
+
+	if (width <= 0 || height <= 0 || numFrames <= 0 || scene.numThreads <= 0 || numSpheres < 0 || numLights < 0 || scene.lightSamples <= 0 ||
+		scene.wavefront.maxDepth < 0 || scene.wavefront.samplesPerPixel <= 0 ||
+		scene.antialias.minSamples <= 0 || scene.antialias.maxSamples < scene.antialias.minSamples ||
+		numWorkers < 0 || numLocalWorkers < 0 || workerTimeout <= 0.0 || (numLocalWorkers > 0 && listenAddress.empty())) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if ((!listenAddress.empty() || !connectAddress.empty()) &&
+		(scene.progressive || scene.pathTracing || scene.adaptiveBuckets || scene.deferredShading || scene.incremental ||
+		 animation == ANIMATE_SPHERE || !tracePrefix.empty())) {
+		printf("Distributed rendering hands out single buckets, it does not work with -progressive, -pathtrace, -adaptive, -deferred, -incremental, -animate sphere or -trace\n");
+		return 1;
+	}
+
+	if (tiled && (format == FORMAT_NONE || pipelined || scene.progressive || scene.pathTracing || scene.adaptiveBuckets ||
+		scene.deferredShading || scene.incremental || !tracePrefix.empty() || !listenAddress.empty() || !connectAddress.empty())) {
+		printf("-tiled renders bucket by bucket into a file, it needs -format ppm or pfm and does not work with -pipeline, -progressive, -pathtrace, -adaptive, -deferred, -incremental, -trace or distributed rendering\n");
+		return 1;
+	}
+
+	if (!sceneFile.empty() && builtinSceneOptions) {
+		printf("-scene replaces the built-in scene, it does not work with -mesh, -spheres, -texture, -material or -lights\n");
+		return 1;
+	}
+
+	// PPM output is converted bucket by bucket while rendering
+	scene.outputLDR = (format == FORMAT_PPM);
+
+	// A tiled frame is never in memory as a whole, the buckets go straight to the file
+	Canvas* c = tiled ? nullptr : new Canvas(width, height);
+	scene.cam.init(width, height);
+	scene.c = c;
+	initBuckets(width, height, scene.buckets, BUCKET_SIZE);
+
+	if (!sceneFile.empty()) {
+		a7az0th::Timer t;
+		bool fromCache;
+		if (!loadScene(sceneFile.c_str(), scene, fromCache)) {
+			return 1;
+		}
+		t.stop();
+		int numTriangles = 0;
+		for (int i = 0; i < int(scene.meshes.size()); i++) {
+			numTriangles += scene.meshes[i].getTriangleCount();
+		}
+		printf("Scene %s %s in %.3f milliseconds, %d sphere(s), %d mesh(es) with %d triangles, %d light(s)\n", sceneFile.c_str(),
+			fromCache ? "mapped" : "parsed and built", t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0,
+			int(scene.spheres.size()), int(scene.meshes.size()), numTriangles, int(scene.lights.size()));
+	} else {
+		scene.spheres.push_back(Sphere());
+		addRandomSpheres(scene.spheres, numSpheres);
+		if (mixedMaterials) {
+			// One material of every type, given to the spheres in turn
+			scene.materials.push_back(Material::diffuse(Color(0.8f, 0.8f, 0.8f)));
+			scene.materials.push_back(Material::blinn(Color(0.2f, 0.8f, 0.2f), 60.f));
+			scene.materials.push_back(Material::mirror(Color(0.9f, 0.9f, 0.9f)));
+			scene.materials.push_back(Material::dielectric(Color(1.f, 1.f, 1.f), 1.5f));
+			for (int i = 0; i < int(scene.spheres.size()); i++) {
+				scene.spheres[i].material = i % int(scene.materials.size());
+			}
+		}
+		if (numLights > 0) {
+			addRandomLights(scene.lights, numLights, scene.lights[0].intensity);
+		}
+		for (int i = 0; i < int(meshFiles.size()); i++) {
+			a7az0th::Timer t;
+			Mesh mesh;
+			if (!loadMesh(meshFiles[i].c_str(), mesh, scene.threadman, scene.numThreads)) {
+				return 1;
+			}
+			t.stop();
+			printf("Loaded %s in %.3f milliseconds, %d vertices, %d triangles\n", meshFiles[i].c_str(),
+				t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0, int(mesh.vertices.size()), mesh.getTriangleCount());
+			scene.meshes.push_back(Mesh());
+			scene.meshes.back().vertices.swap(mesh.vertices);
+			scene.meshes.back().normals.swap(mesh.normals);
+			scene.meshes.back().indices.swap(mesh.indices);
+		}
+		{
+			a7az0th::Timer t;
+			scene.buildAccelerator();
+			t.stop();
+			printf("Acceleration structures built in %.3f milliseconds, sphere BVH over %d sphere(s) has %d nodes\n",
+				t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0, scene.accel.getPrimCount(), scene.accel.getNodeCount());
+		}
+	}
+
+	if (scene.pathTracing && !canPathTrace(scene)) {
+		return 1;
+	}
+
+	if (!connectAddress.empty()) {
+		// The coordinator tonemaps the buckets it receives, the worker only renders them
+		scene.outputLDR = false;
+		printf("Worker with %d thread(s) connecting to %s\n", scene.numThreads, connectAddress.c_str());
+		return runClusterWorker(scene, connectAddress, 30000.0) ? 0 : 1;
+	}
+
+	ClusterCoordinator cluster;
+	if (!listenAddress.empty()) {
+		cluster.setWorkerTimeout(workerTimeout);
+		if (!cluster.listen(listenAddress, scene)) {
+			return 1;
+		}
+		if (numLocalWorkers > 0) {
+			// The local workers share the threads of this machine
+			std::vector<std::string> workerArgs;
+			workerArgs.push_back(std::to_string(width));
+			workerArgs.push_back(std::to_string(height));
+			workerArgs.insert(workerArgs.end(), sceneArgs.begin(), sceneArgs.end());
+			workerArgs.push_back("-threads");
+			workerArgs.push_back(std::to_string(Max(scene.numThreads / numLocalWorkers, 1)));
+			if (!cluster.spawnLocalWorkers(argv[0], workerArgs, numLocalWorkers)) {
+				return 1;
+			}
+			numWorkers = Max(numWorkers, numLocalWorkers);
+		}
+		const int connected = cluster.waitForWorkers(numWorkers, workerTimeout * 1000.0);
+		printf("%d of %d worker(s) connected at %s\n", connected, numWorkers, listenAddress.c_str());
+	}
+
+	printf("Rendering %d frame(s) at %dx%d on %d thread(s)\n", numFrames, width, height, scene.numThreads);
+
+	FrameTracer tracer;
+	if (!tracePrefix.empty()) {
+		scene.tracer = &tracer;
+	}
+
+	MetricsWriter* metrics = nullptr;
+	if (!metricsFile.empty()) {
+		metrics = new MetricsWriter(metricsFile, 1.0);
+	}
+
+	BatchFrameSource source(numFrames, animation, metrics, listenAddress.empty() ? nullptr : &cluster);
+	if (pipelined) {
+		// The main thread writes frame N while the render thread works on frame N+1
+		FramePipeline pipeline(width, height, source, false);
+		pipeline.start();
+		while (!pipeline.finished()) {
+			if (!pipeline.acquire()) {
+				std::this_thread::yield();
+				continue;
+			}
+			if (!saveFrame(pipeline.front(), format, prefix, pipeline.frontFrame())) {
+				return 1;
+			}
+		}
+		pipeline.stop();
+		const PipelineStats stats = pipeline.getStats();
+		printf("Pipeline: %d frames, render %.3f milliseconds, latency %.3f milliseconds, %.2f fps\n",
+			stats.framesPresented, stats.avgRenderMs, stats.avgLatencyMs, stats.presentFps);
+	} else if (tiled) {
+		for (int frame = 0; frame < numFrames; frame++) {
+			char fileName[1024];
+			snprintf(fileName, sizeof(fileName), "%s_%04d.cgtile", prefix.c_str(), frame);
+			if (!source.renderTiledFrame(fileName, format == FORMAT_PPM ? TILED_RGBA8 : TILED_RGB32F)) {
+				return 1;
+			}
+		}
+	} else {
+		for (int frame = 0; frame < numFrames; frame++) {
+			source.renderFrame(*c);
+			if (!saveFrame(*c, format, prefix, frame)) {
+				return 1;
+			}
+		}
+	}
+
+	cluster.shutdown();
+
+	if (scene.tracer) {
+		const std::string traceFile = tracePrefix + ".json";
+		const std::string heatmapFile = tracePrefix + "_heatmap.ppm";
+		if (!tracer.saveChromeTrace(traceFile.c_str()) || !tracer.saveHeatmap(heatmapFile.c_str(), width, height)) {
+			printf("Failed to write the trace %s\n", tracePrefix.c_str());
+			return 1;
+		}
+		scene.tracer = nullptr;
+	}
+
+	if (metrics) {
+		const bool ok = metrics->flush();
+		delete metrics;
+		if (!ok) {
+			printf("Failed to write %s\n", metricsFile.c_str());
+			return 1;
+		}
+	}
+
+	delete c;
+	scene.c = nullptr;
+
+	const double totalMs = source.totalMs;
+#ifdef CG_STATS
+	printf("Average frame time %.3f milliseconds, %.2f Mrays/s\n",
+		totalMs / numFrames, double(source.totalRays) / (totalMs * 1000.0));
+#else
+	// Without the counters the number of rays is unknown
+	printf("Average frame time %.3f milliseconds\n", totalMs / numFrames);
+#endif
+
+	return 0;
+}
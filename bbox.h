@@ -0,0 +1,68 @@
+#pragma once
+
+#include <float.h> //FLT_MAX
+#include "vector.h"
+#include "defs.h"
+
+// Rounding in the slab test can make a ray that exactly touches a box edge or corner miss it, which
+// lets rays fall through the shared vertices of triangles. Scaling the far distance by 1 + 2*gamma(3)
+// makes the test conservative ("Robust BVH Ray Traversal", Ize, JCGT 2013).
+const float SLAB_EPSILON = 1.f + 2.f * (3.f * 5.9604645e-8f) / (1.f - 3.f * 5.9604645e-8f);
+
+// Axis aligned bounding box
+struct BBox {
+	Vector vmin, vmax;
+
+	BBox() { makeEmpty(); }
+	BBox(const Vector& vmin, const Vector& vmax): vmin(vmin), vmax(vmax) {}
+
+	void makeEmpty() {
+		vmin.set( FLT_MAX,  FLT_MAX,  FLT_MAX);
+		vmax.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	}
+	bool isEmpty() const { return vmin.x > vmax.x; }
+
+	void add(const Vector& p) {
+		vmin.set(Min(vmin.x, p.x), Min(vmin.y, p.y), Min(vmin.z, p.z));
+		vmax.set(Max(vmax.x, p.x), Max(vmax.y, p.y), Max(vmax.z, p.z));
+	}
+	void add(const BBox& b) {
+		vmin.set(Min(vmin.x, b.vmin.x), Min(vmin.y, b.vmin.y), Min(vmin.z, b.vmin.z));
+		vmax.set(Max(vmax.x, b.vmax.x), Max(vmax.y, b.vmax.y), Max(vmax.z, b.vmax.z));
+	}
+
+	Vector center() const { return (vmin + vmax) / 2.f; }
+	Vector extent() const { return vmax - vmin; }
+
+	// Returns the index of the longest axis of the box
+	int maxAxis() const {
+		const Vector e = extent();
+		if (e.x >= e.y && e.x >= e.z) return 0;
+		return (e.y >= e.z) ? 1 : 2;
+	}
+
+	// Surface area of the box, used by the SAH cost function
+	float area() const {
+		if (isEmpty()) return 0.f;
+		const Vector e = extent();
+		return 2.f * (e.x*e.y + e.y*e.z + e.z*e.x);
+	}
+
+	// Slab test of the ray segment [0, maxT] against the box.
+	// invDir holds the reciprocal of the ray direction components.
+	bool intersect(const Vector& origin, const Vector& invDir, float maxT) const {
+		float t0 = 0.f, t1 = maxT;
+		for (int i = 0; i < 3; i++) {
+			float tNear = (vmin[i] - origin[i]) * invDir[i];
+			float tFar  = (vmax[i] - origin[i]) * invDir[i];
+			if (tNear > tFar) {
+				const float tmp = tNear; tNear = tFar; tFar = tmp;
+			}
+			tFar *= SLAB_EPSILON;
+			t0 = tNear > t0 ? tNear : t0;
+			t1 = tFar  < t1 ? tFar  : t1;
+			if (t0 > t1) return false;
+		}
+		return true;
+	}
+};
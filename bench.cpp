@@ -0,0 +1,424 @@
+// Benchmark suite. Times the hot building blocks of the renderer in isolation and full frames
+// at several resolutions and thread counts, and writes the results as JSON or CSV so they can
+// be compared across builds and machines.
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "render.h"
+#include "fastmath.h"
+#include "matrix.h"
+#include "raystream.h"
+#include "timer.h"
+
+#include <string>
+#include <vector>
+
+enum ReportFormat {
+	REPORT_JSON,
+	REPORT_CSV,
+};
+
+struct BenchResult {
+	std::string name;
+	std::string variant;
+	int width, height; //< Image size for frame benchmarks, 0 for micro benchmarks
+	int threads;
+	int iterations; //< Timed repetitions, the best one is reported
+	double nsPerRay; //< For micro benchmarks that do not trace rays, one ray is one operation
+};
+
+struct BenchOptions {
+	double minMs; //< Every benchmark repeats until it has run for at least that long...
+	int minIterations; //< ...and at least that many times
+	int maxIterations;
+	std::string filter; //< Only benchmarks whose name contains this are run
+};
+
+// Keeps the optimizer from removing the benchmarked code
+volatile float benchSink;
+
+static void printUsage(const char* exe) {
+	printf("Usage: %s [options]\n", exe);
+	printf("  -format F      report format: json or csv (default json)\n");
+	printf("  -out FILE      write the report to FILE instead of stdout\n");
+	printf("  -threads N     highest thread count for the frame benchmarks (default: all cores)\n");
+	printf("  -filter TEXT   run only the benchmarks whose name contains TEXT\n");
+	printf("  -quick         fewer repetitions and smaller frames, for smoke testing\n");
+}
+
+// Parses a whole decimal number in [1, INT_MAX]. Returns false for empty, partly numeric or out of range text.
+static bool parsePositiveInt(const char* text, int& value) {
+	char* end = nullptr;
+	errno = 0;
+	const long parsed = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || errno == ERANGE || parsed <= 0 || parsed > INT_MAX) {
+		return false;
+	}
+	value = int(parsed);
+	return true;
+}
+
+// Calls run() until the time and iteration limits are reached and returns the fastest call
+// in nanoseconds per ray. run() must process numRays rays (or operations) per call.
+template <class Func>
+static BenchResult measure(const BenchOptions& opts, const char* name, const char* variant, int64 numRays, Func run) {
+	run(); // Warm up caches and lazily built state
+
+	double bestNs = 1e30;
+	double totalMs = 0.0;
+	int iterations = 0;
+	while (iterations < opts.maxIterations && (iterations < opts.minIterations || totalMs < opts.minMs)) {
+		a7az0th::Timer t;
+		run();
+		t.stop();
+		const double ns = double(t.elapsed(a7az0th::Timer::Nanoseconds));
+		bestNs = Min(bestNs, ns);
+		totalMs += ns / 1000000.0;
+		iterations++;
+	}
+
+	BenchResult res;
+	res.name = name;
+	res.variant = variant;
+	res.width = res.height = 0;
+	res.threads = 1;
+	res.iterations = iterations;
+	res.nsPerRay = bestNs / double(numRays);
+	return res;
+}
+
+static bool selected(const BenchOptions& opts, const char* name) {
+	return opts.filter.empty() || strstr(name, opts.filter.c_str()) != nullptr;
+}
+
+// Rays from the default camera position towards random points around the unit sphere, about half of them hit
+static std::vector<Ray> makeRays(int count) {
+	Xoroshiro128 rng(1234);
+	std::vector<Ray> rays(count);
+	for (int i = 0; i < count; i++) {
+		const Vector target(rng.getRange(-1.5f, 1.5f), 0.f, rng.getRange(-1.5f, 1.5f));
+		rays[i].origin = Vector(0.f, -3.f, 0.f);
+		rays[i].dir = (target - rays[i].origin).normalize();
+		rays[i].depth = 0;
+	}
+	return rays;
+}
+
+static void runMicroBenchmarks(const BenchOptions& opts, std::vector<BenchResult>& results) {
+	const int N = 4096;
+	const std::vector<Ray> rays = makeRays(N);
+
+	if (selected(opts, "sphere_intersect")) {
+		const Sphere sphere;
+		results.push_back(measure(opts, "sphere_intersect", "", N, [&]() {
+			float acc = 0.f;
+			for (int i = 0; i < N; i++) {
+				IntersectionInfo info;
+				sphere.intersect(rays[i], info);
+				acc += info.distSq;
+			}
+			benchSink = acc;
+		}));
+	}
+
+	if (selected(opts, "scene_intersect")) {
+		scene.spheres.clear();
+		scene.spheres.push_back(Sphere());
+		addRandomSpheres(scene.spheres, 1000);
+		scene.buildAccelerator();
+		results.push_back(measure(opts, "scene_intersect", "bvh_1001_spheres", N, [&]() {
+			float acc = 0.f;
+			for (int i = 0; i < N; i++) {
+				IntersectionInfo info;
+				scene.intersect(rays[i], info);
+				acc += info.distSq;
+			}
+			benchSink = acc;
+		}));
+	}
+
+	const int W = 640, H = 480;
+	if (selected(opts, "scene_occluded")) {
+		scene.spheres.clear();
+		scene.spheres.push_back(Sphere());
+		addRandomSpheres(scene.spheres, 1000);
+		scene.buildAccelerator();
+		// Shadow rays are as long as the distance to a light, make these reach through the whole scene
+		results.push_back(measure(opts, "scene_occluded", "bvh_1001_spheres", N, [&]() {
+			int acc = 0;
+			for (int i = 0; i < N; i++) {
+				acc += scene.occluded(rays[i], 100.f);
+			}
+			benchSink = float(acc);
+		}));
+	}
+
+	if (selected(opts, "camera_ray")) {
+		Camera cam;
+		cam.init(W, H);
+		results.push_back(measure(opts, "camera_ray", "per_pixel", W * H, [&]() {
+			float acc = 0.f;
+			for (int y = 0; y < H; y++) {
+				for (int x = 0; x < W; x++) {
+					acc += cam.getCameraRay(x, y).dir.x;
+				}
+			}
+			benchSink = acc;
+		}));
+
+		Canvas c(W, H);
+		std::vector<Rect> buckets;
+		initBuckets(c, buckets);
+		RayStream stream;
+		results.push_back(measure(opts, "camera_ray", "stream_32x32", W * H, [&]() {
+			float acc = 0.f;
+			for (int i = 0; i < int(buckets.size()); i++) {
+				cam.getCameraRays(buckets[i], stream);
+				acc += stream.dx[0];
+			}
+			benchSink = acc;
+		}));
+	}
+
+	if (selected(opts, "shade")) {
+		scene.spheres.clear();
+		scene.spheres.push_back(Sphere());
+		addRandomSpheres(scene.spheres, 1000);
+		scene.buildAccelerator();
+		// Hits on the first sphere, shaded with each material type in turn
+		ShadingBatch batch;
+		for (int i = 0; i < N; i++) {
+			IntersectionInfo info;
+			if (scene.spheres[0].intersect(rays[i], info)) {
+				info.primId = 0;
+				batch.add(info, rays[i], i % 256, i / 256);
+			}
+		}
+		std::vector<Color> colors(batch.size());
+		const char* names[MATERIAL_TYPE_COUNT] = { "diffuse", "phong", "blinn", "mirror", "glass" };
+		const Material saved = scene.materials[0];
+		for (int t = 0; t < MATERIAL_TYPE_COUNT; t++) {
+			scene.materials[0].type = MaterialType(t);
+			results.push_back(measure(opts, "shade", names[t], batch.size(), [&]() {
+				batch.shade(scene.sampler, 0, colors.data());
+				benchSink = colors[0].r;
+			}));
+		}
+		scene.materials[0] = saved;
+	}
+
+	if (selected(opts, "vector")) {
+		std::vector<Vector> a(N), b(N);
+		for (int i = 0; i < N; i++) {
+			a[i] = rays[i].dir;
+			b[i] = rays[(i * 7) % N].dir + Vector(0.1f, 0.2f, 0.3f);
+		}
+		results.push_back(measure(opts, "vector", "cross_normalize_dot", N, [&]() {
+			float acc = 0.f;
+			for (int i = 0; i < N; i++) {
+				Vector v = cross(a[i], b[i]);
+				acc += dot(v.normalize(), b[i]);
+			}
+			benchSink = acc;
+		}));
+	}
+
+	if (selected(opts, "uv")) {
+		// Sphere uv coordinates of the ray directions, with the C library against the approximations
+		results.push_back(measure(opts, "uv", "libm", N, [&]() {
+			float acc = 0.f;
+			for (int i = 0; i < N; i++) {
+				const Vector& d = rays[i].dir;
+				acc += atan2f(d.y, d.x) + asinf(d.z);
+			}
+			benchSink = acc;
+		}));
+		results.push_back(measure(opts, "uv", "fast_scalar", N, [&]() {
+			float acc = 0.f;
+			for (int i = 0; i < N; i++) {
+				const Vector& d = rays[i].dir;
+				float u, v;
+				sphereUV(d.x, d.y, d.z, u, v);
+				acc += u + v;
+			}
+			benchSink = acc;
+		}));
+		RayStream::FloatArray dx(N), dy(N), dz(N);
+		for (int i = 0; i < N; i++) {
+			dx[i] = rays[i].dir.x;
+			dy[i] = rays[i].dir.y;
+			dz[i] = rays[i].dir.z;
+		}
+		results.push_back(measure(opts, "uv", "fast_simd", N, [&]() {
+			vfloat acc(0.f);
+			for (int i = 0; i + SIMD_WIDTH <= N; i += SIMD_WIDTH) {
+				vfloat u, v;
+				sphereUV(vfloat::load(&dx[i]), vfloat::load(&dy[i]), vfloat::load(&dz[i]), u, v);
+				acc = acc + u + v;
+			}
+			benchSink = getLane(acc, 0);
+		}));
+	}
+
+	if (selected(opts, "matrix")) {
+		const Matrix m = rotateAroundX(10.f) * rotateAroundY(20.f) * rotateAroundZ(30.f);
+		results.push_back(measure(opts, "matrix", "vector_times_matrix", N, [&]() {
+			float acc = 0.f;
+			for (int i = 0; i < N; i++) {
+				acc += (rays[i].dir * m).x;
+			}
+			benchSink = acc;
+		}));
+		results.push_back(measure(opts, "matrix", "matrix_times_matrix", N, [&]() {
+			Matrix acc(1.f);
+			for (int i = 0; i < N; i++) {
+				acc = acc * m;
+			}
+			benchSink = acc.determinant();
+		}));
+	}
+}
+
+static void runFrameBenchmarks(const BenchOptions& opts, bool quick, int maxThreads, std::vector<BenchResult>& results) {
+	if (!selected(opts, "frame")) {
+		return;
+	}
+
+	scene.spheres.clear();
+	scene.spheres.push_back(Sphere());
+	addRandomSpheres(scene.spheres, 1000);
+	scene.buildAccelerator();
+
+	std::vector<int> threadCounts;
+	for (int t = 1; t < maxThreads; t *= 2) {
+		threadCounts.push_back(t);
+	}
+	threadCounts.push_back(maxThreads);
+
+	const int sizes[][2] = { { 320, 240 }, { 640, 480 }, { 1920, 1080 } };
+	const int numSizes = quick ? 1 : 3;
+	for (int s = 0; s < numSizes; s++) {
+		const int width = sizes[s][0];
+		const int height = sizes[s][1];
+		Canvas c(width, height);
+		scene.cam.init(width, height);
+		scene.c = &c;
+		initBuckets(c, scene.buckets);
+
+		for (int t = 0; t < int(threadCounts.size()); t++) {
+			scene.numThreads = threadCounts[t];
+			for (int packets = 0; packets < 2; packets++) {
+				scene.usePackets = packets != 0;
+				BenchResult res = measure(opts, "frame", packets ? "packets" : "scalar", int64(width) * height, [&]() {
+					raytrace(scene);
+				});
+				res.width = width;
+				res.height = height;
+				res.threads = scene.numThreads;
+				results.push_back(res);
+			}
+		}
+	}
+	scene.usePackets = false;
+}
+
+static void writeReport(FILE* fp, ReportFormat format, const std::vector<BenchResult>& results) {
+	if (format == REPORT_CSV) {
+		fprintf(fp, "name,variant,width,height,threads,iterations,ns_per_ray,mrays_per_s\n");
+		for (int i = 0; i < int(results.size()); i++) {
+			const BenchResult& r = results[i];
+			fprintf(fp, "%s,%s,%d,%d,%d,%d,%.3f,%.3f\n", r.name.c_str(), r.variant.c_str(),
+				r.width, r.height, r.threads, r.iterations, r.nsPerRay, 1000.0 / r.nsPerRay);
+		}
+		return;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"simd\": \"%s\",\n", SIMD_NAME);
+	fprintf(fp, "  \"processors\": %d,\n", a7az0th::getProcessorCount());
+#ifdef NDEBUG
+	fprintf(fp, "  \"optimized\": true,\n");
+#else
+	fprintf(fp, "  \"optimized\": false,\n");
+#endif
+	fprintf(fp, "  \"results\": [\n");
+	for (int i = 0; i < int(results.size()); i++) {
+		const BenchResult& r = results[i];
+		fprintf(fp, "    {\"name\": \"%s\", \"variant\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, "
+			"\"iterations\": %d, \"ns_per_ray\": %.3f, \"mrays_per_s\": %.3f}%s\n",
+			r.name.c_str(), r.variant.c_str(), r.width, r.height, r.threads, r.iterations,
+			r.nsPerRay, 1000.0 / r.nsPerRay, (i + 1 < int(results.size())) ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char ** argv) {
+
+	ReportFormat format = REPORT_JSON;
+	std::string outFile;
+	int maxThreads = scene.numThreads;
+	bool quick = false;
+
+	BenchOptions opts;
+	opts.minMs = 500.0;
+	opts.minIterations = 5;
+	opts.maxIterations = 1000;
+
+	for (int argIdx = 1; argIdx < argc; argIdx++) {
+		const char* arg = argv[argIdx];
+		const bool hasValue = argIdx + 1 < argc;
+		if (!strcmp(arg, "-format") && hasValue) {
+			const char* f = argv[++argIdx];
+			if      (!strcmp(f, "json")) format = REPORT_JSON;
+			else if (!strcmp(f, "csv"))  format = REPORT_CSV;
+			else {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "-out") && hasValue) {
+			outFile = argv[++argIdx];
+		} else if (!strcmp(arg, "-threads") && hasValue) {
+			if (!parsePositiveInt(argv[++argIdx], maxThreads)) {
+				printUsage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(arg, "-filter") && hasValue) {
+			opts.filter = argv[++argIdx];
+		} else if (!strcmp(arg, "-quick")) {
+			quick = true;
+		} else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (maxThreads <= 0) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (quick) {
+		opts.minMs = 20.0;
+		opts.minIterations = 1;
+	}
+
+	std::vector<BenchResult> results;
+	runMicroBenchmarks(opts, results);
+	runFrameBenchmarks(opts, quick, maxThreads, results);
+
+	FILE* fp = stdout;
+	if (!outFile.empty()) {
+		fp = fopen(outFile.c_str(), "w");
+		if (!fp) {
+			printf("Failed to open %s\n", outFile.c_str());
+			return 1;
+		}
+	}
+	writeReport(fp, format, results);
+	if (fp != stdout && fclose(fp) != 0) {
+		printf("Failed to write %s\n", outFile.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,404 @@
+#include "bvh.h"
+#include "packet.h"
+
+#include <algorithm>
+
+namespace {
+
+const int NUM_BINS = 16;
+const int MAX_LEAF_SIZE = 4; //< Nodes with that many primitives or less always become leaves
+const int MAX_SAH_LEAF_SIZE = 8; //< Bigger nodes are split even if the SAH prefers a leaf
+const int MAX_SAH_DEPTH = 40; //< Below this depth nodes are split at the median to bound the tree depth
+const int PARALLEL_BINNING_SIZE = 64 * 1024; //< Nodes larger than that are binned by all threads
+const int CHUNK_SIZE = 16 * 1024;
+
+const float TRAVERSAL_COST = 1.f;
+const float INTERSECTION_COST = 1.f;
+
+struct Bin {
+	BBox box;
+	int count;
+	Bin(): count(0) {}
+};
+
+// A range of primitive indices waiting to be turned into the node at nodeIdx
+struct BuildTask {
+	int nodeIdx;
+	int start, end;
+	int depth;
+	BuildTask() {}
+	BuildTask(int nodeIdx, int start, int end, int depth): nodeIdx(nodeIdx), start(start), end(end), depth(depth) {}
+};
+
+struct BuildContext {
+	const BBox* primBoxes;
+	std::vector<Vector> centroids;
+	std::vector<int> indices;
+	a7az0th::ThreadManager* threadman;
+	int numThreads;
+};
+
+inline int getBin(float c, float cmin, float binScale) {
+	const int bin = int((c - cmin) * binScale);
+	return Min(Max(bin, 0), NUM_BINS - 1);
+}
+
+// Computes the bounds of the primitives and their centroids in [start, end)
+void computeBounds(const BuildContext& ctx, int start, int end, BBox& box, BBox& centroidBox) {
+	for (int i = start; i < end; i++) {
+		const int idx = ctx.indices[i];
+		box.add(ctx.primBoxes[idx]);
+		centroidBox.add(ctx.centroids[idx]);
+	}
+}
+
+void binPrimitives(const BuildContext& ctx, int start, int end, int axis, float cmin, float binScale, Bin* bins) {
+	for (int i = start; i < end; i++) {
+		const int idx = ctx.indices[i];
+		Bin& bin = bins[getBin(ctx.centroids[idx][axis], cmin, binScale)];
+		bin.count++;
+		bin.box.add(ctx.primBoxes[idx]);
+	}
+}
+
+struct MultiThreadedCentroids : a7az0th::MultiThreadedFor {
+	MultiThreadedCentroids(BuildContext& ctx, const std::vector<BBox>& primBoxes): ctx(ctx), primBoxes(primBoxes) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int start = index * CHUNK_SIZE;
+		const int end = Min(start + CHUNK_SIZE, int(primBoxes.size()));
+		for (int i = start; i < end; i++) {
+			ctx.centroids[i] = primBoxes[i].center();
+			ctx.indices[i] = i;
+		}
+	}
+private:
+	BuildContext& ctx;
+	const std::vector<BBox>& primBoxes;
+};
+
+struct MultiThreadedSphereBoxes : a7az0th::MultiThreadedFor {
+	MultiThreadedSphereBoxes(const MappableArray<Sphere>& spheres, std::vector<BBox>& boxes): spheres(spheres), boxes(boxes) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int start = index * CHUNK_SIZE;
+		const int end = Min(start + CHUNK_SIZE, int(spheres.size()));
+		for (int i = start; i < end; i++) {
+			boxes[i] = spheres[i].getBBox();
+		}
+	}
+private:
+	const MappableArray<Sphere>& spheres;
+	std::vector<BBox>& boxes;
+};
+
+struct MultiThreadedNodeBounds : a7az0th::MultiThreadedFor {
+	MultiThreadedNodeBounds(const BuildContext& ctx, int start, int end, int numChunks)
+		: ctx(ctx), start(start), end(end), boxes(numChunks), centroidBoxes(numChunks) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int s = start + index * CHUNK_SIZE;
+		computeBounds(ctx, s, Min(s + CHUNK_SIZE, end), boxes[index], centroidBoxes[index]);
+	}
+	const BuildContext& ctx;
+	int start, end;
+	std::vector<BBox> boxes;
+	std::vector<BBox> centroidBoxes;
+};
+
+struct MultiThreadedBinning : a7az0th::MultiThreadedFor {
+	MultiThreadedBinning(const BuildContext& ctx, int start, int end, int numChunks, int axis, float cmin, float binScale)
+		: ctx(ctx), start(start), end(end), axis(axis), cmin(cmin), binScale(binScale), bins(numChunks * NUM_BINS) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int s = start + index * CHUNK_SIZE;
+		binPrimitives(ctx, s, Min(s + CHUNK_SIZE, end), axis, cmin, binScale, &bins[index * NUM_BINS]);
+	}
+	const BuildContext& ctx;
+	int start, end, axis;
+	float cmin, binScale;
+	std::vector<Bin> bins;
+};
+
+// Fills in the node for the given task. Returns false if the node became a leaf,
+// otherwise allocates the two children and returns the tasks for them in left and right.
+// Large nodes are binned by all threads with allowParallel, which is only for the nodes at the top
+// of the tree. Subtrees are built on the threads already, they must not start another run.
+bool splitNode(BuildContext& ctx, std::vector<BVHTree::Node>& nodes, const BuildTask& task, bool allowParallel, BuildTask& left, BuildTask& right) {
+	const int count = task.end - task.start;
+	const bool parallel = allowParallel && count > PARALLEL_BINNING_SIZE && ctx.numThreads > 1;
+	const int numChunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	BBox box, centroidBox;
+	if (parallel) {
+		MultiThreadedNodeBounds bounds(ctx, task.start, task.end, numChunks);
+		bounds.run(*ctx.threadman, numChunks, ctx.numThreads);
+		for (int i = 0; i < numChunks; i++) {
+			box.add(bounds.boxes[i]);
+			centroidBox.add(bounds.centroidBoxes[i]);
+		}
+	} else {
+		computeBounds(ctx, task.start, task.end, box, centroidBox);
+	}
+
+	nodes[task.nodeIdx].box = box;
+	nodes[task.nodeIdx].count = int16(count);
+	nodes[task.nodeIdx].offset = task.start;
+	nodes[task.nodeIdx].axis = 0;
+
+	if (count <= MAX_LEAF_SIZE) {
+		return false;
+	}
+
+	const int axis = centroidBox.maxAxis();
+	const float cmin = centroidBox.vmin[axis];
+	const float cextent = centroidBox.vmax[axis] - cmin;
+
+	int mid = -1;
+	if (cextent > 0.f && task.depth < MAX_SAH_DEPTH) {
+		const float binScale = NUM_BINS * (1.f - 1e-5f) / cextent;
+		Bin bins[NUM_BINS];
+		if (parallel) {
+			MultiThreadedBinning binning(ctx, task.start, task.end, numChunks, axis, cmin, binScale);
+			binning.run(*ctx.threadman, numChunks, ctx.numThreads);
+			for (int i = 0; i < numChunks; i++) {
+				for (int b = 0; b < NUM_BINS; b++) {
+					bins[b].count += binning.bins[i*NUM_BINS + b].count;
+					bins[b].box.add(binning.bins[i*NUM_BINS + b].box);
+				}
+			}
+		} else {
+			binPrimitives(ctx, task.start, task.end, axis, cmin, binScale, bins);
+		}
+
+		// Sweep from the right to get the cost of the right side of every split plane
+		float rightCost[NUM_BINS];
+		BBox acc;
+		int accCount = 0;
+		for (int b = NUM_BINS - 1; b > 0; b--) {
+			acc.add(bins[b].box);
+			accCount += bins[b].count;
+			rightCost[b] = acc.area() * accCount;
+		}
+
+		// Then sweep from the left and pick the cheapest split. Split 'b' puts bins [0, b) on the left side.
+		int bestSplit = -1;
+		float bestCost = FLT_MAX;
+		acc.makeEmpty();
+		accCount = 0;
+		for (int b = 1; b < NUM_BINS; b++) {
+			acc.add(bins[b - 1].box);
+			accCount += bins[b - 1].count;
+			const float cost = acc.area() * accCount + rightCost[b];
+			if (accCount > 0 && accCount < count && cost < bestCost) {
+				bestCost = cost;
+				bestSplit = b;
+			}
+		}
+
+		const float nodeArea = box.area();
+		const float leafCost = INTERSECTION_COST * count;
+		const float splitCost = TRAVERSAL_COST + INTERSECTION_COST * bestCost / (nodeArea > 0.f ? nodeArea : 1.f);
+		if (bestSplit > 0 && leafCost <= splitCost && count <= MAX_SAH_LEAF_SIZE) {
+			return false;
+		}
+
+		if (bestSplit > 0) {
+			const int* first = &ctx.indices[0];
+			const std::vector<Vector>& centroids = ctx.centroids;
+			int* it = std::partition(&ctx.indices[task.start], &ctx.indices[0] + task.end, [&](int idx) {
+				return getBin(centroids[idx][axis], cmin, binScale) < bestSplit;
+			});
+			mid = int(it - first);
+		}
+	}
+
+	if (mid <= task.start || mid >= task.end) {
+		// All centroids coincide or the tree got too deep - split in the middle of the range
+		mid = (task.start + task.end) / 2;
+		const std::vector<Vector>& centroids = ctx.centroids;
+		std::nth_element(&ctx.indices[task.start], &ctx.indices[mid], &ctx.indices[0] + task.end, [&](int a, int b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+	}
+
+	const int childIdx = int(nodes.size());
+	nodes.resize(nodes.size() + 2);
+	nodes[task.nodeIdx].offset = childIdx;
+	nodes[task.nodeIdx].count = 0;
+	nodes[task.nodeIdx].axis = int16(axis);
+
+	left  = BuildTask(childIdx,     task.start, mid,      task.depth + 1);
+	right = BuildTask(childIdx + 1, mid,        task.end, task.depth + 1);
+	return true;
+}
+
+void buildSubtree(BuildContext& ctx, std::vector<BVHTree::Node>& nodes, const BuildTask& task) {
+	BuildTask left, right;
+	if (splitNode(ctx, nodes, task, false, left, right)) {
+		buildSubtree(ctx, nodes, left);
+		buildSubtree(ctx, nodes, right);
+	}
+}
+
+// Builds each of the pending subtrees into its own node array
+struct MultiThreadedSubtreeBuild : a7az0th::MultiThreadedFor {
+	MultiThreadedSubtreeBuild(BuildContext& ctx, const std::vector<BuildTask>& tasks)
+		: ctx(ctx), tasks(tasks), subtrees(tasks.size()) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		std::vector<BVHTree::Node>& local = subtrees[index];
+		local.resize(1);
+		BuildTask root = tasks[index];
+		root.nodeIdx = 0;
+		buildSubtree(ctx, local, root);
+	}
+	BuildContext& ctx;
+	const std::vector<BuildTask>& tasks;
+	std::vector<std::vector<BVHTree::Node> > subtrees;
+};
+
+} // namespace
+
+void BVHTree::build(const std::vector<BBox>& primBoxes, a7az0th::ThreadManager& threadman, int numThreads, std::vector<int>& primOrder) {
+	nodes.clear();
+	primOrder.clear();
+	const int numPrims = int(primBoxes.size());
+	if (numPrims == 0) {
+		return;
+	}
+
+	BuildContext ctx;
+	ctx.threadman = &threadman;
+	ctx.numThreads = numThreads;
+	ctx.primBoxes = primBoxes.data();
+	ctx.centroids.resize(numPrims);
+	ctx.indices.resize(numPrims);
+
+	const int numChunks = (numPrims + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	MultiThreadedCentroids centroids(ctx, primBoxes);
+	centroids.run(threadman, numChunks, numThreads);
+
+	// Split the top of the tree until there are enough independent subtrees to keep all threads busy
+	const int subtreeSize = Max(numPrims / (numThreads * 8), 1024);
+	std::vector<BuildTask> pending(1, BuildTask(0, 0, numPrims, 0));
+	std::vector<BuildTask> subtreeTasks;
+	std::vector<Node> built(1);
+	while (!pending.empty()) {
+		const BuildTask task = pending.back();
+		pending.pop_back();
+		if (task.end - task.start <= subtreeSize) {
+			subtreeTasks.push_back(task);
+			continue;
+		}
+		BuildTask left, right;
+		if (splitNode(ctx, built, task, true, left, right)) {
+			pending.push_back(left);
+			pending.push_back(right);
+		}
+	}
+
+	MultiThreadedSubtreeBuild subtreeBuild(ctx, subtreeTasks);
+	subtreeBuild.run(threadman, int(subtreeTasks.size()), numThreads);
+
+	// Stitch the subtrees into the main array. The root of each subtree goes into the node reserved
+	// for it, the rest is appended and the child offsets are shifted accordingly.
+	for (int i = 0; i < int(subtreeTasks.size()); i++) {
+		const std::vector<Node>& local = subtreeBuild.subtrees[i];
+		const int base = int(built.size()) - 1;
+		for (int n = 0; n < int(local.size()); n++) {
+			Node node = local[n];
+			if (!node.isLeaf()) {
+				node.offset += base;
+			}
+			if (n == 0) {
+				built[subtreeTasks[i].nodeIdx] = node;
+			} else {
+				built.push_back(node);
+			}
+		}
+	}
+
+	nodes.swap(built);
+	primOrder.swap(ctx.indices);
+}
+
+void BVH::clear() {
+	tree.clear();
+	prims.clear();
+	primIds.clear();
+	primSlots.clear();
+}
+
+void BVH::build(const MappableArray<Sphere>& spheres, a7az0th::ThreadManager& threadman, int numThreads) {
+	clear();
+	const int numPrims = int(spheres.size());
+
+	std::vector<BBox> boxes(numPrims);
+	MultiThreadedSphereBoxes sphereBoxes(spheres, boxes);
+	sphereBoxes.run(threadman, (numPrims + CHUNK_SIZE - 1) / CHUNK_SIZE, numThreads);
+
+	std::vector<int> order;
+	tree.build(boxes, threadman, numThreads, order);
+
+	std::vector<Sphere> ordered(numPrims);
+	for (int i = 0; i < numPrims; i++) {
+		ordered[i] = spheres[order[i]];
+	}
+	prims.assign(ordered);
+	std::vector<int> slots(numPrims);
+	for (int i = 0; i < numPrims; i++) {
+		slots[order[i]] = i;
+	}
+	primIds.swap(order);
+	primSlots.swap(slots);
+}
+
+void BVH::updateSphere(int idx, const Sphere& sphere) {
+	const MappableArray<int>& ids = primIds;
+	const MappableArray<int>& slots = primSlots;
+	if (idx < 0 || idx >= int(slots.size())) {
+		return;
+	}
+	// Checked against primIds, the slots may come from a compiled scene file
+	const int pos = slots[idx];
+	if (pos < 0 || pos >= int(ids.size()) || ids[pos] != idx) {
+		return;
+	}
+	prims.set(pos, sphere);
+	auto primBox = [&](int i) { return prims.get(i).getBBox(); };
+	tree.refit(pos, primBox);
+}
+
+bool BVH::intersect(const Ray& ray, IntersectionInfo& info) const {
+	float maxT = info.isValid() ? sqrtf(info.distSq) : FLT_MAX;
+	int hitIdx = -1;
+	// All spheres of a leaf are tested at once. Only the distance and the sphere of the closest hit
+	// are kept, its attributes are left to Scene::getHitAttributes.
+	auto intersectLeaf = [&](int first, int count, float& maxT) {
+		const int idx = prims.intersect(ray, first, first + count, maxT);
+		if (idx >= 0) {
+			hitIdx = idx;
+		}
+	};
+	tree.traverse(ray, maxT, intersectLeaf);
+
+	if (hitIdx < 0) {
+		return false;
+	}
+	info.distSq = maxT * maxT;
+	info.primId = primIds[hitIdx];
+	info.attributes = 0;
+	return true;
+}
+
+bool BVH::occluded(const Ray& ray, float maxT) const {
+	auto anyHit = [&](int first, int count, float maxT) {
+		return prims.occluded(ray, first, first + count, maxT);
+	};
+	return tree.occluded(ray, maxT, anyHit);
+}
+
+void BVH::intersect(const RayPacket& packet, PacketHit& hit) const {
+	auto intersectLeaf = [&](int first, int count, vfloat& maxT) {
+		for (int i = first; i < first + count; i++) {
+			intersectPacket(prims.get(i), primIds[i], packet, hit);
+		}
+	};
+	tree.traverse(packet, hit.t, intersectLeaf);
+}
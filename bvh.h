@@ -0,0 +1,286 @@
+#pragma once
+
+#include "sphere.h"
+#include "sphereset.h"
+#include "packet.h"
+#include "bbox.h"
+#include "defs.h"
+#include "stats.h"
+#include "mappablearray.h"
+
+#include "threadman.h"
+
+#include <vector>
+
+// Bounding volume hierarchy nodes over an arbitrary set of primitives given by their boxes.
+// The tree is built top-down with a binned Surface Area Heuristic. The upper levels are split
+// one node at a time with the binning pass spread over all threads, after which the remaining
+// subtrees are built independently in parallel.
+// Nodes are stored in a flat array, the two children of an inner node are always adjacent.
+class BVHTree {
+public:
+	struct Node {
+		BBox box;
+		int offset; //< Index of the left child for inner nodes, index of the first primitive for leaves
+		int16 count; //< Number of primitives in a leaf, 0 for inner nodes
+		int16 axis;  //< Split axis of inner nodes, used to pick the traversal order
+
+		bool isLeaf() const { return count > 0; }
+	};
+
+	// Builds the tree over primitives with the given bounding boxes. On return primOrder holds the
+	// primitive indices in leaf order, leaves reference ranges of that array.
+	void build(const std::vector<BBox>& primBoxes, a7az0th::ThreadManager& threadman, int numThreads, std::vector<int>& primOrder);
+
+	// Walks the leaves hit by the ray segment [0, maxT] front to back. intersectLeaf(first, count, maxT)
+	// is called for every such leaf and is expected to shrink maxT when it finds a closer hit.
+	template <class LeafFunc>
+	void traverse(const Ray& ray, float& maxT, LeafFunc& intersectLeaf) const;
+
+	// Same as traverse, but for a whole packet. A node is visited if any active lane hits its box,
+	// so this pays off only for coherent rays. maxT holds the current hit distance of every lane.
+	template <class LeafFunc>
+	void traverse(const RayPacket& packet, vfloat& maxT, LeafFunc& intersectLeaf) const;
+
+	// Any-hit walk for shadow rays. Stops at the first leaf for which anyHit(first, count, maxT)
+	// returns true and returns true, returns false if no leaf reports a hit within [0, maxT].
+	template <class LeafFunc>
+	bool occluded(const Ray& ray, float maxT, LeafFunc& anyHit) const;
+
+	// Updates the boxes of the leaf with primitive 'prim', its position in primOrder, and of all
+	// nodes above it after the primitive changed. primBox(i) returns the box of the primitive at
+	// position i. Costs a walk down the tree instead of a rebuild, but the tree gets worse the
+	// further the primitive ends up from where it was when the tree was built.
+	template <class BoxFunc>
+	void refit(int prim, BoxFunc& primBox);
+
+	void clear() { nodes.clear(); }
+	bool empty() const { return nodes.empty(); }
+	int getNodeCount() const { return int(nodes.size()); }
+	BBox getBounds() const { return nodes.empty() ? BBox() : nodes[0].box; }
+
+	// Calls visit(array) for every array the tree is made of, always in the same order.
+	// Used to write the tree into a compiled scene and to map it back, see scenefile.h.
+	template <class Visitor>
+	void visitArrays(Visitor& visit) { visit(nodes); }
+
+private:
+	MappableArray<Node> nodes;
+};
+
+// Bounding volume hierarchy over a set of spheres. Used as the acceleration structure of the scene.
+class BVH {
+public:
+	BVH() {}
+
+	// Builds the hierarchy over the given spheres. The spheres are copied internally in leaf order,
+	// so the input may be modified or released afterwards.
+	void build(const MappableArray<Sphere>& spheres, a7az0th::ThreadManager& threadman, int numThreads);
+
+	// Finds the closest intersection of the ray with the spheres.
+	// info.primId is set to the index of the hit sphere in the array passed to build().
+	bool intersect(const Ray& ray, IntersectionInfo& info) const;
+
+	// Finds the closest hit for every active lane of the packet.
+	void intersect(const RayPacket& packet, PacketHit& hit) const;
+
+	// Returns true if the ray hits any sphere at a distance of at most maxT. Stops at the first hit
+	// found and computes no hit attributes, which makes it cheaper than intersect.
+	bool occluded(const Ray& ray, float maxT) const;
+
+	// Replaces sphere 'idx' of the array passed to build() and refits the tree to it, see
+	// BVHTree::refit. Meant for interactive edits of a few spheres, rebuild after many.
+	void updateSphere(int idx, const Sphere& sphere);
+
+	void clear();
+	int getNodeCount() const { return tree.getNodeCount(); }
+	int getPrimCount() const { return prims.size(); }
+	BBox getBounds() const { return tree.getBounds(); }
+
+	// Same as BVHTree::visitArrays
+	template <class Visitor>
+	void visitArrays(Visitor& visit) {
+		tree.visitArrays(visit);
+		prims.visitArrays(visit);
+		visit(primIds);
+		visit(primSlots);
+	}
+
+private:
+	BVHTree tree;
+	SphereSet prims; //< The spheres reordered so each leaf references a contiguous range
+	MappableArray<int> primIds; //< Original index of each sphere in prims
+	MappableArray<int> primSlots; //< Position in prims of each original sphere, the inverse of primIds
+};
+
+template <class BoxFunc>
+void BVHTree::refit(int prim, BoxFunc& primBox) {
+	if (nodes.empty()) {
+		return;
+	}
+	const MappableArray<Node>& tree = nodes;
+	// The left child of a node holds the lower part of its primitive range. Where the right one
+	// starts is found at its leftmost leaf.
+	int path[64];
+	int depth = 0;
+	int current = 0;
+	while (!tree[current].isLeaf()) {
+		path[depth++] = current;
+		int leftmost = tree[current].offset + 1;
+		while (!tree[leftmost].isLeaf()) {
+			leftmost = tree[leftmost].offset;
+		}
+		current = tree[current].offset + (prim < tree[leftmost].offset ? 0 : 1);
+	}
+
+	BBox box;
+	for (int i = tree[current].offset; i < tree[current].offset + tree[current].count; i++) {
+		box.add(primBox(i));
+	}
+	nodes[current].box = box;
+	while (depth > 0) {
+		const int parent = path[--depth];
+		box = tree[tree[parent].offset].box;
+		box.add(tree[tree[parent].offset + 1].box);
+		nodes[parent].box = box;
+	}
+}
+
+template <class LeafFunc>
+void BVHTree::traverse(const Ray& ray, float& maxT, LeafFunc& intersectLeaf) const {
+	if (nodes.empty()) {
+		return;
+	}
+
+	const Vector invDir(1.f / ray.dir.x, 1.f / ray.dir.y, 1.f / ray.dir.z);
+	const bool dirIsNeg[3] = { ray.dir.x < 0.f, ray.dir.y < 0.f, ray.dir.z < 0.f };
+
+	int stack[64];
+	int stackSize = 0;
+	int current = 0;
+	int numVisited = 0, numTested = 0;
+	while (true) {
+		const Node& node = nodes[current];
+		numVisited++;
+		if (node.box.intersect(ray.origin, invDir, maxT)) {
+			if (node.isLeaf()) {
+				numTested += node.count;
+				intersectLeaf(node.offset, node.count, maxT);
+			} else {
+				// Visit the child closer to the ray origin first, so far nodes get culled by maxT
+				if (dirIsNeg[node.axis]) {
+					stack[stackSize++] = node.offset;
+					current = node.offset + 1;
+				} else {
+					stack[stackSize++] = node.offset + 1;
+					current = node.offset;
+				}
+				continue;
+			}
+		}
+		if (stackSize == 0) {
+			break;
+		}
+		current = stack[--stackSize];
+	}
+	STATS_ADD(STAT_NODE_VISITS, numVisited);
+	STATS_ADD(STAT_PRIM_TESTS, numTested);
+}
+
+template <class LeafFunc>
+void BVHTree::traverse(const RayPacket& packet, vfloat& maxT, LeafFunc& intersectLeaf) const {
+	if (nodes.empty() || none(packet.active)) {
+		return;
+	}
+
+	const vfloat invDir[3] = { vfloat(1.f) / packet.dx, vfloat(1.f) / packet.dy, vfloat(1.f) / packet.dz };
+
+	// The lanes of a coherent packet point roughly the same way, so the traversal order
+	// is taken from the first active lane
+	int firstLane = 0;
+	while (!((packet.active.bits() >> firstLane) & 1)) firstLane++;
+	const bool dirIsNeg[3] = {
+		getLane(packet.dx, firstLane) < 0.f,
+		getLane(packet.dy, firstLane) < 0.f,
+		getLane(packet.dz, firstLane) < 0.f,
+	};
+
+	int numActive = 0;
+	for (int i = 0; i < SIMD_WIDTH; i++) numActive += (packet.active.bits() >> i) & 1;
+
+	int stack[64];
+	int stackSize = 0;
+	int current = 0;
+	int numVisited = 0, numTested = 0;
+	while (true) {
+		const Node& node = nodes[current];
+		numVisited++;
+		if (any(intersectPacket(node.box, packet, invDir, maxT))) {
+			if (node.isLeaf()) {
+				numTested += node.count * numActive;
+				intersectLeaf(node.offset, node.count, maxT);
+			} else {
+				if (dirIsNeg[node.axis]) {
+					stack[stackSize++] = node.offset;
+					current = node.offset + 1;
+				} else {
+					stack[stackSize++] = node.offset + 1;
+					current = node.offset;
+				}
+				continue;
+			}
+		}
+		if (stackSize == 0) {
+			break;
+		}
+		current = stack[--stackSize];
+	}
+	STATS_ADD(STAT_NODE_VISITS, numVisited);
+	STATS_ADD(STAT_PRIM_TESTS, numTested);
+}
+
+template <class LeafFunc>
+bool BVHTree::occluded(const Ray& ray, float maxT, LeafFunc& anyHit) const {
+	if (nodes.empty()) {
+		return false;
+	}
+
+	const Vector invDir(1.f / ray.dir.x, 1.f / ray.dir.y, 1.f / ray.dir.z);
+	const bool dirIsNeg[3] = { ray.dir.x < 0.f, ray.dir.y < 0.f, ray.dir.z < 0.f };
+
+	int stack[64];
+	int stackSize = 0;
+	int current = 0;
+	int numVisited = 0, numTested = 0;
+	bool hit = false;
+	while (true) {
+		const Node& node = nodes[current];
+		numVisited++;
+		if (node.box.intersect(ray.origin, invDir, maxT)) {
+			if (node.isLeaf()) {
+				numTested += node.count;
+				if (anyHit(node.offset, node.count, maxT)) {
+					hit = true;
+					break;
+				}
+			} else {
+				// Any hit will do, but the near child is still the more likely to contain one
+				if (dirIsNeg[node.axis]) {
+					stack[stackSize++] = node.offset;
+					current = node.offset + 1;
+				} else {
+					stack[stackSize++] = node.offset + 1;
+					current = node.offset;
+				}
+				continue;
+			}
+		}
+		if (stackSize == 0) {
+			break;
+		}
+		current = stack[--stackSize];
+	}
+	STATS_ADD(STAT_NODE_VISITS, numVisited);
+	STATS_ADD(STAT_PRIM_TESTS, numTested);
+	return hit;
+}
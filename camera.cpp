@@ -1,5 +1,7 @@
 #include "camera.h"
 #include "matrix.h"
+#include "packet.h"
+#include "raystream.h"
 
 // The default constructor for the class
 // It initializes all camera parameters with default values and precomputes
@@ -16,9 +18,11 @@ Camera::Camera() {
 	pitch  = 0.0f;
 	roll   = 0.0f;
 	pos    = Vector(0.0f, -3.0f, 0.0f);
+	revision = 0;
 }
 
 void Camera::init(int w, int h) {
+	revision++;
 	width = w;
 	height = h;
 	aspect = (float)width / height;
@@ -52,11 +56,18 @@ void Camera::init(int w, int h) {
 /// returns a ray that starts at the location of the camera and goes through the
 /// top-left corner of the corresponding pixel in the virtual image sensor.
 Ray Camera::getCameraRay(int x, int y)
+{
+	return getCameraRay(float(x), float(y));
+}
+
+/// Same as above, but for an arbitrary point on the image plane given in pixel units.
+/// Used to place several samples inside one pixel.
+Ray Camera::getCameraRay(float x, float y)
 {
 	Vector dir;
 
-	float w = float(x) / width;
-	float h = float(y) / height;
+	float w = x / width;
+	float h = y / height;
 
 	Vector hor_offset;
 	Vector ver_offset;
@@ -75,12 +86,104 @@ Ray Camera::getCameraRay(int x, int y)
 	return ray;
 }
 
+bool Camera::project(const Vector& p, float& x, float& y) const
+{
+	// The sensor is the plane at distance 1 along cameraFront, spanned by cameraRight and cameraUp
+	const Vector d = p - pos;
+	const float depth = dot(d, cameraFront);
+	if (depth <= 1e-6f) {
+		return false;
+	}
+	const float sx = dot(d, cameraRight) / depth;
+	const float sy = dot(d, cameraUp) / depth;
+	x = (sx + sensorWidth) / (2.f * sensorWidth) * float(width);
+	y = (sensorHeight - sy) / (2.f * sensorHeight) * float(height);
+	return true;
+}
+
+/// Packet version of getCameraRay. Fills the packet with the rays through the top-left corners
+/// of the PACKET_W x PACKET_H block of pixels that starts at (x, y). All lanes are marked active,
+/// the caller is responsible for masking out pixels outside of the image.
+/// The jitter, in pixels, is added to every lane and moves the rays away from the pixel corners.
+void Camera::getCameraRays(int x, int y, RayPacket& packet, float jitterX, float jitterY)
+{
+	const Vector dx = (sensorTopRight - sensorTopLeft) / float(width);
+	const Vector dy = (sensorBotLeft  - sensorTopLeft) / float(height);
+	const Vector base = sensorTopLeft - pos;
+
+	const vfloat px = vfloat(float(x)) + packetLaneX() + vfloat(jitterX);
+	const vfloat py = vfloat(float(y)) + packetLaneY() + vfloat(jitterY);
+
+	const vfloat dirX = vfloat(base.x) + px * vfloat(dx.x) + py * vfloat(dy.x);
+	const vfloat dirY = vfloat(base.y) + px * vfloat(dx.y) + py * vfloat(dy.y);
+	const vfloat dirZ = vfloat(base.z) + px * vfloat(dx.z) + py * vfloat(dy.z);
+	const vfloat invLength = vfloat(1.f) / vsqrt(dirX*dirX + dirY*dirY + dirZ*dirZ);
+
+	packet.ox = vfloat(pos.x);
+	packet.oy = vfloat(pos.y);
+	packet.oz = vfloat(pos.z);
+	packet.dx = dirX * invLength;
+	packet.dy = dirY * invLength;
+	packet.dz = dirZ * invLength;
+	packet.active = allLanes();
+}
+
+/// Stream version of getCameraRay. Fills the stream with the rays through all pixels of the rectangle.
+/// The sensor deltas are computed once for the whole rectangle. The direction of a pixel is split into
+/// a per-column and a per-row term, the column terms are shared by all rows, so each ray takes three
+/// additions before it is normalized SIMD_WIDTH rays at a time.
+void Camera::getCameraRays(const Rect& r, RayStream& rays, float jitterX, float jitterY)
+{
+	rays.resize(r.width(), r.height());
+	rays.origin = pos;
+	if (r.area() <= 0) {
+		return;
+	}
+
+	const Vector dx = (sensorTopRight - sensorTopLeft) / float(width);
+	const Vector dy = (sensorBotLeft  - sensorTopLeft) / float(height);
+	const Vector base = sensorTopLeft - pos;
+	const int stride = rays.stride;
+
+	// The column terms go into the first row of the stream and are completed in place
+	float* colX = &rays.dx[0];
+	float* colY = &rays.dy[0];
+	float* colZ = &rays.dz[0];
+	for (int i = 0; i < stride; i++) {
+		const float px = float(r.x0 + i) + jitterX;
+		colX[i] = px * dx.x;
+		colY[i] = px * dx.y;
+		colZ[i] = px * dx.z;
+	}
+
+	for (int y = r.height() - 1; y >= 0; y--) {
+		const float py = float(r.y0 + y) + jitterY;
+		const vfloat rowX(base.x + py * dy.x);
+		const vfloat rowY(base.y + py * dy.y);
+		const vfloat rowZ(base.z + py * dy.z);
+		float* outX = &rays.dx[y * stride];
+		float* outY = &rays.dy[y * stride];
+		float* outZ = &rays.dz[y * stride];
+		// Row 0 holds the column terms and is done last, after all other rows have read them
+		for (int i = 0; i < stride; i += SIMD_WIDTH) {
+			const vfloat dirX = rowX + vfloat::load(colX + i);
+			const vfloat dirY = rowY + vfloat::load(colY + i);
+			const vfloat dirZ = rowZ + vfloat::load(colZ + i);
+			const vfloat invLength = vfloat(1.f) / vsqrt(dirX*dirX + dirY*dirY + dirZ*dirZ);
+			(dirX * invLength).store(outX + i);
+			(dirY * invLength).store(outY + i);
+			(dirZ * invLength).store(outZ + i);
+		}
+	}
+}
+
 /// Function is responsible for handling camera rotation
 /// Function takes as input 3 numbers that represent rotation in all 3 axis
 /// The roll, pitch and yaw angles of the camera are then increased by the ammounts given.
 /// NOTE: We do not allow the camera to flip so up and down movements
 /// (represented with the pitch angle) are limited to [-90:90]
 void Camera::rotateCamera(float r, float p, float y) {
+	revision++;
 	roll  += r;
 	pitch += p;
 	yaw   += y;
@@ -115,6 +218,7 @@ void Camera::rotateCamera(float r, float p, float y) {
 /// Function takes as input one vector - v and translates the camera to that position.
 void Camera::moveCameraAbsolute(const Vector & v)
 {
+	revision++;
 	const Vector translation = pos - v;
 	const Matrix rotate = 
 	     rotateAroundX(pitch)
@@ -146,6 +250,7 @@ void Camera::moveCameraAbsolute(const Vector & v)
 /// in each direction. The final camera movement is calculated by adding up the movements in each separate axis
 /// Final Camera position = Original camera position + v.x * ForwardDirection + v.y * RightDirection + v.z * UpDirection;
 void Camera::moveCameraRelative(const Vector & v) {
+	revision++;
 	const Matrix rotate =  
 	     rotateAroundX(pitch)
 	   * rotateAroundY(roll)
@@ -178,6 +283,7 @@ void Camera::moveCameraRelative(const Vector & v) {
 /// Final Camera position = Original camera position + v.x * ForwardDirection + v.y * RightDirection + v.z * UpDirection;
 void Camera::moveCameraGameLike(const Vector & v)
 {
+	revision++;
 	const Matrix rotate = 
 	     rotateAroundX(pitch)
 	   * rotateAroundY(roll)
@@ -210,6 +316,7 @@ void Camera::moveCameraGameLike(const Vector & v)
 /// Function resets all camera parameters to their default values.
 void Camera::resetDefaults()
 {
+	revision++;
 	//width = 640;
 	//height = 480;
 	//fov = 90;
@@ -231,10 +338,22 @@ void Camera::resetDefaults()
 	sensorBotLeft  = pos + Vector(-sensorWidth, 1.0f, -sensorHeight);
 }
 
+/// Function sets all parameters that place the camera at once, as read from a scene file,
+/// and recalculates the sensor for them.
+void Camera::setView(const Vector& newPos, float newYaw, float newPitch, float newRoll, float newFov) {
+	pos = newPos;
+	yaw = newYaw;
+	pitch = Min(Max(newPitch, -90.f), 90.f);
+	roll = newRoll;
+	fov = newFov;
+	init(width, height);
+}
+
 /// Function implements the effect of zooming in on the objects in the direction the camera is facing
 /// Function decreases camera FOV by 1% of the current value
 /// and then recalculates all the camera parameters that would be affected by this change.
 void Camera::zoomIn() {
+	revision++;
 	fov -= fov * 0.01f;
 	const float diag = tanf(toRadians(fov / 2));
 
@@ -265,6 +384,7 @@ void Camera::zoomIn() {
 /// NOTE: FOV cannot be increased to a value greater than 180 degrees.
 void Camera::zoomOut()
 {
+	revision++;
 	fov += fov * 0.01f;
 	if (fov > 180) fov = 180;
 	const float diag = tanf(toRadians(fov / 2));
@@ -292,19 +412,19 @@ void Camera::zoomOut()
 
 /// Function returns the value of camera Roll angle
 /// The Roll angle describes camera rotation around the Z axis
-float Camera::getRoll() {
+float Camera::getRoll() const {
 	return roll;
 }
 
 /// Function returns the value of camera Pitch angle
 /// The Pitch angle describes camera rotation around the X axis
-float Camera::getPitch() {
+float Camera::getPitch() const {
 	return pitch;
 }
 
 /// Function returns the value of camera Yaw angle
 /// The Yaw angle describes camera rotation around the Y axis
-float Camera::getYaw() {
+float Camera::getYaw() const {
 	return yaw;
 }
 
@@ -320,7 +440,7 @@ Vector Camera::getUp() {
 	return cameraUp;
 }
 
-Vector Camera::getPos() {
+Vector Camera::getPos() const {
 	return pos;
 }
 
@@ -328,10 +448,10 @@ Vector Camera::getDir() {
 	return cameraFront;
 }
 
-int Camera::getWidth() {
+int Camera::getWidth() const {
 	return width;
 }
 
-int Camera::getHeight() {
+int Camera::getHeight() const {
 	return height;
 }
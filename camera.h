@@ -3,22 +3,33 @@
 #include "vector.h"
 #include "defs.h"
 
+struct RayPacket;
+struct RayStream;
+struct Rect;
+
 // A class that represents a simple rectangular pinhole camera.
 class Camera {
 public:
 	void init(int w = 640, int h = 480);
 	Camera();
 	Ray getCameraRay(int x,int y);
-	float getRoll();
-	float getPitch();
-	float getYaw();
+	Ray getCameraRay(float x, float y);
+	// Finds the point (x, y) of the image plane whose camera ray passes through p, the inverse of
+	// getCameraRay. Returns false if p is not in front of the camera.
+	bool project(const Vector& p, float& x, float& y) const;
+	void getCameraRays(int x, int y, RayPacket& packet, float jitterX = 0.f, float jitterY = 0.f);
+	void getCameraRays(const Rect& r, RayStream& rays, float jitterX = 0.f, float jitterY = 0.f);
+	float getRoll() const;
+	float getPitch() const;
+	float getYaw() const;
+	float getFov() const { return fov; }
 	Vector getFront();
 	Vector getRight();
 	Vector getUp();
-	Vector getPos();
+	Vector getPos() const;
 	Vector getDir();
-	int getWidth();
-	int getHeight();
+	int getWidth() const;
+	int getHeight() const;
 	void zoomIn();
 	void zoomOut();
 	void rotateCamera(float, float, float);
@@ -26,10 +37,18 @@ public:
 	void moveCameraRelative(const Vector &);
 	void moveCameraGameLike(const Vector &);
 	void resetDefaults();
+	// Places the camera at pos, turned by the angles in degrees, with a diagonal field of view of
+	// fov degrees. Keeps the image size.
+	void setView(const Vector& pos, float yaw, float pitch, float roll, float fov);
 	void lockCamera();
 	void unlockCamera();
 	bool isCameraLocked();
 	void switchCameraLock();
+	// Size of a pixel on the plane at distance 1 in front of the camera, how fast the footprint of
+	// a camera ray grows with the distance
+	float getPixelSpread() const { return 2.f * sensorWidth / float(width); }
+	// Incremented by every call that changes the generated rays, used to detect a moved camera
+	uint32 getRevision() const { return revision; }
 
 private:
 	int width;
@@ -50,4 +69,6 @@ private:
 	Vector sensorTopLeft;
 	Vector sensorTopRight;
 	Vector sensorBotLeft;
+
+	uint32 revision;
 };
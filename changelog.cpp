@@ -0,0 +1,39 @@
+#include "changelog.h"
+
+void ChangeLog::add(uint32 revision, const BBox& bounds) {
+	Entry entry;
+	entry.revision = revision;
+	entry.bounds = bounds;
+	entries.push_back(entry);
+	if (entries.size() > MAX_ENTRIES) {
+		entries.pop_front();
+	}
+}
+
+bool ChangeLog::getChanges(uint32 since, uint32 current, BBox& bounds) const {
+	bounds.makeEmpty();
+	// Every revision in between needs an entry of its own, walk them back from the newest
+	uint32 expected = current;
+	for (std::deque<Entry>::const_reverse_iterator it = entries.rbegin(); it != entries.rend() && expected != since; ++it) {
+		if (it->revision != expected) {
+			return false;
+		}
+		bounds.add(it->bounds);
+		expected--;
+	}
+	return expected == since;
+}
+
+bool ChangeLog::getSurfaces(uint32 revision, SurfaceBounds& surfaces) const {
+	if (!surfacesValid || surfacesRevision != revision) {
+		return false;
+	}
+	surfaces = this->surfaces;
+	return true;
+}
+
+void ChangeLog::setSurfaces(uint32 revision, const SurfaceBounds& surfaces) {
+	this->surfaces = surfaces;
+	surfacesRevision = revision;
+	surfacesValid = true;
+}
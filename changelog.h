@@ -0,0 +1,60 @@
+#pragma once
+
+#include "bbox.h"
+#include "material.h"
+#include "defs.h"
+
+#include <deque>
+
+// Remembers which part of the scene the recent changes affected, so a canvas that shows an older
+// revision of the scene can be brought up to date by rendering only the pixels that see that part.
+// Every change to the scene increments its revision. Changes that know their extent record a box
+// of all the points whose shading they may alter, see Scene::markChanged(const BBox&); a revision
+// without a box stands for a change of unknown extent.
+// What the materials of the objects make the extent of a change depend on
+struct SurfaceBounds {
+	BBox all; //< All objects, nothing outside of it is ever shaded
+	BBox specular; //< Objects with mirror or glass materials, they reflect changes anywhere in the scene
+	bool highlights; //< Some object has a Phong or Blinn highlight
+
+	SurfaceBounds(): highlights(false) {}
+
+	void add(const BBox& box, const Material& m) {
+		all.add(box);
+		if (m.type == MATERIAL_MIRROR || m.type == MATERIAL_DIELECTRIC) {
+			specular.add(box);
+		} else if (m.type == MATERIAL_PHONG || m.type == MATERIAL_BLINN) {
+			highlights = true;
+		}
+	}
+};
+
+class ChangeLog {
+public:
+	ChangeLog(): surfacesRevision(0), surfacesValid(false) {}
+
+	// Records that revision 'revision' changed only the points inside 'bounds'
+	void add(uint32 revision, const BBox& bounds);
+
+	// Combines the boxes of the revisions after 'since' up to and including 'current'. Returns
+	// false if any of them has no box, or is older than the last MAX_ENTRIES recorded ones.
+	bool getChanges(uint32 since, uint32 current, BBox& bounds) const;
+
+	// The surface bounds of the scene at revision 'revision', as left by the last edit. Returns
+	// false if the scene changed in another way since, then they have to be collected again.
+	// The edits of sceneedit.h grow the bounds by what they move instead of walking all objects.
+	bool getSurfaces(uint32 revision, SurfaceBounds& surfaces) const;
+	void setSurfaces(uint32 revision, const SurfaceBounds& surfaces);
+
+private:
+	enum { MAX_ENTRIES = 64 };
+
+	struct Entry {
+		uint32 revision;
+		BBox bounds;
+	};
+	std::deque<Entry> entries; //< Increasing revisions
+	SurfaceBounds surfaces;
+	uint32 surfacesRevision;
+	bool surfacesValid;
+};
@@ -0,0 +1,844 @@
+#include "cluster.h"
+#include "render.h"
+#include "random.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+	#include <process.h>
+	typedef int socklen_t;
+	typedef ULONG nfds_t;
+	#define poll WSAPoll
+#else
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <sys/wait.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <netdb.h>
+	#include <poll.h>
+	#include <signal.h>
+	#include <spawn.h>
+	#include <unistd.h>
+	extern char** environ;
+#endif
+
+#include <algorithm>
+#include <thread>
+#include <type_traits>
+
+namespace {
+
+const uint32 CLUSTER_MAGIC = 0x44524743; //< "CGRD"
+const uint32 CLUSTER_VERSION = 1;
+const double ACCEPT_POLL_MS = 100.0; //< Longest the coordinator waits in poll before it checks the timeouts
+const double HELLO_RECV_MS = 20.0; //< Longest the coordinator waits for the rest of a hello that started to arrive
+
+enum MessageType {
+	MSG_HELLO = 1, //< Worker: HelloMessage
+	MSG_REJECT, //< Coordinator: the scene of the worker does not match, no payload
+	MSG_LIGHTS, //< Coordinator: frame id followed by the lights of the frame
+	MSG_BUCKETS, //< Coordinator: frame id followed by BucketTasks
+	MSG_PIXELS, //< Worker: BucketTask followed by the colors of the bucket, row by row
+	MSG_BATCH_DONE, //< Worker: frame id followed by the StatCounters of the batch
+	MSG_STOP, //< Coordinator: the render is over, no payload
+	MSG_COUNT,
+};
+
+struct MessageHeader {
+	uint32 type;
+	uint32 size; //< Bytes of payload after the header
+};
+
+struct HelloMessage {
+	uint32 magic;
+	uint32 version;
+	uint32 fingerprint;
+	int32 numThreads;
+};
+
+struct BucketTask {
+	uint32 frame;
+	int32 bucket; //< Index in the scene.buckets of the coordinator
+	Rect rect;
+};
+
+// Messages are copied to and from the sockets byte by byte
+static_assert(std::is_trivially_copyable<HelloMessage>::value, "HelloMessage is sent as bytes");
+static_assert(std::is_trivially_copyable<BucketTask>::value, "BucketTask is sent as bytes");
+static_assert(std::is_trivially_copyable<Light>::value, "Light is sent as bytes");
+static_assert(std::is_trivially_copyable<Color>::value, "Color is sent as bytes");
+static_assert(std::is_trivially_copyable<StatCounters>::value, "StatCounters is sent as bytes");
+
+// Largest payload each side accepts for each message type, 0 for the types it never receives.
+// The size comes from the peer, a larger one is refused before anything is allocated.
+struct MessageLimits {
+	size_t maxSize[MSG_COUNT];
+
+	MessageLimits() {
+		for (int i = 0; i < MSG_COUNT; i++) {
+			maxSize[i] = 0;
+		}
+	}
+};
+
+// What workers send: their hello, pixels of buckets no larger than maxBucketArea and statistics
+MessageLimits getCoordinatorLimits(int maxBucketArea) {
+	MessageLimits limits;
+	limits.maxSize[MSG_HELLO] = sizeof(HelloMessage);
+	limits.maxSize[MSG_PIXELS] = sizeof(BucketTask) + sizeof(Color) * size_t(maxBucketArea);
+	limits.maxSize[MSG_BATCH_DONE] = sizeof(uint32) + sizeof(StatCounters);
+	return limits;
+}
+
+// What the coordinator sends: the lights, which are as many as in the scene of the worker, and
+// batches of at most one bucket per worker thread
+MessageLimits getWorkerLimits(int numLights, int numThreads) {
+	MessageLimits limits;
+	limits.maxSize[MSG_LIGHTS] = sizeof(uint32) + sizeof(Light) * size_t(numLights);
+	limits.maxSize[MSG_BUCKETS] = sizeof(uint32) + sizeof(BucketTask) * size_t(Max(numThreads, 1));
+	return limits;
+}
+
+double elapsedMs(const a7az0th::Timer& since) {
+	a7az0th::Timer t = since;
+	t.stop();
+	return t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+}
+
+#ifdef _WIN32
+void closeSocket(int s) { closesocket(SOCKET(s)); }
+bool initSockets() {
+	static const bool ok = [] { WSADATA data; return WSAStartup(MAKEWORD(2, 2), &data) == 0; }();
+	return ok;
+}
+#else
+void closeSocket(int s) { close(s); }
+bool initSockets() {
+	// A worker that goes away must show up as a failed send, not kill the coordinator
+	signal(SIGPIPE, SIG_IGN);
+	return true;
+}
+#endif
+
+bool sendAll(int s, const void* data, size_t size) {
+	const char* p = static_cast<const char*>(data);
+	while (size > 0) {
+		const int n = int(send(s, p, int(Min(size, size_t(1 << 30))), 0));
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= size_t(n);
+	}
+	return true;
+}
+
+bool recvAll(int s, void* data, size_t size) {
+	char* p = static_cast<char*>(data);
+	while (size > 0) {
+		const int n = int(recv(s, p, int(Min(size, size_t(1 << 30))), 0));
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= size_t(n);
+	}
+	return true;
+}
+
+bool sendMessage(int s, MessageType type, const void* payload, size_t size) {
+	MessageHeader header;
+	header.type = type;
+	header.size = uint32(size);
+	return sendAll(s, &header, sizeof(header)) && (size == 0 || sendAll(s, payload, size));
+}
+
+// Fails for a message of unknown type or larger than its limit, the connection is useless then
+bool recvMessage(int s, const MessageLimits& limits, MessageHeader& header, std::vector<char>& payload) {
+	if (!recvAll(s, &header, sizeof(header)) || header.type >= MSG_COUNT || header.size > limits.maxSize[header.type]) {
+		return false;
+	}
+	payload.resize(header.size);
+	return header.size == 0 || recvAll(s, payload.data(), header.size);
+}
+
+// Sends a frame id followed by the items of an array
+template <class T>
+bool sendFrameArray(int s, MessageType type, uint32 frame, const T* items, int count) {
+	std::vector<char> payload(sizeof(frame) + sizeof(T) * count);
+	memcpy(payload.data(), &frame, sizeof(frame));
+	memcpy(payload.data() + sizeof(frame), items, sizeof(T) * count);
+	return sendMessage(s, type, payload.data(), payload.size());
+}
+
+// Resolves "host:port" or "unix:/path" into a socket address. Returns the address family, or -1.
+int parseAddress(const std::string& address, sockaddr_storage& addr, socklen_t& addrLen) {
+	memset(&addr, 0, sizeof(addr));
+	if (address.compare(0, 5, "unix:") == 0) {
+#ifdef _WIN32
+		printf("Unix domain sockets are not supported on this platform: %s\n", address.c_str());
+		return -1;
+#else
+		sockaddr_un* un = reinterpret_cast<sockaddr_un*>(&addr);
+		const std::string path = address.substr(5);
+		if (path.empty() || path.size() >= sizeof(un->sun_path)) {
+			printf("Invalid socket path %s\n", address.c_str());
+			return -1;
+		}
+		un->sun_family = AF_UNIX;
+		memcpy(un->sun_path, path.c_str(), path.size() + 1);
+		addrLen = socklen_t(sizeof(sockaddr_un));
+		return AF_UNIX;
+#endif
+	}
+	const size_t colon = address.rfind(':');
+	if (colon == std::string::npos) {
+		printf("Invalid address %s, expected host:port or unix:/path\n", address.c_str());
+		return -1;
+	}
+	std::string host = address.substr(0, colon);
+	const std::string port = address.substr(colon + 1);
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = host.empty() ? AI_PASSIVE : 0;
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+		printf("Cannot resolve %s\n", address.c_str());
+		return -1;
+	}
+	memcpy(&addr, result->ai_addr, result->ai_addrlen);
+	addrLen = socklen_t(result->ai_addrlen);
+	freeaddrinfo(result);
+	return AF_INET;
+}
+
+// Bucket results are small and answered right away, do not hold them back to fill a packet
+void setNoDelay(int s, int family) {
+	if (family == AF_INET) {
+		int one = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+	}
+}
+
+// Makes a blocked recv give up after 'seconds', so a worker that dies in the middle of a
+// message does not hang the coordinator
+void setReceiveTimeout(int s, double seconds) {
+#ifdef _WIN32
+	const DWORD ms = DWORD(seconds * 1000.0);
+	setsockopt(SOCKET(s), SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&ms), sizeof(ms));
+#else
+	timeval tv;
+	tv.tv_sec = long(seconds);
+	tv.tv_usec = long((seconds - double(tv.tv_sec)) * 1e6);
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+}
+
+} // namespace
+
+uint32 getSceneFingerprint(const Scene& scene) {
+	uint32 h = hashCombine(CLUSTER_MAGIC, CLUSTER_VERSION);
+	auto addFloat = [&h](float f) {
+		uint32 bits;
+		memcpy(&bits, &f, sizeof(bits));
+		h = hashCombine(h, bits);
+	};
+	auto addVector = [&addFloat](const Vector& v) {
+		addFloat(v.x);
+		addFloat(v.y);
+		addFloat(v.z);
+	};
+	h = hashCombine(h, uint32(scene.cam.getWidth()));
+	h = hashCombine(h, uint32(scene.cam.getHeight()));
+	// Scene files place the camera, a worker with a different view would render other pixels
+	addVector(scene.cam.getPos());
+	addFloat(scene.cam.getYaw());
+	addFloat(scene.cam.getPitch());
+	addFloat(scene.cam.getRoll());
+	addFloat(scene.cam.getFov());
+	h = hashCombine(h, uint32(scene.usePackets) | uint32(scene.adaptiveAA) << 1);
+	h = hashCombine(h, uint32(scene.antialias.minSamples));
+	h = hashCombine(h, uint32(scene.antialias.maxSamples));
+	addFloat(scene.antialias.threshold);
+	addFloat(scene.antialias.contrast);
+	h = hashCombine(h, uint32(scene.sampler));
+	h = hashCombine(h, uint32(scene.lightSamples));
+	h = hashCombine(h, uint32(scene.spheres.size()));
+	for (int i = 0; i < int(scene.spheres.size()); i++) {
+		const Sphere& s = scene.spheres[i];
+		addVector(s.getPos());
+		addFloat(s.getRadius());
+		h = hashCombine(h, uint32(s.material));
+	}
+	h = hashCombine(h, uint32(scene.materials.size()));
+	for (int i = 0; i < int(scene.materials.size()); i++) {
+		const Material& m = scene.materials[i];
+		h = hashCombine(h, uint32(m.type));
+		h = hashCombine(h, uint32(m.texture));
+		addFloat(m.col.r);
+		addFloat(m.col.g);
+		addFloat(m.col.b);
+		addFloat(m.exponent);
+		addFloat(m.ior);
+	}
+	// The sizes and the first vertex tell meshes apart well enough without hashing millions of vertices
+	h = hashCombine(h, uint32(scene.meshes.size()));
+	for (int i = 0; i < int(scene.meshes.size()); i++) {
+		const Mesh& mesh = scene.meshes[i];
+		h = hashCombine(h, uint32(mesh.vertices.size()));
+		h = hashCombine(h, uint32(mesh.getTriangleCount()));
+		h = hashCombine(h, uint32(mesh.material));
+		if (!mesh.vertices.empty()) {
+			addVector(mesh.vertices[0]);
+		}
+	}
+	h = hashCombine(h, uint32(scene.textures.size()));
+	// The lights move between frames, but the workers expect as many as they have
+	h = hashCombine(h, uint32(scene.lights.size()));
+	return h;
+}
+
+ClusterCoordinator::ClusterCoordinator(): listenSocket(-1), fingerprint(0), maxBucketArea(0), frameId(0), workerTimeout(60.0) {}
+
+ClusterCoordinator::~ClusterCoordinator() {
+	shutdown();
+}
+
+bool ClusterCoordinator::listen(const std::string& address, const Scene& scene) {
+	fingerprint = getSceneFingerprint(scene);
+	maxBucketArea = 0;
+	for (int i = 0; i < int(scene.buckets.size()); i++) {
+		maxBucketArea = Max(maxBucketArea, scene.buckets[i].area());
+	}
+	if (!initSockets()) {
+		printf("Failed to initialize sockets\n");
+		return false;
+	}
+	sockaddr_storage addr;
+	socklen_t addrLen = 0;
+	const int family = parseAddress(address, addr, addrLen);
+	if (family < 0) {
+		return false;
+	}
+	const int s = int(socket(family, SOCK_STREAM, 0));
+	if (s < 0) {
+		printf("Failed to create a socket for %s\n", address.c_str());
+		return false;
+	}
+	if (family == AF_INET) {
+		int one = 1;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+	}
+#ifndef _WIN32
+	else {
+		// A socket file left over by an earlier run would make bind fail
+		unlink(reinterpret_cast<sockaddr_un*>(&addr)->sun_path);
+	}
+#endif
+	if (bind(s, reinterpret_cast<sockaddr*>(&addr), addrLen) != 0 || ::listen(s, 64) != 0) {
+		printf("Failed to listen at %s\n", address.c_str());
+		closeSocket(s);
+		return false;
+	}
+	listenSocket = s;
+	this->address = address;
+	return true;
+}
+
+bool ClusterCoordinator::spawnLocalWorkers(const char* exe, const std::vector<std::string>& args, int count) {
+	// Workers connect to the loopback interface when the coordinator listens on all of them
+	std::string connectTo = address;
+	if (!connectTo.empty() && connectTo[0] == ':') {
+		connectTo = "127.0.0.1" + connectTo;
+	}
+	std::vector<std::string> all(1, exe);
+	all.insert(all.end(), args.begin(), args.end());
+	all.push_back("-connect");
+	all.push_back(connectTo);
+	std::vector<char*> argv;
+	for (int i = 0; i < int(all.size()); i++) {
+		argv.push_back(const_cast<char*>(all[i].c_str()));
+	}
+	argv.push_back(nullptr);
+
+	for (int i = 0; i < count; i++) {
+#ifdef _WIN32
+		const intptr_t pid = _spawnv(_P_NOWAIT, exe, argv.data());
+		if (pid == -1) {
+#else
+		pid_t pid;
+		if (posix_spawnp(&pid, exe, nullptr, nullptr, argv.data(), environ) != 0) {
+#endif
+			printf("Failed to start worker %d from %s\n", i, exe);
+			return false;
+		}
+		children.push_back(int(pid));
+	}
+	return true;
+}
+
+int ClusterCoordinator::waitForWorkers(int count, double timeoutMs) {
+	a7az0th::Timer t;
+	std::vector<pollfd> fds;
+	while (int(workers.size()) < count) {
+		const double left = timeoutMs - elapsedMs(t);
+		if (left <= 0.0) {
+			break;
+		}
+		fds.clear();
+		addConnectionFds(fds);
+		if (poll(fds.data(), nfds_t(fds.size()), int(Min(left, ACCEPT_POLL_MS))) >= 0) {
+			handleConnections(fds.data());
+		}
+	}
+	return int(workers.size());
+}
+
+void ClusterCoordinator::addConnectionFds(std::vector<pollfd>& fds) const {
+	pollfd pfd;
+	pfd.fd = listenSocket;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	fds.push_back(pfd);
+	for (int i = 0; i < int(handshakes.size()); i++) {
+		pfd.fd = handshakes[i].socket;
+		fds.push_back(pfd);
+	}
+}
+
+void ClusterCoordinator::handleConnections(const pollfd* fds) {
+	// Walk backwards so finishing a handshake does not shift the ones still to look at
+	for (int i = int(handshakes.size()) - 1; i >= 0; i--) {
+		if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			finishHandshake(i);
+		} else if (elapsedMs(handshakes[i].since) > workerTimeout * 1000.0) {
+			closeSocket(handshakes[i].socket);
+			handshakes.erase(handshakes.begin() + i);
+		}
+	}
+	if (fds[0].revents & POLLIN) {
+		acceptWorker();
+	}
+}
+
+void ClusterCoordinator::acceptWorker() {
+	const int s = int(accept(listenSocket, nullptr, nullptr));
+	if (s < 0) {
+		return;
+	}
+	Handshake h;
+	h.socket = s;
+	handshakes.push_back(h);
+}
+
+void ClusterCoordinator::finishHandshake(int idx) {
+	const int s = handshakes[idx].socket;
+	handshakes.erase(handshakes.begin() + idx);
+	// The hello has started to arrive, the rest of it follows right away
+	setReceiveTimeout(s, HELLO_RECV_MS / 1000.0);
+	MessageHeader header;
+	std::vector<char> payload;
+	HelloMessage hello;
+	if (!recvMessage(s, getCoordinatorLimits(maxBucketArea), header, payload) || header.type != MSG_HELLO || payload.size() != sizeof(hello)) {
+		closeSocket(s);
+		return;
+	}
+	memcpy(&hello, payload.data(), sizeof(hello));
+	if (hello.magic != CLUSTER_MAGIC || hello.version != CLUSTER_VERSION || hello.fingerprint != fingerprint) {
+		printf("Rejected a worker whose scene does not match\n");
+		sendMessage(s, MSG_REJECT, nullptr, 0);
+		closeSocket(s);
+		return;
+	}
+	sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	getsockname(s, reinterpret_cast<sockaddr*>(&addr), &len);
+	setNoDelay(s, addr.ss_family);
+	setReceiveTimeout(s, workerTimeout);
+
+	Worker* w = new Worker;
+	w->socket = s;
+	w->numThreads = Max(int(hello.numThreads), 1);
+	w->frameSent = 0;
+	w->batchesInFlight = 0;
+	workers.push_back(w);
+}
+
+void ClusterCoordinator::dropWorker(int idx, std::deque<int>& pending, const std::vector<char>& finished) {
+	Worker* w = workers[idx];
+	// Its buckets go out first, they are the ones the frame is waiting for
+	for (int i = int(w->assigned.size()) - 1; i >= 0; i--) {
+		const int bucket = w->assigned[i];
+		if (!finished[bucket] && --issueCount[bucket] == 0) {
+			pending.push_front(bucket);
+		}
+	}
+	closeSocket(w->socket);
+	delete w;
+	workers.erase(workers.begin() + idx);
+	stats.numLost++;
+}
+
+bool ClusterCoordinator::readMessage(Worker& w, Scene& scene, std::vector<char>& finished, int& remaining) {
+	MessageHeader header;
+	std::vector<char> payload;
+	if (!recvMessage(w.socket, getCoordinatorLimits(maxBucketArea), header, payload)) {
+		return false;
+	}
+	w.lastHeard.start();
+	if (header.type == MSG_PIXELS) {
+		BucketTask task;
+		if (payload.size() < sizeof(task)) {
+			return false;
+		}
+		memcpy(&task, payload.data(), sizeof(task));
+		if (task.frame != frameId) {
+			// A copy of a bucket of an earlier frame that lost the race, nothing to do
+			return true;
+		}
+		const Rect& r = task.rect;
+		if (task.bucket < 0 || task.bucket >= int(finished.size()) || r != scene.buckets[task.bucket] ||
+			payload.size() != sizeof(task) + sizeof(Color) * r.area()) {
+			return false;
+		}
+		std::vector<int>::iterator it = std::find(w.assigned.begin(), w.assigned.end(), task.bucket);
+		if (it != w.assigned.end()) {
+			w.assigned.erase(it);
+		}
+		if (finished[task.bucket]) {
+			return true;
+		}
+		Canvas& c = *scene.c;
+		const Color* colors = reinterpret_cast<const Color*>(payload.data() + sizeof(task));
+		for (int y = r.y0; y < r.y1; y++) {
+			memcpy(&c.buffer[y * c.width + r.x0], colors + (y - r.y0) * r.width(), sizeof(Color) * r.width());
+		}
+		if (scene.outputLDR) {
+			tonemapRect(c.buffer, c.ldr, c.width, r, scene.tonemap);
+		}
+		finished[task.bucket] = 1;
+		remaining--;
+		return true;
+	}
+	if (header.type == MSG_BATCH_DONE) {
+		uint32 frame;
+		StatCounters batchCounters;
+		if (payload.size() != sizeof(frame) + sizeof(batchCounters)) {
+			return false;
+		}
+		memcpy(&frame, payload.data(), sizeof(frame));
+		memcpy(&batchCounters, payload.data() + sizeof(frame), sizeof(batchCounters));
+		if (frame == frameId) {
+			counters += batchCounters;
+			w.batchesInFlight--;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool ClusterCoordinator::feedWorker(Worker& w, const Scene& scene, std::deque<int>& pending, const std::vector<char>& finished) {
+	// Keep up to two batches with the worker, so it starts on the next one while the results of
+	// the last one are on their way
+	while (int(w.assigned.size()) <= w.numThreads) {
+		std::vector<BucketTask> batch;
+		while (int(batch.size()) < w.numThreads && !pending.empty()) {
+			const int bucket = pending.front();
+			pending.pop_front();
+			if (!finished[bucket]) {
+				BucketTask task;
+				task.frame = frameId;
+				task.bucket = bucket;
+				task.rect = scene.buckets[bucket];
+				batch.push_back(task);
+			}
+		}
+		// Nothing left to hand out, duplicate the buckets the frame is still waiting for
+		for (int i = 0; i < int(finished.size()) && int(batch.size()) < w.numThreads; i++) {
+			if (!finished[i] && issueCount[i] == 1 && std::find(w.assigned.begin(), w.assigned.end(), i) == w.assigned.end()) {
+				BucketTask task;
+				task.frame = frameId;
+				task.bucket = i;
+				task.rect = scene.buckets[i];
+				batch.push_back(task);
+				stats.numReissued++;
+			}
+		}
+		if (batch.empty()) {
+			return true;
+		}
+		if (w.frameSent != frameId) {
+			if (!sendFrameArray(w.socket, MSG_LIGHTS, frameId, scene.lights.data(), int(scene.lights.size()))) {
+				return false;
+			}
+			w.frameSent = frameId;
+		}
+		if (!sendFrameArray(w.socket, MSG_BUCKETS, frameId, batch.data(), int(batch.size()))) {
+			return false;
+		}
+		if (w.assigned.empty() && w.batchesInFlight == 0) {
+			// The worker had nothing to do so far, the timeout starts now
+			w.lastHeard.start();
+		}
+		for (int i = 0; i < int(batch.size()); i++) {
+			w.assigned.push_back(batch[i].bucket);
+			issueCount[batch[i].bucket]++;
+		}
+		w.batchesInFlight++;
+	}
+	return true;
+}
+
+bool ClusterCoordinator::waitingForStats() const {
+	for (int i = 0; i < int(workers.size()); i++) {
+		if (workers[i]->batchesInFlight > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void ClusterCoordinator::render(Scene& scene) {
+	a7az0th::Timer frameTimer;
+	frameId++;
+	stats = ClusterStats();
+	counters.clear();
+
+	const int numBuckets = int(scene.buckets.size());
+	std::vector<char> finished(numBuckets, 0);
+	issueCount.assign(numBuckets, 0);
+	std::deque<int> pending;
+	for (int i = 0; i < numBuckets; i++) {
+		pending.push_back(i);
+	}
+	int remaining = numBuckets;
+	for (int i = 0; i < int(workers.size()); i++) {
+		workers[i]->assigned.clear();
+		workers[i]->batchesInFlight = 0;
+	}
+
+	std::vector<pollfd> fds;
+	// The statistics of a batch follow its last bucket, the frame is over once they are all in
+	while (remaining > 0 || waitingForStats()) {
+		for (int i = 0; i < int(workers.size()); i++) {
+			if (!feedWorker(*workers[i], scene, pending, finished)) {
+				dropWorker(i--, pending, finished);
+			}
+		}
+		if (workers.empty()) {
+			break;
+		}
+
+		const int numPolled = int(workers.size());
+		fds.resize(numPolled);
+		for (int i = 0; i < numPolled; i++) {
+			fds[i].fd = workers[i]->socket;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		addConnectionFds(fds);
+		if (poll(fds.data(), nfds_t(fds.size()), int(ACCEPT_POLL_MS)) < 0) {
+			continue;
+		}
+
+		// Walk backwards so dropping a worker does not shift the ones still to look at
+		for (int i = int(workers.size()) - 1; i >= 0; i--) {
+			Worker& w = *workers[i];
+			bool alive = true;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				alive = readMessage(w, scene, finished, remaining);
+			} else if ((!w.assigned.empty() || w.batchesInFlight > 0) && elapsedMs(w.lastHeard) > workerTimeout * 1000.0) {
+				printf("Worker %d did not answer for %.0f seconds\n", i, workerTimeout);
+				alive = false;
+			}
+			if (!alive) {
+				dropWorker(i, pending, finished);
+			}
+		}
+		handleConnections(&fds[numPolled]);
+	}
+
+	if (remaining > 0) {
+		// No worker left, render what is missing here
+		std::vector<Rect> rest;
+		for (int i = 0; i < numBuckets; i++) {
+			if (!finished[i]) {
+				rest.push_back(scene.buckets[i]);
+			}
+		}
+		printf("No worker connected, rendering %d bucket(s) locally\n", int(rest.size()));
+		raytraceBuckets(scene, rest);
+		counters += collectFrameStats();
+		stats.numLocal = int(rest.size());
+	}
+	scene.c->ldrValid = scene.outputLDR;
+
+	frameTimer.stop();
+	stats.numWorkers = int(workers.size());
+	stats.numBuckets = numBuckets;
+	stats.frameMs = frameTimer.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+	scene.stats.counters = counters;
+	scene.stats.frameMs = stats.frameMs;
+	scene.stats.frame++;
+}
+
+void ClusterCoordinator::shutdown() {
+	for (int i = 0; i < int(workers.size()); i++) {
+		sendMessage(workers[i]->socket, MSG_STOP, nullptr, 0);
+	}
+	// Workers may still be busy with copies of buckets that finished elsewhere. Take their results
+	// until they close the connection, so they get to read the stop and exit cleanly.
+	const MessageLimits limits = getCoordinatorLimits(maxBucketArea);
+	MessageHeader header;
+	std::vector<char> payload;
+	for (int i = 0; i < int(workers.size()); i++) {
+		while (recvMessage(workers[i]->socket, limits, header, payload)) {}
+		closeSocket(workers[i]->socket);
+		delete workers[i];
+	}
+	workers.clear();
+	for (int i = 0; i < int(handshakes.size()); i++) {
+		closeSocket(handshakes[i].socket);
+	}
+	handshakes.clear();
+	if (listenSocket >= 0) {
+		closeSocket(listenSocket);
+		listenSocket = -1;
+#ifndef _WIN32
+		if (address.compare(0, 5, "unix:") == 0) {
+			unlink(address.c_str() + 5);
+		}
+#endif
+	}
+	for (int i = 0; i < int(children.size()); i++) {
+#ifdef _WIN32
+		int status;
+		_cwait(&status, children[i], 0);
+#else
+		waitpid(pid_t(children[i]), nullptr, 0);
+#endif
+	}
+	children.clear();
+}
+
+bool runClusterWorker(Scene& scene, const std::string& address, double connectTimeoutMs) {
+	if (!initSockets()) {
+		printf("Failed to initialize sockets\n");
+		return false;
+	}
+	sockaddr_storage addr;
+	socklen_t addrLen = 0;
+	const int family = parseAddress(address, addr, addrLen);
+	if (family < 0) {
+		return false;
+	}
+	// The coordinator may not be up yet when a whole farm is started at once
+	int s = -1;
+	a7az0th::Timer t;
+	while (s < 0) {
+		s = int(socket(family, SOCK_STREAM, 0));
+		if (s >= 0 && connect(s, reinterpret_cast<sockaddr*>(&addr), addrLen) != 0) {
+			closeSocket(s);
+			s = -1;
+		}
+		if (s < 0) {
+			if (elapsedMs(t) > connectTimeoutMs) {
+				printf("Failed to connect to the coordinator at %s\n", address.c_str());
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+	setNoDelay(s, family);
+
+	HelloMessage hello;
+	hello.magic = CLUSTER_MAGIC;
+	hello.version = CLUSTER_VERSION;
+	hello.fingerprint = getSceneFingerprint(scene);
+	hello.numThreads = scene.numThreads;
+	if (!sendMessage(s, MSG_HELLO, &hello, sizeof(hello))) {
+		closeSocket(s);
+		return false;
+	}
+
+	Canvas& c = *scene.c;
+	const MessageLimits limits = getWorkerLimits(int(scene.lights.size()), scene.numThreads);
+	MessageHeader header;
+	std::vector<char> payload;
+	std::vector<char> pixels;
+	std::vector<BucketTask> tasks;
+	std::vector<Rect> rects;
+	int numBuckets = 0;
+	bool ok = false;
+	bool rejected = false;
+	while (recvMessage(s, limits, header, payload)) {
+		uint32 frame = 0;
+		if (payload.size() >= sizeof(frame)) {
+			memcpy(&frame, payload.data(), sizeof(frame));
+		}
+		const char* items = payload.data() + sizeof(frame);
+		const size_t itemBytes = payload.size() - Min(payload.size(), sizeof(frame));
+		if (header.type == MSG_STOP) {
+			ok = true;
+			break;
+		} else if (header.type == MSG_REJECT) {
+			printf("The coordinator rejected this worker, it was started with a different scene\n");
+			rejected = true;
+			break;
+		} else if (header.type == MSG_LIGHTS) {
+			scene.lights.resize(itemBytes / sizeof(Light));
+			memcpy(scene.lights.data(), items, scene.lights.size() * sizeof(Light));
+			scene.updateLights();
+		} else if (header.type == MSG_BUCKETS) {
+			tasks.resize(itemBytes / sizeof(BucketTask));
+			memcpy(tasks.data(), items, tasks.size() * sizeof(BucketTask));
+			rects.resize(tasks.size());
+			bool valid = true;
+			for (int i = 0; i < int(tasks.size()); i++) {
+				rects[i] = tasks[i].rect;
+				valid &= rects[i].x0 >= 0 && rects[i].y0 >= 0 && rects[i].x1 <= c.width && rects[i].y1 <= c.height;
+			}
+			if (!valid) {
+				printf("The coordinator sent a bucket outside of the image, is it rendering a different size?\n");
+				break;
+			}
+			collectFrameStats();
+			raytraceBuckets(scene, rects);
+			const StatCounters batchCounters = collectFrameStats();
+
+			bool sent = true;
+			for (int i = 0; i < int(tasks.size()) && sent; i++) {
+				const Rect& r = rects[i];
+				pixels.resize(sizeof(BucketTask) + sizeof(Color) * r.area());
+				memcpy(pixels.data(), &tasks[i], sizeof(BucketTask));
+				Color* colors = reinterpret_cast<Color*>(pixels.data() + sizeof(BucketTask));
+				for (int y = r.y0; y < r.y1; y++) {
+					memcpy(colors + (y - r.y0) * r.width(), &c.buffer[y * c.width + r.x0], sizeof(Color) * r.width());
+				}
+				sent = sendMessage(s, MSG_PIXELS, pixels.data(), pixels.size());
+			}
+			sent = sent && sendFrameArray(s, MSG_BATCH_DONE, frame, &batchCounters, 1);
+			if (!sent) {
+				break;
+			}
+			numBuckets += int(tasks.size());
+		} else {
+			printf("Unexpected message %u from the coordinator\n", header.type);
+			break;
+		}
+	}
+	closeSocket(s);
+	if (!ok && !rejected) {
+		printf("Lost the connection to the coordinator at %s\n", address.c_str());
+	}
+	printf("Worker rendered %d bucket(s)\n", numBuckets);
+	return ok;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "scene.h"
+#include "stats.h"
+#include "timer.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+struct pollfd;
+
+// Distributed bucket rendering. A coordinator process hands the buckets of every frame to worker
+// processes over sockets and assembles the pixels they send back into its canvas. Every worker is
+// started with the same scene options as the coordinator, builds the scene itself and renders
+// with its own threads.
+//
+// Addresses are "host:port" for TCP or "unix:/path" for a Unix domain socket. All nodes must use
+// the same byte order and float format; the messages are the raw structures.
+//
+// Work is pulled, not planned: a worker gets a batch of one bucket per thread whenever it has at
+// most one batch left, so fast nodes get through more buckets. Once no bucket is left to hand
+// out, idle workers get copies of the buckets still out on other workers and the first result to
+// arrive is kept, so one slow node does not hold up the frame. A worker that disconnects or
+// stays silent for longer than the worker timeout is dropped and its buckets go to the others.
+// Without any worker left the coordinator renders the rest of the frame itself.
+
+// Load balance information about the last distributed frame
+struct ClusterStats {
+	int numWorkers; //< Workers connected at the end of the frame
+	int numBuckets; //< Buckets of the frame
+	int numReissued; //< Bucket copies handed to a second worker near the end of the frame
+	int numLost; //< Workers dropped during the frame
+	int numLocal; //< Buckets the coordinator rendered itself
+	double frameMs;
+
+	ClusterStats(): numWorkers(0), numBuckets(0), numReissued(0), numLost(0), numLocal(0), frameMs(0.0) {}
+};
+
+// Hash of everything a worker must agree on with the coordinator: the image size, the camera,
+// the render settings, the objects and the materials. Workers with a different scene are turned
+// away.
+uint32 getSceneFingerprint(const Scene& scene);
+
+class ClusterCoordinator {
+public:
+	ClusterCoordinator();
+	~ClusterCoordinator();
+
+	// Starts accepting workers for 'scene' at 'address'. Returns false if the address cannot be
+	// used. Workers may connect at any time after this, also while a frame is being rendered.
+	bool listen(const std::string& address, const Scene& scene);
+
+	// Starts 'count' worker processes on this machine: the executable 'exe' with 'args' and
+	// "-connect <address>" appended. A stand-in for a cluster when testing.
+	bool spawnLocalWorkers(const char* exe, const std::vector<std::string>& args, int count);
+
+	// Accepts workers until 'count' are connected or timeoutMs has passed. Returns how many are connected.
+	int waitForWorkers(int count, double timeoutMs);
+
+	// Seconds a worker may hold buckets without sending anything back before it is dropped
+	void setWorkerTimeout(double seconds) { workerTimeout = seconds; }
+
+	// Renders scene.buckets of the current frame into scene.c and fills scene.stats, like raytrace.
+	// The workers get the lights of the scene with the first batch of every frame, so the lights
+	// may change between frames; everything else must stay as the workers built it.
+	void render(Scene& scene);
+
+	const ClusterStats& getStats() const { return stats; }
+
+	// Tells the workers to exit and waits for the spawned ones
+	void shutdown();
+
+private:
+	ClusterCoordinator(const ClusterCoordinator&);
+	ClusterCoordinator& operator=(const ClusterCoordinator&);
+
+	struct Worker {
+		int socket;
+		int numThreads;
+		std::vector<int> assigned; //< Buckets handed to the worker that it has not sent back yet
+		uint32 frameSent; //< Frame whose lights the worker has, 0 for none
+		int batchesInFlight; //< Batches of the current frame whose statistics have not arrived yet
+		a7az0th::Timer lastHeard; //< Time since the worker last sent something
+	};
+
+	// A connection that has not sent its hello yet
+	struct Handshake {
+		int socket;
+		a7az0th::Timer since;
+	};
+
+	// Adds the listen socket and then the pending handshakes to 'fds'
+	void addConnectionFds(std::vector<pollfd>& fds) const;
+	// Takes the results of poll for the entries of addConnectionFds, starting at 'fds': accepts new
+	// connections and turns the handshakes that sent their hello into workers. Never waits for a
+	// connection, one that stays silent is closed after the worker timeout.
+	void handleConnections(const pollfd* fds);
+	void acceptWorker();
+	void finishHandshake(int idx);
+	// Closes the connection and puts the buckets only this worker had back in front of 'pending'
+	void dropWorker(int idx, std::deque<int>& pending, const std::vector<char>& finished);
+	// Handles one message of the worker. Returns false if the worker has to be dropped.
+	bool readMessage(Worker& w, Scene& scene, std::vector<char>& finished, int& remaining);
+	// True while a worker still has to send the statistics of a batch of the current frame
+	bool waitingForStats() const;
+	// Hands out buckets until the worker has more than one batch. Returns false if sending failed.
+	bool feedWorker(Worker& w, const Scene& scene, std::deque<int>& pending, const std::vector<char>& finished);
+
+	int listenSocket;
+	std::string address;
+	std::vector<Worker*> workers;
+	std::vector<Handshake> handshakes;
+	std::vector<int> children; //< Process ids of the spawned workers
+	uint32 fingerprint; //< Of the scene given to listen
+	int maxBucketArea; //< Of the buckets of the scene given to listen, limits the size of the results
+	uint32 frameId; //< Counts the frames rendered, tags the buckets so late results of an old frame are ignored
+	double workerTimeout;
+	std::vector<int> issueCount; //< How many workers got each bucket of the current frame
+	StatCounters counters; //< Sum of the counters the workers sent for the current frame
+	ClusterStats stats;
+};
+
+// Worker side: connects to the coordinator at 'address', retrying for up to connectTimeoutMs,
+// and renders the buckets it receives into scene.c until the coordinator says stop.
+// Returns false if the connection fails or the coordinator goes away or refuses the scene.
+bool runClusterWorker(Scene& scene, const std::string& address, double connectTimeoutMs);
@@ -7,7 +7,7 @@ struct Color {
 
 	float r, g, b;
 	Color() {}
-	Color(float r, float g, float b): r(r), b(b), g(g) {}
+	Color(float r, float g, float b): r(r), g(g), b(b) {}
 
 	Color operator * (float scalar) const {
 		return Color(r * scalar, g * scalar, b * scalar);
@@ -53,19 +53,6 @@ struct Color {
 		return *this;
 	}
 
-	Color& operator=(const Color& rhs) {
-		r = rhs.r;
-		g = rhs.g;
-		b = rhs.b;
-		return *this;
-	}
-
-	Color(const Color& rhs) {
-		r = rhs.r;
-		g = rhs.g;
-		b = rhs.b;
-	}
-
 	Color operator / (float scalar) const {
 		scalar = 1.0f / scalar;
 		return Color(r * scalar, g * scalar, b * scalar);
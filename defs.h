@@ -37,7 +37,6 @@ inline float pi() { return 3.141592653589793f; }
 inline float toRadians(float degrees) { return (degrees / 180.0f) * pi(); }
 inline float toDegrees(float radians) { return (radians / pi()) * 180.0f; }
 inline float sqr(float x) { return x * x; }
-inline float getRandomInRange(float min, float max) { return min + (max-min)*(float(rand())/RAND_MAX); }
 inline Vector faceforward(const Vector &v, const Vector &n) { return dot(v, n) < 0.0f ? n : -n; }
 
 struct Ray {
@@ -46,13 +45,26 @@ struct Ray {
 	int depth;
 };
 
+// Hit attributes beyond the distance and the primitive. The intersection routines only find the
+// closest hit, the attributes are computed afterwards by Scene::getHitAttributes for the final hit
+// alone, and only those the shading asks for.
+enum HitAttribute {
+	HIT_POINT = 1,
+	HIT_NORMAL = 2,
+	HIT_UV = 4,
+	HIT_ALL = HIT_POINT | HIT_NORMAL | HIT_UV,
+};
+
 struct IntersectionInfo {
-	Vector intersectionPoint;
-	Vector normal;
+	Vector intersectionPoint; //< Valid with HIT_POINT
+	Vector normal; //< Valid with HIT_NORMAL
 	float distSq;
-	float u;
+	float u; //< u and v are valid with HIT_UV. Triangles set their barycentric coordinates right away.
 	float v;
+	int primId; //< Index of the hit sphere or triangle, -1 if unknown
+	int meshId; //< Index of the hit mesh in the scene, -1 for spheres
+	int attributes; //< HIT_* flags of the attributes computed so far
 
-	bool isValid() { return distSq < 1e9f; }
-	IntersectionInfo(): distSq(1e9f), u(0.0f), v(0.0f) {}
+	bool isValid() const { return distSq < 1e9f; }
+	IntersectionInfo(): distSq(1e9f), u(0.0f), v(0.0f), primId(-1), meshId(-1), attributes(0) {}
 };
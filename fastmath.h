@@ -0,0 +1,113 @@
+#pragma once
+
+#include "simd.h"
+#include "defs.h"
+
+#include <math.h>
+#include <string.h>
+
+// Polynomial approximations of the transcendental functions used per hit. Every function is a
+// template that works on float and on vfloat, so the same code serves the scalar shading and the
+// SIMD loops over many hits. The error bounds hold for the float version and for every lane.
+// Everything lives in the fastmath namespace, so the scalar helpers cannot clash with functions of
+// the system headers like POSIX select(). The vfloat overloads in simd.h are found by argument
+// dependent lookup.
+namespace fastmath {
+
+// Scalar versions of the vfloat helpers, so the templates below also compile for float
+inline float vmin(float a, float b) { return Min(a, b); }
+inline float vmax(float a, float b) { return Max(a, b); }
+inline float vsqrt(float a) { return sqrtf(a); }
+inline float select(bool m, float a, float b) { return m ? a : b; }
+inline float vfrexp(float a, float& e) {
+	uint32 bits;
+	memcpy(&bits, &a, sizeof(bits));
+	e = float(int(bits >> 23) - 127);
+	bits = (bits & 0x007fffffu) | 0x3f800000u;
+	float m;
+	memcpy(&m, &bits, sizeof(m));
+	return m;
+}
+inline float vldexp(float a, float e) {
+	const uint32 bits = uint32(int(e) + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return a * scale;
+}
+
+template <class T>
+inline T fastAbs(T x) { return vmax(x, T(0.f) - x); }
+
+// Rounds to the nearest integer, for |x| < 2^22. Adding and removing 1.5 * 2^23 leaves no
+// fraction bits to round with.
+template <class T>
+inline T fastRound(T x) { return (x + T(12582912.f)) - T(12582912.f); }
+
+// atan(x) for |x| <= 1, absolute error below 1e-5 radians
+template <class T>
+inline T fastAtanUnit(T x) {
+	const T x2 = x * x;
+	return x * (T(0.99997726f) + x2 * (T(-0.33262347f) + x2 * (T(0.19354346f) + x2 * (T(-0.11643287f) + x2 * (T(0.05265332f) + x2 * T(-0.01172120f))))));
+}
+
+// atan2(y, x), absolute error below 1e-5 radians. Returns 0 for (0, 0).
+template <class T>
+inline T fastAtan2(T y, T x) {
+	const T ax = fastAbs(x);
+	const T ay = fastAbs(y);
+	const T hi = vmax(ax, ay);
+	// Dividing by the larger one keeps the argument in [0, 1]
+	const T a = fastAtanUnit(vmin(ax, ay) / vmax(hi, T(1e-30f)));
+	T r = select(ay > ax, T(1.57079633f) - a, a);
+	r = select(x < T(0.f), T(3.14159265f) - r, r);
+	return select(y < T(0.f), T(0.f) - r, r);
+}
+
+// asin(x) for x in [-1, 1], absolute error below 1e-6 radians.
+// Abramowitz and Stegun 4.4.46, the sqrt(1 - x) factor captures the singular slope near 1.
+template <class T>
+inline T fastAsin(T x) {
+	const T ax = vmin(fastAbs(x), T(1.f));
+	const T p = T(1.5707963050f) + ax * (T(-0.2145988016f) + ax * (T(0.0889789874f) + ax * (T(-0.0501743046f) +
+		ax * (T(0.0308918810f) + ax * (T(-0.0170881256f) + ax * (T(0.0066700901f) + ax * T(-0.0012624911f)))))));
+	const T r = T(1.57079633f) - vsqrt(T(1.f) - ax) * p;
+	return select(x < T(0.f), T(0.f) - r, r);
+}
+
+// log2(x) for positive normal x, absolute error below 2e-6
+template <class T>
+inline T fastLog2(T x) {
+	T e;
+	T m = vfrexp(x, e);
+	// Centre the mantissa on 1 so the series converges quickly: m in [sqrt(1/2), sqrt(2))
+	const auto big = m > T(1.41421356f);
+	m = select(big, m * T(0.5f), m);
+	e = select(big, e + T(1.f), e);
+	// ln(m) = 2 atanh(t) with t = (m - 1) / (m + 1), |t| < 0.172
+	const T t = (m - T(1.f)) / (m + T(1.f));
+	const T t2 = t * t;
+	const T lnm = T(2.f) * t * (T(1.f) + t2 * (T(1.f / 3.f) + t2 * (T(1.f / 5.f) + t2 * (T(1.f / 7.f) + t2 * T(1.f / 9.f)))));
+	return e + lnm * T(1.44269504f);
+}
+
+// 2^x, relative error below 2e-7 plus the rounding of the result. Results below 2^-126 are 0.
+template <class T>
+inline T fastExp2(T x) {
+	x = vmin(vmax(x, T(-127.f)), T(127.f));
+	const T n = fastRound(x);
+	// Cephes exp2f polynomial for the fraction in [-0.5, 0.5]
+	const T f = x - n;
+	const T p = T(1.f) + f * (T(6.931472028550421e-1f) + f * (T(2.402264791363012e-1f) + f * (T(5.550332471162809e-2f) +
+		f * (T(9.618437357674640e-3f) + f * (T(1.339887440266574e-3f) + f * T(1.535336188319500e-4f))))));
+	return select(x > T(-126.5f), vldexp(p, vmax(n, T(-126.f))), T(0.f));
+}
+
+// x^y for x >= 0. The relative error grows with |y * log2(x)|, it stays below 5e-6 while that is
+// below 20, which covers highlight exponents up to a few hundred on everything that is visible.
+template <class T>
+inline T fastPow(T x, T y) {
+	const T safeX = vmax(x, T(1.17549435e-38f));
+	return select(x > T(0.f), fastExp2(y * fastLog2(safeX)), T(0.f));
+}
+
+} // namespace fastmath
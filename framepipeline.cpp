@@ -0,0 +1,103 @@
+#include "framepipeline.h"
+
+FramePipeline::FramePipeline(int width, int height, FrameSource& source, bool dropFrames)
+	: source(source), dropFrames(dropFrames), backIdx(0), frontIdx(1), middle(2),
+	  stopRequested(false), sourceDone(false), framesPublished(0),
+	  framesPresented(0), totalRenderMs(0), totalLatencyMs(0) {
+	for (int i = 0; i < NUM_BUFFERS; i++) {
+		canvases[i] = new Canvas(width, height);
+		for (int p = 0; p < width * height; p++) {
+			canvases[i]->buffer[p] = BLACK;
+		}
+		frameIndex[i] = -1;
+		renderMs[i] = 0.0;
+	}
+}
+
+FramePipeline::~FramePipeline() {
+	stop();
+	for (int i = 0; i < NUM_BUFFERS; i++) {
+		delete canvases[i];
+	}
+}
+
+void FramePipeline::start() {
+	if (renderThread.joinable()) {
+		return;
+	}
+	stopRequested = false;
+	wallTimer.start();
+	renderThread = std::thread(&FramePipeline::renderLoop, this);
+}
+
+void FramePipeline::stop() {
+	stopRequested = true;
+	if (renderThread.joinable()) {
+		renderThread.join();
+	}
+}
+
+void FramePipeline::renderLoop() {
+	int frame = 0;
+	while (!stopRequested) {
+		a7az0th::Timer t;
+		if (!source.renderFrame(*canvases[backIdx])) {
+			break;
+		}
+		t.stop();
+		frameIndex[backIdx] = frame++;
+		renderTimer[backIdx] = t;
+		renderMs[backIdx] = t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+
+		if (!dropFrames) {
+			// Wait for the presenter to take the previous frame, so it is not overwritten
+			while ((middle.load(std::memory_order_acquire) & FRESH_BIT) && !stopRequested) {
+				std::this_thread::yield();
+			}
+		}
+		backIdx = middle.exchange(backIdx | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+		framesPublished++;
+	}
+	sourceDone = true;
+}
+
+bool FramePipeline::acquire() {
+	if (!(middle.load(std::memory_order_acquire) & FRESH_BIT)) {
+		return false;
+	}
+	frontIdx = middle.exchange(frontIdx, std::memory_order_acq_rel) & INDEX_MASK;
+
+	// Latency is measured from the start of rendering the frame to the moment it is handed over
+	a7az0th::Timer latency = renderTimer[frontIdx];
+	latency.stop();
+	framesPresented++;
+	totalRenderMs += renderMs[frontIdx];
+	totalLatencyMs += latency.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+	return true;
+}
+
+bool FramePipeline::finished() const {
+	return sourceDone && !(middle.load(std::memory_order_acquire) & FRESH_BIT);
+}
+
+PipelineStats FramePipeline::getStats() const {
+	PipelineStats stats;
+	a7az0th::Timer wall = wallTimer;
+	wall.stop();
+	const double wallSec = wall.elapsed(a7az0th::Timer::Nanoseconds) / 1e9;
+
+	stats.framesRendered = framesPublished;
+	stats.framesPresented = framesPresented;
+	// The last published frame may still wait in the middle canvas, it is not dropped yet
+	const int pending = (middle.load(std::memory_order_acquire) & FRESH_BIT) ? 1 : 0;
+	stats.framesDropped = Max(0, stats.framesRendered - stats.framesPresented - pending);
+	if (framesPresented > 0) {
+		stats.avgRenderMs = totalRenderMs / framesPresented;
+		stats.avgLatencyMs = totalLatencyMs / framesPresented;
+	}
+	if (wallSec > 0.0) {
+		stats.renderFps = stats.framesRendered / wallSec;
+		stats.presentFps = stats.framesPresented / wallSec;
+	}
+	return stats;
+}
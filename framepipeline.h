@@ -0,0 +1,88 @@
+#pragma once
+
+#include "scene.h"
+
+#include "timer.h"
+
+#include <atomic>
+#include <thread>
+
+// Renders frames into a Canvas, called by the render thread of a FramePipeline
+struct FrameSource {
+	virtual ~FrameSource() {}
+	// Renders the next frame into c. Returning false stops the pipeline.
+	virtual bool renderFrame(Canvas& c) = 0;
+};
+
+// Frame timings measured by the presenting thread
+struct PipelineStats {
+	int framesRendered; //< Frames published by the render thread so far
+	int framesPresented; //< Frames picked up by acquire()
+	int framesDropped; //< Frames replaced by a newer one before they were acquired
+	double avgRenderMs; //< Average time to render a presented frame
+	double avgLatencyMs; //< Average time from the start of rendering a frame to acquire() returning it
+	double renderFps; //< Frames rendered per second of wall clock time
+	double presentFps; //< Frames presented per second of wall clock time
+
+	PipelineStats(): framesRendered(0), framesPresented(0), framesDropped(0), avgRenderMs(0), avgLatencyMs(0), renderFps(0), presentFps(0) {}
+};
+
+// Triple buffered frame pipeline. A dedicated thread keeps rendering into a back canvas while the
+// presenting thread shows the front canvas. A finished frame is swapped with the middle canvas and
+// the presenter swaps the middle with the front when it wants a new frame. Both swaps are a single
+// atomic exchange, neither side ever takes a lock.
+// With dropFrames the renderer never waits and the presenter always gets the newest frame.
+// Without it the renderer waits until the presenter has taken the previous frame, so every frame is
+// presented exactly once; the renderer still works on frame N+1 while frame N is presented.
+class FramePipeline {
+public:
+	FramePipeline(int width, int height, FrameSource& source, bool dropFrames);
+	~FramePipeline();
+
+	// Starts the render thread
+	void start();
+	// Asks the render thread to stop after the frame in progress and waits for it
+	void stop();
+
+	// Makes the newest finished frame the front canvas. Returns false if no new frame was
+	// published since the last call, in which case the front canvas stays the same.
+	bool acquire();
+	// The canvas returned by the last successful acquire(). Stays valid until the next acquire().
+	const Canvas& front() const { return *canvases[frontIdx]; }
+	// Index of the front frame, counting from 0
+	int frontFrame() const { return frameIndex[frontIdx]; }
+
+	// True once the frame source returned false and the last frame was acquired
+	bool finished() const;
+
+	PipelineStats getStats() const;
+
+private:
+	enum { NUM_BUFFERS = 3, FRESH_BIT = 4, INDEX_MASK = 3 };
+
+	void renderLoop();
+
+	FrameSource& source;
+	const bool dropFrames;
+	Canvas* canvases[NUM_BUFFERS];
+
+	// Written by the render thread before a canvas is published, read by the presenter after acquiring it
+	int frameIndex[NUM_BUFFERS];
+	a7az0th::Timer renderTimer[NUM_BUFFERS];
+	double renderMs[NUM_BUFFERS];
+
+	int backIdx; //< Owned by the render thread
+	int frontIdx; //< Owned by the presenting thread
+	std::atomic<int> middle; //< Index of the middle canvas, with FRESH_BIT set if it holds an unacquired frame
+
+	std::atomic<bool> stopRequested;
+	std::atomic<bool> sourceDone;
+	std::atomic<int> framesPublished;
+	std::thread renderThread;
+
+	// Presenter side statistics
+	a7az0th::Timer wallTimer;
+	int framesPresented;
+	double totalRenderMs;
+	double totalLatencyMs;
+};
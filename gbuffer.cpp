@@ -0,0 +1,15 @@
+#include "gbuffer.h"
+
+bool GBuffer::beginFrame(int width, int height, uint32 cameraRevision, uint32 geometryRevision) {
+	shadeOnly = filled && width == this->width && height == this->height &&
+		cameraRevision == this->cameraRevision && geometryRevision == this->geometryRevision;
+	if (!shadeOnly) {
+		this->width = width;
+		this->height = height;
+		this->cameraRevision = cameraRevision;
+		this->geometryRevision = geometryRevision;
+		filled = false;
+		pixels.resize(size_t(width) * height);
+	}
+	return shadeOnly;
+}
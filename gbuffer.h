@@ -0,0 +1,49 @@
+#pragma once
+
+#include "defs.h"
+
+#include <vector>
+
+// The camera ray hit of every pixel, with the attributes its material needed, kept from one
+// frame to the next for deferred shading. As long as neither the camera nor the objects change,
+// a frame only has to shade the stored hits again, which is all that moving a light, changing
+// its color or editing a material takes. Whether the hits are still valid is decided from the
+// revisions of the camera and the objects, nothing has to invalidate them explicitly.
+// The rays all start at the camera position, only their directions are stored.
+class GBuffer {
+public:
+	struct Pixel {
+		IntersectionInfo info; //< Not valid for pixels whose ray left the scene
+		Vector dir; //< Normalized direction of the camera ray
+	};
+
+	GBuffer(): width(0), height(0), cameraRevision(0), geometryRevision(0), filled(false), shadeOnly(false) {}
+
+	// Starts a frame. Returns true if the hits stored by the previous frames are those of the
+	// given image size and revisions, then the frame can shade them without tracing. Otherwise
+	// the frame has to store every pixel.
+	bool beginFrame(int width, int height, uint32 cameraRevision, uint32 geometryRevision);
+
+	// Must be called after every pixel of the frame is stored
+	void endFrame() { filled = true; }
+
+	void store(int x, int y, const IntersectionInfo& info, const Vector& dir) {
+		Pixel& p = pixels[y * width + x];
+		p.info = info;
+		p.dir = dir;
+	}
+	const Pixel& get(int x, int y) const { return pixels[y * width + x]; }
+
+	// True if the last frame was shaded from the stored hits
+	bool wasShadeOnly() const { return shadeOnly; }
+
+	size_t getMemoryUsage() const { return pixels.size() * sizeof(Pixel); }
+
+private:
+	int width, height;
+	uint32 cameraRevision; //< Revisions the stored hits were traced with
+	uint32 geometryRevision;
+	bool filled; //< Every pixel was stored since the revisions were last set
+	bool shadeOnly;
+	std::vector<Pixel> pixels;
+};
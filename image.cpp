@@ -0,0 +1,50 @@
+#include "image.h"
+
+#include <stdio.h>
+#include <vector>
+
+bool savePPM(const Canvas& c, const char* fileName) {
+	FILE* fp = fopen(fileName, "wb");
+	if (!fp) {
+		return false;
+	}
+	fprintf(fp, "P6\n%d %d\n255\n", c.width, c.height);
+
+	std::vector<uint8> row(c.width * 3);
+	bool ok = true;
+	for (int y = 0; y < c.height && ok; y++) {
+		if (c.ldrValid) {
+			const uint32* src = c.ldr + y * c.width;
+			for (int x = 0; x < c.width; x++) {
+				row[x*3 + 0] = uint8(src[x]);
+				row[x*3 + 1] = uint8(src[x] >> 8);
+				row[x*3 + 2] = uint8(src[x] >> 16);
+			}
+		} else {
+			const Color* src = c.buffer + y * c.width;
+			for (int x = 0; x < c.width; x++) {
+				row[x*3 + 0] = src[x].getRedUINT8();
+				row[x*3 + 1] = src[x].getGreenUINT8();
+				row[x*3 + 2] = src[x].getBlueUINT8();
+			}
+		}
+		ok = fwrite(row.data(), 1, row.size(), fp) == row.size();
+	}
+	return (fclose(fp) == 0) && ok;
+}
+
+// PFM stores scanlines bottom to top. A negative scale marks little-endian data.
+bool savePFM(const Canvas& c, const char* fileName) {
+	FILE* fp = fopen(fileName, "wb");
+	if (!fp) {
+		return false;
+	}
+	fprintf(fp, "PF\n%d %d\n-1.0\n", c.width, c.height);
+
+	bool ok = true;
+	for (int y = c.height - 1; y >= 0 && ok; y--) {
+		const Color* src = c.buffer + y * c.width;
+		ok = fwrite(src, sizeof(Color), c.width, fp) == size_t(c.width);
+	}
+	return (fclose(fp) == 0) && ok;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "scene.h"
+
+// Writes the canvas as a binary 8-bit PPM (P6). Uses the tonemapped 8-bit copy if the canvas has one,
+// otherwise the colors are clamped to [0, 1].
+// Returns false if the file could not be written.
+bool savePPM(const Canvas& c, const char* fileName);
+
+// Writes the canvas as a little-endian PFM (PF) keeping the full float range, before tonemapping.
+// Returns false if the file could not be written.
+bool savePFM(const Canvas& c, const char* fileName);
@@ -0,0 +1,161 @@
+#include "light.h"
+
+#include <math.h>
+
+Light Light::point(const Vector& pos, const Color& col, float intensity) {
+	Light l;
+	l.type = LIGHT_POINT;
+	l.pos = pos;
+	l.col = col;
+	l.intensity = intensity;
+	return l;
+}
+
+Light Light::sphere(const Vector& pos, float radius, const Color& col, float intensity) {
+	Light l = point(pos, col, intensity);
+	l.type = LIGHT_SPHERE;
+	l.radius = radius;
+	return l;
+}
+
+Light Light::quad(const Vector& corner, const Vector& edge1, const Vector& edge2, const Color& col, float intensity) {
+	Light l = point(corner, col, intensity);
+	l.type = LIGHT_QUAD;
+	l.edge1 = edge1;
+	l.edge2 = edge2;
+	return l;
+}
+
+bool Light::sample(const Vector& p, float u, float v, LightSample& ls) const {
+	switch (type) {
+	case LIGHT_SPHERE: {
+		const Vector toCenter = pos - p;
+		const float distSq = toCenter.lengthSqr();
+		if (distSq > radius * radius) {
+			// Sample the cone of directions the sphere covers, uniformly by solid angle
+			const float dist = sqrtf(distSq);
+			const Vector axis = toCenter / dist;
+			const float cosMax = sqrtf(Max(0.f, 1.f - radius * radius / distSq));
+			const float cosTheta = 1.f - u * (1.f - cosMax);
+			const float sinTheta = sqrtf(Max(0.f, 1.f - cosTheta * cosTheta));
+			const float phi = 2.f * pi() * v;
+			Vector t, b;
+			makeBasis(axis, t, b);
+			ls.dir = t * (cosf(phi) * sinTheta) + b * (sinf(phi) * sinTheta) + axis * cosTheta;
+			// Distance to the near side of the sphere along the sampled direction
+			const float proj = dist * cosTheta;
+			ls.dist = proj - sqrtf(Max(0.f, radius * radius - (distSq - proj * proj)));
+			// Radiance intensity / (pi r^2) over the pdf 1 / (2 pi (1 - cosMax))
+			ls.radiance = col * (intensity * 2.f * (1.f - cosMax) / (radius * radius));
+			return true;
+		}
+		// Inside the light, fall back to its center
+		ls.dir = toCenter;
+		ls.dist = sqrtf(distSq);
+		if (ls.dist == 0.f) {
+			return false;
+		}
+		ls.dir = ls.dir / ls.dist;
+		ls.radiance = col * (intensity / distSq);
+		return true;
+	}
+	case LIGHT_QUAD: {
+		const Vector onLight = pos + edge1 * u + edge2 * v;
+		const Vector toLight = onLight - p;
+		const float distSq = toLight.lengthSqr();
+		if (distSq == 0.f) {
+			return false;
+		}
+		ls.dist = sqrtf(distSq);
+		ls.dir = toLight / ls.dist;
+		const Vector normal = cross(edge1, edge2).normalize();
+		const float cosLight = -dot(ls.dir, normal);
+		if (cosLight <= 0.f) {
+			return false;
+		}
+		// Radiance intensity / area over the pdf dist^2 / (area cosLight)
+		ls.radiance = col * (intensity * cosLight / distSq);
+		return true;
+	}
+	default: {
+		const Vector toLight = pos - p;
+		const float distSq = toLight.lengthSqr();
+		if (distSq == 0.f) {
+			return false;
+		}
+		ls.dist = sqrtf(distSq);
+		ls.dir = toLight / ls.dist;
+		ls.radiance = col * (intensity / distSq);
+		return true;
+	}
+	}
+}
+
+float Light::getPower() const {
+	const float lum = 0.2126f * col.r + 0.7152f * col.g + 0.0722f * col.b;
+	// A one sided quad emits into a hemisphere with cosine falloff, everything else into the full sphere
+	const float solidAngle = (type == LIGHT_QUAD) ? pi() : 4.f * pi();
+	return lum * intensity * solidAngle;
+}
+
+void LightSampler::build(const std::vector<Light>& lights) {
+	const int n = int(lights.size());
+	prob.assign(n, 0.f);
+	alias.assign(n, 0);
+	pdfs.assign(n, 0.f);
+	if (n == 0) {
+		return;
+	}
+
+	double total = 0.0;
+	for (int i = 0; i < n; i++) {
+		total += Max(lights[i].getPower(), 0.f);
+	}
+	// Lights without power are never picked, unless all of them are dark
+	for (int i = 0; i < n; i++) {
+		pdfs[i] = total > 0.0 ? float(Max(lights[i].getPower(), 0.f) / total) : 1.f / float(n);
+	}
+
+	// Every slot holds the average probability 1/n. Slots below it are topped up with a light above it.
+	std::vector<float> scaled(n);
+	std::vector<int> small, large;
+	for (int i = 0; i < n; i++) {
+		scaled[i] = pdfs[i] * float(n);
+		if (scaled[i] < 1.f) {
+			small.push_back(i);
+		} else {
+			large.push_back(i);
+		}
+	}
+	while (!small.empty() && !large.empty()) {
+		const int s = small.back();
+		const int l = large.back();
+		small.pop_back();
+		prob[s] = scaled[s];
+		alias[s] = l;
+		scaled[l] -= 1.f - scaled[s];
+		if (scaled[l] < 1.f) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// Whatever is left is 1 up to rounding
+	for (int i = 0; i < int(large.size()); i++) {
+		prob[large[i]] = 1.f;
+		alias[large[i]] = large[i];
+	}
+	for (int i = 0; i < int(small.size()); i++) {
+		prob[small[i]] = 1.f;
+		alias[small[i]] = small[i];
+	}
+}
+
+bool LightSampler::sampleLight(const std::vector<Light>& lights, const Vector& p, const Vector& normal, float pick, float u, float v,
+	LightSample& ls, float& pickPdf, float& cosTheta) const {
+	const int lightIdx = sample(pick, pickPdf);
+	if (lightIdx < 0 || !lights[lightIdx].sample(p, u, v, ls)) {
+		return false;
+	}
+	cosTheta = dot(ls.dir, normal);
+	return cosTheta > 0.f;
+}
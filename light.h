@@ -0,0 +1,87 @@
+#pragma once
+
+#include "color.h"
+#include "vector.h"
+#include "defs.h"
+
+#include <vector>
+
+enum LightType {
+	LIGHT_POINT,
+	LIGHT_SPHERE, //< Spherical area light around pos
+	LIGHT_QUAD, //< One sided parallelogram spanned by edge1 and edge2 from the corner pos, emitting along cross(edge1, edge2)
+};
+
+// The light arriving at a shading point from one sampled point on a light
+struct LightSample {
+	Vector dir; //< Normalized direction from the shading point towards the light
+	float dist; //< Distance to the sampled point, shadow rays stop just before it
+	Color radiance; //< Incoming light, already divided by the probability density of the sampled point
+};
+
+// A light source. A point light has the radiant intensity 'intensity' in every direction.
+// Area lights spread the same intensity over their surface, so a small area light looks like a
+// point light at the same place, but casts soft shadows.
+struct Light {
+	Light(): type(LIGHT_POINT), pos(0, 0, -10), edge1(0, 0, 0), edge2(0, 0, 0), radius(0.f), col(1, 1, 1), intensity(50) {}
+
+	static Light point(const Vector& pos, const Color& col, float intensity);
+	static Light sphere(const Vector& pos, float radius, const Color& col, float intensity);
+	static Light quad(const Vector& corner, const Vector& edge1, const Vector& edge2, const Color& col, float intensity);
+
+	// Picks a point on the light as seen from p using the two uniform random numbers u and v.
+	// Returns false if the sampled point does not send any light towards p.
+	bool sample(const Vector& p, float u, float v, LightSample& ls) const;
+
+	// Total emitted power, up to a constant factor. Used to pick the bright lights more often.
+	float getPower() const;
+
+	LightType type;
+	Vector pos;
+	Vector edge1, edge2; //< Sides of quad lights
+	float radius; //< Radius of sphere lights
+	Color col;
+	float intensity;
+};
+
+// Picks one light out of many with probability proportional to its power in constant time,
+// using Vose's alias method. Each slot of the table holds a light, the probability to keep it and
+// the light to take instead, so a sample costs one random slot and one comparison no matter how
+// many lights there are.
+class LightSampler {
+public:
+	// Rebuilds the table. Must be called again whenever lights are added or removed, or their power changes.
+	void build(const std::vector<Light>& lights);
+
+	// Maps the uniform random number u to a light index and returns the probability of picking it
+	// in pdf. Returns -1 if there are no lights.
+	int sample(float u, float& pdf) const {
+		const int n = int(prob.size());
+		if (n == 0) {
+			return -1;
+		}
+		const float scaled = u * float(n);
+		const int slot = Min(int(scaled), n - 1);
+		const int idx = (scaled - float(slot) < prob[slot]) ? slot : alias[slot];
+		pdf = pdfs[idx];
+		return idx;
+	}
+
+	int size() const { return int(prob.size()); }
+
+	// Picks one of 'lights', which the table was built for, with the random number 'pick' and
+	// samples it with (u, v) for the surface at p with the given normal, see Light::sample.
+	// Returns false if there are no lights, or the sampled point sends no light towards p or lies
+	// below the surface. Otherwise fills ls, the probability of the pick in pickPdf and the cosine
+	// between the normal and ls.dir in cosTheta. The one light sampling step of every shader.
+	bool sampleLight(const std::vector<Light>& lights, const Vector& p, const Vector& normal, float pick, float u, float v,
+		LightSample& ls, float& pickPdf, float& cosTheta) const;
+
+	// Probability that sample picks light 'idx'
+	float getPdf(int idx) const { return pdfs[idx]; }
+
+private:
+	std::vector<float> prob; //< Probability of keeping the light of the slot
+	std::vector<int> alias; //< Light taken when the slot is not kept
+	std::vector<float> pdfs; //< Selection probability of every light
+};
@@ -17,210 +17,136 @@
 	#endif //WIN32
 #endif //APPLE
 
-#include "color.h"
-#include "camera.h"
-#include "sphere.h"
-#include "defs.h"
+#include "render.h"
+#include "scenefile.h"
+#include "framepipeline.h"
 
-#include "threadman.h"
-#include "timer.h"
-
-#include <vector>
 #include <string>
-
-// Simple structure used to represent a rectangular section of an image. A 'bucket'
-struct Rect {
-
-	int x0, y0, x1, y1; //< The 2 diagonal points of the rectangle
-
-	Rect() {}
-	Rect(int x0, int y0, int x1, int y1) : x0(x0), x1(x1), y0(y0), y1(y1){}
-	// Clips the rectangle against image size
-	void clip(int maxX, int maxY) {
-		x1 = Min(x1, maxX);
-		y1 = Min(y1, maxY);
-	}
-};
-
-struct Canvas {
-	Canvas(int width, int height): width(width), height(height) {
-		buffer = new Color[width*height];
-	}
-	~Canvas() {
-		delete [] buffer;
-		buffer = nullptr;
-		width = height = 0;
-	}
-
-	int width;
-	int height;
-	Color *buffer;
-};
-
-struct Scene {
-	Scene() {
-		numThreads = a7az0th::getProcessorCount();
-	}
-
-	a7az0th::ThreadManager threadman;
-	int numThreads;
-
-	Camera cam;
-	Sphere sphere;
-	Canvas *c;
-	std::vector<Rect> buckets;
-};
-
-Scene scene;
-
-
-
-struct Light {
-	Light() {
-		pos = Vector(0, 0, -10);
-		col = Color(1, 1, 1);
-		intensity = 50;
-	}
-
-	float intensity;
-	Color col;
-	Vector pos;
-};
-
-Light light;
-
-inline Vector getReflectionDir(const Vector &viewDir, const Vector& normal) {
-	const float cos = -dot(viewDir, normal);
-	return viewDir + normal*2*cos;
-}
-
-Color lambert(const Color &c, IntersectionInfo& info) {
-
-	const int numLights = 1;
-	const int numSamples = 1;
-	const Color lightColor = light.col * light.intensity;
-	const Vector pointOnLight = light.pos;
-
-	const Vector lightVec = (pointOnLight - info.intersectionPoint).normalize();
-
-	const Vector from = info.intersectionPoint + info.normal * 1e-6f;
-	const Vector to   = pointOnLight;
-
-	Color lambertComponent = Color(0.0f, 0.0f, 0.0f);
-	const float cosTheta  = dot(lightVec, info.normal);
-	const Color lightContribution = c * lightColor * Max(0, cosTheta) / (from - to).lengthSqr();
-	lambertComponent += lightContribution / float(numSamples);
-	lambertComponent = lambertComponent / float(numLights);
-
-	Color specularComponent(0,0,0);
-	const bool phong = 1;
-	if (phong) {
-		const Vector reflect = getReflectionDir(lightVec, info.normal);
-		const Vector viewDir = (info.intersectionPoint - scene.cam.getPos()).normalize();
-		const float factor = Max(0.f, dot(reflect, viewDir));
-
-		specularComponent = lightColor * pow(factor, 30);
-	}
-
-	const float& AMBIENT_LIGHT = 0.1f;
-	const Color ambientComponent  = c * AMBIENT_LIGHT;
-
-	return ambientComponent + (lambertComponent+specularComponent) * (1.f - AMBIENT_LIGHT);
-}
-
-
-void initBuckets(Canvas& c, std::vector<Rect>& buckets, const int BUCKET_SIZE = 32) {
-
-	buckets.clear();
-
-	const int W = c.width;
-	const int H = c.height;
-	const int BW = (W + BUCKET_SIZE-1) / BUCKET_SIZE;
-	const int BH = (H + BUCKET_SIZE-1) / BUCKET_SIZE;
-	for (int y = 0; y < BH; y++) {
-		if (y % 2 == 0)
-			for (int x = 0; x < BW; x++)
-				buckets.push_back(Rect(x * BUCKET_SIZE, y * BUCKET_SIZE, (x + 1) * BUCKET_SIZE, (y + 1) * BUCKET_SIZE));
-		else
-			for (int x = BW - 1; x >= 0; x--)
-				buckets.push_back(Rect(x * BUCKET_SIZE, y * BUCKET_SIZE, (x + 1) * BUCKET_SIZE, (y + 1) * BUCKET_SIZE));
-	}
-	for (int i = 0; i < (int) buckets.size(); i++) {
-		buckets[i].clip(W, H);
-	}
-}
-
-struct MultiThreadedRender : a7az0th::MultiThreadedFor {
-	MultiThreadedRender(std::vector<Rect>& buckets, Canvas& c): buckets(buckets), c(c) {}
-	virtual void body(int index, int threadIdx, int numThreads) override {
-		const Rect& r = buckets[index];
-		for (int y=r.y0; y < r.y1; y++) {
-			for (int x = r.x0; x < r.x1; x++) {
-				Color& col = c.buffer[y*c.width + x];
-				const Ray& r = scene.cam.getCameraRay(x, y);
-				IntersectionInfo info;
-				scene.sphere.intersect(r, info);
-
-				if (info.isValid()) {
-					col = lambert(RED, info);
-				} else {
-					col = WHITE*0.3f;
-				}
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+std::atomic<bool> toggleProgressive(false); //< Set by the keyboard handler, applied by the render thread
+std::atomic<bool> toggleAntialias(false);
+std::atomic<bool> togglePathTracing(false);
+std::atomic<bool> toggleDeferred(false);
+std::atomic<bool> toggleIncremental(false);
+
+// Renders the animated scene on the render thread of the pipeline
+struct ViewerFrameSource : FrameSource {
+	ViewerFrameSource(): progressive(false), samplesPerPixel(0), error(1.f) {}
+	virtual bool renderFrame(Canvas& c) override {
+		if (toggleProgressive.exchange(false)) {
+			scene.progressive = !scene.progressive;
+			printf("\nProgressive accumulation %s\n", scene.progressive ? "on" : "off");
+		}
+		if (toggleAntialias.exchange(false)) {
+			scene.adaptiveAA = !scene.adaptiveAA;
+			printf("\nAdaptive supersampling %s\n", scene.adaptiveAA ? "on" : "off");
+		}
+		if (togglePathTracing.exchange(false)) {
+			if (scene.pathTracing || canPathTrace(scene)) {
+				scene.pathTracing = !scene.pathTracing;
+				printf("\nPath tracing %s\n", scene.pathTracing ? "on" : "off");
 			}
 		}
+		if (toggleDeferred.exchange(false)) {
+			scene.deferredShading = !scene.deferredShading;
+			printf("\nDeferred shading %s\n", scene.deferredShading ? "on" : "off");
+		}
+		if (toggleIncremental.exchange(false)) {
+			scene.incremental = !scene.incremental;
+			printf("\nIncremental rendering %s\n", scene.incremental ? "on" : "off");
+		}
+		scene.c = &c;
+		raytrace(scene);
+		progressive = scene.progressive;
+		samplesPerPixel = scene.accum.getSamplesPerPixel();
+		error = scene.accum.getError();
+		// The light stays still while accumulating, otherwise every frame would start over
+		if (!scene.progressive) {
+			animateLight();
+		}
+		return true;
 	}
-private:
-	std::vector<Rect>& buckets;
-	Canvas& c;
+	// Copies of the scene state for the display thread
+	std::atomic<bool> progressive;
+	std::atomic<int> samplesPerPixel;
+	std::atomic<float> error;
 };
 
+ViewerFrameSource frameSource;
+FramePipeline* pipeline = nullptr;
 
-void raytrace(Scene& scene) {
-	MultiThreadedRender renderer(scene.buckets, *scene.c);
-	renderer.run(scene.threadman, int(scene.buckets.size()), scene.numThreads);
-};
-
+// Shows the newest finished frame. Rendering runs on the pipeline thread, so the cores keep
+// working on the next frame while this one is uploaded and swapped.
 void display() {
+	if (!pipeline->acquire()) {
+		// Nothing new yet, do not spin the GLUT thread against the renderer
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		glutPostRedisplay();
+		return;
+	}
 
-	a7az0th::Timer t;
-	raytrace(scene);
-	t.stop();
-	printf("Frame rendered in %.3f milliseconds\r", t.elapsed(a7az0th::Timer::Nanoseconds)/1000000.f);
-	glDrawPixels(scene.c->width, scene.c->height, GL_RGB, GL_FLOAT ,(float*)scene.c->buffer);
+	const Canvas& c = pipeline->front();
+	// The render threads convert the buckets to 8-bit as they finish, a quarter of the float upload
+	glDrawPixels(c.width, c.height, GL_RGBA, GL_UNSIGNED_BYTE, c.ldr);
 	glutSwapBuffers();
 
-	static float angle = 0.f;
-	const float radius = 5.f;
-	const float x = cosf(angle)*radius;
-	const float y = sinf(angle)*radius;
-
-	angle += pi() / 80.f;
-	if (angle > pi()*2.f) {
-		angle -= pi()*2.f;
+	const PipelineStats stats = pipeline->getStats();
+	if (frameSource.progressive) {
+		printf("Frame %d, render %.3f ms, latency %.3f ms, %.1f fps, %d spp, error %.4f    \r", pipeline->frontFrame(),
+			stats.avgRenderMs, stats.avgLatencyMs, stats.presentFps, int(frameSource.samplesPerPixel), float(frameSource.error));
+	} else {
+		printf("Frame %d, render %.3f ms, latency %.3f ms, %.1f fps, %d dropped    \r", pipeline->frontFrame(),
+			stats.avgRenderMs, stats.avgLatencyMs, stats.presentFps, stats.framesDropped);
 	}
 
-	Vector v(x, y, -5);
-	light.pos.x = x;
-	light.pos.y = y;
-	light.pos.z = -5;
-
 	glutPostRedisplay();
 	//glFlush();
 }
 
+void keyboard(unsigned char key, int x, int y) {
+	if (key == 'p' || key == 'P') {
+		toggleProgressive = true;
+	} else if (key == 'a' || key == 'A') {
+		toggleAntialias = true;
+	} else if (key == 't' || key == 'T') {
+		togglePathTracing = true;
+	} else if (key == 'g' || key == 'G') {
+		toggleDeferred = true;
+	} else if (key == 'i' || key == 'I') {
+		toggleIncremental = true;
+	}
+}
 
 int main(int argc, char ** argv) {
 
 	const int div = 4;
 	int width = 640 / div;
 	int height = 480 / div;
-	if (argc == 3) {
+	// [width height] [scene file]
+	const char* sceneFile = nullptr;
+	if (argc >= 3) {
 		width  = std::stoi(argv[1]);
 		height = std::stoi(argv[2]);
 	}
+	if (argc == 2 || argc == 4) {
+		sceneFile = argv[argc - 1];
+	}
 	Canvas c(width, height);
 	scene.cam.init(c.width, c.height);
 	scene.c = &c;
+	scene.outputLDR = true;
+	if (sceneFile) {
+		bool fromCache;
+		if (!loadScene(sceneFile, scene, fromCache)) {
+			return 1;
+		}
+	} else {
+		scene.spheres.push_back(Sphere());
+		scene.buildAccelerator();
+	}
 	initBuckets(c, scene.buckets);
 
 
@@ -230,6 +156,11 @@ int main(int argc, char ** argv) {
 	glutInitWindowPosition(50, 50); // Position the window's initial top-left corner
 	glutCreateWindow("OpenGL Setup Test"); // Create a window with the given title
 	glutDisplayFunc(display); // Register display callback handler for window re-paint
+	glutKeyboardFunc(keyboard); // 'p' toggles progressive accumulation, 'a' adaptive supersampling, 't' path tracing, 'g' deferred shading, 'i' incremental rendering
+
+	FramePipeline framePipeline(c.width, c.height, frameSource, true);
+	pipeline = &framePipeline;
+	framePipeline.start();
 	glutMainLoop();
 
 	return 0;
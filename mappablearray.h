@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+// An array that either owns its elements in a std::vector or borrows them from memory owned by
+// someone else, usually a memory mapped file. Borrowing costs nothing however large the array is,
+// which lets the objects and the acceleration structures of a compiled scene be used straight
+// from the mapping, see scenefile.h.
+// Reading works the same in both cases. Anything that modifies a borrowed array first copies the
+// elements into owned storage, so borrowed memory is never written.
+// The elements are copied with the vector and must be plain data.
+template <class T, class Alloc = std::allocator<T> >
+class MappableArray {
+public:
+	typedef std::vector<T, Alloc> Storage;
+
+	MappableArray(): ptr(nullptr), count(0), borrowed(false) {}
+	MappableArray(const MappableArray& other): storage(other.storage) { copyView(other); }
+	MappableArray& operator=(const MappableArray& other) {
+		storage = other.storage;
+		copyView(other);
+		return *this;
+	}
+	// Moving keeps the buffer of the vector, so the pointer stays valid
+	MappableArray(MappableArray&& other) noexcept: storage(std::move(other.storage)), ptr(other.ptr), count(other.count), borrowed(other.borrowed) {
+		other.reset();
+	}
+	MappableArray& operator=(MappableArray&& other) {
+		storage = std::move(other.storage);
+		ptr = other.ptr;
+		count = other.count;
+		borrowed = other.borrowed;
+		other.reset();
+		return *this;
+	}
+
+	// Refers to 'n' elements at 'data' instead of owning any. They must stay valid until the
+	// array is modified, cleared or destroyed.
+	void borrow(const T* data, size_t n) {
+		Storage().swap(storage);
+		ptr = data;
+		count = n;
+		borrowed = true;
+	}
+	bool isBorrowed() const { return borrowed; }
+
+	const T* data() const { return ptr; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T& operator[](size_t i) const { return ptr[i]; }
+
+	T* data() { own(); return storage.data(); }
+	T& operator[](size_t i) { own(); return storage[i]; }
+	void resize(size_t n) { own(); storage.resize(n); sync(); }
+	void assign(size_t n, const T& value) { own(); storage.assign(n, value); sync(); }
+	void push_back(const T& value) { own(); storage.push_back(value); sync(); }
+	void clear() { storage.clear(); reset(); }
+	void swap(MappableArray& other) {
+		storage.swap(other.storage);
+		std::swap(ptr, other.ptr);
+		std::swap(count, other.count);
+		std::swap(borrowed, other.borrowed);
+	}
+	void swap(Storage& other) { own(); storage.swap(other); sync(); }
+
+private:
+	void own() {
+		if (borrowed) {
+			storage.assign(ptr, ptr + count);
+			borrowed = false;
+			sync();
+		}
+	}
+	void sync() {
+		ptr = storage.data();
+		count = storage.size();
+	}
+	void reset() {
+		ptr = nullptr;
+		count = 0;
+		borrowed = false;
+	}
+	void copyView(const MappableArray& other) {
+		borrowed = other.borrowed;
+		if (borrowed) {
+			ptr = other.ptr;
+			count = other.count;
+		} else {
+			sync();
+		}
+	}
+
+	Storage storage;
+	const T* ptr; //< First element, in storage or in the borrowed memory
+	size_t count;
+	bool borrowed;
+};
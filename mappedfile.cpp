@@ -0,0 +1,118 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+size_t getPageSize() {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return size_t(info.dwPageSize);
+}
+
+MappedFile::MappedFile(): data_(nullptr), size_(0), mtime(0), fileHandle(nullptr), mappingHandle(nullptr) {}
+
+bool MappedFile::open(const char* fileName, bool sequential) {
+	close();
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	FILETIME writeTime;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0 || !GetFileTime(file, NULL, NULL, &writeTime)) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+	void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	fileHandle = file;
+	mappingHandle = mapping;
+	data_ = static_cast<const char*>(ptr);
+	size_ = size_t(fileSize.QuadPart);
+	mtime = uint64(writeTime.dwHighDateTime) << 32 | writeTime.dwLowDateTime;
+	return true;
+}
+
+void MappedFile::close() {
+	if (data_) {
+		UnmapViewOfFile(data_);
+		CloseHandle(mappingHandle);
+		CloseHandle(fileHandle);
+	}
+	data_ = nullptr;
+	size_ = 0;
+	mtime = 0;
+	fileHandle = mappingHandle = nullptr;
+}
+
+#else
+
+size_t getPageSize() {
+	const long size = sysconf(_SC_PAGESIZE);
+	return (size > 0) ? size_t(size) : 4096;
+}
+
+MappedFile::MappedFile(): data_(nullptr), size_(0), mtime(0) {}
+
+bool MappedFile::open(const char* fileName, bool sequential) {
+	close();
+	const int fd = ::open(fileName, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	void* ptr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps its own reference to the file
+	::close(fd);
+	if (ptr == MAP_FAILED) {
+		return false;
+	}
+	madvise(ptr, size_t(st.st_size), sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+	data_ = static_cast<const char*>(ptr);
+	size_ = size_t(st.st_size);
+#ifdef __APPLE__
+	mtime = uint64(st.st_mtimespec.tv_sec) * 1000000000ull + uint64(st.st_mtimespec.tv_nsec);
+#else
+	mtime = uint64(st.st_mtim.tv_sec) * 1000000000ull + uint64(st.st_mtim.tv_nsec);
+#endif
+	return true;
+}
+
+void MappedFile::close() {
+	if (data_) {
+		munmap(const_cast<char*>(data_), size_);
+	}
+	data_ = nullptr;
+	size_ = 0;
+	mtime = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
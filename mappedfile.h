@@ -0,0 +1,40 @@
+#pragma once
+
+#include "defs.h"
+
+#include <stddef.h>
+
+// Size of the pages of a mapping, the unit in which the system reads a mapped file
+size_t getPageSize();
+
+// Read-only memory mapping of a whole file.
+// The mapping lives as long as the object, so pointers into data() must not outlive it.
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Maps the file. Returns false if the file does not exist or cannot be mapped.
+	// 'sequential' tells the system the file is read front to back, otherwise it is read at random.
+	bool open(const char* fileName, bool sequential = true);
+	void close();
+
+	bool isOpen() const { return data_ != nullptr; }
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+	// Last modification time of the file when it was opened, in system specific units. Files
+	// derived from this one store it to notice edits that keep the size.
+	uint64 modificationTime() const { return mtime; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const char* data_;
+	size_t size_;
+	uint64 mtime;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#endif
+};
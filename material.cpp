@@ -0,0 +1,53 @@
+#include "material.h"
+
+#include <string.h>
+
+Material Material::diffuse(const Color& col) {
+	Material m;
+	m.type = MATERIAL_DIFFUSE;
+	m.col = col;
+	return m;
+}
+
+Material Material::phong(const Color& col, float exponent) {
+	Material m = diffuse(col);
+	m.type = MATERIAL_PHONG;
+	m.exponent = exponent;
+	return m;
+}
+
+Material Material::blinn(const Color& col, float exponent) {
+	Material m = phong(col, exponent);
+	m.type = MATERIAL_BLINN;
+	return m;
+}
+
+Material Material::mirror(const Color& col) {
+	Material m = diffuse(col);
+	m.type = MATERIAL_MIRROR;
+	return m;
+}
+
+Material Material::dielectric(const Color& col, float ior) {
+	Material m = diffuse(col);
+	m.type = MATERIAL_DIELECTRIC;
+	m.ior = ior;
+	return m;
+}
+
+bool parseMaterialType(const char* name, MaterialType& type) {
+	if (!strcmp(name, "diffuse")) {
+		type = MATERIAL_DIFFUSE;
+	} else if (!strcmp(name, "phong")) {
+		type = MATERIAL_PHONG;
+	} else if (!strcmp(name, "blinn")) {
+		type = MATERIAL_BLINN;
+	} else if (!strcmp(name, "mirror")) {
+		type = MATERIAL_MIRROR;
+	} else if (!strcmp(name, "glass")) {
+		type = MATERIAL_DIELECTRIC;
+	} else {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "color.h"
+#include "defs.h"
+
+enum MaterialType {
+	MATERIAL_DIFFUSE,
+	MATERIAL_PHONG, //< Diffuse with a Phong highlight
+	MATERIAL_BLINN, //< Diffuse with a Blinn-Phong highlight
+	MATERIAL_MIRROR, //< Perfect reflection tinted by col
+	MATERIAL_DIELECTRIC, //< Glass, Fresnel weighted reflection and refraction
+	MATERIAL_TYPE_COUNT
+};
+
+// Surface description of the objects. Every type has its own shading kernel, so only the
+// parameters of the type matter. Objects refer to their material by its index in Scene::materials.
+struct Material {
+	// The red Phong material of the original single sphere scene
+	Material(): type(MATERIAL_PHONG), col(1, 0, 0), texture(-1), exponent(30.f), ior(1.5f) {}
+
+	static Material diffuse(const Color& col);
+	static Material phong(const Color& col, float exponent);
+	static Material blinn(const Color& col, float exponent);
+	static Material mirror(const Color& col);
+	static Material dielectric(const Color& col, float ior);
+
+	MaterialType type;
+	Color col; //< Diffuse color, or the tint of the reflected and refracted light
+	int texture; //< Index in Scene::textures, multiplies col at the uv coordinates of the hit. -1 for none.
+	float exponent; //< Sharpness of the highlight of phong and blinn materials
+	float ior; //< Index of refraction of dielectrics
+};
+
+// Parses "diffuse", "phong", "blinn", "mirror" or "glass". Returns false for anything else.
+bool parseMaterialType(const char* name, MaterialType& type);
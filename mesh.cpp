@@ -0,0 +1,190 @@
+#include "mesh.h"
+
+namespace {
+
+const int CHUNK_SIZE = 16 * 1024;
+
+// Per-ray constants of the watertight ray/triangle test from
+// "Watertight Ray/Triangle Intersection", Woop, Benthin and Wald, JCGT 2013.
+// The ray is transformed so that it points along +Z, the test is then done in 2D on the sheared
+// triangle edges, which guarantees that rays hitting a shared edge never fall through both triangles.
+struct WatertightRay {
+	Vector origin;
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+
+	WatertightRay(const Ray& ray): origin(ray.origin) {
+		const Vector& D = ray.dir;
+		const float ax = fabsf(D.x), ay = fabsf(D.y), az = fabsf(D.z);
+		kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		// Keep the winding of the triangle the same after the permutation
+		if (D[kz] < 0.f) {
+			const int tmp = kx; kx = ky; ky = tmp;
+		}
+		Sx = D[kx] / D[kz];
+		Sy = D[ky] / D[kz];
+		Sz = 1.f / D[kz];
+	}
+};
+
+// Tests the ray against triangle (v0, v1, v2). On a hit closer than maxT returns true along with
+// the distance t and the barycentric coordinates b1, b2 of the hit point with respect to v1 and v2.
+inline bool intersectTriangle(const WatertightRay& ray, const Vector& v0, const Vector& v1, const Vector& v2,
+                              float maxT, float& t, float& b1, float& b2) {
+	const Vector A = v0 - ray.origin;
+	const Vector B = v1 - ray.origin;
+	const Vector C = v2 - ray.origin;
+
+	const float Ax = A[ray.kx] - ray.Sx * A[ray.kz];
+	const float Ay = A[ray.ky] - ray.Sy * A[ray.kz];
+	const float Bx = B[ray.kx] - ray.Sx * B[ray.kz];
+	const float By = B[ray.ky] - ray.Sy * B[ray.kz];
+	const float Cx = C[ray.kx] - ray.Sx * C[ray.kz];
+	const float Cy = C[ray.ky] - ray.Sy * C[ray.kz];
+
+	float U = Cx*By - Cy*Bx;
+	float V = Ax*Cy - Ay*Cx;
+	float W = Bx*Ay - By*Ax;
+
+	// An edge function that is exactly zero may be a rounding artifact, redo it in double precision
+	if (U == 0.f || V == 0.f || W == 0.f) {
+		U = float(double(Cx)*double(By) - double(Cy)*double(Bx));
+		V = float(double(Ax)*double(Cy) - double(Ay)*double(Cx));
+		W = float(double(Bx)*double(Ay) - double(By)*double(Ax));
+	}
+
+	if ((U < 0.f || V < 0.f || W < 0.f) && (U > 0.f || V > 0.f || W > 0.f)) return false;
+
+	const float det = U + V + W;
+	if (det == 0.f) return false;
+
+	const float Az = ray.Sz * A[ray.kz];
+	const float Bz = ray.Sz * B[ray.kz];
+	const float Cz = ray.Sz * C[ray.kz];
+	const float T = U*Az + V*Bz + W*Cz;
+
+	// Compare the unnormalized distance against [0, maxT] without dividing by det first
+	if (det > 0.f ? (T <= 0.f || T > maxT * det) : (T >= 0.f || T < maxT * det)) return false;
+
+	const float rcpDet = 1.f / det;
+	t  = T * rcpDet;
+	b1 = V * rcpDet;
+	b2 = W * rcpDet;
+	return true;
+}
+
+struct MultiThreadedTriangleBoxes : a7az0th::MultiThreadedFor {
+	MultiThreadedTriangleBoxes(const Mesh& mesh, std::vector<BBox>& boxes): mesh(mesh), boxes(boxes) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int start = index * CHUNK_SIZE;
+		const int end = Min(start + CHUNK_SIZE, int(boxes.size()));
+		for (int i = start; i < end; i++) {
+			BBox box;
+			box.add(mesh.vertices[mesh.indices[i*3 + 0]]);
+			box.add(mesh.vertices[mesh.indices[i*3 + 1]]);
+			box.add(mesh.vertices[mesh.indices[i*3 + 2]]);
+			boxes[i] = box;
+		}
+	}
+private:
+	const Mesh& mesh;
+	std::vector<BBox>& boxes;
+};
+
+} // namespace
+
+void Mesh::buildAccelerator(a7az0th::ThreadManager& threadman, int numThreads) {
+	const int numTriangles = getTriangleCount();
+	std::vector<BBox> boxes(numTriangles);
+	MultiThreadedTriangleBoxes triangleBoxes(*this, boxes);
+	triangleBoxes.run(threadman, (numTriangles + CHUNK_SIZE - 1) / CHUNK_SIZE, numThreads);
+
+	std::vector<int> order;
+	tree.build(boxes, threadman, numThreads, order);
+
+	std::vector<int> ordered(indices.size());
+	for (int i = 0; i < numTriangles; i++) {
+		ordered[i*3 + 0] = indices[order[i]*3 + 0];
+		ordered[i*3 + 1] = indices[order[i]*3 + 1];
+		ordered[i*3 + 2] = indices[order[i]*3 + 2];
+	}
+	indices.swap(ordered);
+}
+
+bool Mesh::intersect(const Ray& ray, IntersectionInfo& info) const {
+	const WatertightRay wray(ray);
+	float maxT = info.isValid() ? sqrtf(info.distSq) : FLT_MAX;
+	int hitTriangle = -1;
+	float hitU = 0.f, hitV = 0.f;
+
+	auto intersectLeaf = [&](int first, int count, float& maxT) {
+		for (int i = first; i < first + count; i++) {
+			const int* tri = &indices[i*3];
+			float t, b1, b2;
+			if (intersectTriangle(wray, vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], maxT, t, b1, b2)) {
+				maxT = t;
+				hitTriangle = i;
+				hitU = b1;
+				hitV = b2;
+			}
+		}
+	};
+	tree.traverse(ray, maxT, intersectLeaf);
+
+	if (hitTriangle < 0) {
+		return false;
+	}
+
+	info.distSq = maxT * maxT;
+	info.u = hitU;
+	info.v = hitV;
+	info.primId = hitTriangle;
+	info.attributes = HIT_UV;
+	return true;
+}
+
+void Mesh::getHitInfo(const Ray& ray, IntersectionInfo& info, int attributes) const {
+	if (attributes & HIT_POINT) {
+		info.intersectionPoint = ray.origin + ray.dir * sqrtf(info.distSq);
+	}
+	if (attributes & HIT_NORMAL) {
+		const int* tri = &indices[info.primId*3];
+		Vector normal;
+		if (normals.empty()) {
+			normal = cross(vertices[tri[1]] - vertices[tri[0]], vertices[tri[2]] - vertices[tri[0]]);
+		} else {
+			normal = normals[tri[0]] * (1.f - info.u - info.v) + normals[tri[1]] * info.u + normals[tri[2]] * info.v;
+		}
+		normal.normalize();
+		info.normal = faceforward(ray.dir, normal);
+	}
+	info.attributes |= attributes;
+}
+
+bool Mesh::occluded(const Ray& ray, float maxT) const {
+	const WatertightRay wray(ray);
+	auto anyHit = [&](int first, int count, float maxT) {
+		for (int i = first; i < first + count; i++) {
+			const int* tri = &indices[i*3];
+			float t, b1, b2;
+			if (intersectTriangle(wray, vertices[tri[0]], vertices[tri[1]], vertices[tri[2]], maxT, t, b1, b2)) {
+				return true;
+			}
+		}
+		return false;
+	};
+	return tree.occluded(ray, maxT, anyHit);
+}
+
+BBox Mesh::getBounds() const {
+	return tree.getBounds();
+}
+
+void Mesh::clear() {
+	vertices.clear();
+	normals.clear();
+	indices.clear();
+	tree.clear();
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "vector.h"
+#include "bbox.h"
+#include "bvh.h"
+#include "defs.h"
+#include "mappablearray.h"
+
+#include "threadman.h"
+
+#include <vector>
+
+// An indexed triangle mesh with its own BVH.
+class Mesh {
+public:
+	Mesh(): material(0) {}
+
+	MappableArray<Vector> vertices;
+	MappableArray<Vector> normals; //< Optional per-vertex normals. Either empty or the same size as vertices.
+	MappableArray<int> indices; //< Three vertex indices per triangle
+	int material; //< Index in Scene::materials, shared by all triangles
+
+	int getTriangleCount() const { return int(indices.size() / 3); }
+
+	// Builds the BVH over the triangles. The triangles are reordered to match the leaf order,
+	// so triangle indices reported by intersect refer to the order after the build.
+	void buildAccelerator(a7az0th::ThreadManager& threadman, int numThreads);
+
+	// Finds the closest hit with the mesh that is nearer than the hit already stored in info.
+	// Sets the distance, the index of the hit triangle in info.primId and the barycentric
+	// coordinates u, v of the hit with respect to the 2nd and 3rd vertex, which come for free.
+	// The point and the normal are left to getHitInfo.
+	bool intersect(const Ray& ray, IntersectionInfo& info) const;
+
+	// Computes the HIT_* attributes in 'attributes' for a hit found by intersect. The normal is
+	// interpolated if the mesh has vertex normals and faces the ray.
+	void getHitInfo(const Ray& ray, IntersectionInfo& info, int attributes) const;
+
+	// Returns true if the ray hits any triangle at a distance of at most maxT, without looking for the closest one
+	bool occluded(const Ray& ray, float maxT) const;
+
+	BBox getBounds() const;
+
+	void clear();
+
+	// Calls visit(array) for the geometry and the BVH arrays, see BVHTree::visitArrays
+	template <class Visitor>
+	void visitArrays(Visitor& visit) {
+		visit(vertices);
+		visit(normals);
+		visit(indices);
+		tree.visitArrays(visit);
+	}
+
+private:
+	BVHTree tree;
+};
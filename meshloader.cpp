@@ -0,0 +1,731 @@
+#include "meshloader.h"
+#include "mappedfile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <sstream>
+
+namespace {
+
+const size_t OBJ_CHUNK_SIZE = 4 << 20; //< Approximate number of bytes parsed by one OBJ task
+const int PLY_CHUNK_SIZE = 256 * 1024; //< Number of PLY elements parsed by one task
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+inline const char* skipBlanks(const char* p, const char* end) {
+	while (p < end && isBlank(*p)) p++;
+	return p;
+}
+
+// Returns a pointer to the character after the next new line at or after p
+inline const char* skipLine(const char* p, const char* end) {
+	const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+	return nl ? nl + 1 : end;
+}
+
+// Parses a number in the form [+-]digits[.digits][(e|E)[+-]digits]. Much faster than strtof
+// since it does not care about locales. Returns false if there is no number at p.
+bool parseFloat(const char*& p, const char* end, float& out) {
+	p = skipBlanks(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+
+	const uint64 MAX_MANTISSA = 100000000000000000ULL; // 1e17, keeps 17 significant digits
+	uint64 mantissa = 0;
+	int exponent = 0;
+	int numDigits = 0;
+	for (; p < end && isDigit(*p); p++, numDigits++) {
+		if (mantissa < MAX_MANTISSA) {
+			mantissa = mantissa * 10 + (*p - '0');
+		} else {
+			exponent++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && isDigit(*p); p++, numDigits++) {
+			if (mantissa < MAX_MANTISSA) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+		}
+	}
+	if (numDigits == 0) {
+		return false;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		bool negativeExp = false;
+		if (q < end && (*q == '-' || *q == '+')) {
+			negativeExp = (*q == '-');
+			q++;
+		}
+		int e = 0;
+		const char* expStart = q;
+		for (; q < end && isDigit(*q); q++) {
+			e = Min(e * 10 + (*q - '0'), 9999);
+		}
+		if (q != expStart) {
+			exponent += negativeExp ? -e : e;
+			p = q;
+		}
+	}
+
+	double value = double(mantissa);
+	if (exponent < 0) {
+		value /= pow(10.0, -exponent);
+	} else if (exponent > 0) {
+		value *= pow(10.0, exponent);
+	}
+	out = float(negative ? -value : value);
+	return true;
+}
+
+bool parseInt(const char*& p, const char* end, int& out) {
+	p = skipBlanks(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+	if (p >= end || !isDigit(*p)) {
+		return false;
+	}
+	int64 value = 0;
+	for (; p < end && isDigit(*p); p++) {
+		value = Min(value * 10 + (*p - '0'), int64(0x7fffffff));
+	}
+	out = int(negative ? -value : value);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OBJ
+
+// A range of whole lines of the file. The first pass counts the vertices and triangles in every
+// chunk, prefix sums of the counts then give each chunk the place where it writes its data.
+struct OBJChunk {
+	const char* begin;
+	const char* end;
+	int numVertices;
+	int numTriangles;
+	int vertexOffset;
+	int triangleOffset;
+	bool error;
+};
+
+enum OBJLineType {
+	OBJ_OTHER,
+	OBJ_VERTEX,
+	OBJ_FACE,
+};
+
+// Returns the type of the line in [p, end) and moves p past the keyword
+inline OBJLineType getOBJLineType(const char*& p, const char* end) {
+	p = skipBlanks(p, end);
+	if (p + 1 < end && isBlank(p[1])) {
+		if (p[0] == 'v') { p += 2; return OBJ_VERTEX; }
+		if (p[0] == 'f') { p += 2; return OBJ_FACE; }
+	}
+	return OBJ_OTHER;
+}
+
+// Number of vertex references of a face line
+inline int countFaceVertices(const char* p, const char* end) {
+	int count = 0;
+	while (true) {
+		p = skipBlanks(p, end);
+		if (p >= end || *p == '#') break;
+		count++;
+		while (p < end && !isBlank(*p)) p++;
+	}
+	return count;
+}
+
+struct MultiThreadedOBJCount : a7az0th::MultiThreadedFor {
+	MultiThreadedOBJCount(std::vector<OBJChunk>& chunks): chunks(chunks) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		OBJChunk& chunk = chunks[index];
+		for (const char* line = chunk.begin; line < chunk.end;) {
+			const char* lineEnd = static_cast<const char*>(memchr(line, '\n', chunk.end - line));
+			if (!lineEnd) lineEnd = chunk.end;
+
+			const char* p = line;
+			const OBJLineType type = getOBJLineType(p, lineEnd);
+			if (type == OBJ_VERTEX) {
+				chunk.numVertices++;
+			} else if (type == OBJ_FACE) {
+				chunk.numTriangles += Max(countFaceVertices(p, lineEnd) - 2, 0);
+			}
+			line = lineEnd + 1;
+		}
+	}
+	std::vector<OBJChunk>& chunks;
+};
+
+struct MultiThreadedOBJParse : a7az0th::MultiThreadedFor {
+	MultiThreadedOBJParse(std::vector<OBJChunk>& chunks, Mesh& mesh): chunks(chunks), mesh(mesh) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		OBJChunk& chunk = chunks[index];
+		const int totalVertices = int(mesh.vertices.size());
+		int vertexIdx = chunk.vertexOffset;
+		int* tri = mesh.indices.data() + size_t(chunk.triangleOffset) * 3;
+
+		for (const char* line = chunk.begin; line < chunk.end && !chunk.error;) {
+			const char* lineEnd = static_cast<const char*>(memchr(line, '\n', chunk.end - line));
+			if (!lineEnd) lineEnd = chunk.end;
+
+			const char* p = line;
+			const OBJLineType type = getOBJLineType(p, lineEnd);
+			if (type == OBJ_VERTEX) {
+				Vector& v = mesh.vertices[vertexIdx++];
+				if (!parseFloat(p, lineEnd, v.x) || !parseFloat(p, lineEnd, v.y) || !parseFloat(p, lineEnd, v.z)) {
+					chunk.error = true;
+				}
+			} else if (type == OBJ_FACE) {
+				int first = -1, prev = -1;
+				for (int n = 0; ; n++) {
+					p = skipBlanks(p, lineEnd);
+					if (p >= lineEnd || *p == '#') break;
+
+					int idx;
+					if (!parseInt(p, lineEnd, idx) || idx == 0) {
+						chunk.error = true;
+						break;
+					}
+					// Negative indices are relative to the vertices defined so far
+					idx = (idx > 0) ? idx - 1 : vertexIdx + idx;
+					if (idx < 0 || idx >= totalVertices) {
+						chunk.error = true;
+						break;
+					}
+					// Skip the texture and normal references of the v/vt/vn form
+					while (p < lineEnd && !isBlank(*p)) p++;
+
+					if (n == 0) {
+						first = idx;
+					} else if (n >= 2) {
+						tri[0] = first;
+						tri[1] = prev;
+						tri[2] = idx;
+						tri += 3;
+					}
+					prev = idx;
+				}
+			}
+			line = lineEnd + 1;
+		}
+	}
+	std::vector<OBJChunk>& chunks;
+	Mesh& mesh;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// PLY
+
+enum PLYType {
+	PLY_INVALID,
+	PLY_INT8,
+	PLY_UINT8,
+	PLY_INT16,
+	PLY_UINT16,
+	PLY_INT32,
+	PLY_UINT32,
+	PLY_FLOAT32,
+	PLY_FLOAT64,
+};
+
+PLYType getPLYType(const std::string& name) {
+	if (name == "char"   || name == "int8")    return PLY_INT8;
+	if (name == "uchar"  || name == "uint8")   return PLY_UINT8;
+	if (name == "short"  || name == "int16")   return PLY_INT16;
+	if (name == "ushort" || name == "uint16")  return PLY_UINT16;
+	if (name == "int"    || name == "int32")   return PLY_INT32;
+	if (name == "uint"   || name == "uint32")  return PLY_UINT32;
+	if (name == "float"  || name == "float32") return PLY_FLOAT32;
+	if (name == "double" || name == "float64") return PLY_FLOAT64;
+	return PLY_INVALID;
+}
+
+int getPLYTypeSize(PLYType type) {
+	switch (type) {
+	case PLY_INT8: case PLY_UINT8: return 1;
+	case PLY_INT16: case PLY_UINT16: return 2;
+	case PLY_INT32: case PLY_UINT32: case PLY_FLOAT32: return 4;
+	case PLY_FLOAT64: return 8;
+	default: return 0;
+	}
+}
+
+template <class T>
+inline T readRaw(const char* p, bool swap) {
+	T value;
+	if (swap) {
+		char tmp[sizeof(T)];
+		for (int i = 0; i < int(sizeof(T)); i++) tmp[i] = p[sizeof(T) - 1 - i];
+		memcpy(&value, tmp, sizeof(T));
+	} else {
+		memcpy(&value, p, sizeof(T));
+	}
+	return value;
+}
+
+inline double readPLYValue(const char* p, PLYType type, bool swap) {
+	switch (type) {
+	case PLY_INT8:    return double(readRaw<int8>(p, swap));
+	case PLY_UINT8:   return double(readRaw<uint8>(p, swap));
+	case PLY_INT16:   return double(readRaw<int16>(p, swap));
+	case PLY_UINT16:  return double(readRaw<uint16>(p, swap));
+	case PLY_INT32:   return double(readRaw<int32>(p, swap));
+	case PLY_UINT32:  return double(readRaw<uint32>(p, swap));
+	case PLY_FLOAT32: return double(readRaw<float>(p, swap));
+	case PLY_FLOAT64: return readRaw<double>(p, swap);
+	default: return 0.0;
+	}
+}
+
+struct PLYProperty {
+	std::string name;
+	PLYType type; //< Type of the value, or of the list items for lists
+	PLYType countType; //< Type of the list size, PLY_INVALID for scalar properties
+	int offset; //< Offset inside the element, valid only for the properties before the first list
+
+	bool isList() const { return countType != PLY_INVALID; }
+};
+
+struct PLYElement {
+	std::string name;
+	int64 count;
+	std::vector<PLYProperty> props;
+
+	bool isFixedSize() const {
+		for (int i = 0; i < int(props.size()); i++) {
+			if (props[i].isList()) return false;
+		}
+		return true;
+	}
+	// Size of one element, valid only if isFixedSize()
+	int getStride() const {
+		int stride = 0;
+		for (int i = 0; i < int(props.size()); i++) stride += getPLYTypeSize(props[i].type);
+		return stride;
+	}
+	int findProperty(const char* propName) const {
+		for (int i = 0; i < int(props.size()); i++) {
+			if (props[i].name == propName) return i;
+		}
+		return -1;
+	}
+};
+
+// True if 'count' records of 'stride' bytes starting at p end before 'end'. Divides instead of
+// multiplying, so a count from a malformed header cannot wrap the size around.
+inline bool fitsPLYRecords(const char* p, const char* end, int64 count, int64 stride) {
+	return count >= 0 && p <= end && (stride == 0 || count <= (end - p) / stride);
+}
+
+// Size of one element with a variable layout starting at p, or -1 if it does not fit before end
+int64 getPLYElementSize(const PLYElement& element, const char* p, const char* end, bool swap) {
+	int64 size = 0;
+	for (int i = 0; i < int(element.props.size()); i++) {
+		const PLYProperty& prop = element.props[i];
+		if (prop.isList()) {
+			const int countSize = getPLYTypeSize(prop.countType);
+			if (p + size + countSize > end) return -1;
+			const int64 n = int64(readPLYValue(p + size, prop.countType, swap));
+			size += countSize;
+			if (!fitsPLYRecords(p + size, end, n, getPLYTypeSize(prop.type))) return -1;
+			size += n * getPLYTypeSize(prop.type);
+		} else {
+			size += getPLYTypeSize(prop.type);
+		}
+	}
+	return (p + size <= end) ? size : -1;
+}
+
+struct MultiThreadedPLYVertices : a7az0th::MultiThreadedFor {
+	MultiThreadedPLYVertices(const char* data, int stride, const PLYProperty* pos[3], const PLYProperty* nrm[3], bool swap, Mesh& mesh)
+		: data(data), stride(stride), swap(swap), mesh(mesh) {
+		for (int i = 0; i < 3; i++) {
+			this->pos[i] = pos[i];
+			this->nrm[i] = nrm[i];
+		}
+	}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int start = index * PLY_CHUNK_SIZE;
+		const int end = Min(start + PLY_CHUNK_SIZE, int(mesh.vertices.size()));
+		const bool hasNormals = !mesh.normals.empty();
+		for (int i = start; i < end; i++) {
+			const char* rec = data + int64(i) * stride;
+			Vector& v = mesh.vertices[i];
+			for (int c = 0; c < 3; c++) {
+				v[c] = float(readPLYValue(rec + pos[c]->offset, pos[c]->type, swap));
+			}
+			if (hasNormals) {
+				Vector& n = mesh.normals[i];
+				for (int c = 0; c < 3; c++) {
+					n[c] = float(readPLYValue(rec + nrm[c]->offset, nrm[c]->type, swap));
+				}
+			}
+		}
+	}
+	const char* data;
+	int stride;
+	const PLYProperty* pos[3];
+	const PLYProperty* nrm[3];
+	bool swap;
+	Mesh& mesh;
+};
+
+// Fast path for the common case of a face element that holds only triangles. Every face then has
+// the same size, so faces can be addressed directly and parsed in parallel. If a face that is not a
+// triangle is found, notTriangles is raised and the caller falls back to the serial parser.
+struct MultiThreadedPLYTriangles : a7az0th::MultiThreadedFor {
+	MultiThreadedPLYTriangles(const char* data, int stride, int countOffset, const PLYProperty& list, bool swap, int numVertices, Mesh& mesh)
+		: data(data), stride(stride), countOffset(countOffset), list(list), swap(swap), numVertices(numVertices), mesh(mesh),
+		  notTriangles(false), badIndex(false) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int start = index * PLY_CHUNK_SIZE;
+		const int end = Min(start + PLY_CHUNK_SIZE, mesh.getTriangleCount());
+		const int countSize = getPLYTypeSize(list.countType);
+		const int itemSize = getPLYTypeSize(list.type);
+		for (int i = start; i < end; i++) {
+			const char* rec = data + int64(i) * stride + countOffset;
+			if (readPLYValue(rec, list.countType, swap) != 3.0) {
+				notTriangles = true;
+				return;
+			}
+			for (int c = 0; c < 3; c++) {
+				const int idx = int(readPLYValue(rec + countSize + c * itemSize, list.type, swap));
+				if (idx < 0 || idx >= numVertices) {
+					badIndex = true;
+					return;
+				}
+				mesh.indices[size_t(i) * 3 + c] = idx;
+			}
+		}
+	}
+	const char* data;
+	int stride, countOffset;
+	const PLYProperty& list;
+	bool swap;
+	int numVertices;
+	Mesh& mesh;
+	std::atomic<bool> notTriangles;
+	std::atomic<bool> badIndex;
+};
+
+bool endsWith(const std::string& str, const char* suffix) {
+	const size_t n = strlen(suffix);
+	if (str.size() < n) return false;
+	for (size_t i = 0; i < n; i++) {
+		if (tolower(str[str.size() - n + i]) != suffix[i]) return false;
+	}
+	return true;
+}
+
+} // namespace
+
+bool loadOBJ(const char* fileName, Mesh& mesh, a7az0th::ThreadManager& threadman, int numThreads) {
+	mesh.clear();
+	MappedFile file;
+	if (!file.open(fileName)) {
+		printf("Failed to open %s\n", fileName);
+		return false;
+	}
+
+	const char* data = file.data();
+	const char* dataEnd = data + file.size();
+	const int numChunks = int(Min(file.size() / OBJ_CHUNK_SIZE + 1, size_t(numThreads) * 64));
+
+	// Chunks start at line boundaries, so every line belongs to exactly one chunk
+	std::vector<OBJChunk> chunks(numChunks);
+	const char* chunkStart = data;
+	for (int i = 0; i < numChunks; i++) {
+		OBJChunk& chunk = chunks[i];
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.begin = chunkStart;
+		if (i + 1 < numChunks) {
+			const char* split = data + file.size() / numChunks * (i + 1);
+			chunk.end = (split > chunkStart) ? skipLine(split, dataEnd) : chunkStart;
+		} else {
+			chunk.end = dataEnd;
+		}
+		chunkStart = chunk.end;
+	}
+
+	MultiThreadedOBJCount count(chunks);
+	count.run(threadman, numChunks, numThreads);
+
+	int64 numVertices = 0, numTriangles = 0;
+	for (int i = 0; i < numChunks; i++) {
+		chunks[i].vertexOffset = int(numVertices);
+		chunks[i].triangleOffset = int(numTriangles);
+		numVertices += chunks[i].numVertices;
+		numTriangles += chunks[i].numTriangles;
+	}
+	if (numVertices > 0x7fffffff || numTriangles * 3 > 0x7fffffff) {
+		printf("%s is too large\n", fileName);
+		return false;
+	}
+
+	mesh.vertices.resize(size_t(numVertices));
+	mesh.indices.resize(size_t(numTriangles) * 3);
+
+	MultiThreadedOBJParse parse(chunks, mesh);
+	parse.run(threadman, numChunks, numThreads);
+
+	for (int i = 0; i < numChunks; i++) {
+		if (chunks[i].error) {
+			printf("Failed to parse %s\n", fileName);
+			mesh.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool loadPLY(const char* fileName, Mesh& mesh, a7az0th::ThreadManager& threadman, int numThreads) {
+	mesh.clear();
+	MappedFile file;
+	if (!file.open(fileName)) {
+		printf("Failed to open %s\n", fileName);
+		return false;
+	}
+
+	const char* data = file.data();
+	const char* dataEnd = data + file.size();
+
+	// The header is a short block of text lines terminated by "end_header"
+	std::vector<PLYElement> elements;
+	bool swap = false;
+	bool headerDone = false;
+	bool isBinary = false;
+	const char* p = data;
+	for (int lineIdx = 0; p < dataEnd && !headerDone; lineIdx++) {
+		const char* lineEnd = skipLine(p, dataEnd);
+		std::istringstream line(std::string(p, lineEnd));
+		p = lineEnd;
+
+		std::string keyword;
+		line >> keyword;
+		if (lineIdx == 0) {
+			if (keyword != "ply") break;
+		} else if (keyword == "format") {
+			std::string format;
+			line >> format;
+			const uint16 one = 1;
+			const bool hostLittleEndian = *reinterpret_cast<const uint8*>(&one) == 1;
+			if (format == "binary_little_endian") {
+				isBinary = true;
+				swap = !hostLittleEndian;
+			} else if (format == "binary_big_endian") {
+				isBinary = true;
+				swap = hostLittleEndian;
+			}
+		} else if (keyword == "element") {
+			PLYElement element;
+			line >> element.name >> element.count;
+			// The mesh counts its vertices and triangles in int
+			if (!line || element.count < 0 || element.count > INT_MAX) {
+				printf("Invalid element count in %s\n", fileName);
+				return false;
+			}
+			elements.push_back(element);
+		} else if (keyword == "property" && !elements.empty()) {
+			PLYProperty prop;
+			std::string type;
+			line >> type;
+			prop.countType = PLY_INVALID;
+			if (type == "list") {
+				std::string countType;
+				line >> countType >> type;
+				prop.countType = getPLYType(countType);
+			}
+			prop.type = getPLYType(type);
+			line >> prop.name;
+			if (prop.type == PLY_INVALID || (type == "list" && prop.countType == PLY_INVALID)) {
+				printf("Unsupported property type in %s\n", fileName);
+				return false;
+			}
+			PLYElement& element = elements.back();
+			prop.offset = element.isFixedSize() ? element.getStride() : -1;
+			element.props.push_back(prop);
+		} else if (keyword == "end_header") {
+			headerDone = true;
+		}
+	}
+	if (!headerDone) {
+		printf("%s is not a valid PLY file\n", fileName);
+		return false;
+	}
+	if (!isBinary) {
+		printf("%s is an ASCII PLY file, only binary PLY files are supported\n", fileName);
+		return false;
+	}
+
+	int numVertices = 0;
+	for (int i = 0; i < int(elements.size()); i++) {
+		if (elements[i].name == "vertex") numVertices = int(elements[i].count);
+	}
+
+	for (int e = 0; e < int(elements.size()); e++) {
+		const PLYElement& element = elements[e];
+		const bool fixedSize = element.isFixedSize();
+
+		if (element.name == "vertex") {
+			const PLYProperty* pos[3] = { nullptr, nullptr, nullptr };
+			const PLYProperty* nrm[3] = { nullptr, nullptr, nullptr };
+			const char* posNames[3] = { "x", "y", "z" };
+			const char* nrmNames[3] = { "nx", "ny", "nz" };
+			for (int c = 0; c < 3; c++) {
+				const int posIdx = element.findProperty(posNames[c]);
+				const int nrmIdx = element.findProperty(nrmNames[c]);
+				pos[c] = (posIdx >= 0) ? &element.props[posIdx] : nullptr;
+				nrm[c] = (nrmIdx >= 0) ? &element.props[nrmIdx] : nullptr;
+			}
+			const int stride = element.getStride();
+			if (!fixedSize || !pos[0] || !pos[1] || !pos[2] || !fitsPLYRecords(p, dataEnd, element.count, stride)) {
+				printf("Unsupported or truncated vertex data in %s\n", fileName);
+				mesh.clear();
+				return false;
+			}
+
+			mesh.vertices.resize(size_t(element.count));
+			if (nrm[0] && nrm[1] && nrm[2]) {
+				mesh.normals.resize(size_t(element.count));
+			}
+			MultiThreadedPLYVertices vertices(p, stride, pos, nrm, swap, mesh);
+			vertices.run(threadman, int((element.count + PLY_CHUNK_SIZE - 1) / PLY_CHUNK_SIZE), numThreads);
+			p += element.count * stride;
+			continue;
+		}
+
+		const int listIdx = (element.name == "face") ? Max(element.findProperty("vertex_indices"), element.findProperty("vertex_index")) : -1;
+		if (listIdx >= 0 && element.props[listIdx].isList()) {
+			const PLYProperty& list = element.props[listIdx];
+
+			// Try the parallel path first, it works if all faces are triangles and there are no other lists
+			int numLists = 0, countOffset = 0, triangleStride = 0;
+			for (int i = 0; i < int(element.props.size()); i++) {
+				const PLYProperty& prop = element.props[i];
+				if (i == listIdx) {
+					countOffset = triangleStride;
+					triangleStride += getPLYTypeSize(prop.countType) + 3 * getPLYTypeSize(prop.type);
+				} else {
+					triangleStride += getPLYTypeSize(prop.type);
+				}
+				numLists += prop.isList();
+			}
+			if (numLists == 1 && fitsPLYRecords(p, dataEnd, element.count, triangleStride)) {
+				mesh.indices.resize(size_t(element.count) * 3);
+				MultiThreadedPLYTriangles triangles(p, triangleStride, countOffset, list, swap, numVertices, mesh);
+				triangles.run(threadman, int((element.count + PLY_CHUNK_SIZE - 1) / PLY_CHUNK_SIZE), numThreads);
+				// Past the first face that is not a triangle the records are misaligned and their
+				// indices are garbage, only with triangles alone is an invalid index real
+				if (!triangles.notTriangles) {
+					if (triangles.badIndex) {
+						printf("Invalid vertex index in %s\n", fileName);
+						mesh.clear();
+						return false;
+					}
+					p += element.count * triangleStride;
+					continue;
+				}
+				mesh.indices.clear();
+			}
+
+			// General case, faces have to be walked one by one to find where each of them starts
+			const int countSize = getPLYTypeSize(list.countType);
+			const int itemSize = getPLYTypeSize(list.type);
+			for (int64 f = 0; f < element.count; f++) {
+				for (int i = 0; i < int(element.props.size()); i++) {
+					const PLYProperty& prop = element.props[i];
+					if (!prop.isList()) {
+						p += getPLYTypeSize(prop.type);
+						continue;
+					}
+					if (p + countSize > dataEnd) {
+						printf("Truncated face data in %s\n", fileName);
+						mesh.clear();
+						return false;
+					}
+					const int n = int(readPLYValue(p, prop.countType, swap));
+					p += countSize;
+					if (n < 0 || p + int64(n) * getPLYTypeSize(prop.type) > dataEnd) {
+						printf("Truncated face data in %s\n", fileName);
+						mesh.clear();
+						return false;
+					}
+					if (i == listIdx) {
+						int first = 0, prev = 0;
+						for (int k = 0; k < n; k++) {
+							const int idx = int(readPLYValue(p + k * itemSize, list.type, swap));
+							if (idx < 0 || idx >= numVertices) {
+								printf("Invalid vertex index in %s\n", fileName);
+								mesh.clear();
+								return false;
+							}
+							if (k == 0) {
+								first = idx;
+							} else if (k >= 2) {
+								mesh.indices.push_back(first);
+								mesh.indices.push_back(prev);
+								mesh.indices.push_back(idx);
+							}
+							prev = idx;
+						}
+					}
+					p += int64(n) * getPLYTypeSize(prop.type);
+				}
+			}
+			continue;
+		}
+
+		// Any other element is skipped
+		bool truncated = false;
+		if (fixedSize) {
+			truncated = !fitsPLYRecords(p, dataEnd, element.count, element.getStride());
+			if (!truncated) {
+				p += element.count * element.getStride();
+			}
+		} else {
+			for (int64 i = 0; i < element.count; i++) {
+				const int64 size = getPLYElementSize(element, p, dataEnd, swap);
+				if (size < 0) {
+					break;
+				}
+				p += size;
+			}
+		}
+		if (truncated) {
+			printf("Truncated data in %s\n", fileName);
+			mesh.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool loadMesh(const char* fileName, Mesh& mesh, a7az0th::ThreadManager& threadman, int numThreads) {
+	const std::string name(fileName);
+	if (endsWith(name, ".obj")) {
+		return loadOBJ(fileName, mesh, threadman, numThreads);
+	}
+	if (endsWith(name, ".ply")) {
+		return loadPLY(fileName, mesh, threadman, numThreads);
+	}
+	printf("Unknown mesh format %s\n", fileName);
+	return false;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "mesh.h"
+
+#include "threadman.h"
+
+// Mesh loaders. The input file is memory mapped and split into chunks that are parsed by all threads.
+// On failure an error is printed, false is returned and the mesh is left empty.
+// The loaders only fill the geometry, Mesh::buildAccelerator still has to be called afterwards.
+
+// Loads an .obj or a .ply file, depending on the file extension
+bool loadMesh(const char* fileName, Mesh& mesh, a7az0th::ThreadManager& threadman, int numThreads);
+
+// Wavefront OBJ. Reads positions ('v') and faces ('f'), polygons are triangulated as fans.
+// Texture coordinates, OBJ normals, groups and materials are ignored.
+bool loadOBJ(const char* fileName, Mesh& mesh, a7az0th::ThreadManager& threadman, int numThreads);
+
+// Binary (little or big endian) PLY. Reads x, y, z and optional nx, ny, nz from the vertex
+// element and the vertex index list from the face element. Polygons are triangulated as fans.
+bool loadPLY(const char* fileName, Mesh& mesh, a7az0th::ThreadManager& threadman, int numThreads);
@@ -0,0 +1,101 @@
+#include "meshloader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Checks for the mesh loaders, run by ctest. Every check prints what failed, main returns the number
+// of failed checks.
+
+namespace {
+
+const char* TEST_FILE = "meshloader_test.ply";
+
+// Enough faces for several parallel chunks, so chunks past a polygon read misaligned records
+const int NUM_FACES = 600 * 1024;
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+	if (!condition) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+// Writes a binary little endian PLY with five vertices and the given faces. The header claims
+// 'faceCount' faces if it is given.
+bool writePLY(const std::vector<std::vector<int> >& faces, const char* faceCount = nullptr) {
+	FILE* fp = fopen(TEST_FILE, "wb");
+	if (!fp) {
+		printf("Failed to create %s\n", TEST_FILE);
+		return false;
+	}
+	fprintf(fp, "ply\nformat binary_little_endian 1.0\n");
+	fprintf(fp, "element vertex 5\nproperty float x\nproperty float y\nproperty float z\n");
+	const std::string count = faceCount ? faceCount : std::to_string(faces.size());
+	fprintf(fp, "element face %s\nproperty list uchar int vertex_indices\nend_header\n", count.c_str());
+	const float vertices[5][3] = { {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0}, {-1, 0.5f, 0} };
+	fwrite(vertices, sizeof(vertices), 1, fp);
+	for (int i = 0; i < int(faces.size()); i++) {
+		const unsigned char count = (unsigned char)faces[i].size();
+		fwrite(&count, 1, 1, fp);
+		fwrite(&faces[i][0], sizeof(int), count, fp);
+	}
+	return fclose(fp) == 0;
+}
+
+std::vector<int> makeFace(int a, int b, int c, int d = -1, int e = -1) {
+	std::vector<int> face;
+	face.push_back(a);
+	face.push_back(b);
+	face.push_back(c);
+	if (d >= 0) face.push_back(d);
+	if (e >= 0) face.push_back(e);
+	return face;
+}
+
+} // namespace
+
+int main() {
+	a7az0th::ThreadManager threadman;
+	const int numThreads = Max(a7az0th::getProcessorCount(), 2);
+
+	// Triangles only, read by the parallel path
+	std::vector<std::vector<int> > faces(NUM_FACES, makeFace(1, 2, 3));
+	Mesh mesh;
+	check(writePLY(faces) && loadPLY(TEST_FILE, mesh, threadman, numThreads), "triangle PLY loads");
+	check(mesh.getTriangleCount() == NUM_FACES, "triangle PLY has one triangle per face");
+
+	// A quad and a pentagon among the triangles are triangulated as fans. Shifted by the extra
+	// index of the quad, the triangle records read as a count of 3 and an index out of range.
+	faces[100] = makeFace(1, 2, 3, 4);
+	faces[NUM_FACES / 2] = makeFace(0, 1, 2, 3, 4);
+	check(writePLY(faces) && loadPLY(TEST_FILE, mesh, threadman, numThreads), "mixed polygon PLY loads");
+	check(mesh.getTriangleCount() == NUM_FACES + 1 + 2, "mixed polygon PLY is triangulated");
+	if (mesh.getTriangleCount() == NUM_FACES + 3) {
+		const int quad[6] = { 1, 2, 3, 1, 3, 4 };
+		check(memcmp(&mesh.indices[100 * 3], quad, sizeof(quad)) == 0, "quad is split into a fan");
+	}
+
+	// An index out of range is an error, with and without polygons
+	faces[NUM_FACES - 1] = makeFace(0, 1, 5);
+	check(writePLY(faces) && !loadPLY(TEST_FILE, mesh, threadman, numThreads), "mixed polygon PLY with a bad index fails");
+	faces[100] = faces[NUM_FACES / 2] = makeFace(1, 2, 3);
+	check(writePLY(faces) && !loadPLY(TEST_FILE, mesh, threadman, numThreads), "triangle PLY with a bad index fails");
+	check(mesh.getTriangleCount() == 0, "failed load leaves the mesh empty");
+
+	// Face counts the file cannot hold are rejected before anything is sized by them. Times the
+	// 13 bytes of a triangle record the first one wraps around to 10.
+	faces.assign(4, makeFace(1, 2, 3));
+	check(writePLY(faces, "1418980313362273202") && !loadPLY(TEST_FILE, mesh, threadman, numThreads), "PLY with a wrapping face count fails");
+	check(writePLY(faces, "5") && !loadPLY(TEST_FILE, mesh, threadman, numThreads), "PLY with more faces than data fails");
+	check(writePLY(faces, "-1") && !loadPLY(TEST_FILE, mesh, threadman, numThreads), "PLY with a negative face count fails");
+
+	remove(TEST_FILE);
+	if (failures == 0) {
+		printf("All mesh loader checks passed\n");
+	}
+	return failures;
+}
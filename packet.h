@@ -0,0 +1,101 @@
+#pragma once
+
+#include "simd.h"
+#include "sphere.h"
+#include "defs.h"
+
+// A packet of SIMD_WIDTH rays in structure-of-arrays layout.
+// Primary ray packets cover a PACKET_W x PACKET_H block of pixels, lane i maps to
+// pixel (x + i % PACKET_W, y + i / PACKET_W).
+#if SIMD_WIDTH == 16
+	#define PACKET_W 4
+	#define PACKET_H 4
+#elif SIMD_WIDTH == 8
+	#define PACKET_W 4
+	#define PACKET_H 2
+#else
+	#define PACKET_W 2
+	#define PACKET_H 2
+#endif
+
+struct RayPacket {
+	vfloat ox, oy, oz;
+	vfloat dx, dy, dz;
+	vmask active; //< Lanes that carry a valid ray. Inactive lanes are never reported as hit.
+
+	// Extracts a single ray from the packet
+	Ray getRay(int lane) const {
+		Ray ray;
+		ray.origin = Vector(getLane(ox, lane), getLane(oy, lane), getLane(oz, lane));
+		ray.dir = Vector(getLane(dx, lane), getLane(dy, lane), getLane(dz, lane));
+		ray.depth = 0;
+		return ray;
+	}
+};
+
+// Closest hit for every lane of a packet
+struct PacketHit {
+	vfloat t; //< Distance along the ray, FLT_MAX if the lane missed everything
+	int primId[SIMD_WIDTH];
+
+	PacketHit(): t(FLT_MAX) {
+		for (int i = 0; i < SIMD_WIDTH; i++) primId[i] = -1;
+	}
+	vmask hitMask() const { return t < vfloat(FLT_MAX); }
+};
+
+// Horizontal and vertical offsets of the lanes inside the pixel block
+inline vfloat packetLaneX() {
+	alignas(SIMD_ALIGN) float tmp[SIMD_WIDTH];
+	for (int i = 0; i < SIMD_WIDTH; i++) tmp[i] = float(i % PACKET_W);
+	return vfloat::load(tmp);
+}
+inline vfloat packetLaneY() {
+	alignas(SIMD_ALIGN) float tmp[SIMD_WIDTH];
+	for (int i = 0; i < SIMD_WIDTH; i++) tmp[i] = float(i / PACKET_W);
+	return vfloat::load(tmp);
+}
+
+// Slab test of every active lane against the box, limited to [0, maxT] per lane
+inline vmask intersectPacket(const BBox& box, const RayPacket& packet, const vfloat invDir[3], vfloat maxT) {
+	const vfloat tx0 = (vfloat(box.vmin.x) - packet.ox) * invDir[0];
+	const vfloat tx1 = (vfloat(box.vmax.x) - packet.ox) * invDir[0];
+	const vfloat ty0 = (vfloat(box.vmin.y) - packet.oy) * invDir[1];
+	const vfloat ty1 = (vfloat(box.vmax.y) - packet.oy) * invDir[1];
+	const vfloat tz0 = (vfloat(box.vmin.z) - packet.oz) * invDir[2];
+	const vfloat tz1 = (vfloat(box.vmax.z) - packet.oz) * invDir[2];
+	const vfloat tNear = vmax(vmax(vmin(tx0, tx1), vmin(ty0, ty1)), vmax(vmin(tz0, tz1), vfloat(0.f)));
+	const vfloat tFar  = vmin(vmin(vmax(tx0, tx1), vmax(ty0, ty1)), vmax(tz0, tz1)) * vfloat(SLAB_EPSILON);
+	return packet.active & (tNear <= vmin(tFar, maxT));
+}
+
+// Same math as Sphere::intersect, done for all lanes at once. Updates the lanes that
+// hit the sphere closer than their current hit and tags them with primId.
+inline void intersectPacket(const Sphere& sphere, int primId, const RayPacket& packet, PacketHit& hit) {
+	const Vector& O = sphere.getPos();
+	const float radius = sphere.getRadius();
+
+	const vfloat hx = packet.ox - vfloat(O.x);
+	const vfloat hy = packet.oy - vfloat(O.y);
+	const vfloat hz = packet.oz - vfloat(O.z);
+	const vfloat A = packet.dx*packet.dx + packet.dy*packet.dy + packet.dz*packet.dz;
+	const vfloat B = vfloat(2.f) * (hx*packet.dx + hy*packet.dy + hz*packet.dz);
+	const vfloat C = hx*hx + hy*hy + hz*hz - vfloat(radius*radius);
+	const vfloat Dscr = B*B - vfloat(4.f)*A*C;
+
+	vmask valid = packet.active & (Dscr >= vfloat(0.f));
+	if (none(valid)) return;
+
+	const vfloat sq = vsqrt(vmax(Dscr, vfloat(0.f)));
+	const vfloat inv2A = vfloat(0.5f) / A;
+	const vfloat x1 = (-B + sq) * inv2A;
+	const vfloat x2 = (-B - sq) * inv2A;
+	const vfloat sol = select(x2 < vfloat(0.f), x1, x2);
+	valid = valid & (sol >= vfloat(0.f)) & (sol <= hit.t);
+	if (none(valid)) return;
+
+	hit.t = select(valid, sol, hit.t);
+	for (int bits = valid.bits(), lane = 0; bits; bits >>= 1, lane++) {
+		if (bits & 1) hit.primId[lane] = primId;
+	}
+}
@@ -0,0 +1,81 @@
+#include "progressive.h"
+
+#include <math.h>
+
+namespace {
+
+const int ROWS_PER_TASK = 16;
+
+// Radical inverse of 'index' in the given base, the index-th point of the van der Corput sequence
+float radicalInverse(int index, int base) {
+	const float invBase = 1.f / base;
+	float invBi = invBase;
+	float result = 0.f;
+	while (index > 0) {
+		result += (index % base) * invBi;
+		index /= base;
+		invBi *= invBase;
+	}
+	return result;
+}
+
+// Sums the relative standard error of every pixel, one task per ROWS_PER_TASK rows
+struct MultiThreadedError : a7az0th::MultiThreadedFor {
+	MultiThreadedError(const float* lumSum, const float* lumSumSq, int width, int height, int numPasses)
+		: lumSum(lumSum), lumSumSq(lumSumSq), width(width), height(height), numPasses(numPasses),
+		  taskError((height + ROWS_PER_TASK - 1) / ROWS_PER_TASK, 0.0) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		const int start = index * ROWS_PER_TASK * width;
+		const int end = Min((index + 1) * ROWS_PER_TASK, height) * width;
+		const float n = float(numPasses);
+		double acc = 0.0;
+		for (int i = start; i < end; i++) {
+			const float mean = lumSum[i] / n;
+			const float variance = Max(0.f, lumSumSq[i] / n - mean * mean) * n / (n - 1.f);
+			// The standard error of the mean, relative to the pixel brightness. The small bias keeps
+			// black pixels from dominating the average.
+			acc += sqrtf(variance / n) / (mean + 0.01f);
+		}
+		taskError[index] = acc;
+	}
+	const float* lumSum;
+	const float* lumSumSq;
+	int width, height, numPasses;
+	std::vector<double> taskError;
+};
+
+} // namespace
+
+void ProgressiveBuffer::beginPass(int w, int h, uint32 cameraRev, uint32 sceneRev, float& jitterX, float& jitterY) {
+	if (w != width || h != height || cameraRev != cameraRevision || sceneRev != sceneRevision) {
+		width = w;
+		height = h;
+		cameraRevision = cameraRev;
+		sceneRevision = sceneRev;
+		numPasses = 0;
+	}
+	if (numPasses == 0) {
+		sum.assign(width * height, Color(0.f, 0.f, 0.f));
+		lumSum.assign(width * height, 0.f);
+		lumSumSq.assign(width * height, 0.f);
+		error = 1.f;
+	}
+	jitterX = radicalInverse(numPasses, 2);
+	jitterY = radicalInverse(numPasses, 3);
+	numPasses++;
+}
+
+void ProgressiveBuffer::endPass(a7az0th::ThreadManager& threadman, int numThreads) {
+	if (numPasses < 2 || width * height == 0) {
+		error = 1.f;
+		return;
+	}
+	MultiThreadedError estimate(lumSum.data(), lumSumSq.data(), width, height, numPasses);
+	const int numTasks = int(estimate.taskError.size());
+	estimate.run(threadman, numTasks, numThreads);
+	double total = 0.0;
+	for (int i = 0; i < numTasks; i++) {
+		total += estimate.taskError[i];
+	}
+	error = float(total / (double(width) * height));
+}
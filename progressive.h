@@ -0,0 +1,57 @@
+#pragma once
+
+#include "color.h"
+#include "defs.h"
+
+#include "threadman.h"
+
+#include <vector>
+
+// Accumulates one jittered sample per pixel and pass over many frames, so a static view converges
+// to an anti-aliased image while every frame costs the same as a regular render.
+// The jitter follows the Halton (2, 3) sequence and is the same for all pixels of a pass, which
+// keeps the primary rays of a pass coherent enough for packet tracing.
+// The first pass has no jitter and matches a regular render exactly.
+class ProgressiveBuffer {
+public:
+	ProgressiveBuffer(): width(0), height(0), numPasses(0), cameraRevision(0), sceneRevision(0), error(0.f) {}
+
+	// Starts a new pass. The accumulated samples are dropped if the image size or one of the
+	// revisions differs from the previous pass. Returns the jitter of the pass in jitterX/Y.
+	void beginPass(int width, int height, uint32 cameraRevision, uint32 sceneRevision, float& jitterX, float& jitterY);
+
+	// Adds the sample of pixel (x, y) for the current pass and returns the average of all its samples
+	Color addSample(int x, int y, const Color& sample) {
+		const int idx = y * width + x;
+		const float lum = luminance(sample);
+		sum[idx] += sample;
+		lumSum[idx] += lum;
+		lumSumSq[idx] += lum * lum;
+		return sum[idx] / float(numPasses);
+	}
+
+	// Recomputes the convergence estimate. Must be called after all samples of the pass are added.
+	void endPass(a7az0th::ThreadManager& threadman, int numThreads);
+
+	void reset() { numPasses = 0; }
+
+	// Number of samples every pixel has received so far
+	int getSamplesPerPixel() const { return numPasses; }
+
+	// Average relative standard error of the pixel luminances, 1 until there are two samples.
+	// Halving it takes four times as many samples.
+	float getError() const { return error; }
+
+private:
+	static float luminance(const Color& c) { return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b; }
+
+	int width, height;
+	int numPasses;
+	uint32 cameraRevision; //< Revisions the accumulated samples were rendered with
+	uint32 sceneRevision;
+	float error;
+
+	std::vector<Color> sum; //< Sum of the samples of every pixel
+	std::vector<float> lumSum; //< Sum of the sample luminances, for the variance estimate
+	std::vector<float> lumSumSq; //< Sum of the squared sample luminances
+};
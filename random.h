@@ -0,0 +1,93 @@
+#pragma once
+
+#include "defs.h"
+#include "vector.h"
+
+#include <string.h>
+
+// Hashes the pixel coordinates into a random looking 32 bit value, used to decorrelate the sample
+// patterns of neighbouring pixels
+inline uint32 hashPixel(int x, int y, uint32 seed) {
+	uint32 h = uint32(x) * 0x8da6b343u ^ uint32(y) * 0xd8163841u ^ seed * 0xcb1ab31fu;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+// Mixes 'value' into the hash 'seed'
+inline uint32 hashCombine(uint32 seed, uint32 value) {
+	uint32 h = seed ^ (value * 0x9e3779b9u + 0x7f4a7c15u);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+// Maps the upper 24 bits to a float in [0, 1). 24 bits is all a float holds below 1.
+inline float toUnitFloat(uint32 bits) {
+	return float(bits >> 8) * (1.f / 16777216.f);
+}
+
+// Advances the PCG state and returns a uniform random number in [0, 1) with 24 bits of precision.
+// The whole generator is the one 32 bit state, cheap enough to keep one per path or shading point.
+inline float nextRandom(uint32& state) {
+	const uint32 s = state;
+	state = state * 747796405u + 2891336453u;
+	const uint32 w = ((s >> ((s >> 28) + 4u)) ^ s) * 277803737u;
+	return toUnitFloat((w >> 22) ^ w);
+}
+
+// Random numbers for a point in space, seeded by hashing its coordinates. The same point always
+// gets the same numbers, so a render is repeatable however the buckets are spread over the threads,
+// while neighbouring points get unrelated ones.
+struct PointRandom {
+	PointRandom(const Vector& p) {
+		uint32 bits[3];
+		memcpy(bits, &p.x, sizeof(float));
+		memcpy(bits + 1, &p.y, sizeof(float));
+		memcpy(bits + 2, &p.z, sizeof(float));
+		state = hashPixel(int(bits[0]), int(bits[1]), bits[2]);
+	}
+	float next() { return nextRandom(state); }
+	uint32 state;
+};
+
+// xoroshiro128+ generator, the general purpose generator for everything that is not a pixel sample.
+// Much faster than rand() and every instance has its own state, so threads do not share anything.
+class Xoroshiro128 {
+public:
+	// Expands the seed with splitmix64, any seed including 0 gives a good state
+	explicit Xoroshiro128(uint64 seed = 0) {
+		for (int i = 0; i < 2; i++) {
+			seed += 0x9e3779b97f4a7c15ull;
+			uint64 z = seed;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			s[i] = z ^ (z >> 31);
+		}
+	}
+
+	uint64 next() {
+		const uint64 s0 = s[0];
+		uint64 s1 = s[1];
+		const uint64 result = s0 + s1;
+		s1 ^= s0;
+		s[0] = rotl(s0, 24) ^ s1 ^ (s1 << 16);
+		s[1] = rotl(s1, 37);
+		return result;
+	}
+
+	// Uniform in [0, 1), from the upper bits which are the best ones of xoroshiro128+
+	float nextFloat() { return toUnitFloat(uint32(next() >> 32)); }
+
+	float getRange(float min, float max) { return min + (max - min) * nextFloat(); }
+
+private:
+	static uint64 rotl(uint64 x, int k) { return (x << k) | (x >> (64 - k)); }
+	uint64 s[2];
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "simd.h"
+#include "rect.h"
+#include "defs.h"
+
+#include <vector>
+
+// A batch of rays that share one origin, stored as separate SIMD aligned arrays of direction
+// components. Primary rays of a whole bucket are generated into a stream at once, row by row.
+// Every row starts at a multiple of SIMD_WIDTH, ray (x, y) of the bucket is at y * stride + x.
+// The padding lanes at the end of the rows hold valid but unused directions.
+struct RayStream {
+	typedef std::vector<float, AlignedAllocator<float> > FloatArray;
+
+	Vector origin;
+	FloatArray dx, dy, dz;
+	int width, height; //< Size of the bucket the rays were generated for
+	int stride; //< Distance between the first rays of two consecutive rows
+
+	RayStream(): width(0), height(0), stride(0) {}
+
+	// Makes room for a w x h bucket. Keeps the allocation when it is already large enough.
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		stride = (w + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+		if (int(dx.size()) < stride * h) {
+			dx.resize(stride * h);
+			dy.resize(stride * h);
+			dz.resize(stride * h);
+		}
+	}
+
+	// Returns the ray of pixel (x, y), relative to the top-left corner of the bucket
+	Ray getRay(int x, int y) const {
+		const int idx = y * stride + x;
+		Ray ray;
+		ray.origin = origin;
+		ray.dir = Vector(dx[idx], dy[idx], dz[idx]);
+		ray.depth = 0;
+		return ray;
+	}
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "defs.h"
+
+// Simple structure used to represent a rectangular section of an image. A 'bucket'
+struct Rect {
+
+	int x0, y0, x1, y1; //< The 2 diagonal points of the rectangle
+
+	Rect() {}
+	Rect(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1){}
+	// Clips the rectangle against image size
+	void clip(int maxX, int maxY) {
+		x1 = Min(x1, maxX);
+		y1 = Min(y1, maxY);
+	}
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+	int area() const { return width() * height(); }
+	bool operator == (const Rect& rhs) const { return x0 == rhs.x0 && y0 == rhs.y0 && x1 == rhs.x1 && y1 == rhs.y1; }
+	bool operator != (const Rect& rhs) const { return !(*this == rhs); }
+};
@@ -0,0 +1,485 @@
+#include "render.h"
+#include "packet.h"
+#include "raystream.h"
+#include "sceneedit.h"
+#include "tiledimage.h"
+#include "timer.h"
+
+Scene scene;
+
+void initBuckets(Canvas& c, std::vector<Rect>& buckets, const int BUCKET_SIZE) {
+	initBuckets(c.width, c.height, buckets, BUCKET_SIZE);
+}
+
+void initBuckets(int W, int H, std::vector<Rect>& buckets, const int BUCKET_SIZE) {
+
+	buckets.clear();
+
+	const int BW = (W + BUCKET_SIZE-1) / BUCKET_SIZE;
+	const int BH = (H + BUCKET_SIZE-1) / BUCKET_SIZE;
+	for (int y = 0; y < BH; y++) {
+		if (y % 2 == 0)
+			for (int x = 0; x < BW; x++)
+				buckets.push_back(Rect(x * BUCKET_SIZE, y * BUCKET_SIZE, (x + 1) * BUCKET_SIZE, (y + 1) * BUCKET_SIZE));
+		else
+			for (int x = BW - 1; x >= 0; x--)
+				buckets.push_back(Rect(x * BUCKET_SIZE, y * BUCKET_SIZE, (x + 1) * BUCKET_SIZE, (y + 1) * BUCKET_SIZE));
+	}
+	for (int i = 0; i < (int) buckets.size(); i++) {
+		buckets[i].clip(W, H);
+	}
+}
+
+// Renders single buckets of the scene canvas, shared by the static and the adaptive bucket scheduling
+// With an accumulation buffer the rays are shifted by the jitter of the current pass and the
+// canvas receives the running average instead of the new sample.
+// 'seed' is the progressive pass. It picks the sample of the pixel sampler and varies the
+// supersampling patterns between passes.
+// With a G-buffer the camera ray hits of the buckets are stored in it, or with shadeOnly taken
+// from it instead of being traced. Not used with supersampling or accumulation.
+// The canvas covers the image from its origin, which is only moved for the tiles of tiled frames.
+struct SceneBucketRenderer : BucketRenderer {
+	SceneBucketRenderer(Canvas& c, ProgressiveBuffer* accum = nullptr, float jitterX = 0.f, float jitterY = 0.f, uint32 seed = 0)
+		: c(c), accum(accum), jitterX(jitterX), jitterY(jitterY), seed(seed), gbuffer(nullptr), shadeOnly(false), originX(0), originY(0) {}
+	void setGBuffer(GBuffer* gbuffer, bool shadeOnly) {
+		this->gbuffer = gbuffer;
+		this->shadeOnly = shadeOnly;
+	}
+	// Pixel (x, y) of the image goes to pixel (x - originX, y - originY) of the canvas
+	void setOrigin(int x, int y) {
+		originX = x;
+		originY = y;
+	}
+	virtual void renderBucket(const Rect& r, int threadIdx) override {
+		if (shadeOnly) {
+			renderBucketDeferred(r);
+		} else if (scene.adaptiveAA) {
+			renderBucketAdaptive(r);
+		} else if (scene.usePackets) {
+			renderBucketPackets(r);
+		} else {
+			renderBucketScalar(r);
+		}
+		// The bucket is still in cache, convert it right away instead of in a separate pass over the frame
+		if (scene.outputLDR) {
+			tonemapRect(c.buffer, c.ldr, c.width, Rect(r.x0 - originX, r.y0 - originY, r.x1 - originX, r.y1 - originY), scene.tonemap);
+		}
+	}
+private:
+	// Traces the whole bucket first and then shades its hits grouped by material
+	void renderBucketScalar(const Rect& r) {
+		// One stream per thread for all buckets, it only grows when a bucket is larger than before
+		thread_local RayStream rays;
+		scene.cam.getCameraRays(r, rays, jitterX, jitterY);
+		ShadingBatch batch;
+		for (int y=r.y0; y < r.y1; y++) {
+			for (int x = r.x0; x < r.x1; x++) {
+				const Ray& ray = rays.getRay(x - r.x0, y - r.y0);
+				IntersectionInfo info;
+				scene.intersect(ray, info);
+
+				if (info.isValid()) {
+					batch.add(info, ray, x, y);
+					STATS_ADD(STAT_HITS, 1);
+				} else {
+					STATS_ADD(STAT_MISSES, 1);
+					storeMiss(x, y, ray);
+				}
+			}
+		}
+		storeBatch(batch);
+	}
+
+	// Shades the hits the G-buffer has for the bucket, nothing is traced
+	void renderBucketDeferred(const Rect& r) {
+		Ray ray;
+		ray.origin = scene.cam.getPos();
+		ray.depth = 0;
+		ShadingBatch batch;
+		for (int y = r.y0; y < r.y1; y++) {
+			for (int x = r.x0; x < r.x1; x++) {
+				const GBuffer::Pixel& pixel = gbuffer->get(x, y);
+				if (pixel.info.isValid()) {
+					ray.dir = pixel.dir;
+					batch.add(pixel.info, ray, x, y);
+				} else {
+					storeSample(x, y, backgroundColor());
+				}
+			}
+		}
+		storeBatch(batch);
+	}
+
+	// Shades the hits of the batch and stores their colors in their pixels. The G-buffer gets
+	// the hits with their attributes, which also keeps the ones a changed material asked for.
+	void storeBatch(ShadingBatch& batch) {
+		std::vector<Color> colors(batch.size());
+		batch.shade(scene.sampler, seed, colors.data());
+		for (int i = 0; i < batch.size(); i++) {
+			const ShadingBatch::Hit& hit = batch.getHit(i);
+			storeSample(hit.x, hit.y, colors[i]);
+			if (gbuffer) {
+				gbuffer->store(hit.x, hit.y, hit.info, hit.ray.dir);
+			}
+		}
+	}
+
+	// Stores the background for a camera ray that left the scene
+	void storeMiss(int x, int y, const Ray& ray) {
+		storeSample(x, y, backgroundColor());
+		if (gbuffer) {
+			gbuffer->store(x, y, IntersectionInfo(), ray.dir);
+		}
+	}
+
+	void storeSample(int x, int y, const Color& col) {
+		STATS_ADD(STAT_SAMPLES, 1);
+		c.buffer[(y - originY)*c.width + x - originX] = accum ? accum->addSample(x, y, col) : col;
+	}
+
+	// Traces the bucket in PACKET_W x PACKET_H blocks of pixels. Visibility is resolved for the
+	// whole packet at once, the hits are shaded together grouped by material after the bucket.
+	void renderBucketPackets(const Rect& r) {
+		const vfloat laneX = packetLaneX();
+		const vfloat laneY = packetLaneY();
+		ShadingBatch batch;
+		for (int y = r.y0; y < r.y1; y += PACKET_H) {
+			for (int x = r.x0; x < r.x1; x += PACKET_W) {
+				RayPacket packet;
+				scene.cam.getCameraRays(x, y, packet, jitterX, jitterY);
+				// Mask out the lanes that fall outside of the bucket
+				packet.active = (vfloat(float(x)) + laneX < vfloat(float(r.x1))) & (vfloat(float(y)) + laneY < vfloat(float(r.y1)));
+
+				PacketHit hit;
+				scene.intersect(packet, hit);
+
+				const int activeBits = packet.active.bits();
+				const int hitBits = hit.hitMask().bits();
+				for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+					if (!((activeBits >> lane) & 1)) continue;
+					const int px = x + lane % PACKET_W;
+					const int py = y + lane / PACKET_W;
+					const Ray ray = packet.getRay(lane);
+					IntersectionInfo info;
+					if ((hitBits >> lane) & 1) {
+						info.distSq = sqr(getLane(hit.t, lane));
+						info.primId = hit.primId[lane];
+					}
+					scene.intersectMeshes(ray, info);
+					if (info.isValid()) {
+						batch.add(info, ray, px, py);
+						STATS_ADD(STAT_HITS, 1);
+					} else {
+						STATS_ADD(STAT_MISSES, 1);
+						storeMiss(px, py, ray);
+					}
+				}
+			}
+		}
+		storeBatch(batch);
+	}
+
+	// Traces and shades one primary ray through the point (x, y) of the image plane
+	Color traceSample(float x, float y, PixelSampler& sampler) {
+		const Ray ray = scene.cam.getCameraRay(x, y);
+		IntersectionInfo info;
+		scene.intersect(ray, info);
+		if (info.isValid()) {
+			STATS_ADD(STAT_HITS, 1);
+			return shade(ray, info, 0, &sampler);
+		}
+		STATS_ADD(STAT_MISSES, 1);
+		return backgroundColor();
+	}
+
+	// Adds 'count' more samples of pixel (x, y), continuing its sample sequence
+	void addPixelSamples(PixelEstimator& pixel, int x, int y, int count) {
+		const float exposure = scene.tonemap.exposure;
+		for (int i = 0; i < count; i++) {
+			PixelSampler sampler(scene.sampler, x, y, uint32(pixel.count), seed);
+			float u, v;
+			sampler.get2D(u, v);
+			const Color col = traceSample(float(x) + u, float(y) + v, sampler);
+			// Converge on what ends up on screen, differences above white are clamped away anyway
+			const float lum = 0.2126f * col.r + 0.7152f * col.g + 0.0722f * col.b;
+			pixel.add(col, Min(lum * exposure, 1.f));
+		}
+	}
+
+	// Adaptive supersampling, see AntialiasSettings. Always traces scalar rays, the pixels that
+	// are refined are too scattered for packets.
+	// The first round also covers a one pixel border around the bucket, so the neighbour test sees
+	// the same values on both sides of a bucket edge and does not leave seams.
+	void renderBucketAdaptive(const Rect& r) {
+		const AntialiasSettings& aa = scene.antialias;
+		const int minSamples = Max(aa.minSamples, 1);
+		const int maxSamples = Max(aa.maxSamples, minSamples);
+		const Rect outer(Max(r.x0 - 1, 0), Max(r.y0 - 1, 0), Min(r.x1 + 1, scene.cam.getWidth()), Min(r.y1 + 1, scene.cam.getHeight()));
+		const int w = outer.width();
+
+		std::vector<PixelEstimator> pixels(outer.area());
+		for (int y = outer.y0; y < outer.y1; y++) {
+			for (int x = outer.x0; x < outer.x1; x++) {
+				addPixelSamples(pixels[(y - outer.y0) * w + x - outer.x0], x, y, minSamples);
+			}
+		}
+
+		// Pixels whose samples disagree, or that differ from a neighbour by more than the contrast
+		// threshold, which catches edges and thin features all first round samples missed
+		std::vector<int> refine;
+		for (int y = r.y0; y < r.y1; y++) {
+			for (int x = r.x0; x < r.x1; x++) {
+				const int idx = (y - outer.y0) * w + x - outer.x0;
+				const PixelEstimator& pixel = pixels[idx];
+				bool uncertain = pixel.getError() > aa.threshold;
+				const float lum = pixel.getMeanLuminance();
+				if (x > outer.x0)     uncertain |= fabsf(lum - pixels[idx - 1].getMeanLuminance()) > aa.contrast;
+				if (x < outer.x1 - 1) uncertain |= fabsf(lum - pixels[idx + 1].getMeanLuminance()) > aa.contrast;
+				if (y > outer.y0)     uncertain |= fabsf(lum - pixels[idx - w].getMeanLuminance()) > aa.contrast;
+				if (y < outer.y1 - 1) uncertain |= fabsf(lum - pixels[idx + w].getMeanLuminance()) > aa.contrast;
+				if (uncertain && pixel.count < maxSamples) {
+					refine.push_back(idx);
+				}
+			}
+		}
+
+		// Every round keeps only the pixels that are still above the threshold
+		while (!refine.empty()) {
+			int numLeft = 0;
+			for (int i = 0; i < int(refine.size()); i++) {
+				const int idx = refine[i];
+				PixelEstimator& pixel = pixels[idx];
+				addPixelSamples(pixel, outer.x0 + idx % w, outer.y0 + idx / w, Min(minSamples, maxSamples - pixel.count));
+				if (pixel.count < maxSamples && pixel.getError() > aa.threshold) {
+					refine[numLeft++] = idx;
+				}
+			}
+			refine.resize(numLeft);
+		}
+
+		for (int y = r.y0; y < r.y1; y++) {
+			for (int x = r.x0; x < r.x1; x++) {
+				storeSample(x, y, pixels[(y - outer.y0) * w + x - outer.x0].getMean());
+			}
+		}
+	}
+
+	Canvas& c;
+	ProgressiveBuffer* accum;
+	float jitterX, jitterY;
+	uint32 seed;
+	GBuffer* gbuffer;
+	bool shadeOnly;
+	int originX, originY;
+};
+
+struct MultiThreadedRender : a7az0th::MultiThreadedFor {
+	MultiThreadedRender(const std::vector<Rect>& buckets, BucketRenderer& renderer): buckets(buckets), renderer(renderer) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		renderer.renderBucket(buckets[index], threadIdx);
+	}
+private:
+	const std::vector<Rect>& buckets;
+	BucketRenderer& renderer;
+};
+
+// Collects the buckets that can see the changes to the scene after revision 'since'. Returns false
+// if the extent of some change is not known, then all of them have to be rendered.
+static bool findChangedBuckets(Scene& scene, uint32 since, std::vector<Rect>& changed) {
+	BBox bounds;
+	if (!scene.changes.getChanges(since, scene.revision, bounds)) {
+		return false;
+	}
+	changed.clear();
+	if (bounds.isEmpty()) {
+		return true;
+	}
+	float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+	for (int i = 0; i < 8; i++) {
+		const Vector corner((i & 1) ? bounds.vmax.x : bounds.vmin.x, (i & 2) ? bounds.vmax.y : bounds.vmin.y, (i & 4) ? bounds.vmax.z : bounds.vmin.z);
+		float x, y;
+		if (!scene.cam.project(corner, x, y)) {
+			// The box reaches behind the camera, it may cover any pixel
+			changed = scene.buckets;
+			return true;
+		}
+		x0 = Min(x0, x);
+		y0 = Min(y0, y);
+		x1 = Max(x1, x);
+		y1 = Max(y1, y);
+	}
+	// The rays go through the pixel corners, widen by a pixel so rounding cannot lose an edge
+	const Rect r(int(floorf(x0)) - 1, int(floorf(y0)) - 1, int(floorf(x1)) + 2, int(floorf(y1)) + 2);
+	for (int i = 0; i < int(scene.buckets.size()); i++) {
+		const Rect& b = scene.buckets[i];
+		if (b.x0 < r.x1 && r.x0 < b.x1 && b.y0 < r.y1 && r.y0 < b.y1) {
+			changed.push_back(b);
+		}
+	}
+	return true;
+}
+
+static void renderBuckets(Scene& scene, BucketRenderer& bucketRenderer) {
+	if (scene.adaptiveBuckets) {
+		scene.scheduler.run(scene.buckets, bucketRenderer, scene.threadman, scene.numThreads);
+	} else {
+		MultiThreadedRender renderer(scene.buckets, bucketRenderer);
+		renderer.run(scene.threadman, int(scene.buckets.size()), scene.numThreads);
+	}
+}
+
+void raytrace(Scene& scene) {
+	a7az0th::Timer frameTimer;
+	ProgressiveBuffer* accum = nullptr;
+	float jitterX = 0.f, jitterY = 0.f;
+	if (scene.progressive) {
+		accum = &scene.accum;
+		accum->beginPass(scene.c->width, scene.c->height, scene.cam.getRevision(), scene.revision, jitterX, jitterY);
+	}
+
+	// Progressive passes draw new supersampling patterns, otherwise every pass would repeat the first
+	const uint32 seed = accum ? uint32(accum->getSamplesPerPixel()) : 0;
+	SceneBucketRenderer bucketRenderer(*scene.c, accum, jitterX, jitterY, seed);
+	// Jittered or supersampled rays differ from frame to frame, there is nothing to keep
+	const bool repeatable = !scene.progressive && !scene.adaptiveAA && !scene.pathTracing;
+	GBuffer* gbuffer = nullptr;
+	bool shadeOnly = false;
+	if (scene.deferredShading && repeatable) {
+		gbuffer = &scene.gbuffer;
+		shadeOnly = gbuffer->beginFrame(scene.c->width, scene.c->height, scene.cam.getRevision(), scene.geometryRevision);
+		bucketRenderer.setGBuffer(gbuffer, shadeOnly);
+	}
+
+	// An incremental frame keeps the canvas and renders only the buckets the changes can affect.
+	// A G-buffer that has to be filled again needs the whole frame.
+	Canvas& c = *scene.c;
+	std::vector<Rect> changed;
+	const bool partial = scene.incremental && repeatable && !scene.tracer && (!gbuffer || shadeOnly) &&
+		c.complete && (c.ldrValid || !scene.outputLDR) && c.cameraRevision == scene.cam.getRevision() && findChangedBuckets(scene, c.sceneRevision, changed);
+	scene.stats.numBuckets = partial ? int(changed.size()) : int(scene.buckets.size());
+
+	if (partial) {
+		MultiThreadedRender renderer(changed, bucketRenderer);
+		renderer.run(scene.threadman, int(changed.size()), scene.numThreads);
+	} else if (scene.pathTracing) {
+		// Works on whole waves of pixels instead of buckets, there is nothing to trace per bucket
+		scene.integrator.render(scene, accum, seed);
+	} else if (scene.tracer) {
+		scene.tracer->beginFrame(scene.numThreads);
+		TracingBucketRenderer tracingRenderer(bucketRenderer, *scene.tracer);
+		renderBuckets(scene, tracingRenderer);
+		scene.tracer->endFrame();
+	} else {
+		renderBuckets(scene, bucketRenderer);
+	}
+
+	if (accum) {
+		accum->endPass(scene.threadman, scene.numThreads);
+	}
+	if (gbuffer) {
+		gbuffer->endFrame();
+	}
+	scene.c->ldrValid = scene.outputLDR;
+	c.complete = repeatable;
+	c.cameraRevision = scene.cam.getRevision();
+	c.sceneRevision = scene.revision;
+
+	frameTimer.stop();
+	scene.stats.counters = collectFrameStats();
+	scene.stats.frameMs = frameTimer.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+	scene.stats.frame++;
+}
+
+void raytraceBuckets(Scene& scene, const std::vector<Rect>& buckets) {
+	SceneBucketRenderer bucketRenderer(*scene.c);
+	MultiThreadedRender renderer(buckets, bucketRenderer);
+	renderer.run(scene.threadman, int(buckets.size()), scene.numThreads);
+}
+
+// Renders every bucket into a tile canvas of the writer and queues it for writing
+struct TiledBucketRenderer : BucketRenderer {
+	TiledBucketRenderer(TiledImageWriter& out): out(out) {}
+	virtual void renderBucket(const Rect& r, int threadIdx) override {
+		Canvas* tile = out.acquireTile();
+		SceneBucketRenderer renderer(*tile);
+		renderer.setOrigin(r.x0, r.y0);
+		renderer.renderBucket(r, threadIdx);
+		out.submit(tile, r);
+	}
+private:
+	TiledImageWriter& out;
+};
+
+void raytraceTiled(Scene& scene, TiledImageWriter& out) {
+	a7az0th::Timer frameTimer;
+	TiledBucketRenderer bucketRenderer(out);
+	MultiThreadedRender renderer(scene.buckets, bucketRenderer);
+	renderer.run(scene.threadman, int(scene.buckets.size()), scene.numThreads);
+
+	frameTimer.stop();
+	scene.stats.counters = collectFrameStats();
+	scene.stats.frameMs = frameTimer.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+	scene.stats.numBuckets = int(scene.buckets.size());
+	scene.stats.frame++;
+}
+
+void addRandomSpheres(MappableArray<Sphere>& spheres, int count) {
+	Xoroshiro128 rng(42);
+	const float radius = Max(0.02f, 0.5f / cbrtf(float(Max(count, 1)) / 1000.f + 1.f));
+	for (int i = 0; i < count; i++) {
+		const Vector pos(rng.getRange(-8.f, 8.f), rng.getRange(2.f, 20.f), rng.getRange(-6.f, 6.f));
+		spheres.push_back(Sphere(pos, radius * rng.getRange(0.5f, 1.f)));
+	}
+}
+
+void addRandomLights(std::vector<Light>& lights, int count, float totalIntensity) {
+	Xoroshiro128 rng(7);
+	lights.clear();
+	float sum = 0.f;
+	for (int i = 0; i < count; i++) {
+		const Vector pos(rng.getRange(-8.f, 8.f), rng.getRange(-8.f, 12.f), rng.getRange(-8.f, -3.f));
+		const Color col(rng.getRange(0.5f, 1.f), rng.getRange(0.5f, 1.f), rng.getRange(0.5f, 1.f));
+		// A few bright lights among many dim ones, the kind of spread the alias table is for
+		const float weight = powf(rng.nextFloat(), 4.f) + 0.01f;
+		lights.push_back(Light::sphere(pos, rng.getRange(0.1f, 0.5f), col, weight));
+		sum += weight;
+	}
+	for (int i = 0; i < count; i++) {
+		lights[i].intensity *= totalIntensity / sum;
+	}
+}
+
+void animateLight() {
+	static float angle = 0.f;
+	const float radius = 5.f;
+	const float x = cosf(angle)*radius;
+	const float y = sinf(angle)*radius;
+
+	angle += pi() / 80.f;
+	if (angle > pi()*2.f) {
+		angle -= pi()*2.f;
+	}
+
+	if (scene.lights.empty()) {
+		return;
+	}
+	moveLight(scene, 0, Vector(x, y, -5));
+}
+
+void animateSphere() {
+	static float angle = 0.f;
+	const float radius = 1.f;
+	const float step = radius * pi() / 80.f;
+	const Vector delta(-sinf(angle) * step, 0.f, cosf(angle) * step);
+
+	angle += pi() / 80.f;
+	if (angle > pi()*2.f) {
+		angle -= pi()*2.f;
+	}
+
+	if (scene.spheres.empty()) {
+		return;
+	}
+	const int idx = int(scene.spheres.size()) - 1;
+	moveSphere(scene, idx, scene.spheres[idx].getPos() + delta);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "scene.h"
+#include "shading.h"
+
+#include <vector>
+
+class TiledImageWriter;
+
+// Splits the canvas into BUCKET_SIZE x BUCKET_SIZE buckets, ordered in a serpentine pattern
+void initBuckets(Canvas& c, std::vector<Rect>& buckets, const int BUCKET_SIZE = 32);
+// Same for a width x height image without a canvas
+void initBuckets(int width, int height, std::vector<Rect>& buckets, const int BUCKET_SIZE = 32);
+
+// Renders all buckets of the scene into its canvas using scene.numThreads threads.
+// With scene.adaptiveBuckets the buckets are further split and balanced by scene.scheduler.
+// With scene.adaptiveAA every pixel gets between scene.antialias.minSamples and maxSamples samples,
+// depending on how much they vary.
+// With scene.pathTracing the frame is rendered by scene.integrator instead, see WavefrontIntegrator.
+// With scene.progressive every call adds one more sample per pixel to scene.accum and the canvas
+// receives the average.
+// With scene.deferredShading and neither of the two above the camera ray hits are kept in
+// scene.gbuffer, and the frames after the first only shade them again until the camera or the
+// objects change.
+// With scene.incremental a canvas that already holds a frame of the same view only gets the
+// buckets re-rendered that the changes since then can affect, see ChangeLog. Not with the
+// accumulation, the supersampling or the path tracer, whose frames are not repeatable.
+// The counters and the duration of the call are stored in scene.stats.
+void raytrace(Scene& scene);
+
+// Renders only the given buckets of the canvas, one task per bucket on scene.numThreads threads.
+// Progressive accumulation and path tracing need the whole frame and are not used, nor are the
+// tracer and the stats of raytrace. Renders the buckets handed out by a ClusterCoordinator.
+void raytraceBuckets(Scene& scene, const std::vector<Rect>& buckets);
+
+// Renders the frame into a tiled image file instead of scene.c, which is not used, see
+// TiledImageWriter. scene.buckets must be the tiles of the writer, as initBuckets makes them
+// with its tile size. The buckets are tonemapped when scene.outputLDR is set. Only the direct
+// bucket renderer is used, with or without supersampling; progressive accumulation, path tracing,
+// the G-buffer, incremental frames and the tracer need the frame in memory and are ignored.
+// Fills scene.stats like raytrace.
+void raytraceTiled(Scene& scene, TiledImageWriter& out);
+
+// Scatters 'count' small spheres in a slab behind the default sphere. Uses a fixed seed so every
+// run gets the same scene, shared by the batch renderer and the benchmarks.
+void addRandomSpheres(MappableArray<Sphere>& spheres, int count);
+
+// Replaces the lights with 'count' small sphere lights of random color and brightness, scattered
+// above the scene with a fixed seed. Their intensities add up to totalIntensity.
+void addRandomLights(std::vector<Light>& lights, int count, float totalIntensity);
+
+// Moves the first light of the scene one step along its circular path around the sphere.
+// Called once per frame by both the interactive viewer and the batch renderer, unless they
+// accumulate progressively.
+void animateLight();
+
+// Moves the last sphere one step along a small circle, for testing incremental frames
+void animateSphere();
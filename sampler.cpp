@@ -0,0 +1,139 @@
+#include "sampler.h"
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+bool parseSamplerType(const char* name, SamplerType& type) {
+	if (!strcmp(name, "random")) {
+		type = SAMPLER_RANDOM;
+	} else if (!strcmp(name, "sobol")) {
+		type = SAMPLER_SOBOL;
+	} else if (!strcmp(name, "bluenoise")) {
+		type = SAMPLER_BLUE_NOISE;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+namespace {
+
+const int MASK_PIXELS = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+const int KERNEL_RADIUS = 7; //< The Gaussian is below 1e-5 further out
+const float KERNEL_SIGMA = 1.5f;
+
+// Void-and-cluster (Ulichney 1993). A binary pattern is kept together with the Gaussian filtered
+// density of its set pixels, wrapping around the edges so the mask tiles. The densest set pixel
+// is the tightest cluster, the emptiest free pixel the largest void. Ranking the pixels in the
+// order clusters are removed and voids filled gives a threshold mask whose every level is a well
+// spread pattern.
+struct VoidAndCluster {
+	std::vector<uint8> pattern;
+	std::vector<float> energy;
+	float kernel[2 * KERNEL_RADIUS + 1][2 * KERNEL_RADIUS + 1];
+
+	VoidAndCluster(): pattern(MASK_PIXELS, 0), energy(MASK_PIXELS, 0.f) {
+		for (int dy = -KERNEL_RADIUS; dy <= KERNEL_RADIUS; dy++) {
+			for (int dx = -KERNEL_RADIUS; dx <= KERNEL_RADIUS; dx++) {
+				kernel[dy + KERNEL_RADIUS][dx + KERNEL_RADIUS] = expf(-float(dx*dx + dy*dy) / (2.f * KERNEL_SIGMA * KERNEL_SIGMA));
+			}
+		}
+	}
+
+	void splat(int p, float sign) {
+		const int px = p % BLUE_NOISE_SIZE;
+		const int py = p / BLUE_NOISE_SIZE;
+		for (int dy = -KERNEL_RADIUS; dy <= KERNEL_RADIUS; dy++) {
+			const int y = (py + dy) & (BLUE_NOISE_SIZE - 1);
+			for (int dx = -KERNEL_RADIUS; dx <= KERNEL_RADIUS; dx++) {
+				const int x = (px + dx) & (BLUE_NOISE_SIZE - 1);
+				energy[y * BLUE_NOISE_SIZE + x] += sign * kernel[dy + KERNEL_RADIUS][dx + KERNEL_RADIUS];
+			}
+		}
+	}
+
+	void set(int p) { pattern[p] = 1; splat(p, 1.f); }
+	void clear(int p) { pattern[p] = 0; splat(p, -1.f); }
+
+	// Set pixel with the highest density when 'value' is 1, free pixel with the lowest when it is 0
+	int find(uint8 value) const {
+		int best = -1;
+		for (int p = 0; p < MASK_PIXELS; p++) {
+			if (pattern[p] != value) continue;
+			if (best < 0 || (value ? energy[p] > energy[best] : energy[p] < energy[best])) {
+				best = p;
+			}
+		}
+		return best;
+	}
+};
+
+std::vector<float> buildBlueNoiseMask() {
+	std::vector<int> rank(MASK_PIXELS, 0);
+
+	// Initial pattern: random pixels, then moved from clusters into voids until it is even
+	VoidAndCluster initial;
+	Xoroshiro128 rng(0xb1ae);
+	const int numInitial = MASK_PIXELS / 10;
+	for (int placed = 0; placed < numInitial; ) {
+		const int p = int(rng.next() % MASK_PIXELS);
+		if (!initial.pattern[p]) {
+			initial.set(p);
+			placed++;
+		}
+	}
+	for (int iter = 0; iter < MASK_PIXELS; iter++) {
+		const int cluster = initial.find(1);
+		initial.clear(cluster);
+		const int hole = initial.find(0);
+		initial.set(hole);
+		if (hole == cluster) {
+			break;
+		}
+	}
+
+	// Phase 1: the initial pixels get the lowest ranks, the tightest cluster is removed last
+	VoidAndCluster vc = initial;
+	for (int r = numInitial - 1; r >= 0; r--) {
+		const int cluster = vc.find(1);
+		vc.clear(cluster);
+		rank[cluster] = r;
+	}
+
+	// Phase 2: fill the largest voids up to half of the pixels
+	vc = initial;
+	int r = numInitial;
+	for (; r < MASK_PIXELS / 2; r++) {
+		const int hole = vc.find(0);
+		vc.set(hole);
+		rank[hole] = r;
+	}
+
+	// Phase 3: the free pixels are now the minority, continue with the density of the free pixels
+	// and fill their tightest clusters
+	VoidAndCluster inverse;
+	for (int p = 0; p < MASK_PIXELS; p++) {
+		if (!vc.pattern[p]) {
+			inverse.set(p);
+		}
+	}
+	for (; r < MASK_PIXELS; r++) {
+		const int cluster = inverse.find(1);
+		inverse.clear(cluster);
+		rank[cluster] = r;
+	}
+
+	std::vector<float> mask(MASK_PIXELS);
+	for (int p = 0; p < MASK_PIXELS; p++) {
+		mask[p] = (float(rank[p]) + 0.5f) / float(MASK_PIXELS);
+	}
+	return mask;
+}
+
+} // namespace
+
+const float* getBlueNoiseMask() {
+	static const std::vector<float> mask = buildBlueNoiseMask();
+	return mask.data();
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "random.h"
+#include "defs.h"
+
+enum SamplerType {
+	SAMPLER_RANDOM, //< Independent random numbers
+	SAMPLER_SOBOL, //< Owen scrambled Sobol points, stratified in every pair of dimensions
+	SAMPLER_BLUE_NOISE, //< Low discrepancy sequence shifted by a blue noise mask, the error of neighbouring pixels is uncorrelated
+};
+
+// Parses "random", "sobol" or "bluenoise". Returns false for anything else.
+bool parseSamplerType(const char* name, SamplerType& type);
+
+inline uint32 reverseBits(uint32 x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// The hash of Laine and Karras on a bit reversed fraction, the lowest bit is the most significant
+// one of the fraction. Every bit only depends on the bits below it.
+inline uint32 laineKarrasHash(uint32 x, uint32 seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Nested uniform (Owen) scrambling of the binary fraction 'x' with the hash of Laine and Karras.
+// Every bit is flipped depending only on the bits above it, so points that share a power of two
+// interval before the scrambling still share one afterwards and the stratification is kept.
+inline uint32 owenScramble(uint32 x, uint32 seed) {
+	return reverseBits(laineKarrasHash(reverseBits(x), seed));
+}
+
+// Second dimension of the Sobol sequence for 'index', bit reversed: bit i is the digit of 2^-(i+1).
+// The generator matrix is Pascal's triangle mod 2, so digit i is the XOR of the index bits j with
+// binomial(j, i) odd, which by Lucas' theorem are the j that have every bit of i set. Five shifts
+// fold those in for all 32 digits at once, without a loop or a branch.
+inline uint32 sobolSecondReversed(uint32 index) {
+	uint32 x = index;
+	x ^= (x >> 1) & 0x55555555u;
+	x ^= (x >> 2) & 0x33333333u;
+	x ^= (x >> 4) & 0x0f0f0f0fu;
+	x ^= (x >> 8) & 0x00ff00ffu;
+	x ^= (x >> 16) & 0x0000ffffu;
+	return x;
+}
+
+// The first two dimensions of the Sobol sequence as 32 bit fractions. Every aligned block of 4^k
+// consecutive points puts one point into each cell of a 2^k x 2^k grid.
+inline void sobol2D(uint32 index, uint32& bitsU, uint32& bitsV) {
+	bitsU = reverseBits(index);
+	bitsV = reverseBits(sobolSecondReversed(index));
+}
+
+// Point 'index' of the 2D Sobol sequence with Owen scrambling seeded by 'seed'.
+// The index is shuffled with the same scrambling, which only reorders points within aligned power
+// of two blocks, so any 4^k consecutive samples starting at a multiple of 4^k remain stratified.
+// Same as scrambling the results of sobol2D, but the hashes work on the bit reversed values
+// directly, which saves six of the ten bit reversals.
+inline void sobolOwen2D(uint32 index, uint32 seed, float& u, float& v) {
+	const uint32 shuffled = owenScramble(index, seed);
+	u = toUnitFloat(reverseBits(laineKarrasHash(shuffled, hashCombine(seed, 1))));
+	v = toUnitFloat(reverseBits(laineKarrasHash(sobolSecondReversed(shuffled), hashCombine(seed, 2))));
+}
+
+// One dimensional version, a scrambled van der Corput sequence
+inline float sobolOwen1D(uint32 index, uint32 seed) {
+	return toUnitFloat(reverseBits(laineKarrasHash(owenScramble(index, seed), hashCombine(seed, 1))));
+}
+
+// Side of the tileable blue noise mask
+const int BLUE_NOISE_SIZE = 64;
+
+// Returns the BLUE_NOISE_SIZE x BLUE_NOISE_SIZE blue noise threshold mask, values uniform in [0, 1).
+// Computed with void-and-cluster on first use, about 30 milliseconds, and shared by all threads.
+const float* getBlueNoiseMask();
+
+// The random numbers of one sample of one pixel, a value of every dimension the sample needs
+// (position in the pixel, light choice, point on the light, bounce direction and so on).
+// Value 'dimension' of sample 'sampleIdx' of pixel (x, y) depends on nothing else, so images are
+// the same however the pixels are spread over the threads, and a sample can be resumed later
+// from just its dimension.
+// Every call takes the next dimension. get2D returns two dimensions that are stratified together.
+struct PixelSampler {
+	PixelSampler(SamplerType type, int x, int y, uint32 sampleIdx, uint32 seed = 0, uint32 dimension = 0)
+		: type(type), x(x), y(y), sampleIdx(sampleIdx), seed(seed), pixelSeed(hashPixel(x, y, seed)), dimension(dimension) {}
+
+	float get1D() {
+		const uint32 dim = dimension++;
+		switch (type) {
+		case SAMPLER_SOBOL:
+			return sobolOwen1D(sampleIdx, hashCombine(pixelSeed, dim));
+		case SAMPLER_BLUE_NOISE: {
+			// Golden ratio sequence over the samples, shifted by the mask
+			const float shift = blueNoise(dim, 0);
+			const float value = shift + float(sampleIdx) * 0.6180339887f;
+			return value - floorf(value);
+		}
+		default: {
+			uint32 state = hashCombine(hashCombine(pixelSeed, dim), sampleIdx);
+			return nextRandom(state);
+		}
+		}
+	}
+
+	void get2D(float& u, float& v) {
+		const uint32 dim = dimension++;
+		switch (type) {
+		case SAMPLER_SOBOL:
+			sobolOwen2D(sampleIdx, hashCombine(pixelSeed, dim), u, v);
+			break;
+		case SAMPLER_BLUE_NOISE: {
+			// R2 sequence over the samples, shifted by two differently placed copies of the mask
+			const float su = blueNoise(dim, 0) + float(sampleIdx) * 0.7548776662f;
+			const float sv = blueNoise(dim, 1) + float(sampleIdx) * 0.5698402910f;
+			u = su - floorf(su);
+			v = sv - floorf(sv);
+			break;
+		}
+		default: {
+			uint32 state = hashCombine(hashCombine(pixelSeed, dim), sampleIdx);
+			u = nextRandom(state);
+			v = nextRandom(state);
+			break;
+		}
+		}
+	}
+
+	SamplerType type;
+	int x, y;
+	uint32 sampleIdx;
+	uint32 seed;
+	uint32 pixelSeed; //< Hash of the pixel and the seed
+	uint32 dimension; //< Next dimension to hand out
+
+private:
+	// Mask value of the pixel, with the mask shifted differently for every dimension so the
+	// dimensions are not correlated. The shift does not depend on the pixel, which is what keeps
+	// the values of neighbouring pixels apart.
+	float blueNoise(uint32 dim, uint32 component) const {
+		const uint32 h = hashCombine(seed, dim * 2 + component);
+		const int mx = (x + int(h & (BLUE_NOISE_SIZE - 1))) & (BLUE_NOISE_SIZE - 1);
+		const int my = (y + int((h >> 8) & (BLUE_NOISE_SIZE - 1))) & (BLUE_NOISE_SIZE - 1);
+		return getBlueNoiseMask()[my * BLUE_NOISE_SIZE + mx];
+	}
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "color.h"
+#include "camera.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "changelog.h"
+#include "mesh.h"
+#include "defs.h"
+#include "rect.h"
+#include "scheduler.h"
+#include "gbuffer.h"
+#include "progressive.h"
+#include "tonemap.h"
+#include "antialias.h"
+#include "sampler.h"
+#include "material.h"
+#include "texture.h"
+#include "light.h"
+#include "wavefront.h"
+#include "trace.h"
+#include "stats.h"
+#include "mappablearray.h"
+#include "mappedfile.h"
+
+#include "threadman.h"
+
+#include <vector>
+
+struct Canvas {
+	Canvas(int width, int height): width(width), height(height) {
+		buffer = new Color[width*height];
+		ldr = new uint32[width*height];
+		ldrValid = false;
+		complete = false;
+		cameraRevision = sceneRevision = 0;
+	}
+	~Canvas() {
+		delete [] buffer;
+		delete [] ldr;
+		buffer = nullptr;
+		ldr = nullptr;
+		width = height = 0;
+	}
+
+	int width;
+	int height;
+	Color *buffer;
+	uint32 *ldr; //< Tonemapped 8-bit RGBA copy of buffer, filled bucket by bucket when Scene::outputLDR is set
+	bool ldrValid; //< True if ldr holds the last rendered frame
+	bool complete; //< The buffer holds a whole frame of the bucket renderer, which incremental frames can update
+	uint32 cameraRevision; //< Revisions of the camera and the scene the buffer shows
+	uint32 sceneRevision;
+};
+
+struct Scene {
+	Scene() {
+		numThreads = a7az0th::getProcessorCount();
+		usePackets = false;
+		adaptiveBuckets = false;
+		progressive = false;
+		adaptiveAA = false;
+		pathTracing = false;
+		deferredShading = false;
+		incremental = false;
+		outputLDR = false;
+		tracer = nullptr;
+		revision = 0;
+		geometryRevision = 0;
+		lightSamples = 1;
+		sampler = SAMPLER_SOBOL;
+		materials.push_back(Material());
+		lights.push_back(Light());
+		lightSampler.build(lights);
+	}
+
+	a7az0th::ThreadManager threadman;
+	int numThreads;
+	bool usePackets; //< Trace primary rays in SIMD packets instead of one by one
+	bool adaptiveBuckets; //< Render through the work stealing scheduler instead of one task per bucket
+	bool progressive; //< Accumulate jittered samples in accum for as long as the view does not change
+	bool adaptiveAA; //< Supersample every pixel as controlled by antialias, instead of one ray through its corner
+	AntialiasSettings antialias;
+	bool pathTracing; //< Render with the wavefront path tracer instead of the direct bucket renderer
+	WavefrontSettings wavefront;
+	bool deferredShading; //< Keep the camera ray hits in gbuffer and only shade them again while the view and the objects stay the same
+	bool incremental; //< Only re-render the buckets the changes since the canvas was rendered can affect, see ChangeLog
+	uint32 revision; //< Incremented by markChanged, resets the progressive accumulation
+	uint32 geometryRevision; //< Incremented by markGeometryChanged, invalidates gbuffer
+	bool outputLDR; //< Convert every finished bucket to 8-bit with the tonemap settings
+	TonemapSettings tonemap;
+	FrameTracer* tracer; //< Records the timing of every bucket when set, owned by the caller
+	FrameStats stats; //< Counters of the last raytrace call
+
+	Camera cam;
+	MappedFile compiledScene; //< Compiled scene file the objects and accel may point into, see loadScene
+	MappableArray<Sphere> spheres;
+	std::vector<Mesh> meshes;
+	std::vector<Material> materials; //< Starts with the default material every object refers to
+	TextureCache textures; //< Image textures of the materials and the cache of their tiles
+	std::vector<Light> lights; //< Starts with a single point light
+	LightSampler lightSampler; //< Picks the light of every shadow ray, see updateLights
+	int lightSamples; //< Shadow rays per shading point, each towards a light picked by its power
+	SamplerType sampler; //< Where the random numbers of the pixel samples come from
+	BVH accel;
+	Canvas *c;
+	std::vector<Rect> buckets;
+	BucketScheduler scheduler; //< Keeps the bucket costs between frames when adaptiveBuckets is set
+	ProgressiveBuffer accum;
+	GBuffer gbuffer; //< Camera ray hits of the last frame when deferredShading is set
+	ChangeLog changes; //< What the recent revisions changed, for incremental frames
+	WavefrontIntegrator integrator; //< Keeps its ray queues between frames when pathTracing is set
+
+	// Must be called after any change to the objects or the lights that is not done through buildAccelerator
+	void markChanged() { revision++; }
+
+	// Same as markChanged, for a change that can only alter the shading of the points inside
+	// 'bounds'. Incremental frames re-render just the buckets the box covers. See sceneedit.h for
+	// the edits that know their bounds.
+	void markChanged(const BBox& bounds) {
+		revision++;
+		changes.add(revision, bounds);
+	}
+
+	// Must be called after the spheres or the meshes change without buildAccelerator. Lights and
+	// materials are not part of the geometry, changing them only needs markChanged.
+	void markGeometryChanged() {
+		geometryRevision++;
+		markChanged();
+	}
+
+	// Must be called after lights are added or removed, or their color or intensity changes.
+	// Moving a light only needs markChanged.
+	void updateLights() {
+		markChanged();
+		lightSampler.build(lights);
+	}
+
+	// Rebuilds the acceleration structures and the light sampler. Must be called every time the
+	// spheres or the meshes change.
+	void buildAccelerator() {
+		geometryRevision++;
+		updateLights();
+		accel.build(spheres, threadman, numThreads);
+		for (int i = 0; i < int(meshes.size()); i++) {
+			meshes[i].buildAccelerator(threadman, numThreads);
+		}
+	}
+
+	// Material of a hit found by intersect
+	int getMaterialIdx(const IntersectionInfo& info) const {
+		return (info.meshId >= 0) ? meshes[info.meshId].material : spheres[info.primId].material;
+	}
+
+	// Computes the HIT_* attributes in 'attributes' of a hit found by intersect, skipping the ones
+	// it already has. Meant for the final hit only, the intersection itself finds just the distance.
+	void getHitAttributes(const Ray& ray, IntersectionInfo& info, int attributes) const {
+		const int missing = attributes & ~info.attributes;
+		if (!missing) {
+			return;
+		}
+		if (info.meshId >= 0) {
+			meshes[info.meshId].getHitInfo(ray, info, missing);
+		} else {
+			spheres[info.primId].getHitInfo(ray, sqrtf(info.distSq), info, missing);
+		}
+	}
+
+	// Finds the closest intersection of the ray with the objects in the scene.
+	// Only the distance and the primitive are known afterwards, see getHitAttributes.
+	bool intersect(const Ray& ray, IntersectionInfo& info) const {
+		STATS_ADD(STAT_RAYS, 1);
+		const bool hit = accel.intersect(ray, info);
+		return intersectMeshes(ray, info) || hit;
+	}
+
+	// Returns true if anything blocks the ray before maxT. Meant for shadow rays, it stops at the
+	// first hit found instead of looking for the closest one.
+	bool occluded(const Ray& ray, float maxT) const {
+		STATS_ADD(STAT_SHADOW_RAYS, 1);
+		if (accel.occluded(ray, maxT)) {
+			return true;
+		}
+		for (int i = 0; i < int(meshes.size()); i++) {
+			if (meshes[i].occluded(ray, maxT)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Finds the closest intersection of the ray with the meshes only, if it is closer than info
+	bool intersectMeshes(const Ray& ray, IntersectionInfo& info) const {
+		bool hit = false;
+		for (int i = 0; i < int(meshes.size()); i++) {
+			if (meshes[i].intersect(ray, info)) {
+				info.meshId = i;
+				hit = true;
+			}
+		}
+		return hit;
+	}
+	// Packet version, resolves the spheres only. Meshes are handled per lane with intersectMeshes.
+	void intersect(const RayPacket& packet, PacketHit& hit) const {
+		const int active = packet.active.bits();
+		for (int i = 0; i < SIMD_WIDTH; i++) STATS_ADD(STAT_RAYS, (active >> i) & 1);
+		accel.intersect(packet, hit);
+	}
+};
+
+extern Scene scene;
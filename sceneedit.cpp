@@ -0,0 +1,157 @@
+#include "sceneedit.h"
+
+namespace {
+
+// Change of the output below which an edit does not show: half a step of the 8-bit colors
+const float OUTPUT_CUTOFF = 0.5f / 255.f;
+
+// The bounds left by the previous edit if nothing else changed since, otherwise walks all objects
+SurfaceBounds getSurfaceBounds(const Scene& scene) {
+	SurfaceBounds surfaces;
+	if (scene.changes.getSurfaces(scene.revision, surfaces)) {
+		return surfaces;
+	}
+	for (int i = 0; i < int(scene.spheres.size()); i++) {
+		const Sphere& s = scene.spheres[i];
+		surfaces.add(s.getBBox(), scene.materials[s.material]);
+	}
+	for (int i = 0; i < int(scene.meshes.size()); i++) {
+		surfaces.add(scene.meshes[i].getBounds(), scene.materials[scene.meshes[i].material]);
+	}
+	return surfaces;
+}
+
+BBox sphereBox(const Vector& center, float radius) {
+	return BBox(center - Vector(radius, radius, radius), center + Vector(radius, radius, radius));
+}
+
+BBox intersectBoxes(const BBox& a, const BBox& b) {
+	BBox box(Vector(Max(a.vmin.x, b.vmin.x), Max(a.vmin.y, b.vmin.y), Max(a.vmin.z, b.vmin.z)),
+	         Vector(Min(a.vmax.x, b.vmax.x), Min(a.vmax.y, b.vmax.y), Min(a.vmax.z, b.vmax.z)));
+	if (box.vmin.x > box.vmax.x || box.vmin.y > box.vmax.y || box.vmin.z > box.vmax.z) {
+		box.makeEmpty();
+	}
+	return box;
+}
+
+// Center and radius of a sphere around the surface of the light
+void getLightExtent(const Light& light, Vector& center, float& radius) {
+	switch (light.type) {
+	case LIGHT_SPHERE:
+		center = light.pos;
+		radius = light.radius;
+		break;
+	case LIGHT_QUAD:
+		center = light.pos + (light.edge1 + light.edge2) * 0.5f;
+		radius = 0.5f * Max((light.edge1 + light.edge2).length(), (light.edge1 - light.edge2).length());
+		break;
+	default:
+		center = light.pos;
+		radius = 0.f;
+		break;
+	}
+}
+
+// Distance from the center of light 'idx' beyond which it adds less than OUTPUT_CUTOFF to the
+// diffuse shading of any point, assuming colors of at most 1. A light sample is weighted by one
+// over the probability of picking the light, so a dim light among many bright ones reaches as far
+// as a bright one. Sphere lights send at most twice the radiance of a point light at their center.
+float getLightRange(const Scene& scene, int idx) {
+	const Light& light = scene.lights[idx];
+	const float pdf = scene.lightSampler.getPdf(idx);
+	if (pdf <= 0.f) {
+		return 0.f;
+	}
+	const float maxColor = Max(light.col.r, Max(light.col.g, light.col.b));
+	const float scale = (light.type == LIGHT_SPHERE) ? 2.f : 1.f;
+	float cutoff = OUTPUT_CUTOFF / Max(scene.tonemap.exposure, 1e-6f);
+	if (scene.tonemap.srgb) {
+		// The steepest part of the sRGB curve, near black
+		cutoff /= 12.92f;
+	}
+	Vector center;
+	float radius;
+	getLightExtent(light, center, radius);
+	return sqrtf(scale * maxColor * light.intensity / (pdf * cutoff)) + radius;
+}
+
+// Box around the points that a sphere at 'center' can keep from seeing any part of a light within
+// lightRadius of lightCenter, clipped to 'bounds'. The shadow is swept by the sphere moving away
+// from the light, widening by (radius + lightRadius) / dist per unit moved, and ends at the far
+// side of the bounds.
+BBox getShadowBounds(const Vector& center, float radius, const Vector& lightCenter, float lightRadius, const BBox& bounds) {
+	if (bounds.isEmpty()) {
+		return bounds;
+	}
+	const Vector axis = center - lightCenter;
+	const float dist = axis.length();
+	const float spread = radius + lightRadius;
+	if (dist <= spread) {
+		return bounds;
+	}
+	const float reach = (center - bounds.center()).length() + radius + 0.5f * bounds.extent().length();
+	const float s = reach / (dist - spread);
+	BBox box = sphereBox(center, radius);
+	box.add(sphereBox(center + axis * s, radius + spread * s));
+	return intersectBoxes(box, bounds);
+}
+
+// Marks the change confined to 'bounds', plus the mirrors and glass that may show it. 'surfaces'
+// must cover the objects after the edit, the next edit starts from them.
+void markChanged(Scene& scene, BBox bounds, const SurfaceBounds& surfaces) {
+	if (!bounds.isEmpty()) {
+		bounds.add(surfaces.specular);
+	}
+	scene.markChanged(bounds);
+	scene.changes.setSurfaces(scene.revision, surfaces);
+}
+
+} // namespace
+
+void moveLight(Scene& scene, int idx, const Vector& pos) {
+	Light& light = scene.lights[idx];
+	Vector oldCenter, newCenter;
+	float radius;
+	getLightExtent(light, oldCenter, radius);
+	light.pos = pos;
+	getLightExtent(light, newCenter, radius);
+
+	const SurfaceBounds surfaces = getSurfaceBounds(scene);
+	if (surfaces.highlights) {
+		scene.markChanged();
+		scene.changes.setSurfaces(scene.revision, surfaces);
+		return;
+	}
+	const float range = getLightRange(scene, idx);
+	BBox bounds = sphereBox(oldCenter, range);
+	bounds.add(sphereBox(newCenter, range));
+	markChanged(scene, intersectBoxes(bounds, surfaces.all), surfaces);
+}
+
+void moveSphere(Scene& scene, int idx, const Vector& pos) {
+	Sphere& sphere = scene.spheres[idx];
+	const Vector oldPos = sphere.getPos();
+	const float radius = sphere.getRadius();
+	sphere.setPos(pos);
+	scene.accel.updateSphere(idx, sphere);
+	scene.geometryRevision++;
+
+	// The bounds only grow, the old place of the sphere stays covered
+	SurfaceBounds surfaces = getSurfaceBounds(scene);
+	surfaces.add(sphereBox(pos, radius), scene.materials[sphere.material]);
+	BBox bounds = sphereBox(oldPos, radius);
+	bounds.add(sphereBox(pos, radius));
+	for (int i = 0; i < int(scene.lights.size()); i++) {
+		Vector lightCenter;
+		float lightRadius;
+		getLightExtent(scene.lights[i], lightCenter, lightRadius);
+		// Highlights show a shadow at any distance from the light
+		BBox lit = surfaces.all;
+		if (!surfaces.highlights) {
+			lit = intersectBoxes(lit, sphereBox(lightCenter, getLightRange(scene, i)));
+		}
+		bounds.add(getShadowBounds(oldPos, radius, lightCenter, lightRadius, lit));
+		bounds.add(getShadowBounds(pos, radius, lightCenter, lightRadius, lit));
+	}
+	markChanged(scene, bounds, surfaces);
+}
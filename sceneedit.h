@@ -0,0 +1,20 @@
+#pragma once
+
+#include "scene.h"
+
+// Interactive edits that record which part of the scene they affect, so incremental frames only
+// re-render the buckets that see it, see ChangeLog. The bounds are conservative:
+//  - a moved sphere changes what its old and new place look like, and the shadows it cast and
+//    casts now, which are confined to the scene bounds;
+//  - a moved light changes the surfaces within its range, the distance beyond which it adds less
+//    than half a step of the 8-bit output. Phong and Blinn highlights do not fall off with the
+//    distance, with objects that have one the range is unbounded and the whole frame changes;
+//  - mirror and glass objects may show any changed point, they are added to every change.
+
+// Moves light 'idx' so its pos is 'pos' and marks the change
+void moveLight(Scene& scene, int idx, const Vector& pos);
+
+// Moves the center of sphere 'idx' to 'pos', refits the acceleration structure in place and
+// marks the change. Cheaper than buildAccelerator, but traversal slows down a little with every
+// move, rebuild after many.
+void moveSphere(Scene& scene, int idx, const Vector& pos);
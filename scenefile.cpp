@@ -0,0 +1,484 @@
+#include "scenefile.h"
+#include "meshloader.h"
+#include "mappedfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+const uint32 SCENE_FILE_VERSION = 2;
+const uint64 ARRAY_ALIGN = 64; //< Alignment of every array in the compiled file, at least SIMD_ALIGN
+
+struct SceneFileHeader {
+	char magic[4]; //< "CGSC"
+	uint32 version;
+	uint64 textHash; //< Of the scene text
+	uint64 meshHash; //< Of the sizes and modification times of the mesh files
+	int32 simdWidth; //< The sphere arrays of the BVH are padded by that many elements
+	int32 numArrays;
+	uint64 tableOffset; //< The numArrays SceneFileArray entries follow the data
+};
+
+// The first array of the file holds the offsets of the lines of the text that are not spheres,
+// so the other lines are parsed without looking for them among the spheres. The arrays of
+// visitSceneArrays follow.
+
+struct SceneFileArray {
+	uint64 offset; //< From the start of the file
+	uint64 count;
+	uint64 elementSize;
+};
+
+struct MeshEntry {
+	std::string fileName;
+	int material;
+};
+
+// What the text says about the objects besides the spheres, which are only read if the
+// compiled file cannot be used
+struct SceneObjects {
+	std::vector<MeshEntry> meshes;
+	std::unordered_map<std::string, int> materials; //< Index in Scene::materials by name
+};
+
+// Calls visit(array) for every array of the objects and acceleration structures of the scene.
+// The order defines the layout of the compiled file.
+template <class Visitor>
+void visitSceneArrays(Scene& scene, Visitor& visit) {
+	visit(scene.spheres);
+	scene.accel.visitArrays(visit);
+	for (int i = 0; i < int(scene.meshes.size()); i++) {
+		scene.meshes[i].visitArrays(visit);
+	}
+}
+
+// Appends the arrays to the file, each at the next multiple of ARRAY_ALIGN, and collects the table
+struct ArrayWriter {
+	ArrayWriter(FILE* fp, uint64 offset): fp(fp), offset(offset), ok(true) {}
+	template <class T, class Alloc>
+	void operator()(MappableArray<T, Alloc>& array) {
+		static const char zeros[ARRAY_ALIGN] = {};
+		const uint64 padding = (ARRAY_ALIGN - offset % ARRAY_ALIGN) % ARRAY_ALIGN;
+		ok = ok && (padding == 0 || fwrite(zeros, 1, size_t(padding), fp) == padding);
+		offset += padding;
+
+		SceneFileArray entry;
+		entry.offset = offset;
+		entry.count = array.size();
+		entry.elementSize = sizeof(T);
+		table.push_back(entry);
+
+		ok = ok && (array.empty() || fwrite(array.data(), sizeof(T), array.size(), fp) == array.size());
+		offset += entry.count * sizeof(T);
+	}
+	FILE* fp;
+	uint64 offset;
+	std::vector<SceneFileArray> table;
+	bool ok;
+};
+
+// Points the arrays into the mapping, checking every table entry against the file first
+struct ArrayMapper {
+	ArrayMapper(const MappedFile& file, const SceneFileArray* table, int numArrays)
+		: file(file), table(table), numArrays(numArrays), next(0), ok(true) {}
+	template <class T, class Alloc>
+	void operator()(MappableArray<T, Alloc>& array) {
+		if (!ok || next >= numArrays) {
+			ok = false;
+			return;
+		}
+		const SceneFileArray& entry = table[next++];
+		const uint64 size = uint64(file.size());
+		if (entry.elementSize != sizeof(T) || entry.offset % ARRAY_ALIGN != 0 || entry.offset > size ||
+			entry.count > (size - entry.offset) / sizeof(T)) {
+			ok = false;
+			return;
+		}
+		if (entry.count == 0) {
+			array.clear();
+		} else {
+			array.borrow(reinterpret_cast<const T*>(file.data() + entry.offset), size_t(entry.count));
+		}
+	}
+	const MappedFile& file;
+	const SceneFileArray* table;
+	int numArrays;
+	int next;
+	bool ok;
+};
+
+// FNV-1a over 8 byte words, fast enough to run over the whole text at every load
+uint64 hashBytes(const char* data, size_t size, uint64 h = 14695981039346656037ull) {
+	const uint64 prime = 1099511628211ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64 word;
+		memcpy(&word, data + i, sizeof(word));
+		h = (h ^ word) * prime;
+	}
+	for (; i < size; i++) {
+		h = (h ^ uint8(data[i])) * prime;
+	}
+	return h;
+}
+
+// Splits the line into whitespace separated tokens, up to the end or a comment
+void splitLine(const char* p, const char* end, std::vector<std::string>& tokens) {
+	tokens.clear();
+	while (p < end && *p != '#') {
+		if (*p == ' ' || *p == '\t' || *p == '\r') {
+			p++;
+			continue;
+		}
+		const char* start = p;
+		while (p < end && !(*p == ' ' || *p == '\t' || *p == '\r' || *p == '#')) p++;
+		tokens.push_back(std::string(start, p));
+	}
+}
+
+bool parseFloats(const std::vector<std::string>& tokens, int first, int count, float* values) {
+	if (first + count > int(tokens.size())) {
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		const char* s = tokens[first + i].c_str();
+		char* end;
+		values[i] = strtof(s, &end);
+		if (end == s || *end != '\0') {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool isAbsolutePath(const std::string& name) {
+	return !name.empty() && (name[0] == '/' || name[0] == '\\' || (name.size() > 1 && name[1] == ':'));
+}
+
+// Looks up the optional material name at tokens[idx], "default" if there are no more tokens
+bool findMaterial(const SceneObjects& objects, const std::vector<std::string>& tokens, int idx, int& material) {
+	if (idx >= int(tokens.size())) {
+		material = 0;
+		return true;
+	}
+	const std::unordered_map<std::string, int>::const_iterator it = objects.materials.find(tokens[idx]);
+	if (idx + 1 != int(tokens.size()) || it == objects.materials.end()) {
+		return false;
+	}
+	material = it->second;
+	return true;
+}
+
+// Parses one line that is not a sphere. Returns false if the line is not valid.
+bool parseLine(const std::vector<std::string>& tokens, const std::string& dir, Scene& scene, SceneObjects& objects, bool& hasLights) {
+	const std::string& keyword = tokens[0];
+	float v[13];
+	if (keyword == "camera") {
+		Vector pos = scene.cam.getPos();
+		float yaw = scene.cam.getYaw(), pitch = scene.cam.getPitch(), roll = scene.cam.getRoll(), fov = scene.cam.getFov();
+		for (int i = 1; i < int(tokens.size()); ) {
+			const std::string& key = tokens[i];
+			if (key == "pos" && parseFloats(tokens, i + 1, 3, v)) {
+				pos = Vector(v[0], v[1], v[2]);
+				i += 4;
+				continue;
+			}
+			if (!parseFloats(tokens, i + 1, 1, v)) {
+				return false;
+			}
+			if      (key == "yaw")   yaw = v[0];
+			else if (key == "pitch") pitch = v[0];
+			else if (key == "roll")  roll = v[0];
+			else if (key == "fov" && v[0] > 0.f && v[0] < 180.f) fov = v[0];
+			else return false;
+			i += 2;
+		}
+		scene.cam.setView(pos, yaw, pitch, roll, fov);
+		return true;
+	}
+	if (keyword == "material") {
+		Material m;
+		if (tokens.size() < 6 || !parseMaterialType(tokens[2].c_str(), m.type) || !parseFloats(tokens, 3, 3, v) ||
+			objects.materials.count(tokens[1])) {
+			return false;
+		}
+		m.col = Color(v[0], v[1], v[2]);
+		for (int i = 6; i < int(tokens.size()); i += 2) {
+			if (i + 1 >= int(tokens.size())) {
+				return false;
+			}
+			if (tokens[i] == "texture") {
+				const std::string& name = tokens[i + 1];
+				m.texture = scene.textures.add(isAbsolutePath(name) ? name : dir + name);
+			} else if (!parseFloats(tokens, i + 1, 1, v)) {
+				return false;
+			} else if (tokens[i] == "exponent") {
+				m.exponent = v[0];
+			} else if (tokens[i] == "ior") {
+				m.ior = v[0];
+			} else {
+				return false;
+			}
+		}
+		objects.materials[tokens[1]] = int(scene.materials.size());
+		scene.materials.push_back(m);
+		return true;
+	}
+	if (keyword == "light" && tokens.size() >= 2) {
+		Light light;
+		const std::string& type = tokens[1];
+		if (type == "point" && tokens.size() == 9 && parseFloats(tokens, 2, 7, v)) {
+			light = Light::point(Vector(v[0], v[1], v[2]), Color(v[3], v[4], v[5]), v[6]);
+		} else if (type == "sphere" && tokens.size() == 10 && parseFloats(tokens, 2, 8, v) && v[3] > 0.f) {
+			light = Light::sphere(Vector(v[0], v[1], v[2]), v[3], Color(v[4], v[5], v[6]), v[7]);
+		} else if (type == "quad" && tokens.size() == 15 && parseFloats(tokens, 2, 13, v)) {
+			light = Light::quad(Vector(v[0], v[1], v[2]), Vector(v[3], v[4], v[5]), Vector(v[6], v[7], v[8]), Color(v[9], v[10], v[11]), v[12]);
+		} else {
+			return false;
+		}
+		if (!hasLights) {
+			scene.lights.clear();
+			hasLights = true;
+		}
+		scene.lights.push_back(light);
+		return true;
+	}
+	if (keyword == "mesh" && tokens.size() >= 2) {
+		MeshEntry entry;
+		entry.fileName = isAbsolutePath(tokens[1]) ? tokens[1] : dir + tokens[1];
+		if (!findMaterial(objects, tokens, 2, entry.material)) {
+			return false;
+		}
+		objects.meshes.push_back(entry);
+		return true;
+	}
+	return false;
+}
+
+bool parseSphere(const std::vector<std::string>& tokens, const SceneObjects& objects, Sphere& sphere) {
+	float v[4];
+	int material;
+	if (!parseFloats(tokens, 1, 4, v) || !(v[3] > 0.f) || !findMaterial(objects, tokens, 5, material)) {
+		return false;
+	}
+	sphere = Sphere(Vector(v[0], v[1], v[2]), v[3], material);
+	return true;
+}
+
+const char* findLineEnd(const char* text, size_t size, uint64 offset) {
+	const char* lineEnd = static_cast<const char*>(memchr(text + offset, '\n', size - size_t(offset)));
+	return lineEnd ? lineEnd : text + size;
+}
+
+int getLineNumber(const char* text, uint64 offset) {
+	int number = 1;
+	for (uint64 i = 0; i < offset; i++) {
+		number += (text[i] == '\n');
+	}
+	return number;
+}
+
+// Collects the offsets of the lines that are not blank or comments, the sphere lines into
+// sphereLines and all others into otherLines. Sphere lines are told apart without splitting
+// them, there may be millions.
+void findLines(const char* text, size_t size, MappableArray<uint64>& otherLines, std::vector<uint64>& sphereLines) {
+	for (uint64 offset = 0; offset < size; ) {
+		const char* lineEnd = findLineEnd(text, size, offset);
+		const char* p = text + offset;
+		while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+		if (p < lineEnd && *p != '#') {
+			if (lineEnd - p > 6 && !memcmp(p, "sphere", 6) && (p[6] == ' ' || p[6] == '\t')) {
+				sphereLines.push_back(offset);
+			} else {
+				otherLines.push_back(offset);
+			}
+		}
+		offset = uint64(lineEnd - text) + 1;
+	}
+}
+
+// Maps the compiled file and checks that it was built from the text. Returns its table of
+// arrays, or null if the file cannot be used.
+const SceneFileArray* openSceneFile(const std::string& compiledName, uint64 textHash, MappedFile& file, SceneFileHeader& header) {
+	if (!file.open(compiledName.c_str(), false) || file.size() < sizeof(SceneFileHeader)) {
+		file.close();
+		return nullptr;
+	}
+	memcpy(&header, file.data(), sizeof(header));
+	const uint64 size = uint64(file.size());
+	if (memcmp(header.magic, "CGSC", 4) || header.version != SCENE_FILE_VERSION || header.textHash != textHash ||
+		header.simdWidth != SIMD_WIDTH || header.numArrays < 0 || header.tableOffset % sizeof(uint64) != 0 ||
+		header.tableOffset > size || uint64(header.numArrays) > (size - header.tableOffset) / sizeof(SceneFileArray)) {
+		file.close();
+		return nullptr;
+	}
+	return reinterpret_cast<const SceneFileArray*>(file.data() + header.tableOffset);
+}
+
+// Writes the line offsets and the objects of the scene into the compiled file. The file is
+// written under a temporary name and renamed, so other processes never map a partial file.
+bool writeSceneFile(const std::string& compiledName, uint64 textHash, uint64 meshHash, MappableArray<uint64>& lines, Scene& scene) {
+	const std::string tmpName = compiledName + ".tmp";
+	FILE* fp = fopen(tmpName.c_str(), "wb");
+	if (!fp) {
+		return false;
+	}
+	SceneFileHeader header;
+	memcpy(header.magic, "CGSC", 4);
+	header.version = SCENE_FILE_VERSION;
+	header.textHash = textHash;
+	header.meshHash = meshHash;
+	header.simdWidth = SIMD_WIDTH;
+	header.numArrays = 0;
+	header.tableOffset = 0;
+	// Written again with the table position once the arrays are in
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+	ArrayWriter writer(fp, sizeof(header));
+	writer(lines);
+	visitSceneArrays(scene, writer);
+	ok = ok && writer.ok;
+
+	const uint64 padding = (sizeof(uint64) - writer.offset % sizeof(uint64)) % sizeof(uint64);
+	const char zeros[sizeof(uint64)] = {};
+	ok = ok && (padding == 0 || fwrite(zeros, 1, size_t(padding), fp) == padding);
+	header.numArrays = int32(writer.table.size());
+	header.tableOffset = writer.offset + padding;
+	ok = ok && fwrite(writer.table.data(), sizeof(SceneFileArray), writer.table.size(), fp) == writer.table.size();
+	ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = (fclose(fp) == 0) && ok;
+	if (ok) {
+#ifdef _WIN32
+		// rename does not replace an existing file on Windows
+		remove(compiledName.c_str());
+#endif
+		ok = rename(tmpName.c_str(), compiledName.c_str()) == 0;
+	}
+	if (!ok) {
+		remove(tmpName.c_str());
+	}
+	return ok;
+}
+
+void clearObjects(Scene& scene) {
+	scene.spheres.clear();
+	scene.accel.clear();
+	for (int i = 0; i < int(scene.meshes.size()); i++) {
+		scene.meshes[i].clear();
+	}
+}
+
+} // namespace
+
+bool loadScene(const char* fileName, Scene& scene, bool& fromCache) {
+	fromCache = false;
+	MappedFile textFile;
+	if (!textFile.open(fileName)) {
+		printf("Failed to open %s\n", fileName);
+		return false;
+	}
+	const char* text = textFile.data();
+	const size_t textSize = textFile.size();
+	const std::string name(fileName);
+	const size_t slash = name.find_last_of("/\\");
+	const std::string dir = (slash == std::string::npos) ? std::string() : name.substr(0, slash + 1);
+
+	// Drop the old objects before the mapping they may point into
+	scene.spheres.clear();
+	scene.meshes.clear();
+	scene.accel.clear();
+	scene.compiledScene.close();
+	scene.materials.assign(1, Material());
+	scene.lights.assign(1, Light());
+
+	// A compiled file of the same text knows where the lines other than the spheres are
+	const uint64 textHash = hashBytes(text, textSize);
+	const std::string compiledName = name + ".cgscene";
+	MappedFile& compiled = scene.compiledScene;
+	SceneFileHeader header;
+	const SceneFileArray* table = openSceneFile(compiledName, textHash, compiled, header);
+	ArrayMapper mapper(compiled, table, table ? header.numArrays : 0);
+	MappableArray<uint64> lines;
+	mapper(lines);
+	for (size_t i = 0; i < lines.size() && mapper.ok; i++) {
+		mapper.ok = lines[i] < textSize;
+	}
+	std::vector<uint64> sphereLines;
+	const bool mapFailed = !mapper.ok;
+	if (mapFailed) {
+		lines.clear();
+		findLines(text, textSize, lines, sphereLines);
+	}
+
+	SceneObjects objects;
+	objects.materials["default"] = 0;
+	bool hasLights = false;
+	std::vector<std::string> tokens;
+	for (size_t i = 0; i < lines.size(); i++) {
+		splitLine(text + lines[i], findLineEnd(text, textSize, lines[i]), tokens);
+		if (!tokens.empty() && !parseLine(tokens, dir, scene, objects, hasLights)) {
+			printf("Invalid line %d in %s\n", getLineNumber(text, lines[i]), fileName);
+			return false;
+		}
+	}
+
+	// The objects also depend on the mesh files, which are told apart by their size and modification time
+	uint64 meshHash = hashBytes(nullptr, 0);
+	for (int i = 0; i < int(objects.meshes.size()); i++) {
+		MappedFile meshFile;
+		if (!meshFile.open(objects.meshes[i].fileName.c_str())) {
+			printf("Failed to open %s\n", objects.meshes[i].fileName.c_str());
+			return false;
+		}
+		const uint64 meshStamp[2] = { uint64(meshFile.size()), meshFile.modificationTime() };
+		meshHash = hashBytes(reinterpret_cast<const char*>(meshStamp), sizeof(meshStamp), meshHash);
+	}
+	scene.meshes.resize(objects.meshes.size());
+	for (int i = 0; i < int(objects.meshes.size()); i++) {
+		scene.meshes[i].material = objects.meshes[i].material;
+	}
+
+	if (mapper.ok && header.meshHash == meshHash) {
+		visitSceneArrays(scene, mapper);
+		if (mapper.ok && mapper.next == header.numArrays) {
+			fromCache = true;
+			scene.markGeometryChanged();
+			scene.updateLights();
+			return true;
+		}
+		clearObjects(scene);
+	}
+
+	// Build the objects from the text. The line offsets may point into the compiled file, which goes away.
+	if (!mapFailed) {
+		lines.clear();
+		findLines(text, textSize, lines, sphereLines);
+	}
+	compiled.close();
+
+	scene.spheres.resize(sphereLines.size());
+	for (int i = 0; i < int(sphereLines.size()); i++) {
+		splitLine(text + sphereLines[i], findLineEnd(text, textSize, sphereLines[i]), tokens);
+		if (!parseSphere(tokens, objects, scene.spheres[i])) {
+			printf("Invalid line %d in %s\n", getLineNumber(text, sphereLines[i]), fileName);
+			return false;
+		}
+	}
+	for (int i = 0; i < int(objects.meshes.size()); i++) {
+		if (!loadMesh(objects.meshes[i].fileName.c_str(), scene.meshes[i], scene.threadman, scene.numThreads)) {
+			return false;
+		}
+	}
+	scene.buildAccelerator();
+
+	if (!writeSceneFile(compiledName, textHash, meshHash, lines, scene)) {
+		printf("Failed to write %s, the scene will be built again next time\n", compiledName.c_str());
+	}
+	return true;
+}
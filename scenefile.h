@@ -0,0 +1,32 @@
+#pragma once
+
+#include "scene.h"
+
+// Scene description files. A text file describes the camera, the materials, the lights and the
+// objects, one item per line, '#' starts a comment:
+//
+//   camera pos X Y Z [yaw A] [pitch A] [roll A] [fov A]    angles in degrees, fov is diagonal
+//   material NAME TYPE R G B [exponent E] [ior N] [texture FILE]
+//   light point X Y Z R G B INTENSITY
+//   light sphere X Y Z RADIUS R G B INTENSITY
+//   light quad X Y Z E1X E1Y E1Z E2X E2Y E2Z R G B INTENSITY
+//   sphere X Y Z RADIUS [MATERIAL]
+//   mesh FILE [MATERIAL]
+//
+// TYPE is one of the names parseMaterialType accepts. Materials are referred to by NAME and must
+// be defined before they are used; "default" is the red Phong material objects get without one.
+// Relative file names are relative to the scene file. Lights replace the default point light.
+//
+// The objects are compiled once into "<scene>.cgscene" next to the text file: the spheres, the
+// mesh geometry and all BVHs, exactly as buildAccelerator leaves them in memory. Arrays are
+// stored at offsets from the start of the file, aligned for SIMD loads, so the file is relocatable
+// and loading it maps the file and points the arrays of the scene into the mapping, see
+// MappableArray. Nothing is parsed or built then, apart from the few lines that are not objects.
+// The file is rebuilt when the text or the size or modification time of a mesh file changes, or
+// it was written by a build with another SIMD width. Delete it to force a rebuild.
+
+// Replaces the objects, materials and lights of the scene with the ones of the text file and
+// places the camera, which must already have its image size. The acceleration structures are
+// built or mapped, the scene is ready to render on return. fromCache tells whether the objects
+// came from the compiled file. On failure an error is printed and false is returned.
+bool loadScene(const char* fileName, Scene& scene, bool& fromCache);
@@ -0,0 +1,173 @@
+#include "scheduler.h"
+
+#include "timer.h"
+
+namespace {
+
+const int TASKS_PER_THREAD = 8; //< Aim for that many buckets of equal cost per thread
+const int MIN_BUCKET_SIZE = 4; //< Buckets are not split below that many pixels per side
+const int MAX_SPLIT_DEPTH = 4;
+
+int64 elapsedNs(const a7az0th::Timer& t) {
+	return int64(t.elapsed(a7az0th::Timer::Nanoseconds));
+}
+
+} // namespace
+
+struct BucketScheduler::Worker : a7az0th::MultiThreadedFor {
+	Worker(BucketScheduler& scheduler, BucketRenderer& renderer, int numThreads)
+		: scheduler(scheduler), renderer(renderer), busyNs(numThreads, 0), steals(numThreads, 0) {}
+	// Every task of the MultiThreadedFor is a worker that keeps taking buckets until there are none left
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		int task;
+		bool stolen;
+		while (scheduler.getTask(index, task, stolen)) {
+			a7az0th::Timer t;
+			renderer.renderBucket(scheduler.buckets[task], index);
+			t.stop();
+			const int64 ns = elapsedNs(t);
+			scheduler.bucketCost[task] = ns;
+			busyNs[index] += ns;
+			steals[index] += stolen;
+		}
+	}
+	BucketScheduler& scheduler;
+	BucketRenderer& renderer;
+	std::vector<int64> busyNs;
+	std::vector<int> steals;
+};
+
+BucketScheduler::BucketScheduler() {}
+
+void BucketScheduler::reset() {
+	base.clear();
+	baseCost.clear();
+}
+
+void BucketScheduler::splitBuckets(int numThreads) {
+	buckets.clear();
+	bucketBase.clear();
+
+	int64 totalCost = 0;
+	for (int i = 0; i < int(baseCost.size()); i++) {
+		totalCost += baseCost[i];
+	}
+	const int numTargetTasks = numThreads * TASKS_PER_THREAD;
+	const double targetCost = double(totalCost) / numTargetTasks;
+
+	// Without history every base bucket gets the same depth, enough to reach the target bucket count
+	int uniformDepth = 0;
+	while (totalCost == 0 && int(base.size()) << (2 * uniformDepth) < numTargetTasks && uniformDepth < MAX_SPLIT_DEPTH) {
+		uniformDepth++;
+	}
+
+	for (int b = 0; b < int(base.size()); b++) {
+		const Rect& r = base[b];
+		int depth = uniformDepth;
+		if (totalCost > 0) {
+			double cost = double(baseCost[b]);
+			while (cost > targetCost && depth < MAX_SPLIT_DEPTH) {
+				cost /= 4.0;
+				depth++;
+			}
+		}
+		// Thin buckets at the image border stay whole along their short side too, a split is uniform
+		while (depth > 0 && ((r.width() >> depth) < MIN_BUCKET_SIZE || (r.height() >> depth) < MIN_BUCKET_SIZE)) {
+			depth--;
+		}
+
+		const int n = 1 << depth;
+		for (int y = 0; y < n; y++) {
+			for (int x = 0; x < n; x++) {
+				// At least MIN_BUCKET_SIZE pixels per side, never empty
+				buckets.push_back(Rect(r.x0 + r.width() * x / n, r.y0 + r.height() * y / n,
+				                       r.x0 + r.width() * (x + 1) / n, r.y0 + r.height() * (y + 1) / n));
+				bucketBase.push_back(b);
+			}
+		}
+	}
+	bucketCost.assign(buckets.size(), 0);
+}
+
+// Gives every thread a contiguous run of buckets, so neighbouring buckets tend to be rendered by the
+// same thread. Runs are cut at equal estimated cost, taken from the previous frame.
+void BucketScheduler::distributeBuckets(int numThreads) {
+	std::vector<double> estimate(buckets.size(), 1.0);
+	double total = 0.0;
+	for (int i = 0; i < int(buckets.size()); i++) {
+		const int b = bucketBase[i];
+		if (baseCost[b] > 0) {
+			estimate[i] = double(baseCost[b]) * buckets[i].area() / base[b].area();
+		}
+		total += estimate[i];
+	}
+
+	double acc = 0.0;
+	for (int i = 0; i < int(buckets.size()); i++) {
+		const int t = Min(int(acc / total * numThreads), numThreads - 1);
+		queues[t].tasks.push_back(i);
+		acc += estimate[i];
+	}
+}
+
+bool BucketScheduler::getTask(int threadIdx, int& task, bool& stolen) {
+	{
+		WorkQueue& own = queues[threadIdx];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.tasks.empty()) {
+			task = own.tasks.front();
+			own.tasks.pop_front();
+			stolen = false;
+			return true;
+		}
+	}
+	// Steal from the back of the other queues, that is the work their owners would get to last
+	const int numQueues = int(queues.size());
+	for (int i = 1; i < numQueues; i++) {
+		WorkQueue& victim = queues[(threadIdx + i) % numQueues];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.back();
+			victim.tasks.pop_back();
+			stolen = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+void BucketScheduler::run(const std::vector<Rect>& baseBuckets, BucketRenderer& renderer, a7az0th::ThreadManager& threadman, int numThreads) {
+	a7az0th::Timer frameTimer;
+
+	if (base != baseBuckets) {
+		base = baseBuckets;
+		baseCost.assign(base.size(), 0);
+	}
+
+	splitBuckets(numThreads);
+	std::vector<WorkQueue> freshQueues(numThreads);
+	queues.swap(freshQueues);
+	distributeBuckets(numThreads);
+
+	Worker worker(*this, renderer, numThreads);
+	worker.run(threadman, numThreads, numThreads);
+
+	baseCost.assign(base.size(), 0);
+	for (int i = 0; i < int(buckets.size()); i++) {
+		baseCost[bucketBase[i]] += bucketCost[i];
+	}
+
+	frameTimer.stop();
+	stats = SchedulerStats();
+	stats.numBuckets = int(buckets.size());
+	stats.frameMs = elapsedNs(frameTimer) / 1000000.0;
+	double totalBusy = 0.0;
+	for (int t = 0; t < numThreads; t++) {
+		const double busyMs = worker.busyNs[t] / 1000000.0;
+		totalBusy += busyMs;
+		stats.maxBusyMs = Max(stats.maxBusyMs, busyMs);
+		stats.numSteals += worker.steals[t];
+	}
+	stats.avgBusyMs = totalBusy / numThreads;
+	stats.imbalance = (stats.avgBusyMs > 0.0) ? stats.maxBusyMs / stats.avgBusyMs - 1.0 : 0.0;
+}
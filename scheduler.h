@@ -0,0 +1,69 @@
+#pragma once
+
+#include "rect.h"
+#include "defs.h"
+
+#include "threadman.h"
+
+#include <vector>
+#include <deque>
+#include <mutex>
+
+// Callback interface for BucketScheduler, renders a single bucket
+struct BucketRenderer {
+	virtual ~BucketRenderer() {}
+	virtual void renderBucket(const Rect& r, int threadIdx) = 0;
+};
+
+// Load balance information about the last frame rendered by a BucketScheduler
+struct SchedulerStats {
+	int numBuckets; //< Number of buckets the frame was split into
+	int numSteals; //< Buckets rendered by a thread other than the one they were assigned to
+	double frameMs; //< Wall clock time of the whole frame
+	double avgBusyMs; //< Average time a thread spent rendering buckets
+	double maxBusyMs; //< Time spent rendering by the busiest thread
+	double imbalance; //< maxBusy / avgBusy - 1, zero for a perfectly balanced frame
+
+	SchedulerStats(): numBuckets(0), numSteals(0), frameMs(0), avgBusyMs(0), maxBusyMs(0), imbalance(0) {}
+};
+
+// Dynamic bucket scheduler with work stealing and adaptive bucket sizes.
+// Each base bucket is split into 4^d sub-buckets, where d is picked from the time the bucket took
+// in the previous frame, so expensive regions are cut into smaller pieces and cheap ones stay whole.
+// The sub-buckets are dealt to per-thread queues in contiguous runs of about equal estimated cost.
+// A thread takes work from the front of its own queue and, once that is empty, steals from the back
+// of the other queues.
+class BucketScheduler {
+public:
+	BucketScheduler();
+
+	// Renders all buckets. baseBuckets is the grid made by initBuckets; when it changes the cost
+	// history is reset.
+	void run(const std::vector<Rect>& baseBuckets, BucketRenderer& renderer, a7az0th::ThreadManager& threadman, int numThreads);
+
+	const SchedulerStats& getStats() const { return stats; }
+
+	// Clears the cost history, the next frame is split uniformly
+	void reset();
+
+private:
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<int> tasks;
+	};
+	struct Worker;
+
+	void splitBuckets(int numThreads);
+	void distributeBuckets(int numThreads);
+	bool getTask(int threadIdx, int& task, bool& stolen);
+
+	std::vector<Rect> base; //< The base grid of the last frame
+	std::vector<int64> baseCost; //< Render time of every base bucket in the last frame, in nanoseconds
+
+	std::vector<Rect> buckets; //< Sub-buckets of the current frame
+	std::vector<int> bucketBase; //< Index of the base bucket each sub-bucket came from
+	std::vector<int64> bucketCost; //< Measured render time of each sub-bucket, in nanoseconds
+
+	std::vector<WorkQueue> queues;
+	SchedulerStats stats;
+};
@@ -0,0 +1,303 @@
+#include "shading.h"
+#include "fastmath.h"
+
+#include <string.h>
+
+namespace {
+
+const float AMBIENT_LIGHT = 0.1f;
+const int MAX_SPECULAR_DEPTH = 4; //< Bounces between mirrors and through glass before a ray gets the background
+
+inline Vector getReflectionDir(const Vector &viewDir, const Vector& normal) {
+	const float cos = -dot(viewDir, normal);
+	return viewDir + normal*2*cos;
+}
+
+// Length that u (or v) runs through from 0 to 1 on the surface at the hit: around the equator
+// of a sphere, along a triangle edge for the barycentric coordinates of a mesh
+float getUVLength(const IntersectionInfo& info) {
+	if (info.meshId >= 0) {
+		const Mesh& mesh = scene.meshes[info.meshId];
+		const int* tri = &mesh.indices[info.primId * 3];
+		return (mesh.vertices[tri[1]] - mesh.vertices[tri[0]]).length();
+	}
+	// Read through a const reference, the non-const one would make a mapped array copy itself
+	const MappableArray<Sphere>& spheres = scene.spheres;
+	return 2.f * pi() * spheres[info.primId].getRadius();
+}
+
+} // namespace
+
+// Textures are looked up at the mip level where one texel is about the size of the pixel
+// footprint, which grows with the distance and on surfaces seen at a grazing angle. The extra
+// spread after mirrors, glass and diffuse bounces is not tracked.
+Color getSurfaceColor(const Material& m, const IntersectionInfo& info, const Vector& viewDir) {
+	if (m.texture < 0) {
+		return m.col;
+	}
+	const int width = scene.textures.getWidth(m.texture);
+	const float cosTheta = Max(fabsf(dot(viewDir, info.normal)), 0.1f);
+	const float footprint = sqrtf(info.distSq) * scene.cam.getPixelSpread() / cosTheta;
+	const float texels = footprint * float(width) / getUVLength(info);
+	const float lod = log2f(Max(texels, 1.f));
+	return m.col * scene.textures.sample(m.texture, info.u, info.v, lod);
+}
+
+namespace {
+
+// Strength of the highlight of material type T for light arriving along lightDir. The materials
+// without a highlight return a constant 0, and the code that adds it disappears from their kernel.
+template <MaterialType T>
+inline float highlight(const Material& m, const Vector& lightDir, const Vector& normal, const Vector& viewDir) {
+	if (T == MATERIAL_PHONG) {
+		const Vector reflect = getReflectionDir(lightDir, normal);
+		return fastmath::fastPow(Max(0.f, dot(reflect, viewDir)), m.exponent);
+	}
+	if (T == MATERIAL_BLINN) {
+		Vector half = lightDir - viewDir;
+		half.normalize();
+		return fastmath::fastPow(Max(0.f, dot(half, normal)), m.exponent);
+	}
+	return 0.f;
+}
+
+// Diffuse reflection plus the highlight of type T from the lights and the ambient term
+template <MaterialType T>
+Color shadeDirect(const Material& m, const IntersectionInfo& info, const Vector& viewDir, PixelSampler* sampler) {
+	const int numSamples = Max(scene.lightSamples, 1);
+	// Start the shadow rays slightly above the surface so they do not hit it again
+	const Vector from = info.intersectionPoint + info.normal * 1e-4f;
+	// Random numbers for the light samples when the caller has no pixel sampler
+	PointRandom rnd(info.intersectionPoint);
+	const uint32 firstDim = sampler ? sampler->dimension : 0;
+
+	const Color albedo = getSurfaceColor(m, info, viewDir);
+	Color lambertComponent(0.f, 0.f, 0.f);
+	Color specularComponent(0.f, 0.f, 0.f);
+	for (int i = 0; i < numSamples; i++) {
+		float pick, u, v;
+		if (sampler) {
+			// The light samples of a pixel sample are consecutive samples in the same dimensions,
+			// so they are stratified against each other instead of just independent
+			PixelSampler lightSample = *sampler;
+			lightSample.sampleIdx = sampler->sampleIdx * numSamples + i;
+			lightSample.dimension = firstDim;
+			pick = lightSample.get1D();
+			lightSample.get2D(u, v);
+		} else {
+			pick = rnd.next();
+			u = rnd.next();
+			v = rnd.next();
+		}
+		LightSample ls;
+		float pickPdf, cosTheta;
+		if (!scene.lightSampler.sampleLight(scene.lights, from, info.normal, pick, u, v, ls, pickPdf, cosTheta)) {
+			continue;
+		}
+		Ray shadowRay;
+		shadowRay.origin = from;
+		shadowRay.dir = ls.dir;
+		shadowRay.depth = 1;
+		if (scene.occluded(shadowRay, ls.dist * (1.f - 1e-4f))) {
+			continue;
+		}
+		const Color lightContribution = ls.radiance / pickPdf;
+		lambertComponent += albedo * lightContribution * cosTheta;
+		if (T == MATERIAL_PHONG || T == MATERIAL_BLINN) {
+			// The highlight has never had the distance falloff, keep it that way
+			specularComponent += lightContribution * (ls.dist * ls.dist * highlight<T>(m, ls.dir, info.normal, viewDir));
+		}
+	}
+	if (sampler) {
+		sampler->dimension = firstDim + 2;
+	}
+	lambertComponent = lambertComponent / float(numSamples);
+	specularComponent = specularComponent / float(numSamples);
+
+	const Color ambientComponent = albedo * AMBIENT_LIGHT;
+	return ambientComponent + (lambertComponent + specularComponent) * (1.f - AMBIENT_LIGHT);
+}
+
+// Follows a reflected or refracted ray and shades what it hits
+Color traceSecondary(const Vector& from, const Vector& dir, int depth, PixelSampler* sampler) {
+	if (depth > MAX_SPECULAR_DEPTH) {
+		return backgroundColor();
+	}
+	Ray ray;
+	ray.origin = from;
+	ray.dir = dir;
+	ray.depth = depth;
+	IntersectionInfo info;
+	if (!scene.intersect(ray, info)) {
+		return backgroundColor();
+	}
+	return shade(ray, info, depth, sampler);
+}
+
+Color shadeMirror(const Material& m, const IntersectionInfo& info, const Vector& viewDir, int depth, PixelSampler* sampler) {
+	const Vector normal = faceforward(viewDir, info.normal);
+	Vector dir = getReflectionDir(viewDir, normal);
+	dir.normalize();
+	return getSurfaceColor(m, info, viewDir) * traceSecondary(info.intersectionPoint + normal * 1e-4f, dir, depth + 1, sampler);
+}
+
+// Whether the ray enters or leaves the object is told by the normal, which works for the spheres.
+// Mesh normals face the ray, so glass meshes are always entered and behave like thin sheets.
+Color shadeDielectric(const Material& m, const IntersectionInfo& info, const Vector& viewDir, int depth, PixelSampler* sampler) {
+	const bool entering = dot(viewDir, info.normal) < 0.f;
+	const Vector normal = entering ? info.normal : -info.normal;
+	const float eta = entering ? 1.f / m.ior : m.ior;
+	const float cosI = -dot(viewDir, normal);
+	const float sin2T = eta * eta * (1.f - cosI * cosI);
+
+	Vector reflectDir = getReflectionDir(viewDir, normal);
+	reflectDir.normalize();
+	const Color reflected = traceSecondary(info.intersectionPoint + normal * 1e-4f, reflectDir, depth + 1, sampler);
+	if (sin2T >= 1.f) {
+		// Total internal reflection
+		return getSurfaceColor(m, info, viewDir) * reflected;
+	}
+	const float cosT = sqrtf(1.f - sin2T);
+	Vector refractDir = viewDir * eta + normal * (eta * cosI - cosT);
+	refractDir.normalize();
+	const Color refracted = traceSecondary(info.intersectionPoint - normal * 1e-4f, refractDir, depth + 1, sampler);
+
+	// Schlick's approximation, with the angle on the side of the thinner medium
+	const float r0 = sqr((1.f - m.ior) / (1.f + m.ior));
+	const float fresnel = r0 + (1.f - r0) * powf(1.f - (entering ? cosI : cosT), 5.f);
+	return getSurfaceColor(m, info, viewDir) * (reflected * fresnel + refracted * (1.f - fresnel));
+}
+
+// The shading kernel of material type T. The type is known at compile time, so every
+// instantiation is only the code of its own material, without branches on the type.
+template <MaterialType T>
+inline Color shadeKernel(const Material& m, const IntersectionInfo& info, const Vector& viewDir, int depth, PixelSampler* sampler) {
+	STATS_ADD(STAT_SHADING_CALLS, 1);
+	if (T == MATERIAL_MIRROR) {
+		return shadeMirror(m, info, viewDir, depth, sampler);
+	}
+	if (T == MATERIAL_DIELECTRIC) {
+		return shadeDielectric(m, info, viewDir, depth, sampler);
+	}
+	return shadeDirect<T>(m, info, viewDir, sampler);
+}
+
+// Shades 'count' hits that all have a material of type T
+template <MaterialType T>
+void shadeHits(const ShadingBatch::Hit* hits, int count, SamplerType samplerType, uint32 sampleIdx, Color* colors) {
+	const Material* materials = scene.materials.data();
+	for (int i = 0; i < count; i++) {
+		const ShadingBatch::Hit& hit = hits[i];
+		PixelSampler sampler(samplerType, hit.x, hit.y, sampleIdx);
+		colors[hit.index] = shadeKernel<T>(materials[hit.material], hit.info, hit.ray.dir, 0, &sampler);
+	}
+}
+
+// Computes the attributes the materials of the hits need. The uv coordinates of the spheres are
+// the costly part, they are computed for SIMD_WIDTH hits at a time.
+void resolveHitAttributes(ShadingBatch::Hit* hits, int count) {
+	alignas(SIMD_ALIGN) float nx[SIMD_WIDTH], ny[SIMD_WIDTH], nz[SIMD_WIDTH];
+	alignas(SIMD_ALIGN) float u[SIMD_WIDTH], v[SIMD_WIDTH];
+	IntersectionInfo* pending[SIMD_WIDTH];
+	int numPending = 0;
+	auto flush = [&]() {
+		// The unused lanes get a valid normal, they are not stored back
+		for (int i = numPending; i < SIMD_WIDTH; i++) {
+			nx[i] = 1.f;
+			ny[i] = nz[i] = 0.f;
+		}
+		vfloat vu, vv;
+		sphereUV(vfloat::load(nx), vfloat::load(ny), vfloat::load(nz), vu, vv);
+		vu.store(u);
+		vv.store(v);
+		for (int i = 0; i < numPending; i++) {
+			pending[i]->u = u[i];
+			pending[i]->v = v[i];
+			pending[i]->attributes |= HIT_UV;
+		}
+		numPending = 0;
+	};
+
+	for (int i = 0; i < count; i++) {
+		IntersectionInfo& info = hits[i].info;
+		const int attributes = getMaterialAttributes(scene.materials[hits[i].material]);
+		const bool sphereUVs = info.meshId < 0 && (attributes & ~info.attributes & HIT_UV);
+		scene.getHitAttributes(hits[i].ray, info, sphereUVs ? (attributes & ~HIT_UV) : attributes);
+		if (sphereUVs) {
+			nx[numPending] = info.normal.x;
+			ny[numPending] = info.normal.y;
+			nz[numPending] = info.normal.z;
+			pending[numPending++] = &info;
+			if (numPending == SIMD_WIDTH) {
+				flush();
+			}
+		}
+	}
+	if (numPending > 0) {
+		flush();
+	}
+}
+
+} // namespace
+
+Color shade(const Ray& ray, IntersectionInfo& info, int depth, PixelSampler* sampler) {
+	const Material& m = scene.materials[scene.getMaterialIdx(info)];
+	scene.getHitAttributes(ray, info, getMaterialAttributes(m));
+	const Vector& viewDir = ray.dir;
+	switch (m.type) {
+	case MATERIAL_DIFFUSE:    return shadeKernel<MATERIAL_DIFFUSE>(m, info, viewDir, depth, sampler);
+	case MATERIAL_PHONG:      return shadeKernel<MATERIAL_PHONG>(m, info, viewDir, depth, sampler);
+	case MATERIAL_BLINN:      return shadeKernel<MATERIAL_BLINN>(m, info, viewDir, depth, sampler);
+	case MATERIAL_MIRROR:     return shadeKernel<MATERIAL_MIRROR>(m, info, viewDir, depth, sampler);
+	case MATERIAL_DIELECTRIC: return shadeKernel<MATERIAL_DIELECTRIC>(m, info, viewDir, depth, sampler);
+	default:                  return backgroundColor();
+	}
+}
+
+int ShadingBatch::add(const IntersectionInfo& info, const Ray& ray, int x, int y) {
+	Hit hit;
+	hit.info = info;
+	hit.ray = ray;
+	hit.x = x;
+	hit.y = y;
+	hit.material = scene.getMaterialIdx(info);
+	hit.index = int(hits.size());
+	hits.push_back(hit);
+	return hit.index;
+}
+
+void ShadingBatch::shade(SamplerType samplerType, uint32 sampleIdx, Color* colors) {
+	// In place, so the hits keep their attributes for the caller
+	resolveHitAttributes(hits.data(), int(hits.size()));
+
+	// Counting sort by material type, keeping the pixel order within a type
+	int start[MATERIAL_TYPE_COUNT + 1] = {};
+	for (int i = 0; i < int(hits.size()); i++) {
+		start[scene.materials[hits[i].material].type + 1]++;
+	}
+	for (int t = 0; t < MATERIAL_TYPE_COUNT; t++) {
+		start[t + 1] += start[t];
+	}
+	sorted.resize(hits.size());
+	int next[MATERIAL_TYPE_COUNT];
+	memcpy(next, start, sizeof(next));
+	for (int i = 0; i < int(hits.size()); i++) {
+		sorted[next[scene.materials[hits[i].material].type]++] = hits[i];
+	}
+
+	for (int t = 0; t < MATERIAL_TYPE_COUNT; t++) {
+		const Hit* group = sorted.data() + start[t];
+		const int count = start[t + 1] - start[t];
+		if (count == 0) {
+			continue;
+		}
+		switch (MaterialType(t)) {
+		case MATERIAL_DIFFUSE:    shadeHits<MATERIAL_DIFFUSE>(group, count, samplerType, sampleIdx, colors); break;
+		case MATERIAL_PHONG:      shadeHits<MATERIAL_PHONG>(group, count, samplerType, sampleIdx, colors); break;
+		case MATERIAL_BLINN:      shadeHits<MATERIAL_BLINN>(group, count, samplerType, sampleIdx, colors); break;
+		case MATERIAL_MIRROR:     shadeHits<MATERIAL_MIRROR>(group, count, samplerType, sampleIdx, colors); break;
+		case MATERIAL_DIELECTRIC: shadeHits<MATERIAL_DIELECTRIC>(group, count, samplerType, sampleIdx, colors); break;
+		default: break;
+		}
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "scene.h"
+
+#include <vector>
+
+// Color of the rays that leave the scene
+inline Color backgroundColor() { return WHITE*0.3f; }
+
+// The HIT_* attributes the kernel of the material reads. Only textures look at the uv coordinates.
+inline int getMaterialAttributes(const Material& m) {
+	return HIT_POINT | HIT_NORMAL | (m.texture >= 0 ? HIT_UV : 0);
+}
+
+// The color of material m at the hit, col times its texture if it has one. info needs the
+// attributes of getMaterialAttributes, viewDir is the normalized direction of the ray.
+Color getSurfaceColor(const Material& m, const IntersectionInfo& info, const Vector& viewDir);
+
+// Shades the hit of the ray, which has a normalized direction, with the kernel of its material.
+// The hit attributes the material needs are computed first if info does not have them yet.
+// Diffuse, Phong and Blinn materials take scene.lightSamples shadow rays, each towards a light
+// picked by scene.lightSampler, plus a constant ambient term. Mirrors and glass trace secondary
+// rays up to a fixed depth; 'depth' is the depth of the ray that found the hit, 0 for camera rays.
+// The light samples are taken from 'sampler' when given, which advances it by two dimensions
+// for every shading point, otherwise from a hash of the hit point.
+// One switch over the material type per call. Shading many hits goes faster through ShadingBatch.
+Color shade(const Ray& ray, IntersectionInfo& info, int depth, PixelSampler* sampler = nullptr);
+
+// Collects the camera ray hits of a bucket and shades them grouped by material type, so each
+// type is shaded by one loop over its kernel, compiled for that type, instead of choosing the
+// kernel hit by hit.
+class ShadingBatch {
+public:
+	void clear() { hits.clear(); }
+
+	// Queues the hit of the camera ray through pixel (x, y). Its attributes are computed by shade,
+	// only the ones its material needs. Returns the index of its color in the output of shade.
+	int add(const IntersectionInfo& info, const Ray& ray, int x, int y);
+
+	int size() const { return int(hits.size()); }
+
+	struct Hit {
+		IntersectionInfo info;
+		Ray ray;
+		int x, y;
+		int material; //< Index in scene.materials
+		int index; //< Position of the color in the output
+	};
+
+	const Hit& getHit(int i) const { return hits[i]; }
+
+	// Shades all queued hits and stores the color of the i-th one in colors[i]. The pixel
+	// samplers are of type 'sampler' and take the sample 'sampleIdx' of every pixel.
+	// Afterwards getHit returns the hits with the attributes their materials needed.
+	void shade(SamplerType sampler, uint32 sampleIdx, Color* colors);
+
+private:
+	std::vector<Hit> hits;
+	std::vector<Hit> sorted; //< hits ordered by material type
+};
@@ -0,0 +1,355 @@
+#pragma once
+
+#include <stdlib.h>
+#include <new> //std::bad_alloc
+#ifdef _WIN32
+	#include <malloc.h>
+#endif
+
+// Thin wrappers around the widest float SIMD type the compiler is allowed to use.
+// vfloat holds SIMD_WIDTH floats and vmask holds one bit per lane. vint holds SIMD_WIDTH 32 bit
+// integers, with only what is needed to carry indices along: broadcast, select and store.
+// The instruction set is
+// picked at compile time from the target flags (see CG_SIMD in CMakeLists.txt):
+//   AVX-512 - 16 lanes
+//   AVX/AVX2 - 8 lanes
+//   SSE     - 4 lanes
+//   anything else falls back to plain C++ with 4 lanes, so the packet code builds everywhere.
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+#define SIMD_WIDTH 16
+#define SIMD_ALIGN 64
+#define SIMD_NAME "AVX-512"
+
+struct vmask {
+	__mmask16 m;
+	vmask() {}
+	explicit vmask(__mmask16 m): m(m) {}
+	static vmask fromBits(int bits) { return vmask(__mmask16(bits)); }
+	int bits() const { return int(m); }
+};
+inline vmask operator & (vmask a, vmask b) { return vmask(__mmask16(a.m & b.m)); }
+inline vmask operator | (vmask a, vmask b) { return vmask(__mmask16(a.m | b.m)); }
+inline vmask andNot(vmask a, vmask b) { return vmask(__mmask16(a.m & ~b.m)); } //< a & !b
+
+// The unmasked forms of some AVX-512 intrinsics pass an undefined vector as the source of the masked
+// out lanes, which GCC 12 reports as maybe uninitialized wherever they are inlined. Those are called
+// through their zero masking forms with every lane selected, which compile to the same instruction.
+#define SIMD_ALL_LANES __mmask16(0xffff)
+
+struct vfloat {
+	__m512 v;
+	vfloat() {}
+	vfloat(__m512 v): v(v) {}
+	vfloat(float f): v(_mm512_set1_ps(f)) {}
+	static vfloat load(const float* p) { return _mm512_load_ps(p); }
+	static vfloat loadu(const float* p) { return _mm512_loadu_ps(p); }
+	void store(float* p) const { _mm512_store_ps(p, v); }
+};
+inline vfloat operator + (vfloat a, vfloat b) { return _mm512_add_ps(a.v, b.v); }
+inline vfloat operator - (vfloat a, vfloat b) { return _mm512_sub_ps(a.v, b.v); }
+inline vfloat operator * (vfloat a, vfloat b) { return _mm512_mul_ps(a.v, b.v); }
+inline vfloat operator / (vfloat a, vfloat b) { return _mm512_div_ps(a.v, b.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm512_maskz_min_ps(SIMD_ALL_LANES, a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm512_maskz_max_ps(SIMD_ALL_LANES, a.v, b.v); }
+inline vfloat vsqrt(vfloat a) { return _mm512_maskz_sqrt_ps(SIMD_ALL_LANES, a.v); }
+inline vfloat vrsqrt(vfloat a) { return _mm512_maskz_rsqrt14_ps(SIMD_ALL_LANES, a.v); } //< Estimate of 1/sqrt(a), relative error below 2^-14
+inline vmask operator <  (vfloat a, vfloat b) { return vmask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)); }
+inline vmask operator <= (vfloat a, vfloat b) { return vmask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)); }
+inline vmask operator >  (vfloat a, vfloat b) { return vmask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)); }
+inline vmask operator >= (vfloat a, vfloat b) { return vmask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)); }
+// Returns a in the lanes where m is set and b everywhere else
+inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm512_mask_blend_ps(m.m, b.v, a.v); }
+// Rounds every lane to the nearest integer and stores the results to SIMD_ALIGN aligned memory
+inline void storeRounded(vfloat a, int* p) { _mm512_store_si512(p, _mm512_maskz_cvtps_epi32(SIMD_ALL_LANES, a.v)); }
+// Splits positive normal numbers into a mantissa in [1, 2), which is returned, and the exponent e
+inline vfloat vfrexp(vfloat a, vfloat& e) {
+	e = _mm512_maskz_getexp_ps(SIMD_ALL_LANES, a.v);
+	return _mm512_maskz_getmant_ps(SIMD_ALL_LANES, a.v, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_zero);
+}
+// a * 2^e for integer e in [-126, 127]
+inline vfloat vldexp(vfloat a, vfloat e) { return _mm512_maskz_scalef_ps(SIMD_ALL_LANES, a.v, e.v); }
+
+struct vint {
+	__m512i v;
+	vint() {}
+	vint(__m512i v): v(v) {}
+	vint(int i): v(_mm512_set1_epi32(i)) {}
+	void store(int* p) const { _mm512_store_si512(p, v); }
+};
+inline vint select(vmask m, vint a, vint b) { return _mm512_mask_blend_epi32(m.m, b.v, a.v); }
+
+#elif defined(__AVX__)
+
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#define SIMD_ALIGN 32
+#define SIMD_NAME "AVX"
+
+struct vmask {
+	__m256 m;
+	vmask() {}
+	explicit vmask(__m256 m): m(m) {}
+	static vmask fromBits(int bits) {
+		return vmask(_mm256_castsi256_ps(_mm256_set_epi32(
+			-((bits >> 7) & 1), -((bits >> 6) & 1), -((bits >> 5) & 1), -((bits >> 4) & 1),
+			-((bits >> 3) & 1), -((bits >> 2) & 1), -((bits >> 1) & 1), -(bits & 1))));
+	}
+	int bits() const { return _mm256_movemask_ps(m); }
+};
+inline vmask operator & (vmask a, vmask b) { return vmask(_mm256_and_ps(a.m, b.m)); }
+inline vmask operator | (vmask a, vmask b) { return vmask(_mm256_or_ps(a.m, b.m)); }
+inline vmask andNot(vmask a, vmask b) { return vmask(_mm256_andnot_ps(b.m, a.m)); } //< a & !b
+
+struct vfloat {
+	__m256 v;
+	vfloat() {}
+	vfloat(__m256 v): v(v) {}
+	vfloat(float f): v(_mm256_set1_ps(f)) {}
+	static vfloat load(const float* p) { return _mm256_load_ps(p); }
+	static vfloat loadu(const float* p) { return _mm256_loadu_ps(p); }
+	void store(float* p) const { _mm256_store_ps(p, v); }
+};
+inline vfloat operator + (vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator - (vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator * (vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator / (vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat vrsqrt(vfloat a) { return _mm256_rsqrt_ps(a.v); } //< Estimate of 1/sqrt(a), relative error below 1.5 * 2^-12
+inline vmask operator <  (vfloat a, vfloat b) { return vmask(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+inline vmask operator <= (vfloat a, vfloat b) { return vmask(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+inline vmask operator >  (vfloat a, vfloat b) { return vmask(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+inline vmask operator >= (vfloat a, vfloat b) { return vmask(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+// Returns a in the lanes where m is set and b everywhere else
+inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, m.m); }
+// Rounds every lane to the nearest integer and stores the results to SIMD_ALIGN aligned memory
+inline void storeRounded(vfloat a, int* p) { _mm256_store_si256((__m256i*)p, _mm256_cvtps_epi32(a.v)); }
+// Splits positive normal numbers into a mantissa in [1, 2), which is returned, and the exponent e.
+// Plain AVX has no 256 bit integer shifts, the two halves are shifted separately.
+inline vfloat vfrexp(vfloat a, vfloat& e) {
+	const __m256i bits = _mm256_castps_si256(a.v);
+	const __m128i lo = _mm_srli_epi32(_mm256_castsi256_si128(bits), 23);
+	const __m128i hi = _mm_srli_epi32(_mm256_extractf128_si256(bits, 1), 23);
+	e = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1)), _mm256_set1_ps(127.f));
+	return _mm256_or_ps(_mm256_and_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(0x007fffff))), _mm256_set1_ps(1.f));
+}
+// a * 2^e for integer e in [-126, 127]
+inline vfloat vldexp(vfloat a, vfloat e) {
+	const __m256i biased = _mm256_cvtps_epi32(_mm256_add_ps(e.v, _mm256_set1_ps(127.f)));
+	const __m128i lo = _mm_slli_epi32(_mm256_castsi256_si128(biased), 23);
+	const __m128i hi = _mm_slli_epi32(_mm256_extractf128_si256(biased, 1), 23);
+	return _mm256_mul_ps(a.v, _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1)));
+}
+
+struct vint {
+	__m256i v;
+	vint() {}
+	vint(__m256i v): v(v) {}
+	vint(int i): v(_mm256_set1_epi32(i)) {}
+	void store(int* p) const { _mm256_store_si256((__m256i*)p, v); }
+};
+// Blends the bits, the integers never pass through a float conversion
+inline vint select(vmask m, vint a, vint b) {
+	return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b.v), _mm256_castsi256_ps(a.v), m.m));
+}
+
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#define SIMD_ALIGN 16
+#define SIMD_NAME "SSE"
+
+struct vmask {
+	__m128 m;
+	vmask() {}
+	explicit vmask(__m128 m): m(m) {}
+	static vmask fromBits(int bits) {
+		return vmask(_mm_castsi128_ps(_mm_set_epi32(-((bits >> 3) & 1), -((bits >> 2) & 1), -((bits >> 1) & 1), -(bits & 1))));
+	}
+	int bits() const { return _mm_movemask_ps(m); }
+};
+inline vmask operator & (vmask a, vmask b) { return vmask(_mm_and_ps(a.m, b.m)); }
+inline vmask operator | (vmask a, vmask b) { return vmask(_mm_or_ps(a.m, b.m)); }
+inline vmask andNot(vmask a, vmask b) { return vmask(_mm_andnot_ps(b.m, a.m)); } //< a & !b
+
+struct vfloat {
+	__m128 v;
+	vfloat() {}
+	vfloat(__m128 v): v(v) {}
+	vfloat(float f): v(_mm_set1_ps(f)) {}
+	static vfloat load(const float* p) { return _mm_load_ps(p); }
+	static vfloat loadu(const float* p) { return _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_store_ps(p, v); }
+};
+inline vfloat operator + (vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator - (vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator * (vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator / (vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+inline vfloat vrsqrt(vfloat a) { return _mm_rsqrt_ps(a.v); } //< Estimate of 1/sqrt(a), relative error below 1.5 * 2^-12
+inline vmask operator <  (vfloat a, vfloat b) { return vmask(_mm_cmplt_ps(a.v, b.v)); }
+inline vmask operator <= (vfloat a, vfloat b) { return vmask(_mm_cmple_ps(a.v, b.v)); }
+inline vmask operator >  (vfloat a, vfloat b) { return vmask(_mm_cmpgt_ps(a.v, b.v)); }
+inline vmask operator >= (vfloat a, vfloat b) { return vmask(_mm_cmpge_ps(a.v, b.v)); }
+// Returns a in the lanes where m is set and b everywhere else
+inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)); }
+// Rounds every lane to the nearest integer and stores the results to SIMD_ALIGN aligned memory
+inline void storeRounded(vfloat a, int* p) { _mm_store_si128((__m128i*)p, _mm_cvtps_epi32(a.v)); }
+// Splits positive normal numbers into a mantissa in [1, 2), which is returned, and the exponent e
+inline vfloat vfrexp(vfloat a, vfloat& e) {
+	e = _mm_sub_ps(_mm_cvtepi32_ps(_mm_srli_epi32(_mm_castps_si128(a.v), 23)), _mm_set1_ps(127.f));
+	return _mm_or_ps(_mm_and_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(0x007fffff))), _mm_set1_ps(1.f));
+}
+// a * 2^e for integer e in [-126, 127]
+inline vfloat vldexp(vfloat a, vfloat e) {
+	const __m128i biased = _mm_cvtps_epi32(_mm_add_ps(e.v, _mm_set1_ps(127.f)));
+	return _mm_mul_ps(a.v, _mm_castsi128_ps(_mm_slli_epi32(biased, 23)));
+}
+
+struct vint {
+	__m128i v;
+	vint() {}
+	vint(__m128i v): v(v) {}
+	vint(int i): v(_mm_set1_epi32(i)) {}
+	void store(int* p) const { _mm_store_si128((__m128i*)p, v); }
+};
+inline vint select(vmask m, vint a, vint b) {
+	const __m128i mi = _mm_castps_si128(m.m);
+	return _mm_or_si128(_mm_and_si128(mi, a.v), _mm_andnot_si128(mi, b.v));
+}
+
+#else
+
+#include <math.h>
+#define SIMD_WIDTH 4
+#define SIMD_ALIGN 16
+#define SIMD_NAME "scalar"
+
+struct vmask {
+	int m;
+	vmask() {}
+	explicit vmask(int m): m(m) {}
+	static vmask fromBits(int bits) { return vmask(bits); }
+	int bits() const { return m; }
+};
+inline vmask operator & (vmask a, vmask b) { return vmask(a.m & b.m); }
+inline vmask operator | (vmask a, vmask b) { return vmask(a.m | b.m); }
+inline vmask andNot(vmask a, vmask b) { return vmask(a.m & ~b.m); } //< a & !b
+
+struct vfloat {
+	float v[4];
+	vfloat() {}
+	vfloat(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+	static vfloat load(const float* p) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+	static vfloat loadu(const float* p) { return load(p); }
+	void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+};
+
+#define SIMD_SCALAR_OP(op) \
+	inline vfloat operator op (vfloat a, vfloat b) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] op b.v[i]; return r; }
+SIMD_SCALAR_OP(+)
+SIMD_SCALAR_OP(-)
+SIMD_SCALAR_OP(*)
+SIMD_SCALAR_OP(/)
+#undef SIMD_SCALAR_OP
+
+#define SIMD_SCALAR_CMP(op) \
+	inline vmask operator op (vfloat a, vfloat b) { int m = 0; for (int i = 0; i < 4; i++) m |= (a.v[i] op b.v[i]) << i; return vmask(m); }
+SIMD_SCALAR_CMP(<)
+SIMD_SCALAR_CMP(<=)
+SIMD_SCALAR_CMP(>)
+SIMD_SCALAR_CMP(>=)
+#undef SIMD_SCALAR_CMP
+
+inline vfloat vmin(vfloat a, vfloat b) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; }
+inline vfloat vmax(vfloat a, vfloat b) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+inline vfloat vsqrt(vfloat a) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = sqrtf(a.v[i]); return r; }
+inline vfloat vrsqrt(vfloat a) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = 1.f / sqrtf(a.v[i]); return r; }
+// Returns a in the lanes where m is set and b everywhere else
+inline vfloat select(vmask m, vfloat a, vfloat b) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = ((m.m >> i) & 1) ? a.v[i] : b.v[i]; return r; }
+// Rounds every lane to the nearest integer and stores the results
+inline void storeRounded(vfloat a, int* p) { for (int i = 0; i < 4; i++) p[i] = int(floorf(a.v[i] + 0.5f)); }
+// Splits positive normal numbers into a mantissa in [1, 2), which is returned, and the exponent e
+inline vfloat vfrexp(vfloat a, vfloat& e) {
+	vfloat r;
+	for (int i = 0; i < 4; i++) {
+		int exp;
+		r.v[i] = frexpf(a.v[i], &exp) * 2.f;
+		e.v[i] = float(exp - 1);
+	}
+	return r;
+}
+// a * 2^e for integer e in [-126, 127]
+inline vfloat vldexp(vfloat a, vfloat e) { vfloat r; for (int i = 0; i < 4; i++) r.v[i] = ldexpf(a.v[i], int(e.v[i])); return r; }
+
+struct vint {
+	int v[4];
+	vint() {}
+	vint(int i) { v[0] = v[1] = v[2] = v[3] = i; }
+	void store(int* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+};
+inline vint select(vmask m, vint a, vint b) { vint r; for (int i = 0; i < 4; i++) r.v[i] = ((m.m >> i) & 1) ? a.v[i] : b.v[i]; return r; }
+
+#endif
+
+inline vfloat operator - (vfloat a) { return vfloat(0.f) - a; }
+
+inline bool any(vmask m) { return m.bits() != 0; }
+inline bool none(vmask m) { return m.bits() == 0; }
+inline vmask allLanes() { return vmask::fromBits((1 << SIMD_WIDTH) - 1); }
+
+// Reads a single lane. Meant for the scalar tails of packet code, not for inner loops.
+inline float getLane(vfloat a, int lane) {
+	alignas(SIMD_ALIGN) float tmp[SIMD_WIDTH];
+	a.store(tmp);
+	return tmp[lane];
+}
+
+// Returns {0, 1, 2, ... SIMD_WIDTH-1}
+inline vfloat laneIndices() {
+	alignas(SIMD_ALIGN) float tmp[SIMD_WIDTH];
+	for (int i = 0; i < SIMD_WIDTH; i++) tmp[i] = float(i);
+	return vfloat::load(tmp);
+}
+
+inline void* alignedMalloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void* ptr = nullptr;
+	if (posix_memalign(&ptr, alignment, size)) return nullptr;
+	return ptr;
+#endif
+}
+
+inline void alignedFree(void* ptr) {
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+// Allocator for std::vector that aligns the storage to SIMD_ALIGN, so vfloat::load can be used on it
+template <class T>
+struct AlignedAllocator {
+	typedef T value_type;
+	AlignedAllocator() {}
+	template <class U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+	T* allocate(size_t n) {
+		void* ptr = alignedMalloc(n * sizeof(T), SIMD_ALIGN);
+		if (!ptr) throw std::bad_alloc();
+		return static_cast<T*>(ptr);
+	}
+	void deallocate(T* ptr, size_t) { alignedFree(ptr); }
+};
+template <class T, class U> bool operator == (const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+template <class T, class U> bool operator != (const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
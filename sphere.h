@@ -1,13 +1,25 @@
 #pragma once
 #include "vector.h"
 #include "defs.h"
+#include "stats.h"
+#include "bbox.h"
+#include "fastmath.h"
 
 struct Sphere {
 public:
-	Sphere() : O(Vector(0, 0, 0)), radius(1.f) {}
+	Sphere() : material(0), radius(1.f), O(Vector(0, 0, 0)) {}
+	Sphere(const Vector& pos, float r, int material = 0) : material(material), radius(r), O(pos) {}
+	// Finds the distance of the closest hit only, see getHitInfo for the rest
 	int intersect(const Ray& ray, IntersectionInfo& info) const;
+	// Computes the HIT_* attributes in 'attributes' for a ray that hits the sphere at distance t
+	void getHitInfo(const Ray& ray, float t, IntersectionInfo& info, int attributes = HIT_ALL) const;
 	void setRadius(float r) { radius = r; }
 	void setPos(const Vector& newPos) { O = newPos;}
+	float getRadius() const { return radius; }
+	const Vector& getPos() const { return O; }
+	BBox getBBox() const { return BBox(O - Vector(radius, radius, radius), O + Vector(radius, radius, radius)); }
+
+	int material; //< Index in Scene::materials
 private:
 	float radius;
 	Vector O;
@@ -26,7 +38,8 @@ private:
 // (5): (D*D)*x^2 + 2*D*H*x + H*H - r*r = 0
 // This function solves the quadratic equation in (5) and returns information about the intersection
 // If no intersection is found we return infinite distance to mark
-int Sphere::intersect(const Ray &ray, IntersectionInfo &info) const {
+inline int Sphere::intersect(const Ray &ray, IntersectionInfo &info) const {
+	STATS_ADD(STAT_PRIM_TESTS, 1);
 	const Vector &S = ray.origin;
 	const Vector &D = ray.dir;
 	const Vector &H = S - O; // When sphere is located at 0,0,0, then H == S
@@ -45,13 +58,32 @@ int Sphere::intersect(const Ray &ray, IntersectionInfo &info) const {
 	if (info.distSq < distSqr) return false;
 
 	info.distSq = distSqr;
+	info.attributes = 0;
+
+	return true;
+}
 
-	info.intersectionPoint = S + D * sol;
-	info.normal = info.intersectionPoint/radius;
+// Spherical uv coordinates of the unit normal (x, y, z), for float and vfloat
+template <class T>
+inline void sphereUV(T x, T y, T z, T& u, T& v) {
+	u = T(0.5f) + fastmath::fastAtan2(y, x) * T(0.5f / pi());
+	v = T(0.5f) + fastmath::fastAsin(z) * T(1.f / pi());
+}
 
-	const Vector& P = info.normal;
-	info.u = 0.5f + atan2f(P.y, P.x)/(2.0f*pi());
-	info.v = 0.5f + asinf(P.z)/pi();
+inline void Sphere::getHitInfo(const Ray& ray, float t, IntersectionInfo& info, int attributes) const {
+	info.distSq = t*t;
+	// The uv coordinates are derived from the normal and the normal from the point
+	const int needed = attributes | ((attributes & HIT_UV) ? HIT_NORMAL : 0) | ((attributes & HIT_NORMAL) ? HIT_POINT : 0);
 
-	return true;
+	if (needed & HIT_POINT) {
+		info.intersectionPoint = ray.origin + ray.dir * t;
+	}
+	if (needed & HIT_NORMAL) {
+		info.normal = (info.intersectionPoint - O)/radius;
+	}
+	if (needed & HIT_UV) {
+		const Vector& P = info.normal;
+		sphereUV(P.x, P.y, P.z, info.u, info.v);
+	}
+	info.attributes |= needed;
 }
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "sphere.h"
+#include "simd.h"
+#include "defs.h"
+#include "mappablearray.h"
+
+#include <vector>
+
+// A set of spheres stored as separate, SIMD aligned arrays of center coordinates and radii.
+// The intersection kernel tests one ray against SIMD_WIDTH spheres per step and keeps the
+// closest hit in every lane, the lanes are reduced to a single hit once at the end.
+// The arrays are padded with SIMD_WIDTH extra elements, so any range of the set can be loaded
+// with full width loads without reading past the allocation.
+class SphereSet {
+public:
+	SphereSet(): count(0) {}
+
+	void assign(const std::vector<Sphere>& spheres);
+	void clear();
+	int size() const { return count; }
+	Sphere get(int i) const { return Sphere(Vector(x[i], y[i], z[i]), r[i]); }
+	void set(int i, const Sphere& s) {
+		x[i] = s.getPos().x;
+		y[i] = s.getPos().y;
+		z[i] = s.getPos().z;
+		r[i] = s.getRadius();
+	}
+
+	// Finds the closest sphere in [start, end) that the ray hits at a distance of at most tMax.
+	// Returns its index and updates tMax, or returns -1 and leaves tMax untouched.
+	int intersect(const Ray& ray, int start, int end, float& tMax) const;
+
+	// Returns true if the ray hits any sphere in [start, end) at a distance of at most tMax
+	bool occluded(const Ray& ray, int start, int end, float tMax) const;
+
+	// Finds the closest hit with any sphere in the set and fills info for it.
+	// info.primId is set to the index of the sphere in the set.
+	bool intersect(const Ray& ray, IntersectionInfo& info) const;
+
+	// Calls visit(array) for the coordinate and radius arrays, see BVHTree::visitArrays.
+	// Mapped arrays have to start at SIMD_ALIGN and hold the padding too.
+	template <class Visitor>
+	void visitArrays(Visitor& visit) {
+		visit(x);
+		visit(y);
+		visit(z);
+		visit(r);
+		count = r.empty() ? 0 : int(r.size()) - SIMD_WIDTH;
+	}
+
+private:
+	typedef MappableArray<float, AlignedAllocator<float> > FloatArray;
+	FloatArray x, y, z, r;
+	int count;
+};
+
+inline void SphereSet::assign(const std::vector<Sphere>& spheres) {
+	count = int(spheres.size());
+	const int padded = count + SIMD_WIDTH;
+	x.assign(padded, 0.f);
+	y.assign(padded, 0.f);
+	z.assign(padded, 0.f);
+	r.assign(padded, 0.f);
+	for (int i = 0; i < count; i++) {
+		const Vector& O = spheres[i].getPos();
+		x[i] = O.x;
+		y[i] = O.y;
+		z[i] = O.z;
+		r[i] = spheres[i].getRadius();
+	}
+}
+
+inline void SphereSet::clear() {
+	x.clear();
+	y.clear();
+	z.clear();
+	r.clear();
+	count = 0;
+}
+
+// Same quadratic as in Sphere::intersect. The parts that depend only on the ray are hoisted out of the loop.
+inline int SphereSet::intersect(const Ray& ray, int start, int end, float& tMax) const {
+	const vfloat ox(ray.origin.x), oy(ray.origin.y), oz(ray.origin.z);
+	const vfloat dx(ray.dir.x), dy(ray.dir.y), dz(ray.dir.z);
+	const float A = dot(ray.dir, ray.dir);
+	const vfloat fourA(4.f * A);
+	const vfloat inv2A(0.5f / A);
+	const vfloat lanes = laneIndices();
+
+	vfloat bestT(tMax);
+	// Start of the block of the closest hit in every lane, the lane adds its offset at the end.
+	// Kept in integer lanes, floats cannot hold every index of a large set.
+	vint bestStart(-1);
+	bool found = false;
+	for (int i = start; i < end; i += SIMD_WIDTH) {
+		const vfloat hx = ox - vfloat::loadu(&x[i]);
+		const vfloat hy = oy - vfloat::loadu(&y[i]);
+		const vfloat hz = oz - vfloat::loadu(&z[i]);
+		const vfloat rad = vfloat::loadu(&r[i]);
+		const vfloat B = vfloat(2.f) * (hx*dx + hy*dy + hz*dz);
+		const vfloat C = hx*hx + hy*hy + hz*hz - rad*rad;
+		const vfloat Dscr = B*B - fourA*C;
+
+		vmask valid = (Dscr >= vfloat(0.f)) & (lanes < vfloat(float(Min(end - i, SIMD_WIDTH))));
+		if (none(valid)) continue;
+
+		const vfloat sq = vsqrt(vmax(Dscr, vfloat(0.f)));
+		const vfloat x1 = (-B + sq) * inv2A;
+		const vfloat x2 = (-B - sq) * inv2A;
+		const vfloat sol = select(x2 < vfloat(0.f), x1, x2);
+		valid = valid & (sol >= vfloat(0.f)) & (sol <= bestT);
+		if (none(valid)) continue;
+
+		found = true;
+		bestT = select(valid, sol, bestT);
+		bestStart = select(valid, vint(i), bestStart);
+	}
+
+	if (!found) {
+		return -1;
+	}
+
+	alignas(SIMD_ALIGN) float t[SIMD_WIDTH];
+	alignas(SIMD_ALIGN) int blockStart[SIMD_WIDTH];
+	bestT.store(t);
+	bestStart.store(blockStart);
+	int best = -1;
+	for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+		if (blockStart[lane] >= 0 && t[lane] <= tMax) {
+			tMax = t[lane];
+			best = blockStart[lane] + lane;
+		}
+	}
+	return best;
+}
+
+// Same as above, but returns as soon as one lane has a hit instead of keeping the closest one
+inline bool SphereSet::occluded(const Ray& ray, int start, int end, float tMax) const {
+	const vfloat ox(ray.origin.x), oy(ray.origin.y), oz(ray.origin.z);
+	const vfloat dx(ray.dir.x), dy(ray.dir.y), dz(ray.dir.z);
+	const float A = dot(ray.dir, ray.dir);
+	const vfloat fourA(4.f * A);
+	const vfloat inv2A(0.5f / A);
+	const vfloat lanes = laneIndices();
+	const vfloat maxT(tMax);
+
+	for (int i = start; i < end; i += SIMD_WIDTH) {
+		const vfloat hx = ox - vfloat::loadu(&x[i]);
+		const vfloat hy = oy - vfloat::loadu(&y[i]);
+		const vfloat hz = oz - vfloat::loadu(&z[i]);
+		const vfloat rad = vfloat::loadu(&r[i]);
+		const vfloat B = vfloat(2.f) * (hx*dx + hy*dy + hz*dz);
+		const vfloat C = hx*hx + hy*hy + hz*hz - rad*rad;
+		const vfloat Dscr = B*B - fourA*C;
+
+		vmask valid = (Dscr >= vfloat(0.f)) & (lanes < vfloat(float(Min(end - i, SIMD_WIDTH))));
+		if (none(valid)) continue;
+
+		const vfloat sq = vsqrt(vmax(Dscr, vfloat(0.f)));
+		const vfloat x1 = (-B + sq) * inv2A;
+		const vfloat x2 = (-B - sq) * inv2A;
+		const vfloat sol = select(x2 < vfloat(0.f), x1, x2);
+		if (any(valid & (sol >= vfloat(0.f)) & (sol <= maxT))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+inline bool SphereSet::intersect(const Ray& ray, IntersectionInfo& info) const {
+	float t = info.isValid() ? sqrtf(info.distSq) : FLT_MAX;
+	const int idx = intersect(ray, 0, count, t);
+	if (idx < 0) {
+		return false;
+	}
+	info.distSq = t*t;
+	info.primId = idx;
+	info.attributes = 0;
+	return true;
+}
@@ -0,0 +1,153 @@
+#include "stats.h"
+
+#include "timer.h"
+
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+const char* statNames[STAT_COUNT] = {
+	"rays",
+	"shadow_rays",
+	"bvh_node_visits",
+	"intersection_tests",
+	"hits",
+	"misses",
+	"shading_calls",
+	"samples",
+	"texture_samples",
+	"texture_tile_loads",
+};
+
+const char* statHelp[STAT_COUNT] = {
+	"Rays traced through the scene",
+	"Shadow rays traced towards lights",
+	"BVH nodes tested",
+	"Ray-sphere and ray-triangle intersection tests",
+	"Camera samples that hit an object",
+	"Camera samples that hit nothing",
+	"Shading function calls",
+	"Pixel samples written",
+	"Filtered texture lookups",
+	"Texture tiles decoded into the tile cache",
+};
+
+// All live per-thread blocks. Threads register on first use and fold their counts into
+// 'retired' when they exit, so nothing is lost when a thread pool recreates its threads.
+struct StatsRegistry {
+	std::mutex lock;
+	std::vector<StatCounters*> live;
+	StatCounters retired;
+	StatCounters collected; //< Totals at the previous collectFrameStats
+};
+
+StatsRegistry& registry() {
+	static StatsRegistry reg;
+	return reg;
+}
+
+struct ThreadStatsBlock {
+	StatCounters counters;
+	ThreadStatsBlock() {
+		StatsRegistry& reg = registry();
+		std::lock_guard<std::mutex> guard(reg.lock);
+		reg.live.push_back(&counters);
+	}
+	~ThreadStatsBlock() {
+		threadStatsPtr = nullptr;
+		StatsRegistry& reg = registry();
+		std::lock_guard<std::mutex> guard(reg.lock);
+		reg.retired += counters;
+		reg.live.erase(std::find(reg.live.begin(), reg.live.end(), &counters));
+	}
+};
+
+double secondsSinceStart() {
+	static a7az0th::Timer start;
+	a7az0th::Timer t = start;
+	t.stop();
+	return t.elapsed(a7az0th::Timer::Nanoseconds) / 1e9;
+}
+
+} // namespace
+
+const char* getStatName(StatCounter counter) {
+	return statNames[counter];
+}
+
+const char* getStatHelp(StatCounter counter) {
+	return statHelp[counter];
+}
+
+thread_local StatCounters* threadStatsPtr = nullptr;
+
+StatCounters* registerThreadStats() {
+	thread_local ThreadStatsBlock block;
+	threadStatsPtr = &block.counters;
+	return threadStatsPtr;
+}
+
+StatCounters collectFrameStats() {
+	StatsRegistry& reg = registry();
+	std::lock_guard<std::mutex> guard(reg.lock);
+	StatCounters total = reg.retired;
+	for (int i = 0; i < int(reg.live.size()); i++) {
+		total += *reg.live[i];
+	}
+	StatCounters frame;
+	for (int i = 0; i < STAT_COUNT; i++) {
+		frame[i] = total[i] - reg.collected[i];
+	}
+	reg.collected = total;
+	return frame;
+}
+
+MetricsWriter::MetricsWriter(const std::string& fileName, double intervalSec)
+	: fileName(fileName), intervalSec(intervalSec), lastWriteSec(-1.0), elapsedSec(0.0), frames(0) {}
+
+bool MetricsWriter::update(const FrameStats& frame) {
+	totals += frame.counters;
+	elapsedSec += frame.frameMs / 1000.0;
+	last = frame;
+	frames++;
+	if (lastWriteSec >= 0.0 && secondsSinceStart() - lastWriteSec < intervalSec) {
+		return true;
+	}
+	return flush();
+}
+
+bool MetricsWriter::flush() {
+	lastWriteSec = secondsSinceStart();
+	const std::string tmpName = fileName + ".tmp";
+	FILE* fp = fopen(tmpName.c_str(), "w");
+	if (!fp) {
+		return false;
+	}
+	for (int i = 0; i < STAT_COUNT; i++) {
+		const StatCounter c = StatCounter(i);
+		fprintf(fp, "# HELP cg_%s_total %s\n", getStatName(c), getStatHelp(c));
+		fprintf(fp, "# TYPE cg_%s_total counter\n", getStatName(c));
+		fprintf(fp, "cg_%s_total %llu\n", getStatName(c), (unsigned long long)totals[i]);
+	}
+	fprintf(fp, "# HELP cg_frames_total Frames rendered\n# TYPE cg_frames_total counter\ncg_frames_total %d\n", frames);
+	fprintf(fp, "# HELP cg_render_seconds_total Time spent in raytrace\n# TYPE cg_render_seconds_total counter\ncg_render_seconds_total %.6f\n", elapsedSec);
+	for (int i = 0; i < STAT_COUNT; i++) {
+		const StatCounter c = StatCounter(i);
+		fprintf(fp, "# HELP cg_last_frame_%s %s in the last frame\n", getStatName(c), getStatHelp(c));
+		fprintf(fp, "# TYPE cg_last_frame_%s gauge\n", getStatName(c));
+		fprintf(fp, "cg_last_frame_%s %llu\n", getStatName(c), (unsigned long long)last.counters[i]);
+	}
+	fprintf(fp, "# HELP cg_last_frame_seconds Duration of the last frame\n# TYPE cg_last_frame_seconds gauge\ncg_last_frame_seconds %.6f\n", last.frameMs / 1000.0);
+	fprintf(fp, "# HELP cg_last_frame_rays_per_second Ray throughput of the last frame\n# TYPE cg_last_frame_rays_per_second gauge\ncg_last_frame_rays_per_second %.1f\n", last.raysPerSecond());
+	if (fclose(fp) != 0) {
+		return false;
+	}
+#ifdef _WIN32
+	// rename does not replace an existing file on Windows
+	remove(fileName.c_str());
+#endif
+	return rename(tmpName.c_str(), fileName.c_str()) == 0;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "defs.h"
+
+#include <string>
+
+// Render statistics. Every thread counts into its own thread_local block with plain increments,
+// the blocks are summed once per frame by collectFrameStats, after all render threads are done.
+// Counting can be compiled out with the CG_STATS CMake option, STATS_ADD then expands to nothing.
+
+enum StatCounter {
+	STAT_RAYS, //< Rays traced through the scene, packets count their active lanes
+	STAT_SHADOW_RAYS, //< Occlusion queries towards lights
+	STAT_NODE_VISITS, //< BVH nodes whose box was tested
+	STAT_PRIM_TESTS, //< Ray-sphere and ray-triangle tests
+	STAT_HITS, //< Camera samples that hit something
+	STAT_MISSES, //< Camera samples that hit nothing
+	STAT_SHADING_CALLS, //< Calls to the shading function
+	STAT_SAMPLES, //< Pixel samples written to the canvas
+	STAT_TEXTURE_SAMPLES, //< Filtered texture lookups
+	STAT_TEXTURE_TILE_LOADS, //< Texture tiles decoded into the tile cache
+	STAT_COUNT
+};
+
+struct StatCounters {
+	uint64 values[STAT_COUNT];
+
+	StatCounters() { clear(); }
+	void clear() {
+		for (int i = 0; i < STAT_COUNT; i++) values[i] = 0;
+	}
+	uint64& operator[](int idx) { return values[idx]; }
+	uint64 operator[](int idx) const { return values[idx]; }
+	StatCounters& operator += (const StatCounters& rhs) {
+		for (int i = 0; i < STAT_COUNT; i++) values[i] += rhs.values[i];
+		return *this;
+	}
+};
+
+// Name of the counter in snake case, as used in the metrics file
+const char* getStatName(StatCounter counter);
+// One line description of the counter
+const char* getStatHelp(StatCounter counter);
+
+// Counters of the calling thread, null until the thread counts for the first time.
+// A plain pointer needs no initialization guard, so the hot path is a single TLS load.
+extern thread_local StatCounters* threadStatsPtr;
+// Creates and registers the counters of the calling thread
+StatCounters* registerThreadStats();
+
+// The counters of the calling thread
+inline StatCounters& threadStats() {
+	StatCounters* stats = threadStatsPtr;
+	return stats ? *stats : *registerThreadStats();
+}
+
+// Everything counted by all threads since the previous call. Must not be called while other
+// threads are rendering.
+StatCounters collectFrameStats();
+
+// The counters of one frame
+struct FrameStats {
+	StatCounters counters;
+	double frameMs; //< Wall clock time of the raytrace call
+	int frame; //< Index of the frame, counting from 0
+	int numBuckets; //< Buckets rendered, fewer than the frame has if an incremental frame could keep some
+
+	FrameStats(): frameMs(0.0), frame(-1), numBuckets(0) {}
+	double raysPerSecond() const { return frameMs > 0.0 ? counters[STAT_RAYS] * 1000.0 / frameMs : 0.0; }
+};
+
+// Writes the statistics in Prometheus text exposition format. The totals are reported as counters
+// and the last frame as gauges. The file is rewritten at most once every intervalSec, it is first
+// written to a temporary file and then renamed, so a scraper never sees a partial file.
+class MetricsWriter {
+public:
+	MetricsWriter(const std::string& fileName, double intervalSec);
+
+	// Adds the frame to the totals and rewrites the file if the interval has passed.
+	// Returns false if writing failed.
+	bool update(const FrameStats& frame);
+	// Rewrites the file right away
+	bool flush();
+
+private:
+	std::string fileName;
+	double intervalSec;
+	double lastWriteSec; //< Time of the last write, -1 before the first one
+	double elapsedSec; //< Render time accumulated from the frames
+	StatCounters totals;
+	FrameStats last;
+	int frames;
+};
+
+#ifdef CG_STATS
+	#define STATS_ADD(counter, n) (threadStats().values[counter] += uint64(n))
+#else
+	#define STATS_ADD(counter, n) ((void)0)
+#endif
@@ -0,0 +1,470 @@
+#include "texture.h"
+#include "random.h"
+#include "stats.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const uint32 TEXTURE_FILE_VERSION = 2;
+const size_t TILE_BYTES = TEXTURE_TILE_TEXELS * sizeof(uint32);
+
+struct TextureFileHeader {
+	char magic[4]; //< "CGTX"
+	uint32 version;
+	uint64 sourceSize; //< Size of the source image the file was built from
+	uint64 sourceTime; //< Modification time of the source image, see MappedFile::modificationTime
+	int32 numLevels;
+	uint32 dataOffset; //< Start of the first tile
+};
+
+// The tiles start at a page boundary. With pages of at least 4 KB no tile straddles two pages,
+// a tile that is sampled pages in only itself.
+size_t getDataOffset(int numLevels) {
+	const size_t headerSize = sizeof(TextureFileHeader) + numLevels * sizeof(TextureLevel);
+	const size_t align = Max(getPageSize(), TILE_BYTES);
+	return (headerSize + align - 1) / align * align;
+}
+
+// Shared exponent encoding: three 8 bit mantissas and one exponent, enough range for HDR images
+// in the size of an 8-bit RGBA texel
+uint32 encodeRGBE(const Color& c) {
+	const float m = Max(c.r, Max(c.g, c.b));
+	if (!(m > 1e-32f)) {
+		return 0;
+	}
+	int e;
+	const float scale = frexpf(m, &e) * 256.f / m;
+	const uint32 r = uint32(Max(c.r, 0.f) * scale);
+	const uint32 g = uint32(Max(c.g, 0.f) * scale);
+	const uint32 b = uint32(Max(c.b, 0.f) * scale);
+	return r | (g << 8) | (b << 16) | (uint32(e + 128) << 24);
+}
+
+inline Color decodeRGBE(uint32 rgbe) {
+	const int e = int(rgbe >> 24);
+	if (e == 0) {
+		return Color(0.f, 0.f, 0.f);
+	}
+	const float f = ldexpf(1.f, e - 136);
+	return Color((float(rgbe & 0xff) + 0.5f) * f, (float((rgbe >> 8) & 0xff) + 0.5f) * f, (float((rgbe >> 16) & 0xff) + 0.5f) * f);
+}
+
+float srgbToLinear(float c) {
+	return (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+// Reads the next header token of a PPM or PFM file, skipping comments
+bool readToken(const char*& p, const char* end, std::string& token) {
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+		if (p < end && *p == '#') {
+			while (p < end && *p != '\n') p++;
+		} else {
+			break;
+		}
+	}
+	const char* start = p;
+	while (p < end && !(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+	token.assign(start, p);
+	// Exactly one whitespace character separates the header from the pixels
+	if (p < end) p++;
+	return !token.empty();
+}
+
+// Reads a binary 8-bit PPM (sRGB) or a PFM (linear) into linear colors, top row first
+bool readSourceImage(const MappedFile& file, int& width, int& height, std::vector<Color>& pixels) {
+	const char* p = file.data();
+	const char* end = p + file.size();
+	std::string magic, w, h, range;
+	if (!readToken(p, end, magic) || !readToken(p, end, w) || !readToken(p, end, h) || !readToken(p, end, range)) {
+		return false;
+	}
+	width = atoi(w.c_str());
+	height = atoi(h.c_str());
+	if (width <= 0 || height <= 0 || width > (1 << 16) || height > (1 << 16)) {
+		return false;
+	}
+	const size_t numPixels = size_t(width) * height;
+	pixels.resize(numPixels);
+
+	if (magic == "P6") {
+		if (atoi(range.c_str()) != 255 || size_t(end - p) < numPixels * 3) {
+			return false;
+		}
+		float linear[256];
+		for (int i = 0; i < 256; i++) {
+			linear[i] = srgbToLinear(float(i) / 255.f);
+		}
+		const uint8* src = reinterpret_cast<const uint8*>(p);
+		for (size_t i = 0; i < numPixels; i++) {
+			pixels[i] = Color(linear[src[i*3 + 0]], linear[src[i*3 + 1]], linear[src[i*3 + 2]]);
+		}
+		return true;
+	}
+
+	if (magic == "PF" || magic == "Pf") {
+		const int channels = (magic == "PF") ? 3 : 1;
+		// A positive scale marks big-endian data
+		const bool swap = atof(range.c_str()) > 0.0;
+		if (size_t(end - p) < numPixels * channels * sizeof(float)) {
+			return false;
+		}
+		for (int y = 0; y < height; y++) {
+			// Rows are stored bottom to top
+			const char* row = p + size_t(height - 1 - y) * width * channels * sizeof(float);
+			for (int x = 0; x < width; x++) {
+				float v[3];
+				for (int c = 0; c < channels; c++) {
+					uint32 bits;
+					memcpy(&bits, row + (x * channels + c) * sizeof(float), sizeof(bits));
+					if (swap) {
+						bits = (bits >> 24) | ((bits >> 8) & 0xff00u) | ((bits << 8) & 0xff0000u) | (bits << 24);
+					}
+					memcpy(&v[c], &bits, sizeof(float));
+				}
+				pixels[size_t(y) * width + x] = (channels == 3) ? Color(v[0], v[1], v[2]) : Color(v[0], v[0], v[0]);
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+// Box filters the level into one of half the size. An odd last row or column is folded into its
+// neighbour, so no texel is dropped.
+void downsample(const std::vector<Color>& src, int width, int height, std::vector<Color>& dst, int& dstWidth, int& dstHeight) {
+	dstWidth = Max(width / 2, 1);
+	dstHeight = Max(height / 2, 1);
+	dst.resize(size_t(dstWidth) * dstHeight);
+	for (int y = 0; y < dstHeight; y++) {
+		const int y0 = Min(y * 2, height - 1);
+		const int y1 = (y == dstHeight - 1) ? height - 1 : y0 + 1;
+		for (int x = 0; x < dstWidth; x++) {
+			const int x0 = Min(x * 2, width - 1);
+			const int x1 = (x == dstWidth - 1) ? width - 1 : x0 + 1;
+			Color sum(0.f, 0.f, 0.f);
+			int count = 0;
+			for (int sy = y0; sy <= y1; sy++) {
+				for (int sx = x0; sx <= x1; sx++) {
+					sum += src[size_t(sy) * width + sx];
+					count++;
+				}
+			}
+			dst[size_t(y) * dstWidth + x] = sum / float(count);
+		}
+	}
+}
+
+// Writes one level tile by tile. Texels of the edge tiles outside the level repeat the last
+// row and column, they are never sampled.
+bool writeLevelTiles(FILE* fp, const std::vector<Color>& pixels, const TextureLevel& level) {
+	std::vector<uint32> tile(TEXTURE_TILE_TEXELS);
+	for (int ty = 0; ty < level.tilesY; ty++) {
+		for (int tx = 0; tx < level.tilesX; tx++) {
+			for (int y = 0; y < TEXTURE_TILE_SIZE; y++) {
+				const int py = Min(ty * TEXTURE_TILE_SIZE + y, level.height - 1);
+				for (int x = 0; x < TEXTURE_TILE_SIZE; x++) {
+					const int px = Min(tx * TEXTURE_TILE_SIZE + x, level.width - 1);
+					tile[mortonIndex(x, y)] = encodeRGBE(pixels[size_t(py) * level.width + px]);
+				}
+			}
+			if (fwrite(tile.data(), TILE_BYTES, 1, fp) != 1) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Converts the source image into the tiled mip chain file. The file is written under a
+// temporary name and renamed, so other processes never map a partial file.
+bool buildTextureFile(const std::string& sourceName, const std::string& tiledName) {
+	MappedFile source;
+	if (!source.open(sourceName.c_str())) {
+		printf("Failed to open %s\n", sourceName.c_str());
+		return false;
+	}
+	int width, height;
+	std::vector<Color> pixels;
+	if (!readSourceImage(source, width, height, pixels)) {
+		printf("Failed to parse %s, only binary 8-bit .ppm and .pfm textures are supported\n", sourceName.c_str());
+		return false;
+	}
+
+	std::vector<TextureLevel> levels;
+	int numTiles = 0;
+	for (int w = width, h = height; ; w = Max(w / 2, 1), h = Max(h / 2, 1)) {
+		TextureLevel level;
+		level.width = w;
+		level.height = h;
+		level.tilesX = (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		level.tilesY = (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		level.firstTile = numTiles;
+		numTiles += level.tilesX * level.tilesY;
+		levels.push_back(level);
+		if (w == 1 && h == 1) {
+			break;
+		}
+	}
+
+	const std::string tmpName = tiledName + ".tmp";
+	FILE* fp = fopen(tmpName.c_str(), "wb");
+	if (!fp) {
+		printf("Failed to write %s\n", tmpName.c_str());
+		return false;
+	}
+	TextureFileHeader header;
+	memcpy(header.magic, "CGTX", 4);
+	header.version = TEXTURE_FILE_VERSION;
+	header.sourceSize = uint64(source.size());
+	header.sourceTime = source.modificationTime();
+	header.numLevels = int32(levels.size());
+	header.dataOffset = uint32(getDataOffset(int(levels.size())));
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(levels.data(), sizeof(TextureLevel), levels.size(), fp) == levels.size();
+	const size_t padding = header.dataOffset - sizeof(header) - levels.size() * sizeof(TextureLevel);
+	const std::vector<char> zeros(padding, 0);
+	ok = ok && (padding == 0 || fwrite(zeros.data(), 1, padding, fp) == padding);
+
+	std::vector<Color> next;
+	for (int i = 0; i < int(levels.size()) && ok; i++) {
+		ok = writeLevelTiles(fp, pixels, levels[i]);
+		if (i + 1 < int(levels.size())) {
+			int w, h;
+			downsample(pixels, levels[i].width, levels[i].height, next, w, h);
+			pixels.swap(next);
+		}
+	}
+	ok = (fclose(fp) == 0) && ok;
+	if (ok) {
+#ifdef _WIN32
+		// rename does not replace an existing file on Windows
+		remove(tiledName.c_str());
+#endif
+		ok = rename(tmpName.c_str(), tiledName.c_str()) == 0;
+	}
+	if (!ok) {
+		remove(tmpName.c_str());
+		printf("Failed to write %s\n", tiledName.c_str());
+	}
+	return ok;
+}
+
+} // namespace
+
+Texture::Texture(const std::string& fileName): fileName(fileName), valid(false), dataOffset(0) {}
+
+bool Texture::load() {
+	std::call_once(loadFlag, [this]() { valid = open(); });
+	return valid;
+}
+
+bool Texture::open() {
+	MappedFile source;
+	if (!source.open(fileName.c_str())) {
+		printf("Failed to open %s\n", fileName.c_str());
+		return false;
+	}
+	const uint64 sourceSize = uint64(source.size());
+	const uint64 sourceTime = source.modificationTime();
+	source.close();
+
+	const std::string tiledName = fileName + ".cgtex";
+	for (int attempt = 0; attempt < 2; attempt++) {
+		if (file.open(tiledName.c_str(), false) && file.size() >= sizeof(TextureFileHeader)) {
+			TextureFileHeader header;
+			memcpy(&header, file.data(), sizeof(header));
+			if (!memcmp(header.magic, "CGTX", 4) && header.version == TEXTURE_FILE_VERSION &&
+				header.sourceSize == sourceSize && header.sourceTime == sourceTime && header.numLevels > 0 && header.numLevels <= 32 &&
+				header.dataOffset % TILE_BYTES == 0 && header.dataOffset >= sizeof(header) + header.numLevels * sizeof(TextureLevel)) {
+				levels.resize(header.numLevels);
+				memcpy(levels.data(), file.data() + sizeof(header), levels.size() * sizeof(TextureLevel));
+				const TextureLevel& last = levels.back();
+				// The offset of the machine that wrote the file, its page size may differ
+				dataOffset = header.dataOffset;
+				if (file.size() >= dataOffset + size_t(last.firstTile + last.tilesX * last.tilesY) * TILE_BYTES) {
+					return true;
+				}
+			}
+			levels.clear();
+		}
+		// Missing, stale or truncated, build it and try again
+		file.close();
+		if (attempt == 0 && !buildTextureFile(fileName, tiledName)) {
+			return false;
+		}
+	}
+	printf("Failed to load %s\n", tiledName.c_str());
+	return false;
+}
+
+void Texture::decodeTile(int tile, Color* texels) const {
+	const char* src = file.data() + dataOffset + size_t(tile) * TILE_BYTES;
+	for (int i = 0; i < TEXTURE_TILE_TEXELS; i++) {
+		uint32 rgbe;
+		memcpy(&rgbe, src + i * sizeof(uint32), sizeof(rgbe));
+		texels[i] = decodeRGBE(rgbe);
+	}
+}
+
+// Reads texels tile by tile, keeping the current tile pinned until the next one is needed
+struct TileFetcher {
+	TileFetcher(TextureCache& cache, int texture): cache(cache), texture(texture), tile(-1), slot(-1), texels(nullptr) {}
+	~TileFetcher() {
+		if (slot >= 0) cache.release(slot);
+	}
+
+	const Color& fetch(int newTile, int texel) {
+		if (newTile != tile) {
+			if (slot >= 0) cache.release(slot);
+			slot = cache.acquire(texture, newTile, scratch);
+			texels = (slot >= 0) ? cache.getTexels(slot) : scratch;
+			tile = newTile;
+		}
+		return texels[texel];
+	}
+
+	TextureCache& cache;
+	int texture;
+	int tile;
+	int slot;
+	const Color* texels;
+	Color scratch[TEXTURE_TILE_TEXELS]; //< Holds the tile when its shard has no free slot
+};
+
+TextureCache::TextureCache(): capacity(0), slots(nullptr) {
+	setCapacity(size_t(64) << 20);
+}
+
+TextureCache::~TextureCache() {
+	for (int i = 0; i < int(textures.size()); i++) {
+		delete textures[i];
+	}
+	delete [] slots;
+}
+
+int TextureCache::add(const std::string& fileName) {
+	textures.push_back(new Texture(fileName));
+	return int(textures.size()) - 1;
+}
+
+void TextureCache::setCapacity(size_t bytes) {
+	delete [] slots;
+	// A few slots per shard at least, every thread pins up to one tile while sampling
+	const int slotsPerShard = int(Max(bytes / sizeof(Slot) / NUM_SHARDS, size_t(4)));
+	const int numSlots = slotsPerShard * NUM_SHARDS;
+	capacity = size_t(numSlots) * sizeof(Slot);
+	slots = new Slot[numSlots];
+	for (int i = 0; i < numSlots; i++) {
+		slots[i].key = EMPTY_KEY;
+		slots[i].pins = 0;
+		slots[i].referenced = false;
+	}
+	for (int i = 0; i < NUM_SHARDS; i++) {
+		shards[i].index.clear();
+		shards[i].firstSlot = i * slotsPerShard;
+		shards[i].numSlots = slotsPerShard;
+		shards[i].hand = 0;
+	}
+}
+
+int TextureCache::getWidth(int texture) {
+	return textures[texture]->load() ? textures[texture]->getWidth() : 0;
+}
+
+int TextureCache::acquire(int texture, int tile, Color* scratch) {
+	const uint64 key = (uint64(texture) << 32) | uint32(tile);
+	Shard& shard = shards[hashCombine(uint32(tile), uint32(texture)) % NUM_SHARDS];
+	// Decoding happens under the lock, so two threads never load the same tile twice
+	std::lock_guard<std::mutex> guard(shard.lock);
+	std::unordered_map<uint64, int>::const_iterator it = shard.index.find(key);
+	if (it != shard.index.end()) {
+		Slot& s = slots[it->second];
+		s.referenced = true;
+		s.pins++;
+		return it->second;
+	}
+
+	STATS_ADD(STAT_TEXTURE_TILE_LOADS, 1);
+	// Two turns of the clock clear every reference bit, so a victim is found unless all are pinned
+	int victim = -1;
+	for (int i = 0; i < 2 * shard.numSlots; i++) {
+		const int idx = shard.firstSlot + shard.hand;
+		shard.hand = (shard.hand + 1 == shard.numSlots) ? 0 : shard.hand + 1;
+		Slot& s = slots[idx];
+		if (s.pins > 0) {
+			continue;
+		}
+		if (s.referenced) {
+			s.referenced = false;
+			continue;
+		}
+		victim = idx;
+		break;
+	}
+	if (victim < 0) {
+		textures[texture]->decodeTile(tile, scratch);
+		return -1;
+	}
+
+	Slot& s = slots[victim];
+	if (s.key != EMPTY_KEY) {
+		shard.index.erase(s.key);
+	}
+	textures[texture]->decodeTile(tile, s.texels);
+	s.key = key;
+	// Only a second use marks the tile, a tile touched once is the first to go
+	s.referenced = false;
+	s.pins++;
+	shard.index[key] = victim;
+	return victim;
+}
+
+Color TextureCache::sampleLevel(int texture, int level, float u, float v) {
+	const TextureLevel& lv = textures[texture]->getLevel(level);
+	const float x = u * float(lv.width) - 0.5f;
+	const float y = v * float(lv.height) - 0.5f;
+	const float fx0 = floorf(x);
+	const float fy0 = floorf(y);
+	const float fx = x - fx0;
+	const float fy = y - fy0;
+	// u and v are in [0, 1), so the texel left of or above the first one is the only one to wrap
+	const int x0 = (int(fx0) < 0) ? lv.width - 1 : Min(int(fx0), lv.width - 1);
+	const int y0 = (int(fy0) < 0) ? lv.height - 1 : Min(int(fy0), lv.height - 1);
+	const int x1 = (x0 + 1 == lv.width) ? 0 : x0 + 1;
+	const int y1 = (y0 + 1 == lv.height) ? 0 : y0 + 1;
+
+	const int mask = TEXTURE_TILE_SIZE - 1;
+	const int tx0 = x0 / TEXTURE_TILE_SIZE, tx1 = x1 / TEXTURE_TILE_SIZE;
+	const int row0 = lv.firstTile + (y0 / TEXTURE_TILE_SIZE) * lv.tilesX;
+	const int row1 = lv.firstTile + (y1 / TEXTURE_TILE_SIZE) * lv.tilesX;
+
+	TileFetcher fetcher(*this, texture);
+	const Color c00 = fetcher.fetch(row0 + tx0, mortonIndex(x0 & mask, y0 & mask));
+	const Color c10 = fetcher.fetch(row0 + tx1, mortonIndex(x1 & mask, y0 & mask));
+	const Color c01 = fetcher.fetch(row1 + tx0, mortonIndex(x0 & mask, y1 & mask));
+	const Color c11 = fetcher.fetch(row1 + tx1, mortonIndex(x1 & mask, y1 & mask));
+	return (c00 * (1.f - fx) + c10 * fx) * (1.f - fy) + (c01 * (1.f - fx) + c11 * fx) * fy;
+}
+
+Color TextureCache::sample(int texture, float u, float v, float lod) {
+	STATS_ADD(STAT_TEXTURE_SAMPLES, 1);
+	Texture& tex = *textures[texture];
+	if (!tex.load()) {
+		return MAGENTA;
+	}
+	u -= floorf(u);
+	v -= floorf(v);
+	const float maxLevel = float(tex.getLevelCount() - 1);
+	lod = Min(Max(lod, 0.f), maxLevel);
+	const int level = int(lod);
+	const float t = lod - float(level);
+	const Color c = sampleLevel(texture, level, u, v);
+	if (t <= 0.f) {
+		return c;
+	}
+	return c * (1.f - t) + sampleLevel(texture, level + 1, u, v) * t;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "color.h"
+#include "mappedfile.h"
+#include "defs.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Side of a texture tile in texels. A tile of 32 bit RGBE texels is 4 KB, one page of the
+// mapped file with the usual page size, and 12 KB once decoded into the cache.
+const int TEXTURE_TILE_SIZE = 32;
+const int TEXTURE_TILE_TEXELS = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+
+// Position of texel (x, y) of a tile in its Morton (Z) order. The four texels of a bilinear
+// lookup are next to each other in memory, in any direction.
+inline int mortonIndex(int x, int y) {
+	uint32 bx = uint32(x), by = uint32(y);
+	bx = (bx | (bx << 4)) & 0x0f0fu;
+	bx = (bx | (bx << 2)) & 0x3333u;
+	bx = (bx | (bx << 1)) & 0x5555u;
+	by = (by | (by << 4)) & 0x0f0fu;
+	by = (by | (by << 2)) & 0x3333u;
+	by = (by | (by << 1)) & 0x5555u;
+	return int(bx | (by << 1));
+}
+
+// One level of the mip chain
+struct TextureLevel {
+	int width, height;
+	int tilesX, tilesY;
+	int firstTile; //< Index of the first tile of the level in the file
+};
+
+// An image texture with its mip chain, read from a memory mapped tiled file.
+// The source image (binary .ppm, assumed sRGB, or .pfm, linear) is converted once into
+// "<source>.cgtex" next to it: every mip level, box filtered from the one above, cut into tiles of
+// RGBE texels in Morton order. The file is rebuilt when the size or modification time of the
+// source changes, delete it to force a rebuild. Nothing is read before load, which only maps the
+// file; tiles are paged in by the TextureCache as they are sampled.
+class Texture {
+public:
+	explicit Texture(const std::string& fileName);
+
+	// Maps the tiled file, building it first if needed. Safe to call from several threads, only
+	// the first call does the work. Returns false if the texture could not be loaded.
+	bool load();
+
+	int getWidth() const { return levels.empty() ? 0 : levels[0].width; }
+	int getHeight() const { return levels.empty() ? 0 : levels[0].height; }
+	int getLevelCount() const { return int(levels.size()); }
+	const TextureLevel& getLevel(int level) const { return levels[level]; }
+	const std::string& getFileName() const { return fileName; }
+
+	// Decodes tile 'tile' of the file into TEXTURE_TILE_TEXELS linear colors in Morton order
+	void decodeTile(int tile, Color* texels) const;
+
+private:
+	Texture(const Texture&);
+	Texture& operator=(const Texture&);
+
+	bool open();
+
+	std::string fileName;
+	std::once_flag loadFlag;
+	bool valid;
+	MappedFile file;
+	std::vector<TextureLevel> levels;
+	size_t dataOffset; //< Start of the first tile in the file
+};
+
+// The textures of a scene and a cache of decoded tiles shared by all render threads.
+// The cache holds at most getCapacity() bytes of tiles, however large the textures are in total.
+// It is split into shards by tile, each with its own lock and its own part of the tile slots, so
+// threads sampling different tiles rarely wait for each other. A full shard evicts with the
+// CLOCK algorithm: a tile used since the hand last passed gets a second chance, so the tiles
+// every bucket keeps coming back to stay resident while a one-off sweep over a huge texture only
+// cycles through the rest.
+class TextureCache {
+public:
+	TextureCache();
+	~TextureCache();
+
+	// Registers the texture in 'fileName' and returns its index. Nothing is read until it is
+	// first sampled. Must not be called while rendering.
+	int add(const std::string& fileName);
+	int size() const { return int(textures.size()); }
+
+	// Drops all tiles and limits the cache to 'bytes'. Must not be called while rendering.
+	void setCapacity(size_t bytes);
+	size_t getCapacity() const { return capacity; }
+
+	// Width of the first mip level, loads the texture. 0 if it cannot be loaded.
+	int getWidth(int texture);
+
+	// Trilinear lookup at (u, v), wrapping around both edges. 'lod' is the mip level, fractional
+	// levels blend the two nearest ones. A texture that cannot be loaded is magenta.
+	Color sample(int texture, float u, float v, float lod);
+
+private:
+	TextureCache(const TextureCache&);
+	TextureCache& operator=(const TextureCache&);
+
+	struct Slot {
+		uint64 key; //< Texture and tile held by the slot, EMPTY_KEY if none
+		std::atomic<int> pins; //< Lookups still reading the texels, the slot is not evicted meanwhile
+		bool referenced; //< Used since the clock hand last passed
+		Color texels[TEXTURE_TILE_TEXELS];
+	};
+
+	struct Shard {
+		std::mutex lock;
+		std::unordered_map<uint64, int> index; //< Slot of every resident tile
+		int firstSlot, numSlots;
+		int hand; //< Next slot the clock looks at, relative to firstSlot
+	};
+
+	static const int NUM_SHARDS = 16;
+	static const uint64 EMPTY_KEY = ~0ull;
+
+	// Returns the slot holding the tile, loaded and pinned, or -1 if every slot of its shard is
+	// pinned; the tile is then decoded into 'scratch' instead.
+	int acquire(int texture, int tile, Color* scratch);
+	void release(int slot) { slots[slot].pins--; }
+	const Color* getTexels(int slot) const { return slots[slot].texels; }
+
+	// Bilinear lookup in one level
+	Color sampleLevel(int texture, int level, float u, float v);
+
+	friend struct TileFetcher;
+
+	std::vector<Texture*> textures;
+	size_t capacity;
+	Slot* slots;
+	Shard shards[NUM_SHARDS];
+};
@@ -0,0 +1,181 @@
+#include "tiledimage.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const uint32 TILED_IMAGE_VERSION = 1;
+const uint64 TILED_IMAGE_ALIGN = 4096;
+// Tile canvases there may be at once, 16 MB of them at 32x32. Far more than the render threads
+// keep busy, they only ever wait for the disk if it falls this far behind.
+const int MAX_TILES = 1024;
+
+// 64-bit seek, the files easily grow past 2 GB
+bool seekTo(FILE* fp, uint64 offset) {
+#ifdef _WIN32
+	return _fseeki64(fp, int64(offset), SEEK_SET) == 0;
+#else
+	return fseeko(fp, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+} // namespace
+
+TiledImageWriter::TiledImageWriter()
+	: fp(nullptr), width(0), height(0), tileSize(0), tilesX(0), format(TILED_RGBA8), dataOffset(0), failed(false), closing(false) {}
+
+TiledImageWriter::~TiledImageWriter() {
+	close();
+	for (int i = 0; i < int(tiles.size()); i++) {
+		delete tiles[i];
+	}
+}
+
+bool TiledImageWriter::open(const std::string& fileName, int width, int height, int tileSize, TiledPixelFormat format) {
+	close();
+	this->fileName = fileName;
+	tmpName = fileName + ".tmp";
+	this->width = width;
+	this->height = height;
+	this->tileSize = tileSize;
+	this->format = format;
+	tilesX = (width + tileSize - 1) / tileSize;
+	const int tilesY = (height + tileSize - 1) / tileSize;
+	const uint64 pixelBytes = (format == TILED_RGBA8) ? sizeof(uint32) : sizeof(Color);
+	const uint64 tileBytes = uint64(tileSize) * tileSize * pixelBytes;
+	dataOffset = (sizeof(TiledImageHeader) + TILED_IMAGE_ALIGN - 1) / TILED_IMAGE_ALIGN * TILED_IMAGE_ALIGN;
+	stats = TiledWriterStats();
+	stats.bytes = dataOffset + uint64(tilesX) * tilesY * tileBytes;
+
+	fp = fopen(tmpName.c_str(), "wb");
+	if (!fp) {
+		printf("Failed to create %s\n", tmpName.c_str());
+		return false;
+	}
+	TiledImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CGTI", 4);
+	header.version = TILED_IMAGE_VERSION;
+	header.width = uint32(width);
+	header.height = uint32(height);
+	header.tileSize = uint32(tileSize);
+	header.tilesX = uint32(tilesX);
+	header.tilesY = uint32(tilesY);
+	header.format = uint32(format);
+	header.dataOffset = dataOffset;
+	// Writing the last byte gives the file its full size up front, the tiles arrive in any order
+	const char zero = 0;
+	failed = fwrite(&header, sizeof(header), 1, fp) != 1 || !seekTo(fp, stats.bytes - 1) || fwrite(&zero, 1, 1, fp) != 1;
+	if (failed) {
+		printf("Failed to write %s\n", tmpName.c_str());
+		fclose(fp);
+		fp = nullptr;
+		remove(tmpName.c_str());
+		return false;
+	}
+
+	closing = false;
+	ioThread = std::thread(&TiledImageWriter::ioLoop, this);
+	return true;
+}
+
+Canvas* TiledImageWriter::acquireTile() {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (pool.empty() && int(tiles.size()) >= MAX_TILES) {
+		written.wait(lock, [this]() { return !pool.empty(); });
+	}
+	if (pool.empty()) {
+		tiles.push_back(new Canvas(tileSize, tileSize));
+		stats.tilesAllocated++;
+		return tiles.back();
+	}
+	Canvas* tile = pool.back();
+	pool.pop_back();
+	return tile;
+}
+
+void TiledImageWriter::submit(Canvas* tile, const Rect& r) {
+	Pending p;
+	p.tile = tile;
+	p.rect = r;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(p);
+		stats.maxQueued = Max(stats.maxQueued, int(queue.size()));
+	}
+	queued.notify_one();
+}
+
+void TiledImageWriter::ioLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		queued.wait(lock, [this]() { return !queue.empty() || closing; });
+		if (queue.empty()) {
+			break;
+		}
+		const Pending p = queue.front();
+		queue.pop_front();
+		lock.unlock();
+
+		a7az0th::Timer t;
+		// After a failed write the remaining tiles are only put back, the file is discarded anyway
+		const bool ok = !failed && writeTile(*p.tile, p.rect);
+		t.stop();
+
+		lock.lock();
+		failed = failed || !ok;
+		stats.writeMs += t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+		stats.tilesWritten++;
+		pool.push_back(p.tile);
+		written.notify_one();
+	}
+}
+
+bool TiledImageWriter::writeTile(Canvas& tile, const Rect& r) {
+	const int w = r.width();
+	const int h = r.height();
+	if (w < tileSize || h < tileSize) {
+		for (int y = 0; y < tileSize; y++) {
+			for (int x = (y < h) ? w : 0; x < tileSize; x++) {
+				tile.buffer[y * tileSize + x] = BLACK;
+				tile.ldr[y * tileSize + x] = 0;
+			}
+		}
+	}
+	const int tileIdx = (r.y0 / tileSize) * tilesX + r.x0 / tileSize;
+	const size_t count = size_t(tileSize) * tileSize;
+	if (format == TILED_RGBA8) {
+		return seekTo(fp, dataOffset + uint64(tileIdx) * count * sizeof(uint32)) && fwrite(tile.ldr, sizeof(uint32), count, fp) == count;
+	}
+	return seekTo(fp, dataOffset + uint64(tileIdx) * count * sizeof(Color)) && fwrite(tile.buffer, sizeof(Color), count, fp) == count;
+}
+
+bool TiledImageWriter::close() {
+	if (!fp) {
+		return true;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = true;
+	}
+	queued.notify_one();
+	ioThread.join();
+
+	bool ok = !failed;
+	ok = (fclose(fp) == 0) && ok;
+	fp = nullptr;
+	if (ok) {
+#ifdef _WIN32
+		// rename does not replace an existing file on Windows
+		remove(fileName.c_str());
+#endif
+		ok = rename(tmpName.c_str(), fileName.c_str()) == 0;
+	}
+	if (!ok) {
+		remove(tmpName.c_str());
+		printf("Failed to write %s\n", fileName.c_str());
+	}
+	return ok;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "scene.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tiled image files, for frames too large to keep in memory. The finished buckets of the frame
+// are written straight into their place in the file, so only the buckets being rendered or
+// waiting to be written are ever resident.
+//
+// Layout: a TiledImageHeader, then from dataOffset the tiles of tilesX x tilesY in row major
+// order. Every tile has tileSize x tileSize pixels row by row, also at the right and bottom edges
+// of the image, where the pixels outside of it are zero. Tile i starts at dataOffset + i * tile
+// bytes, so a reader can seek to any tile.
+// TILED_RGBA8 pixels are 8-bit RGBA, tonemapped like the ppm output, TILED_RGB32F pixels are
+// three linear floats like the pfm output, both in the byte order of the machine that wrote them.
+
+enum TiledPixelFormat {
+	TILED_RGBA8,
+	TILED_RGB32F,
+};
+
+struct TiledImageHeader {
+	char magic[4]; //< "CGTI"
+	uint32 version;
+	uint32 width, height;
+	uint32 tileSize;
+	uint32 tilesX, tilesY;
+	uint32 format; //< TiledPixelFormat
+	uint64 dataOffset; //< Start of the first tile, page aligned
+};
+
+// Statistics of one file written by a TiledImageWriter
+struct TiledWriterStats {
+	int tilesWritten;
+	int tilesAllocated; //< Tile buffers ever created, the most that were resident at once
+	int maxQueued; //< Most tiles waiting for the I/O thread at once
+	double writeMs; //< Time the I/O thread spent writing
+	uint64 bytes; //< Size of the file
+
+	TiledWriterStats(): tilesWritten(0), tilesAllocated(0), maxQueued(0), writeMs(0.0), bytes(0) {}
+};
+
+// Writes a tiled image file on its own I/O thread. The render threads take a tile sized canvas,
+// render a bucket into it and queue it; the I/O thread writes it to its place in the file and
+// puts the canvas back for reuse. Queueing takes a lock only for the queue itself, a render
+// thread only waits for the disk when so many tiles are queued that their memory would matter.
+class TiledImageWriter {
+public:
+	TiledImageWriter();
+	~TiledImageWriter();
+
+	// Creates 'fileName' for a width x height image and starts the I/O thread. The file is written
+	// under a temporary name and renamed by close, so a frame that did not finish never looks
+	// like one that did. Returns false if the file cannot be created.
+	bool open(const std::string& fileName, int width, int height, int tileSize, TiledPixelFormat format);
+
+	int getTileSize() const { return tileSize; }
+
+	// A tileSize x tileSize canvas to render one tile into. Safe to call from any thread.
+	Canvas* acquireTile();
+
+	// Queues the pixels of 'r', a tile of the grid, rendered into 'tile' from its top left corner.
+	// The canvas goes back to the pool once written and must not be used after this call.
+	void submit(Canvas* tile, const Rect& r);
+
+	// Waits until the queued tiles are written, stops the I/O thread and gives the file its name.
+	// Returns false if any write failed.
+	bool close();
+
+	const TiledWriterStats& getStats() const { return stats; }
+
+private:
+	TiledImageWriter(const TiledImageWriter&);
+	TiledImageWriter& operator=(const TiledImageWriter&);
+
+	struct Pending {
+		Canvas* tile;
+		Rect rect;
+	};
+
+	void ioLoop();
+	// Writes one tile, zeroing the pixels outside of its rectangle first
+	bool writeTile(Canvas& tile, const Rect& r);
+
+	std::string fileName;
+	std::string tmpName;
+	FILE* fp;
+	int width, height;
+	int tileSize;
+	int tilesX;
+	TiledPixelFormat format;
+	uint64 dataOffset;
+	bool failed; //< A write failed, owned by the I/O thread until it stops
+
+	std::mutex mutex; //< Guards the queue, the pool and closing
+	std::condition_variable queued;
+	std::condition_variable written; //< A tile went back to the pool
+	std::deque<Pending> queue;
+	std::vector<Canvas*> pool; //< Written tiles ready for reuse
+	std::vector<Canvas*> tiles; //< Every tile canvas, deleted with the writer
+	bool closing;
+	std::thread ioThread;
+	TiledWriterStats stats;
+};
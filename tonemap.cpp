@@ -0,0 +1,86 @@
+#include "tonemap.h"
+#include "simd.h"
+
+namespace {
+
+const int CHUNK_PIXELS = 16 * 4; //< Pixels converted per step, 3 * CHUNK_PIXELS is a multiple of every SIMD_WIDTH
+
+// Square root from the reciprocal estimate, accurate to about 12 bits which is plenty for 8-bit output.
+// Zero maps to zero.
+inline vfloat sqrtApprox(vfloat x) {
+	return x * vrsqrt(vmax(x, vfloat(1e-30f)));
+}
+
+// Applies exposure, curve and transfer function and scales to [0, 255]
+template <TonemapCurve curve, bool srgb>
+inline vfloat tonemap(vfloat x, vfloat exposure) {
+	x = vmax(x * exposure, vfloat(0.f));
+	if (curve == TONEMAP_REINHARD) {
+		x = x / (x + vfloat(1.f));
+	} else if (curve == TONEMAP_ACES) {
+		x = (x * (vfloat(2.51f) * x + vfloat(0.03f))) / (x * (vfloat(2.43f) * x + vfloat(0.59f)) + vfloat(0.14f));
+	}
+	x = vmin(x, vfloat(1.f));
+
+	if (srgb) {
+		// 1.055 * x^(1/2.4) - 0.055 fitted with x^(1/2), x^(1/4) and x^(1/8), the error stays below
+		// 0.06 of an 8-bit step, so the power function is replaced by three square roots
+		const vfloat s1 = sqrtApprox(x);
+		const vfloat s2 = sqrtApprox(s1);
+		const vfloat s3 = sqrtApprox(s2);
+		const vfloat gamma = vfloat(0.554479501f) * s1 + vfloat(0.900126357f) * s2 - vfloat(0.488881528f) * s3 + vfloat(0.0344783159f);
+		x = select(x <= vfloat(0.0031308f), x * vfloat(12.92f), gamma);
+		x = vmin(x, vfloat(1.f));
+	}
+	return x * vfloat(255.f);
+}
+
+// The settings are template arguments so the inner loop has no branches and nothing to reload
+template <TonemapCurve curve, bool srgb>
+void tonemapRows(const Color* src, uint32* dst, int width, const Rect& r, float exposureValue) {
+	alignas(SIMD_ALIGN) float in[CHUNK_PIXELS * 3];
+	alignas(SIMD_ALIGN) int out[CHUNK_PIXELS * 3];
+	const vfloat exposure(exposureValue);
+
+	for (int y = r.y0; y < r.y1; y++) {
+		for (int x = r.x0; x < r.x1; x += CHUNK_PIXELS) {
+			const int count = Min(CHUNK_PIXELS, r.x1 - x);
+			const int numFloats = count * 3;
+			const float* channels = &src[y * width + x].r;
+			int i = 0;
+			for (; i + SIMD_WIDTH <= numFloats; i += SIMD_WIDTH) {
+				storeRounded(tonemap<curve, srgb>(vfloat::loadu(channels + i), exposure), out + i);
+			}
+			if (i < numFloats) {
+				// Copy the tail so the last load does not read past the end of the image
+				for (int j = i; j < numFloats; j++) in[j] = channels[j];
+				for (int j = numFloats; j < i + SIMD_WIDTH; j++) in[j] = 0.f;
+				storeRounded(tonemap<curve, srgb>(vfloat::load(in + i), exposure), out + i);
+			}
+
+			uint32* row = dst + y * width + x;
+			for (int p = 0; p < count; p++) {
+				row[p] = uint32(out[p*3 + 0]) | (uint32(out[p*3 + 1]) << 8) | (uint32(out[p*3 + 2]) << 16) | 0xff000000u;
+			}
+		}
+	}
+}
+
+template <TonemapCurve curve>
+void tonemapRows(const Color* src, uint32* dst, int width, const Rect& r, const TonemapSettings& settings) {
+	if (settings.srgb) {
+		tonemapRows<curve, true>(src, dst, width, r, settings.exposure);
+	} else {
+		tonemapRows<curve, false>(src, dst, width, r, settings.exposure);
+	}
+}
+
+} // namespace
+
+void tonemapRect(const Color* src, uint32* dst, int width, const Rect& r, const TonemapSettings& settings) {
+	switch (settings.curve) {
+	case TONEMAP_REINHARD: tonemapRows<TONEMAP_REINHARD>(src, dst, width, r, settings); break;
+	case TONEMAP_ACES:     tonemapRows<TONEMAP_ACES>(src, dst, width, r, settings); break;
+	default:               tonemapRows<TONEMAP_CLAMP>(src, dst, width, r, settings); break;
+	}
+}
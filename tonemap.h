@@ -0,0 +1,25 @@
+#pragma once
+
+#include "color.h"
+#include "rect.h"
+#include "defs.h"
+
+enum TonemapCurve {
+	TONEMAP_CLAMP, //< Clamps to [0, 1], the values are otherwise left as they are
+	TONEMAP_REINHARD, //< x / (1 + x)
+	TONEMAP_ACES, //< Narkowicz's fit of the ACES filmic curve
+};
+
+struct TonemapSettings {
+	float exposure; //< Linear scale applied before the curve
+	TonemapCurve curve;
+	bool srgb; //< Apply the sRGB transfer function after the curve
+
+	TonemapSettings(): exposure(1.f), curve(TONEMAP_CLAMP), srgb(false) {}
+};
+
+// Converts the pixels of rect r of a width x height float image to 8-bit RGBA with alpha 255.
+// Every channel goes through exposure, curve and transfer function, SIMD_WIDTH channels at a time.
+// The colors are read as a flat array of floats, so the RGB layout of Color needs no shuffling.
+// Both images are addressed with the same pixel index; dst[i] holds R in the lowest byte.
+void tonemapRect(const Color* src, uint32* dst, int width, const Rect& r, const TonemapSettings& settings);
@@ -0,0 +1,149 @@
+#include "trace.h"
+#include "image.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+FrameTracer::FrameTracer(int eventsPerThread): eventsPerThread(Max(eventsPerThread, 1)) {}
+
+int64 FrameTracer::now() const {
+	a7az0th::Timer t = epoch;
+	t.stop();
+	return int64(t.elapsed(a7az0th::Timer::Nanoseconds));
+}
+
+void FrameTracer::beginFrame(int numThreads) {
+	if (int(threads.size()) < numThreads) {
+		threads.resize(numThreads);
+	}
+	for (int i = 0; i < numThreads; i++) {
+		if (threads[i].events.empty()) {
+			threads[i].events.resize(eventsPerThread);
+		}
+	}
+	FrameSpan span;
+	span.start = now();
+	span.end = span.start;
+	span.numThreads = numThreads;
+	frames.push_back(span);
+}
+
+void FrameTracer::endFrame() {
+	if (!frames.empty()) {
+		frames.back().end = now();
+	}
+}
+
+void FrameTracer::record(int threadIdx, const Rect& r, int64 start, int64 end) {
+	ThreadBuffer& buf = threads[threadIdx];
+	Event& e = buf.events[buf.numRecorded % eventsPerThread];
+	e.start = start;
+	e.end = end;
+	e.rect = r;
+	e.frame = int(frames.size()) - 1;
+	e.thread = threadIdx;
+	buf.numRecorded++;
+}
+
+void FrameTracer::clear() {
+	threads.clear();
+	frames.clear();
+}
+
+void FrameTracer::collectEvents(std::vector<Event>& out) const {
+	out.clear();
+	for (int t = 0; t < int(threads.size()); t++) {
+		const ThreadBuffer& buf = threads[t];
+		const int64 count = Min(buf.numRecorded, int64(eventsPerThread));
+		for (int64 i = buf.numRecorded - count; i < buf.numRecorded; i++) {
+			out.push_back(buf.events[i % eventsPerThread]);
+		}
+	}
+}
+
+bool FrameTracer::saveChromeTrace(const char* fileName) const {
+	FILE* fp = fopen(fileName, "w");
+	if (!fp) {
+		return false;
+	}
+
+	std::vector<Event> events;
+	collectEvents(events);
+
+	// The last bucket of every thread in every frame, for the wait events
+	std::vector<int64> lastEnd(frames.size() * threads.size(), -1);
+	for (int i = 0; i < int(events.size()); i++) {
+		const Event& e = events[i];
+		int64& last = lastEnd[e.frame * threads.size() + e.thread];
+		last = Max(last, e.end);
+	}
+
+	// Chrome trace timestamps are in microseconds
+	fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"render\"}}");
+	for (int t = 0; t < int(threads.size()); t++) {
+		fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}", t + 1, t);
+	}
+	for (int f = 0; f < int(frames.size()); f++) {
+		const FrameSpan& span = frames[f];
+		fprintf(fp, ",\n{\"name\": \"frame %d\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f}",
+			f, span.start / 1000.0, (span.end - span.start) / 1000.0);
+		for (int t = 0; t < span.numThreads; t++) {
+			const int64 last = lastEnd[f * threads.size() + t];
+			const int64 waitStart = (last >= 0) ? last : span.start;
+			fprintf(fp, ",\n{\"name\": \"wait\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+				t + 1, waitStart / 1000.0, (span.end - waitStart) / 1000.0);
+		}
+	}
+	for (int i = 0; i < int(events.size()); i++) {
+		const Event& e = events[i];
+		fprintf(fp, ",\n{\"name\": \"bucket\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+			"\"args\": {\"frame\": %d, \"x0\": %d, \"y0\": %d, \"x1\": %d, \"y1\": %d}}",
+			e.thread + 1, e.start / 1000.0, (e.end - e.start) / 1000.0, e.frame, e.rect.x0, e.rect.y0, e.rect.x1, e.rect.y1);
+	}
+	fprintf(fp, "\n]}\n");
+	return fclose(fp) == 0;
+}
+
+bool FrameTracer::saveHeatmap(const char* fileName, int width, int height) const {
+	std::vector<Event> events;
+	collectEvents(events);
+
+	std::vector<double> cost(width * height, 0.0);
+	std::vector<int> samples(width * height, 0);
+	for (int i = 0; i < int(events.size()); i++) {
+		Rect r = events[i].rect;
+		r.clip(width, height);
+		if (r.area() <= 0) {
+			continue;
+		}
+		const double perPixel = double(events[i].end - events[i].start) / events[i].rect.area();
+		for (int y = r.y0; y < r.y1; y++) {
+			for (int x = r.x0; x < r.x1; x++) {
+				cost[y * width + x] += perPixel;
+				samples[y * width + x]++;
+			}
+		}
+	}
+
+	double maxCost = 0.0, minCost = 1e30;
+	for (int i = 0; i < width * height; i++) {
+		if (samples[i]) {
+			cost[i] /= samples[i];
+			maxCost = Max(maxCost, cost[i]);
+			minCost = Min(minCost, cost[i]);
+		}
+	}
+	if (maxCost <= 0.0) {
+		minCost = maxCost = 0.0;
+	}
+
+	// Dark blue -> red -> yellow -> white, on a square root scale so the cheap regions do not all look the same
+	Canvas c(width, height);
+	for (int i = 0; i < width * height; i++) {
+		const float v = (maxCost > 0.0) ? sqrtf(float(cost[i] / maxCost)) : 0.f;
+		c.buffer[i] = Color(clamp(v * 3.f, 0.f, 1.f), clamp(v * 3.f - 1.f, 0.f, 1.f), clamp(v * 3.f - 2.f, 0.f, 1.f) + 0.15f * (1.f - v));
+	}
+	printf("Heatmap %s: %.1f to %.1f nanoseconds per pixel\n", fileName, minCost, maxCost);
+	return savePPM(c, fileName);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "scheduler.h"
+#include "rect.h"
+#include "defs.h"
+
+#include "timer.h"
+
+#include <vector>
+
+struct Canvas;
+
+// Records when and on which thread every bucket was rendered. Each thread appends to its own
+// ring buffer, so recording takes two clock reads and no synchronization. When a buffer is full
+// the oldest events are overwritten.
+// The events can be exported as a Chrome trace (chrome://tracing or ui.perfetto.dev) and as a
+// heatmap image of the render cost per pixel.
+class FrameTracer {
+public:
+	struct Event {
+		int64 start, end; //< Nanoseconds since the tracer was created
+		Rect rect;
+		int frame;
+		int thread;
+	};
+
+	explicit FrameTracer(int eventsPerThread = 64 * 1024);
+
+	// Must be called before the buckets of a frame are rendered and after all of them are done.
+	// beginFrame sizes the per-thread buffers, so the thread count may change between frames.
+	void beginFrame(int numThreads);
+	void endFrame();
+
+	// Called by the render threads. threadIdx must be below the numThreads given to beginFrame.
+	int64 now() const;
+	void record(int threadIdx, const Rect& r, int64 start, int64 end);
+
+	// Writes all recorded events as Chrome trace event JSON. Every thread gets a track with its
+	// buckets, the time from its last bucket to the end of the frame shows up as a "wait" event.
+	bool saveChromeTrace(const char* fileName) const;
+
+	// Writes the average render time per pixel of every recorded bucket as an image. The slowest
+	// pixel is white, cheap pixels are dark blue; the range is printed to stdout.
+	bool saveHeatmap(const char* fileName, int width, int height) const;
+
+	void clear();
+	int getFrameCount() const { return int(frames.size()); }
+
+private:
+	struct ThreadBuffer {
+		std::vector<Event> events;
+		int64 numRecorded; //< Total events ever recorded, the ring position is numRecorded % capacity
+		char padding[64]; //< Keeps the counters of neighbouring threads on separate cache lines
+		ThreadBuffer(): numRecorded(0) {}
+	};
+	struct FrameSpan {
+		int64 start, end;
+		int numThreads;
+	};
+
+	void collectEvents(std::vector<Event>& out) const;
+
+	a7az0th::Timer epoch;
+	int eventsPerThread;
+	std::vector<ThreadBuffer> threads;
+	std::vector<FrameSpan> frames;
+};
+
+// Wraps another renderer and records every bucket it renders
+struct TracingBucketRenderer : BucketRenderer {
+	TracingBucketRenderer(BucketRenderer& renderer, FrameTracer& tracer): renderer(renderer), tracer(tracer) {}
+	virtual void renderBucket(const Rect& r, int threadIdx) override {
+		const int64 start = tracer.now();
+		renderer.renderBucket(r, threadIdx);
+		tracer.record(threadIdx, r, start, tracer.now());
+	}
+private:
+	BucketRenderer& renderer;
+	FrameTracer& tracer;
+};
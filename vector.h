@@ -10,11 +10,6 @@ struct Vector {
 
 	Vector() { /*blank on purpose*/ }
 	Vector(float x, float y, float z): x(x), y(y), z(z) {}
-	Vector(const Vector& rhs) {
-		x = rhs.x;
-		y = rhs.y;
-		z = rhs.z;
-	}
 
 	float lengthSqr() const { return x*x + y*y + z*z; }
 	float length() const { return sqrtf(x*x + y*y + z*z); }
@@ -34,13 +29,6 @@ struct Vector {
 		scalar = 1.0f / scalar;
 		return Vector(x * scalar, y * scalar, z * scalar);
 	}
-	
-	Vector& operator = (const Vector& rhs) {
-		x = rhs.x;
-		y = rhs.y;
-		z = rhs.z;
-		return *this;
-	}
 
 	Vector& operator += (const Vector& rhs) {
 		x += rhs.x;
@@ -112,4 +100,13 @@ inline Vector cross(const Vector& a, const Vector& b) {
 	const float y = a.x * b.z - a.z * b.x;
 	const float z = a.x * b.y - a.y * b.x;
 	return Vector(x, -y, z);
-}
\ No newline at end of file
+}
+
+/// Builds the unit vectors 't' and 'b' that form an orthonormal basis together with the unit vector 'n'
+inline void makeBasis(const Vector& n, Vector& t, Vector& b) {
+	const float sign = copysignf(1.f, n.z);
+	const float a = -1.f / (sign + n.z);
+	const float c = n.x * n.y * a;
+	t = Vector(1.f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+	b = Vector(c, sign + n.y * n.y * a, -n.y);
+}
@@ -0,0 +1,417 @@
+#include "wavefront.h"
+#include "scene.h"
+#include "shading.h"
+#include "packet.h"
+#include "sampler.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+namespace {
+
+const int CHUNK_SIZE = 4 * 1024; //< Queue entries per task, a multiple of SIMD_WIDTH
+const int DIR_BITS = 3; //< Bits per direction component in the sort key
+const int DIR_KEYS = 1 << (3 * DIR_BITS);
+
+// Quantizes the direction, rays with the same key leave into the same small cone
+inline int directionKey(float dx, float dy, float dz) {
+	const float scale = float(1 << DIR_BITS) * 0.5f;
+	const int maxQ = (1 << DIR_BITS) - 1;
+	const int qx = Min(int((dx + 1.f) * scale), maxQ);
+	const int qy = Min(int((dy + 1.f) * scale), maxQ);
+	const int qz = Min(int((dz + 1.f) * scale), maxQ);
+	return (qx << (2 * DIR_BITS)) | (qy << DIR_BITS) | qz;
+}
+
+struct MultiThreadedStage : a7az0th::MultiThreadedFor {
+	MultiThreadedStage(WavefrontIntegrator& integrator, WavefrontStage stage): integrator(integrator), stage(stage) {}
+	virtual void body(int index, int threadIdx, int numThreads) override {
+		integrator.runStage(stage, index);
+	}
+private:
+	WavefrontIntegrator& integrator;
+	WavefrontStage stage;
+};
+
+} // namespace
+
+void WavefrontIntegrator::PathQueue::resize(int n) {
+	// Padded so the packet loads of the last entries stay inside the allocation
+	const int padded = n + SIMD_WIDTH;
+	ox.resize(padded);
+	oy.resize(padded);
+	oz.resize(padded);
+	dx.resize(padded);
+	dy.resize(padded);
+	dz.resize(padded);
+	tr.resize(padded);
+	tg.resize(padded);
+	tb.resize(padded);
+	pixel.resize(padded);
+	dimension.resize(padded);
+}
+
+WavefrontIntegrator::WavefrontIntegrator()
+	: scene(nullptr), accum(nullptr), width(0), height(0), firstPixel(0), sampleIdx(0), bounce(0),
+	numKeys(1), scattering(false) {
+	for (int i = 0; i < STAGE_COUNT; i++) stats.stageMs[i] = 0.0;
+	stats.segments = 0;
+	stats.maxBounce = 0;
+}
+
+void WavefrontIntegrator::render(Scene& scene, ProgressiveBuffer* accum, uint32 pass) {
+	this->scene = &scene;
+	this->accum = accum;
+	width = scene.c->width;
+	height = scene.c->height;
+
+	const WavefrontSettings& settings = scene.wavefront;
+	const int numPixels = width * height;
+	int waveSize = Min(Max(settings.waveSize, 1), numPixels);
+	waveSize = (waveSize + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+	const int padded = waveSize + SIMD_WIDTH;
+	paths.resize(waveSize);
+	sorted.resize(waveSize);
+	for (FloatArray* a : { &hitT, &hx, &hy, &hz, &nx, &ny, &nz, &hcr, &hcg, &hcb, &sdx, &sdy, &sdz, &sMaxT, &scr, &scg, &scb }) {
+		a->resize(padded);
+	}
+	keys.resize(padded);
+	numKeys = settings.sortRays ? DIR_KEYS : 1;
+	const int maxChunks = (waveSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	offsets.resize(maxChunks * numKeys);
+	radiance.assign(numPixels, Color(0.f, 0.f, 0.f));
+
+	for (int i = 0; i < STAGE_COUNT; i++) stats.stageMs[i] = 0.0;
+	stats.segments = 0;
+	stats.maxBounce = 0;
+
+	// Each wave holds every pixel at most once, so the stages can add to radiance without locking
+	const uint32 firstSample = pass * uint32(settings.samplesPerPixel);
+	for (sampleIdx = firstSample; sampleIdx < firstSample + uint32(settings.samplesPerPixel); sampleIdx++) {
+		for (firstPixel = 0; firstPixel < numPixels; firstPixel += waveSize) {
+			paths.size = Min(waveSize, numPixels - firstPixel);
+			runParallel(STAGE_GENERATE, (paths.size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+			for (bounce = 0; paths.size > 0; bounce++) {
+				stats.segments += paths.size;
+				stats.maxBounce = Max(stats.maxBounce, bounce);
+				const int numChunks = (paths.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+				runParallel(STAGE_EXTEND, numChunks);
+				runParallel(STAGE_SHADE, numChunks);
+				runParallel(STAGE_SHADOW, numChunks);
+
+				// Counting sort of the surviving paths by key, stable within every key.
+				// The counts of all chunks are turned into write positions here, in key major order.
+				scattering = false;
+				runParallel(STAGE_SORT, numChunks);
+				a7az0th::Timer t;
+				int total = 0;
+				for (int key = 0; key < numKeys; key++) {
+					for (int chunk = 0; chunk < numChunks; chunk++) {
+						const int count = offsets[chunk * numKeys + key];
+						offsets[chunk * numKeys + key] = total;
+						total += count;
+					}
+				}
+				t.stop();
+				stats.stageMs[STAGE_SORT] += t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+				scattering = true;
+				runParallel(STAGE_SORT, numChunks);
+				sorted.size = total;
+				std::swap(paths, sorted);
+			}
+		}
+	}
+
+	runParallel(STAGE_ACCUMULATE, height);
+}
+
+void WavefrontIntegrator::runParallel(WavefrontStage stage, int numChunks) {
+	a7az0th::Timer t;
+	MultiThreadedStage work(*this, stage);
+	work.run(scene->threadman, numChunks, scene->numThreads);
+	t.stop();
+	stats.stageMs[stage] += t.elapsed(a7az0th::Timer::Nanoseconds) / 1000000.0;
+}
+
+void WavefrontIntegrator::runStage(WavefrontStage stage, int chunk) {
+	if (stage == STAGE_ACCUMULATE) {
+		accumulate(chunk);
+		return;
+	}
+	const int first = chunk * CHUNK_SIZE;
+	const int last = Min(first + CHUNK_SIZE, paths.size);
+	switch (stage) {
+	case STAGE_GENERATE: generate(first, last); break;
+	case STAGE_EXTEND: extend(first, last); break;
+	case STAGE_SHADE: shade(first, last); break;
+	case STAGE_SHADOW: shadow(first, last); break;
+	case STAGE_SORT:
+		if (scattering) {
+			scatter(chunk, first, last);
+		} else {
+			histogram(chunk, first, last);
+		}
+		break;
+	default: break;
+	}
+}
+
+void WavefrontIntegrator::generate(int first, int last) {
+	Camera& cam = scene->cam;
+	const Vector origin = cam.getPos();
+	for (int i = first; i < last; i++) {
+		const int p = firstPixel + i;
+		const int x = p % width;
+		const int y = p / width;
+		PixelSampler sampler(scene->sampler, x, y, sampleIdx);
+		float u, v;
+		sampler.get2D(u, v);
+		const Ray ray = cam.getCameraRay(float(x) + u, float(y) + v);
+		paths.ox[i] = origin.x;
+		paths.oy[i] = origin.y;
+		paths.oz[i] = origin.z;
+		paths.dx[i] = ray.dir.x;
+		paths.dy[i] = ray.dir.y;
+		paths.dz[i] = ray.dir.z;
+		paths.tr[i] = paths.tg[i] = paths.tb[i] = 1.f;
+		paths.pixel[i] = p;
+		paths.dimension[i] = sampler.dimension;
+	}
+}
+
+void WavefrontIntegrator::extend(int first, int last) {
+	const Scene& scene = *this->scene;
+	if (scene.usePackets) {
+		// The queue is already in packet layout, the rays are loaded straight from it
+		const vfloat lanes = laneIndices();
+		for (int i = first; i < last; i += SIMD_WIDTH) {
+			RayPacket packet;
+			packet.ox = vfloat::load(&paths.ox[i]);
+			packet.oy = vfloat::load(&paths.oy[i]);
+			packet.oz = vfloat::load(&paths.oz[i]);
+			packet.dx = vfloat::load(&paths.dx[i]);
+			packet.dy = vfloat::load(&paths.dy[i]);
+			packet.dz = vfloat::load(&paths.dz[i]);
+			packet.active = lanes < vfloat(float(last - i));
+			PacketHit hit;
+			scene.intersect(packet, hit);
+			const int count = Min(SIMD_WIDTH, last - i);
+			for (int lane = 0; lane < count; lane++) {
+				const Ray ray = packet.getRay(lane);
+				IntersectionInfo info;
+				if (hit.primId[lane] >= 0) {
+					info.distSq = sqr(getLane(hit.t, lane));
+					info.primId = hit.primId[lane];
+				}
+				scene.intersectMeshes(ray, info);
+				storeHit(i + lane, ray, info);
+			}
+		}
+	} else {
+		for (int i = first; i < last; i++) {
+			Ray ray;
+			ray.origin = Vector(paths.ox[i], paths.oy[i], paths.oz[i]);
+			ray.dir = Vector(paths.dx[i], paths.dy[i], paths.dz[i]);
+			ray.depth = bounce;
+			IntersectionInfo info;
+			scene.intersect(ray, info);
+			storeHit(i, ray, info);
+		}
+	}
+}
+
+void WavefrontIntegrator::storeHit(int idx, const Ray& ray, IntersectionInfo& info) {
+	if (!info.isValid()) {
+		hitT[idx] = FLT_MAX;
+		return;
+	}
+	const Scene& scene = *this->scene;
+	const Material& m = scene.materials[scene.getMaterialIdx(info)];
+	scene.getHitAttributes(ray, info, getMaterialAttributes(m));
+	const Color albedo = getSurfaceColor(m, info, ray.dir);
+	hitT[idx] = sqrtf(info.distSq);
+	hx[idx] = info.intersectionPoint.x;
+	hy[idx] = info.intersectionPoint.y;
+	hz[idx] = info.intersectionPoint.z;
+	nx[idx] = info.normal.x;
+	ny[idx] = info.normal.y;
+	nz[idx] = info.normal.z;
+	hcr[idx] = albedo.r;
+	hcg[idx] = albedo.g;
+	hcb[idx] = albedo.b;
+}
+
+void WavefrontIntegrator::shade(int first, int last) {
+	const Scene& scene = *this->scene;
+	const bool canBounce = bounce < scene.wavefront.maxDepth;
+	for (int i = first; i < last; i++) {
+		const int pix = paths.pixel[i];
+		Color throughput(paths.tr[i], paths.tg[i], paths.tb[i]);
+		keys[i] = -1;
+		sMaxT[i] = 0.f;
+		if (hitT[i] == FLT_MAX) {
+			radiance[pix] += throughput * backgroundColor();
+			if (bounce == 0) STATS_ADD(STAT_MISSES, 1);
+			continue;
+		}
+		if (bounce == 0) STATS_ADD(STAT_HITS, 1);
+		STATS_ADD(STAT_SHADING_CALLS, 1);
+
+		PixelSampler sampler(scene.sampler, pix % width, pix / width, sampleIdx, 0, paths.dimension[i]);
+		const Color albedo(hcr[i], hcg[i], hcb[i]);
+		const Vector dir(paths.dx[i], paths.dy[i], paths.dz[i]);
+		Vector normal(nx[i], ny[i], nz[i]);
+		if (dot(normal, dir) > 0.f) {
+			normal = -normal;
+		}
+		// The shadow ray and the next ray both start slightly above the surface
+		const Vector from = Vector(hx[i], hy[i], hz[i]) + normal * 1e-4f;
+		paths.ox[i] = from.x;
+		paths.oy[i] = from.y;
+		paths.oz[i] = from.z;
+
+		// Next event estimation towards one light picked by its power
+		const float pick = sampler.get1D();
+		float lu, lv;
+		sampler.get2D(lu, lv);
+		LightSample ls;
+		float pickPdf, cosTheta;
+		if (scene.lightSampler.sampleLight(scene.lights, from, normal, pick, lu, lv, ls, pickPdf, cosTheta)) {
+			const Color contribution = throughput * albedo * ls.radiance * (cosTheta / (pi() * pickPdf));
+			sdx[i] = ls.dir.x;
+			sdy[i] = ls.dir.y;
+			sdz[i] = ls.dir.z;
+			sMaxT[i] = ls.dist * (1.f - 1e-4f);
+			scr[i] = contribution.r;
+			scg[i] = contribution.g;
+			scb[i] = contribution.b;
+		}
+
+		if (canBounce) {
+			// Cosine weighted sampling cancels the cosine and the 1/pi of the diffuse BRDF
+			throughput = throughput * albedo;
+			// Both are drawn on every bounce, so a dimension always means the same thing
+			const float survive = sampler.get1D();
+			float r1, r2;
+			sampler.get2D(r1, r2);
+			bool alive = true;
+			// Russian roulette after the first bounces, paths that carry little light end early
+			if (bounce >= 2) {
+				const float q = Min(0.95f, Max(throughput.r, Max(throughput.g, throughput.b)));
+				if (survive >= q) {
+					alive = false;
+				} else {
+					throughput = throughput / q;
+				}
+			}
+			if (alive) {
+				const float phi = 2.f * pi() * r1;
+				const float sinTheta = sqrtf(r2);
+				Vector t, b;
+				makeBasis(normal, t, b);
+				const Vector next = t * (cosf(phi) * sinTheta) + b * (sinf(phi) * sinTheta) + normal * sqrtf(1.f - r2);
+				paths.dx[i] = next.x;
+				paths.dy[i] = next.y;
+				paths.dz[i] = next.z;
+				paths.tr[i] = throughput.r;
+				paths.tg[i] = throughput.g;
+				paths.tb[i] = throughput.b;
+				keys[i] = (numKeys > 1) ? directionKey(next.x, next.y, next.z) : 0;
+			}
+		}
+		paths.dimension[i] = sampler.dimension;
+	}
+}
+
+void WavefrontIntegrator::shadow(int first, int last) {
+	const Scene& scene = *this->scene;
+	for (int i = first; i < last; i++) {
+		if (sMaxT[i] <= 0.f) {
+			continue;
+		}
+		Ray ray;
+		ray.origin = Vector(paths.ox[i], paths.oy[i], paths.oz[i]);
+		ray.dir = Vector(sdx[i], sdy[i], sdz[i]);
+		ray.depth = bounce + 1;
+		if (!scene.occluded(ray, sMaxT[i])) {
+			radiance[paths.pixel[i]] += Color(scr[i], scg[i], scb[i]);
+		}
+	}
+}
+
+void WavefrontIntegrator::histogram(int chunk, int first, int last) {
+	int* counts = &offsets[chunk * numKeys];
+	std::fill(counts, counts + numKeys, 0);
+	for (int i = first; i < last; i++) {
+		if (keys[i] >= 0) {
+			counts[keys[i]]++;
+		}
+	}
+}
+
+void WavefrontIntegrator::scatter(int chunk, int first, int last) {
+	int* positions = &offsets[chunk * numKeys];
+	for (int i = first; i < last; i++) {
+		if (keys[i] < 0) {
+			continue;
+		}
+		const int j = positions[keys[i]]++;
+		sorted.ox[j] = paths.ox[i];
+		sorted.oy[j] = paths.oy[i];
+		sorted.oz[j] = paths.oz[i];
+		sorted.dx[j] = paths.dx[i];
+		sorted.dy[j] = paths.dy[i];
+		sorted.dz[j] = paths.dz[i];
+		sorted.tr[j] = paths.tr[i];
+		sorted.tg[j] = paths.tg[i];
+		sorted.tb[j] = paths.tb[i];
+		sorted.pixel[j] = paths.pixel[i];
+		sorted.dimension[j] = paths.dimension[i];
+	}
+}
+
+void WavefrontIntegrator::accumulate(int row) {
+	Canvas& c = *scene->c;
+	const float scale = 1.f / float(Max(scene->wavefront.samplesPerPixel, 1));
+	for (int x = 0; x < width; x++) {
+		const int idx = row * width + x;
+		const Color col = radiance[idx] * scale;
+		STATS_ADD(STAT_SAMPLES, 1);
+		c.buffer[idx] = accum ? accum->addSample(x, row, col) : col;
+	}
+	if (scene->outputLDR) {
+		tonemapRect(c.buffer, c.ldr, c.width, Rect(0, row, width, row + 1), scene->tonemap);
+	}
+}
+
+bool canPathTrace(const Scene& scene) {
+	// Only the materials some object refers to matter
+	std::vector<bool> used(scene.materials.size(), false);
+	const MappableArray<Sphere>& spheres = scene.spheres;
+	for (int i = 0; i < int(spheres.size()); i++) {
+		used[spheres[i].material] = true;
+	}
+	for (int i = 0; i < int(scene.meshes.size()); i++) {
+		used[scene.meshes[i].material] = true;
+	}
+	bool ok = true;
+	bool highlights = false;
+	for (int i = 0; i < int(used.size()); i++) {
+		if (!used[i]) {
+			continue;
+		}
+		const MaterialType type = scene.materials[i].type;
+		if (type == MATERIAL_MIRROR || type == MATERIAL_DIELECTRIC) {
+			printf("The path tracer only renders diffuse surfaces, material %d is %s\n", i,
+				type == MATERIAL_MIRROR ? "a mirror" : "glass");
+			ok = false;
+		}
+		highlights = highlights || type == MATERIAL_PHONG || type == MATERIAL_BLINN;
+	}
+	if (ok && highlights) {
+		printf("The path tracer leaves out the highlights of phong and blinn materials\n");
+	}
+	return ok;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "color.h"
+#include "simd.h"
+#include "defs.h"
+
+#include "threadman.h"
+
+#include <vector>
+
+struct Scene;
+class ProgressiveBuffer;
+
+struct WavefrontSettings {
+	WavefrontSettings(): maxDepth(4), samplesPerPixel(1), sortRays(true), waveSize(1 << 16) {}
+	int maxDepth; //< Diffuse bounces after the camera ray, 0 gives direct lighting only
+	int samplesPerPixel; //< Paths per pixel and frame, each through a random point of the pixel
+	bool sortRays; //< Sort the rays of every bounce by direction, so neighbouring rays walk the same BVH nodes
+	int waveSize; //< Paths in flight at once, bounds the memory used by the queues
+};
+
+enum WavefrontStage {
+	STAGE_GENERATE,
+	STAGE_EXTEND,
+	STAGE_SHADE,
+	STAGE_SHADOW,
+	STAGE_SORT,
+	STAGE_ACCUMULATE,
+	STAGE_COUNT
+};
+
+// Time spent in every stage during the last frame
+struct WavefrontStats {
+	double stageMs[STAGE_COUNT];
+	uint64 segments; //< Path segments traced, camera rays included
+	int maxBounce; //< Deepest bounce any path reached
+};
+
+// Path tracer that runs every bounce as a sequence of stages, each a parallel loop over a large
+// queue of rays in structure-of-arrays layout:
+//   generate   - camera rays for a wave of pixels
+//   extend     - closest hit of every ray, in SIMD packets when Scene::usePackets is set
+//   shade      - next event estimation towards one light and a cosine sampled diffuse bounce
+//   shadow     - occlusion test of the light samples from the shade stage
+//   sort       - drops the finished paths and orders the rest by direction, a counting sort
+//   accumulate - averages the samples into the canvas and converts it to 8-bit
+// Every stage works on the rays of all pixels of a wave at once instead of following one pixel
+// down its recursion, so each loop runs a single small kernel over contiguous arrays.
+// Surfaces reflect diffusely with the color and texture of their material, without the highlight
+// of phong and blinn materials. Mirrors and glass are not supported, see canPathTrace. Lights are
+// only reached through the shade stage.
+class WavefrontIntegrator {
+public:
+	WavefrontIntegrator();
+
+	// Renders scene.c with scene.wavefront settings. With an accumulation buffer the canvas
+	// receives the running average. Pass p traces samples p * samplesPerPixel onwards of the
+	// sample sequence of every pixel, so the passes continue one sequence.
+	void render(Scene& scene, ProgressiveBuffer* accum, uint32 pass);
+
+	const WavefrontStats& getStats() const { return stats; }
+
+	// Runs one chunk of a stage. Called by the render threads.
+	void runStage(WavefrontStage stage, int chunk);
+
+private:
+	typedef std::vector<float, AlignedAllocator<float> > FloatArray;
+
+	// Paths in flight, one entry per path
+	struct PathQueue {
+		FloatArray ox, oy, oz; //< Origin of the next ray
+		FloatArray dx, dy, dz; //< Direction of the next ray
+		FloatArray tr, tg, tb; //< Throughput, the color the path still carries
+		std::vector<int> pixel;
+		std::vector<uint32> dimension; //< Next dimension of the pixel sample the path belongs to
+		int size;
+
+		PathQueue(): size(0) {}
+		void resize(int n);
+	};
+
+	void generate(int first, int last);
+	void extend(int first, int last);
+	void storeHit(int idx, const Ray& ray, IntersectionInfo& info);
+	void shade(int first, int last);
+	void shadow(int first, int last);
+	void histogram(int chunk, int first, int last);
+	void scatter(int chunk, int first, int last);
+	void accumulate(int row);
+	void runParallel(WavefrontStage stage, int numChunks);
+
+	Scene* scene;
+	ProgressiveBuffer* accum;
+	int width, height;
+	int firstPixel; //< First pixel of the current wave
+	uint32 sampleIdx; //< Sample of the pixels being traced, in the sequence of the pixel sampler
+	int bounce;
+	int numKeys; //< Sort keys, 1 when the rays are only compacted
+	bool scattering; //< Second half of the sort stage, after the counts are turned into positions
+
+	PathQueue paths, sorted;
+	// Results of the extend and shade stages, at the index of the path
+	FloatArray hitT, hx, hy, hz, nx, ny, nz;
+	FloatArray hcr, hcg, hcb; //< Color of the surface at the hit
+	FloatArray sdx, sdy, sdz, sMaxT; //< Shadow ray, starts at the origin of the next ray
+	FloatArray scr, scg, scb; //< Light the shadow ray brings in if it is not blocked
+	std::vector<int> keys; //< Sort key of the next ray, -1 for finished paths
+	std::vector<int> offsets; //< Per chunk and key, counts and then scatter positions
+
+	std::vector<Color> radiance; //< Sum of the path contributions of every pixel in this frame
+	WavefrontStats stats;
+};
+
+// Returns true if the path tracer can render the materials the objects of the scene use. Prints
+// the mirror and glass materials it cannot render, and a note when highlights are left out.
+bool canPathTrace(const Scene& scene);